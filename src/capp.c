@@ -19,6 +19,7 @@
 #include "capp.h"
 #include "cargs.h"
 #include "cdll.h"
+#include "cflate.h"
 #include "cgssrv.h"
 #include "cimg.h"
 #include "cpagec.h"
@@ -472,8 +473,15 @@ zlib_load(GSview *a)
 	    app_msg(a, "Can't find gzclose\n");
 	    code = -1;
 	}
-	if (code == 0)
+	if (code == 0) {
 	    zlib->loaded = TRUE;
+	    /* for Flate compression, if present */
+	    flate_set_zlib(
+		(PFN_deflateInit_)dll_sym(&zlib->hmodule, "deflateInit_"),
+		(PFN_deflate)dll_sym(&zlib->hmodule, "deflate"),
+		(PFN_deflateEnd)dll_sym(&zlib->hmodule, "deflateEnd"),
+		(PFN_deflateReset)dll_sym(&zlib->hmodule, "deflateReset"));
+	}
 	else {
 	    dll_close(&zlib->hmodule);
 	    memset(zlib, 0, sizeof(ZLIB));
@@ -488,6 +496,7 @@ zlib_free(GSview *a)
 {
     if (a->zlib.loaded == FALSE)
 	return;
+    flate_set_zlib(NULL, NULL, NULL, NULL);
     dll_close(&a->zlib.hmodule);
     a->zlib.hmodule = (GGMODULE)0;
     a->zlib.gzopen = NULL;
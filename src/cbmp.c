@@ -20,7 +20,11 @@
 #include "common.h"
 #include "gdevdsp.h"
 #include "cbmp.h"
+#include "cfax.h"
+#include "cflate.h"
 #include "cimg.h"
+#include "clzw.h"
+#include "cpool.h"
 #include "cps.h"	/* for ps_fgets */
 #include <time.h>
 
@@ -34,7 +38,6 @@ static int read_pbm_bits(unsigned char *pbitmap,
 static int read_pgnm_bytes(unsigned char *pbitmap, 
     unsigned int length, GFile *f);
 static int image_bmp2init(IMAGE *img, BITMAP2 *bmp2);
-static void shift_bits(unsigned char *bits, int bwidth, int offset);
 static void write_bigendian_dword(DWORD val, GFile *f);
 static void write_bigendian_word(WORD val, GFile *f);
 
@@ -118,40 +121,6 @@ write_bigendian_word(WORD val, GFile *f)
     gfile_write(f, &w, 2);
 }
 
-/* shift preview by offset bits to the left */
-/* width is in bytes */
-/* fill exposed bits with 1's */
-static void
-shift_bits(unsigned char *bits, int bwidth, int offset)
-{
-int bitoffset;
-int byteoffset;
-int newwidth;
-int shifter;
-int i;
-    if (offset == 0)
-	return;
-    byteoffset = offset / 8;
-    newwidth = bwidth - byteoffset;
-    /* first remove byte offset */
-    memmove(bits, bits+byteoffset, newwidth);
-    memset(bits+newwidth, 0xff, bwidth-newwidth);
-    /* next remove bit offset */
-    bitoffset = offset - byteoffset*8;
-    if (bitoffset==0)
-	return;
-    bitoffset = 8 - bitoffset;
-    for (i=0; i<newwidth; i++) {
-       shifter = bits[i] << 8;
-       if (i==newwidth-1)
-	   shifter += 0xff;	/* can't access bits[bwidth] */
-       else
-	   shifter += bits[i+1];  
-       bits[i] = (unsigned char)(shifter>>bitoffset);
-    }
-}
-
-
 /* Load a Windows bitmap and return an image.
  * Because we are forcing this into a format that 
  * could be written by the Ghostscript "display"
@@ -211,83 +180,95 @@ static const unsigned char clr565[] = {
     0x00, 0xf8, 0x00, 0x00 /* red */
 };
 
-IMAGE *
-bmp_to_image(unsigned char *pbitmap, unsigned int length)
-{
+/* BMP header, palette and the IMAGE format chosen for it */
+typedef struct BMP_INFO_s {
     BITMAP2 bmp2;
     RGB4 colour[256];
     int depth;
+    int bytewidth;	/* length of a BMP row */
+    BOOL convert;	/* rows must be converted from palette */
+    IMAGE img;		/* width, height, raster and format */
+} BMP_INFO;
+
+/* Read the BITMAPINFOHEADER and palette, and choose the 
+ * IMAGE format to use.
+ * Returns the length of the header and palette,
+ * 0 if more than length bytes are needed to know this,
+ * or -1 if the BMP format is not supported.
+ */
+static int
+bmp_read_info(BMP_INFO *info, const unsigned char *pbitmap, 
+    unsigned int length)
+{
+    BITMAP2 *bmp2 = &info->bmp2;
+    RGB4 *colour = info->colour;
+    int depth;
     int palcount;
     int pallength;
-    int bytewidth;
-    BOOL convert;
     int i;
-    int x, y;
-    IMAGE img;
-    IMAGE *pimage;
-    unsigned char *bits;
-    unsigned char *dest;
-    memset(&img, 0, sizeof(img));
+    memset(info, 0, sizeof(BMP_INFO));
     if (length < BITMAP2_LENGTH)
-	return NULL;
+	return 0;
     /* Read the BITMAPINFOHEADER in a portable way. */
-    bmp2.biSize = get_dword(pbitmap);
+    bmp2->biSize = get_dword(pbitmap);
     pbitmap += 4;
-    if (bmp2.biSize < BITMAP2_LENGTH)
-	return NULL;	/* we don't read OS/2 BMP format */
-    bmp2.biWidth = get_dword(pbitmap);
+    if (bmp2->biSize < BITMAP2_LENGTH)
+	return -1;	/* we don't read OS/2 BMP format */
+    bmp2->biWidth = get_dword(pbitmap);
     pbitmap += 4;
-    bmp2.biHeight = get_dword(pbitmap);
+    bmp2->biHeight = get_dword(pbitmap);
     pbitmap += 4;
-    bmp2.biPlanes = get_word(pbitmap);
+    bmp2->biPlanes = get_word(pbitmap);
     pbitmap += 2;
-    bmp2.biBitCount = get_word(pbitmap);
+    bmp2->biBitCount = get_word(pbitmap);
     pbitmap += 2;
-    bmp2.biCompression = get_dword(pbitmap);
+    bmp2->biCompression = get_dword(pbitmap);
     pbitmap += 4;
-    bmp2.biSizeImage = get_dword(pbitmap);
+    bmp2->biSizeImage = get_dword(pbitmap);
     pbitmap += 4;
-    bmp2.biXPelsPerMeter = get_dword(pbitmap);
+    bmp2->biXPelsPerMeter = get_dword(pbitmap);
     pbitmap += 4;
-    bmp2.biYPelsPerMeter = get_dword(pbitmap);
+    bmp2->biYPelsPerMeter = get_dword(pbitmap);
     pbitmap += 4;
-    bmp2.biClrUsed = get_dword(pbitmap);
+    bmp2->biClrUsed = get_dword(pbitmap);
     pbitmap += 4;
-    bmp2.biClrImportant = get_dword(pbitmap);
+    bmp2->biClrImportant = get_dword(pbitmap);
     pbitmap += 4;
-    pbitmap += bmp2.biSize - BITMAP2_LENGTH;
 
     /* Calculate the raster size, depth, palette length etc. */
-    depth = bmp2.biPlanes * bmp2.biBitCount;
-    bytewidth = ((bmp2.biWidth * depth + 31) & ~31) >> 3;
+    depth = bmp2->biPlanes * bmp2->biBitCount;
+    info->depth = depth;
+    info->bytewidth = ((bmp2->biWidth * depth + 31) & ~31) >> 3;
     palcount = 0;
     if (depth <= 8)
-	palcount = (bmp2.biClrUsed != 0) ? 
-		(int)bmp2.biClrUsed : (int)(1 << depth);
+	palcount = (bmp2->biClrUsed != 0) ? 
+		(int)bmp2->biClrUsed : (int)(1 << depth);
+    if (palcount > 256)
+	return -1;
     pallength = 0;
     if ((depth == 16) || (depth == 32)) {
-	if (bmp2.biCompression == BI_BITFIELDS)
+	if (bmp2->biCompression == BI_BITFIELDS)
 	    pallength = 12;
     }
     else
 	pallength = palcount * RGB4_LENGTH;
+    if (length < bmp2->biSize + pallength)
+	return 0;
+    pbitmap += bmp2->biSize - BITMAP2_LENGTH;
     for (i=0; i<palcount; i++) {
 	colour[i].rgbBlue  = pbitmap[i*4+RGB4_BLUE];
 	colour[i].rgbGreen = pbitmap[i*4+RGB4_GREEN];
 	colour[i].rgbRed   = pbitmap[i*4+RGB4_RED];
     }
 
-    if (length < bmp2.biSize + pallength + bmp2.biHeight * bytewidth)
-	return NULL;
-
     /* Now find out which format to use */
     /* Default is 24-bit BGR */
-    img.width = bmp2.biWidth;
-    img.height = bmp2.biHeight;
-    img.raster = img.width * 3;
-    img.format = DISPLAY_COLORS_RGB | DISPLAY_ALPHA_NONE |
+    info->img.width = bmp2->biWidth;
+    info->img.height = bmp2->biHeight;
+    info->img.raster = info->img.width * 3;
+    info->img.format = DISPLAY_COLORS_RGB | DISPLAY_ALPHA_NONE |
        DISPLAY_DEPTH_8 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST;
-    convert = FALSE;
+    info->convert = FALSE;
 
     /* We will save it as either 1-bit/pixel, 8-bit/pixel grey,
      * or 24-bit/pixel RGB.
@@ -300,9 +281,9 @@ bmp_to_image(unsigned char *pbitmap, unsigned int length)
 	    (colour[1].rgbGreen == 0xff) && 
 	    (colour[1].rgbRed == 0xff)) {
 	    /* black and white */
-	    img.format = DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
+	    info->img.format = DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
 	       DISPLAY_DEPTH_1 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST;
-	    img.raster = (img.width + 7) >> 3;
+	    info->img.raster = (info->img.width + 7) >> 3;
 	}
 	else if ((colour[0].rgbBlue == 0xff) && 
 	    (colour[0].rgbGreen == 0xff) && 
@@ -311,23 +292,23 @@ bmp_to_image(unsigned char *pbitmap, unsigned int length)
 	    (colour[1].rgbGreen == 0) && 
 	    (colour[1].rgbRed == 0)) {
 	    /* black and white */
-	    img.format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
+	    info->img.format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
 	       DISPLAY_DEPTH_1 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST;
-	    img.raster = (img.width + 7) >> 3;
+	    info->img.raster = (info->img.width + 7) >> 3;
 	}
 	else if ( (colour[0].rgbBlue == colour[0].rgbGreen) && 
 	    (colour[0].rgbRed == colour[0].rgbGreen) &&
 	    (colour[1].rgbBlue == colour[1].rgbGreen) && 
 	    (colour[1].rgbRed == colour[1].rgbGreen)) {
 	    /* convert to greyscale */
-	    img.format = DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
+	    info->img.format = DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
 	       DISPLAY_DEPTH_8 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST;
-	    img.raster = img.width;
-	    convert = TRUE;
+	    info->img.raster = info->img.width;
+	    info->convert = TRUE;
 	}
 	else
 	    /* convert to colour */
-	    convert = TRUE;
+	    info->convert = TRUE;
     }
     else if ((depth == 4) || (depth == 8)) {
 	BOOL grey = TRUE;
@@ -337,36 +318,36 @@ bmp_to_image(unsigned char *pbitmap, unsigned int length)
 		grey = FALSE;
 	}
 	if (grey) {
-	    img.format = DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
+	    info->img.format = DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
 	       DISPLAY_DEPTH_8 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST;
-	    img.raster = img.width;
+	    info->img.raster = info->img.width;
 	}
-	convert = TRUE;
+	info->convert = TRUE;
 	
     }
     else if (depth == 16) {
 	if (pallength == 0) {
-	    img.format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
+	    info->img.format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
 	       DISPLAY_DEPTH_16 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST |
 	        DISPLAY_NATIVE_555;
-	    img.raster = img.width * 2;
+	    info->img.raster = info->img.width * 2;
 	}
 	else if ((pallength == 12) &&
 	    (memcmp(pbitmap, clr555, sizeof(clr555)) == 0)) {
-	    img.format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
+	    info->img.format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
 	       DISPLAY_DEPTH_16 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST |
 	        DISPLAY_NATIVE_555;
-	    img.raster = img.width * 2;
+	    info->img.raster = info->img.width * 2;
 	}
 	else if ((pallength == 12) &&
 		(memcmp(pbitmap, clr565, sizeof(clr565)) == 0)) {
-	    img.format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
+	    info->img.format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
 	       DISPLAY_DEPTH_16 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST |
 	        DISPLAY_NATIVE_565;
-	    img.raster = img.width * 2;
+	    info->img.raster = info->img.width * 2;
 	}
 	else
-	    return NULL;	/* unrecognised format */
+	    return -1;	/* unrecognised format */
     }
     else if (depth == 24) {
 	/* already in correct format */
@@ -380,84 +361,114 @@ bmp_to_image(unsigned char *pbitmap, unsigned int length)
 	if ( (pallength == 0) || 
 	    ((pallength == 12) &&
 	     (memcmp(pbitmap, clr888, sizeof(clr888)) == 0)) ) {
-	    img.format = DISPLAY_COLORS_RGB | DISPLAY_UNUSED_LAST |
+	    info->img.format = DISPLAY_COLORS_RGB | DISPLAY_UNUSED_LAST |
 	       DISPLAY_DEPTH_8 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST;
-	    img.raster = img.width * 4;
+	    info->img.raster = info->img.width * 4;
 	}
 	else
-	    return NULL;	/* unrecognised format */
+	    return -1;	/* unrecognised format */
     }
     else
-	return NULL;	/* unrecognised format */
+	return -1;	/* unrecognised format */
 
-    pbitmap += pallength;
-
-    img.raster = (img.raster + 3) & ~3;
-    bits = (unsigned char *)malloc(img.raster * img.height);
-    if (bits == NULL)
-	return NULL;
+    info->img.raster = (info->img.raster + 3) & ~3;
+    return bmp2->biSize + pallength;
+}
 
-    for (y=0; y<(int)img.height; y++) {
-        dest = bits + y * img.raster;
-	if (convert) {
-	    int idx;
-	    int shift = 7;
-	    if (depth == 1) {
-		for (x=0; x<bmp2.biWidth; x++) {
-		    idx = pbitmap[x >> 3];
-		    idx = (idx >> shift) & 1;
-		    if ((img.format & DISPLAY_COLORS_MASK) == DISPLAY_COLORS_GRAY)
-			*dest++ = colour[idx].rgbBlue;
-		    else {
-			/* colour */
-			*dest++ = colour[idx].rgbBlue;
-			*dest++ = colour[idx].rgbGreen;
-			*dest++ = colour[idx].rgbRed;
-		    }
-		    shift--;
-		    if (shift < 0)
-			shift = 7;
+/* Copy or convert one BMP row to one IMAGE row */
+static int
+bmp_read_row(BMP_INFO *info, unsigned char *dest, const unsigned char *pbitmap)
+{
+    RGB4 *colour = info->colour;
+    int x;
+    if (info->convert) {
+	int idx;
+	int shift = 7;
+	if (info->depth == 1) {
+	    for (x=0; x<info->bmp2.biWidth; x++) {
+		idx = pbitmap[x >> 3];
+		idx = (idx >> shift) & 1;
+		if ((info->img.format & DISPLAY_COLORS_MASK) 
+		    == DISPLAY_COLORS_GRAY)
+		    *dest++ = colour[idx].rgbBlue;
+		else {
+		    /* colour */
+		    *dest++ = colour[idx].rgbBlue;
+		    *dest++ = colour[idx].rgbGreen;
+		    *dest++ = colour[idx].rgbRed;
 		}
+		shift--;
+		if (shift < 0)
+		    shift = 7;
 	    }
-	    else if (depth == 4) {
-		for (x=0; x<bmp2.biWidth; x++) {
-		    idx = pbitmap[x/2];
-		    if (x & 0)
-			idx &= 0xf;
-		    else
-			idx = (idx >> 4) & 0xf;
-		    if ((img.format & DISPLAY_COLORS_MASK) == DISPLAY_COLORS_GRAY)
-			*dest++ = colour[idx].rgbBlue;
-		    else {
-			/* colour */
-			*dest++ = colour[idx].rgbBlue;
-			*dest++ = colour[idx].rgbGreen;
-			*dest++ = colour[idx].rgbRed;
-		    }
+	}
+	else if (info->depth == 4) {
+	    for (x=0; x<info->bmp2.biWidth; x++) {
+		idx = pbitmap[x/2];
+		if (x & 0)
+		    idx &= 0xf;
+		else
+		    idx = (idx >> 4) & 0xf;
+		if ((info->img.format & DISPLAY_COLORS_MASK) 
+		    == DISPLAY_COLORS_GRAY)
+		    *dest++ = colour[idx].rgbBlue;
+		else {
+		    /* colour */
+		    *dest++ = colour[idx].rgbBlue;
+		    *dest++ = colour[idx].rgbGreen;
+		    *dest++ = colour[idx].rgbRed;
 		}
 	    }
-	    else if (depth == 8) {
-		for (x=0; x<bmp2.biWidth; x++) {
-		    idx = pbitmap[x];
-		    if ((img.format & DISPLAY_COLORS_MASK) == DISPLAY_COLORS_GRAY)
-			*dest++ = colour[idx].rgbBlue;
-		    else {
-			/* colour */
-			*dest++ = colour[idx].rgbBlue;
-			*dest++ = colour[idx].rgbGreen;
-			*dest++ = colour[idx].rgbRed;
-		    }
+	}
+	else if (info->depth == 8) {
+	    for (x=0; x<info->bmp2.biWidth; x++) {
+		idx = pbitmap[x];
+		if ((info->img.format & DISPLAY_COLORS_MASK) 
+		    == DISPLAY_COLORS_GRAY)
+		    *dest++ = colour[idx].rgbBlue;
+		else {
+		    /* colour */
+		    *dest++ = colour[idx].rgbBlue;
+		    *dest++ = colour[idx].rgbGreen;
+		    *dest++ = colour[idx].rgbRed;
 		}
 	    }
-	    else {
-		free(bits);
-		return NULL;
-	    }
 	}
-	else {
-	    memcpy(dest, pbitmap, img.raster);
+	else
+	    return -1;
+    }
+    else {
+	memcpy(dest, pbitmap, info->img.raster);
+    }
+    return 0;
+}
+
+IMAGE *
+bmp_to_image(unsigned char *pbitmap, unsigned int length)
+{
+    BMP_INFO info;
+    int hdrlen;
+    int y;
+    IMAGE *pimage;
+    unsigned char *bits;
+
+    hdrlen = bmp_read_info(&info, pbitmap, length);
+    if (hdrlen <= 0)
+	return NULL;
+    if (length < hdrlen + info.bmp2.biHeight * info.bytewidth)
+	return NULL;
+    pbitmap += hdrlen;
+
+    bits = (unsigned char *)malloc(info.img.raster * info.img.height);
+    if (bits == NULL)
+	return NULL;
+
+    for (y=0; y<(int)info.img.height; y++) {
+	if (bmp_read_row(&info, bits + y * info.img.raster, pbitmap) != 0) {
+	    free(bits);
+	    return NULL;
 	}
-	pbitmap += bytewidth;
+	pbitmap += info.bytewidth;
     }
 
     pimage = (IMAGE *)malloc(sizeof(IMAGE));
@@ -465,7 +476,7 @@ bmp_to_image(unsigned char *pbitmap, unsigned int length)
 	free(bits);
 	return NULL;
     }
-    memcpy(pimage, &img, sizeof(IMAGE));
+    memcpy(pimage, &info.img, sizeof(IMAGE));
     pimage->image = bits;
     return pimage;
 }
@@ -768,7 +779,361 @@ pnmfile_to_image(LPCTSTR filename)
     return pimage;
 }
 
-/* Free an image created by bmpfile_to_image or pnmfile_to_image */
+/********************************************************/
+/* Incremental BMP and PNM reader.
+ * The bitmap is written to the reader in pieces of any size,
+ * for example as it arrives through a pipe from Ghostscript,
+ * and is converted directly into the image raster.
+ * Only the raw PNM formats written by Ghostscript are supported.
+ */
+
+#define BITMAP_READER_MAXHDR 4096
+
+struct BITMAP_READER_s {
+    int error;
+    unsigned char hdr[BITMAP_READER_MAXHDR];
+    unsigned int hdr_count;	/* bytes in hdr */
+    int hdr_done;		/* header has been parsed */
+    BOOL bmp;			/* Windows BMP, otherwise PNM */
+    BMP_INFO info;		/* BMP only */
+    IMAGE img;
+    unsigned char *row;		/* BMP only, current row */
+    unsigned int row_length;	/* bytes in one input row */
+    unsigned int row_count;	/* bytes in row */
+    unsigned int y;		/* rows complete */
+    unsigned int count;		/* PNM only, bytes of raster received */
+    BITMAP_ROW_FN row_fn;	/* if set, rows are not kept */
+    void *caller;
+    unsigned char *out;		/* BMP with row_fn, converted row */
+};
+
+/* Get the next decimal number from a PNM header, skipping
+ * white space and comments.
+ * Returns 1 if found, 0 if more data is needed, -1 on error.
+ */
+static int
+pnm_read_number(const unsigned char *buf, unsigned int length, 
+    unsigned int *pos, unsigned int *value)
+{
+    unsigned int i = *pos;
+    unsigned int val = 0;
+    for (;;) {
+	if (i >= length)
+	    return 0;
+	if (buf[i] == '#') {
+	    while ((i < length) && (buf[i] != '\n') && (buf[i] != '\r'))
+		i++;
+	}
+	else if ((buf[i] == ' ') || (buf[i] == '\t') || 
+	    (buf[i] == '\r') || (buf[i] == '\n'))
+	    i++;
+	else
+	    break;
+    }
+    if ((buf[i] < '0') || (buf[i] > '9'))
+	return -1;
+    while ((i < length) && (buf[i] >= '0') && (buf[i] <= '9')) {
+	val = val * 10 + (buf[i] - '0');
+	if (val > 0xffffff)
+	    return -1;
+	i++;
+    }
+    if (i >= length)
+	return 0;	/* number may continue */
+    *pos = i;
+    *value = val;
+    return 1;
+}
+
+/* Parse a PAM header.
+ * Returns the header length, 0 if more data is needed, -1 on error.
+ */
+static int
+pam_read_header(IMAGE *img, const unsigned char *buf, unsigned int length)
+{
+    char line[256];
+    char *t1, *t2;
+    unsigned int i = 3;	/* skip "P7\n" */
+    unsigned int n;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int depth = 0;
+    unsigned int maxval = 0;
+    char tupltype[256];
+    memset(tupltype, 0, sizeof(tupltype));
+    for (;;) {
+	for (n=i; (n<length) && (buf[n] != '\n'); n++)
+	    ;
+	if (n >= length)
+	    return 0;
+	if (n - i >= sizeof(line))
+	    return -1;
+	memcpy(line, buf+i, n-i);
+	line[n-i] = '\0';
+	i = n + 1;
+	if (line[0] == '#')
+	    continue;
+	t1 = strtok(line, " \t\r\n");
+	if (t1 == NULL)
+	    continue;
+	t2 = strtok(NULL, " \t\r\n");
+	if (strcmp(t1, "ENDHDR")==0)
+	    break;
+	else if ((strcmp(t1, "WIDTH")==0) && t2)
+	    width = atoi(t2);
+	else if ((strcmp(t1, "HEIGHT")==0) && t2)
+	    height = atoi(t2);
+	else if ((strcmp(t1, "DEPTH")==0) && t2)
+	    depth = atoi(t2);
+	else if ((strcmp(t1, "MAXVAL")==0) && t2)
+	    maxval = atoi(t2);
+	else if ((strcmp(t1, "TUPLTYPE")==0) && t2)
+	    strncpy(tupltype, t2, sizeof(tupltype)-1);
+    }
+    if ((width == 0) || (height == 0))
+	return -1;
+    img->width = width;
+    img->height = height;
+    if ((strcmp(tupltype, "BLACKANDWHITE")==0) &&
+	(depth == 1) && (maxval == 1)) {
+	img->format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_1 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+	img->raster = (img->width + 7) >> 3;
+    }
+    else if ((strcmp(tupltype, "GRAYSCALE")==0) &&
+	(depth == 1) && (maxval == 255)) {
+	img->format = DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+	img->raster = img->width;
+    }
+    else if ((strcmp(tupltype, "RGB")==0) && 
+	(depth == 3) && (maxval == 255)) {
+	img->format = DISPLAY_COLORS_RGB | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+	img->raster = img->width * 3;
+    }
+    else if ((strcmp(tupltype, "CMYK")==0) &&
+	(depth == 4) && (maxval == 255)) {
+	img->format = DISPLAY_COLORS_CMYK | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+	img->raster = img->width * 4;
+    }
+    else
+	return -1;
+    return (int)i;
+}
+
+/* Parse a raw PNM header.
+ * Returns the header length, 0 if more data is needed, -1 on error.
+ */
+static int
+pnm_read_header(IMAGE *img, const unsigned char *buf, unsigned int length)
+{
+    unsigned int pos = 2;
+    unsigned int width = 0;
+    unsigned int height = 0;
+    unsigned int maxval = 255;
+    int code;
+    if (length < 3)
+	return 0;
+    if (buf[0] != 'P')
+	return -1;
+    if (buf[1] == '7')
+	return pam_read_header(img, buf, length);
+    if ((buf[1] < '4') || (buf[1] > '6'))
+	return -1;	/* only raw formats */
+    code = pnm_read_number(buf, length, &pos, &width);
+    if (code == 1)
+	code = pnm_read_number(buf, length, &pos, &height);
+    if ((code == 1) && (buf[1] != '4'))
+	code = pnm_read_number(buf, length, &pos, &maxval);
+    if (code != 1)
+	return code;
+    /* a single white space character separates header and raster */
+    pos++;
+    if ((width == 0) || (height == 0) || (maxval != 255))
+	return -1;
+    img->width = width;
+    img->height = height;
+    if (buf[1] == '4') {
+	img->format = DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_1 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+	img->raster = (img->width + 7) >> 3;
+    }
+    else if (buf[1] == '5') {
+	img->format = DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+	img->raster = img->width;
+    }
+    else {
+	img->format = DISPLAY_COLORS_RGB | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+	img->raster = img->width * 3;
+    }
+    return (int)pos;
+}
+
+/* Parse the header in r->hdr.
+ * Returns the header length, 0 if more data is needed, -1 on error.
+ */
+static int
+bitmap_reader_header(BITMAP_READER *r)
+{
+    int code;
+    if (r->hdr_count < 2)
+	return 0;
+    if ((r->hdr[0] == 'B') && (r->hdr[1] == 'M')) {
+	r->bmp = TRUE;
+	if (r->hdr_count < BITMAPFILE_LENGTH)
+	    return 0;
+	code = bmp_read_info(&r->info, r->hdr + BITMAPFILE_LENGTH, 
+	    r->hdr_count - BITMAPFILE_LENGTH);
+	if (code <= 0)
+	    return code;
+	memcpy(&r->img, &r->info.img, sizeof(IMAGE));
+	r->row_length = r->info.bytewidth;
+	r->row = (unsigned char *)malloc(r->row_length);
+	if (r->row == NULL)
+	    return -1;
+	return code + BITMAPFILE_LENGTH;
+    }
+    return pnm_read_header(&r->img, r->hdr, r->hdr_count);
+}
+
+/* Add raster data */
+static void
+bitmap_reader_data(BITMAP_READER *r, const unsigned char *buf, 
+    unsigned int len)
+{
+    unsigned int n;
+    unsigned char *dest;
+    if (!r->bmp && (r->row_fn == NULL)) {
+	n = min(len, r->img.raster * r->img.height - r->count);
+	memcpy(r->img.image + r->count, buf, n);
+	r->count += n;
+	return;
+    }
+    while ((len > 0) && (r->y < r->img.height)) {
+	n = min(len, r->row_length - r->row_count);
+	memcpy(r->row + r->row_count, buf, n);
+	r->row_count += n;
+	buf += n;
+	len -= n;
+	if (r->row_count == r->row_length) {
+	    if (r->bmp) {
+		dest = (r->row_fn != NULL) ? r->out :
+		    r->img.image + r->y * r->img.raster;
+		if (bmp_read_row(&r->info, dest, r->row) != 0) {
+		    r->error = 1;
+		    return;
+		}
+	    }
+	    else
+		dest = r->row;
+	    if ((r->row_fn != NULL) &&
+		(r->row_fn(r->caller, &r->img, r->y, dest) != 0)) {
+		r->error = 1;
+		return;
+	    }
+	    r->y++;
+	    r->row_count = 0;
+	}
+    }
+}
+
+BITMAP_READER *
+bitmap_reader_new(void)
+{
+    BITMAP_READER *r = (BITMAP_READER *)malloc(sizeof(BITMAP_READER));
+    if (r != NULL)
+	memset(r, 0, sizeof(BITMAP_READER));
+    return r;
+}
+
+BITMAP_READER *
+bitmap_reader_new_rows(BITMAP_ROW_FN row_fn, void *caller)
+{
+    BITMAP_READER *r = bitmap_reader_new();
+    if (r != NULL) {
+	r->row_fn = row_fn;
+	r->caller = caller;
+    }
+    return r;
+}
+
+int
+bitmap_reader_write(BITMAP_READER *r, const unsigned char *buf, 
+    unsigned int len)
+{
+    unsigned int n;
+    int hdrlen;
+    unsigned char *buf_row;
+    if (r->error)
+	return -1;
+    if (!r->hdr_done) {
+	n = min(len, BITMAP_READER_MAXHDR - r->hdr_count);
+	memcpy(r->hdr + r->hdr_count, buf, n);
+	r->hdr_count += n;
+	buf += n;
+	len -= n;
+	hdrlen = bitmap_reader_header(r);
+	if ((hdrlen == 0) && (r->hdr_count == BITMAP_READER_MAXHDR))
+	    hdrlen = -1;	/* header too long */
+	if (hdrlen < 0) {
+	    r->error = 1;
+	    return -1;
+	}
+	if (hdrlen == 0)
+	    return 0;
+	r->hdr_done = 1;
+	if (r->row_fn == NULL)
+	    buf_row = r->img.image = (unsigned char *)
+		malloc(r->img.raster * r->img.height);
+	else if (r->bmp)
+	    buf_row = r->out = (unsigned char *)malloc(r->img.raster);
+	else {
+	    /* PNM rows are passed on as they are */
+	    r->row_length = r->img.raster;
+	    buf_row = r->row = (unsigned char *)malloc(r->row_length);
+	}
+	if (buf_row == NULL) {
+	    r->error = 1;
+	    return -1;
+	}
+	/* raster data that arrived with the header */
+	bitmap_reader_data(r, r->hdr + hdrlen, r->hdr_count - hdrlen);
+    }
+    bitmap_reader_data(r, buf, len);
+    return r->error ? -1 : 0;
+}
+
+IMAGE *
+bitmap_reader_finish(BITMAP_READER *r)
+{
+    IMAGE *pimage = NULL;
+    BOOL complete;
+    if (r == NULL)
+	return NULL;
+    complete = r->bmp ? (r->y == r->img.height) :
+	(r->count == r->img.raster * r->img.height);
+    if (r->hdr_done && !r->error && complete && (r->row_fn == NULL))
+	pimage = (IMAGE *)malloc(sizeof(IMAGE));
+    if (pimage != NULL)
+	memcpy(pimage, &r->img, sizeof(IMAGE));
+    else if (r->img.image)
+	free(r->img.image);
+    if (r->row)
+	free(r->row);
+    if (r->out)
+	free(r->out);
+    memset(r, 0, sizeof(BITMAP_READER));
+    free(r);
+    return pimage;
+}
+
+/* Free an image created by bmpfile_to_image, pnmfile_to_image
+ * or bitmap_reader_finish.
+ */
 void
 bitmap_image_free(IMAGE *img)
 {
@@ -878,6 +1243,9 @@ image_bmp2init(IMAGE *img, BITMAP2 *bmp2)
 }
 
 
+/* Rows converted at once for each thread */
+#define BMP_CHUNK_ROWS 64
+
 /* Write an IMAGE as a Windows BMP file */
 /* This is typically used to copy the display bitmap to a file */
 int
@@ -896,7 +1264,10 @@ image_to_bmpfile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi)
     int i;
     unsigned char *bits;
     unsigned char *row;
+    int rows;
+    int chunk_rows = 1;
     int topfirst;
+    IMAGE_CONVERT *cv = NULL;
 
     if ((img == NULL) || (img->image == NULL))
 	return -1;
@@ -931,13 +1302,23 @@ image_to_bmpfile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi)
     bmf.bfOffBits = BITMAPFILE_LENGTH + BITMAP2_LENGTH + palcount;
     bmf.bfSize = bmf.bfOffBits + bytewidth * bmp2.biHeight;
 
-    row = (unsigned char *)malloc(bytewidth);
-    if (row == NULL)
+    if (depth == 24) {
+	/* convert a chunk of rows at a time */
+	if ((cv = image_convert_new(img, IMAGE_CONVERT_24BGR)) == NULL)
+	    return -1;
+	chunk_rows = BMP_CHUNK_ROWS * pool_threads();
+    }
+    row = (unsigned char *)malloc(chunk_rows * bytewidth);
+    if (row == NULL) {
+	image_convert_free(cv);
 	return -1;
+    }
+    memset(row, 0, chunk_rows * bytewidth);	/* padding */
     
     f = gfile_open(filename, gfile_modeWrite | gfile_modeCreate);
     if (f == (GFile *)NULL) {
 	free(row);
+	image_convert_free(cv);
 	return -1;
     }
 
@@ -985,8 +1366,12 @@ image_to_bmpfile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi)
 	else
 	    bits = img->image + img->raster * i;
 	if (depth == 24) {
-	    image_to_24BGR(img, row, bits);
-	    gfile_write(f, row, bytewidth);
+	    rows = min(chunk_rows, bmp2.biHeight - i);
+	    if (image_convert_rows(cv, row, bytewidth, bits, 
+		topfirst ? -(long)img->raster : (long)img->raster, rows) != 0)
+		break;
+	    gfile_write(f, row, rows * bytewidth);
+	    i += rows - 1;
 	}
 	else {
 	    if ((int)img->raster < bytewidth) {
@@ -1001,8 +1386,9 @@ image_to_bmpfile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi)
     }
 
     free(row);
+    image_convert_free(cv);
     gfile_close(f);
-    return 0;
+    return (i < bmp2.biHeight) ? -1 : 0;
 }
 
 /*********************************************************/
@@ -1038,6 +1424,117 @@ struct tiff_head_s {
 };
 #define TIFF_HEAD_SIZE 8
 
+/* Rows of an image prepared for image_to_tiff() */
+typedef struct TIFF_ROWS_s {
+    IMAGE *img;
+    IMAGE_CONVERT *cv;		/* to mono or 24RGB, or NULL */
+    unsigned char *line;	/* source of rows[0] */
+    long step;			/* to the next source row */
+    unsigned char *rows;	/* prepared rows */
+    int row_bytes;		/* size of each prepared row */
+    int depth;
+    int preview_depth;
+    int temp_bwidth;
+    int bitoffset;
+    int bwidth;			/* of the preview */
+    BOOL predictor;		/* horizontal differencing of RGB */
+    BOOL invert;		/* mono rows to black=0 */
+} TIFF_ROWS;
+
+/* Prepared rows for each thread */
+#define TIFF_BAND_ROWS 8
+
+/* Convert and shift rows first to last-1 of t->rows */
+static int
+tiff_rows_band(void *arg, int first, int last)
+{
+    TIFF_ROWS *t = (TIFF_ROWS *)arg;
+    unsigned char *preview = t->rows + first * t->row_bytes;
+    unsigned char *line = t->line + first * t->step;
+    int i;
+    /* unused bits at the end of a mono row are 0 before inverting */
+    memset(preview, 0, (last - first) * t->row_bytes);
+    if ((t->preview_depth == 1) || (t->preview_depth == 24)) {
+	if (image_convert_rows(t->cv, preview, t->row_bytes, line, t->step,
+	    last - first) != 0)
+	    return -1;
+    }
+    for (i = first; i < last; i++) {
+	if (t->invert)
+	    image_invert_bits(preview, preview, t->temp_bwidth);
+	else if ((t->cv == NULL) && (t->depth == t->preview_depth))
+	    memmove(preview, line, t->img->raster);
+	if (t->bitoffset)
+	    image_shift_bits(preview, t->temp_bwidth, t->bitoffset);
+	if (t->predictor) {
+	    int j;
+	    for (j = t->bwidth - 1; j >= 3; j--)
+		preview[j] = (unsigned char)(preview[j] - preview[j-3]);
+	}
+	preview += t->row_bytes;
+	line += t->step;
+    }
+    return 0;
+}
+
+/* Prepare count rows, starting at row first of the preview */
+static int
+tiff_rows(TIFF_ROWS *t, unsigned char *line0, int first, int count)
+{
+    t->line = line0 + first * t->step;
+    return pool_for(count, TIFF_BAND_ROWS, tiff_rows_band, t);
+}
+
+/* LZW, Flate or Group 4 compressor for the strips of image_to_tiff() */
+typedef struct TIFF_STRIP_s {
+    lzw_state_t *lzw;
+    flate_state_t *flate;
+    fax_state_t *fax;		/* needs one row for each call */
+    unsigned char *buf;		/* for compressed data */
+    int buf_len;
+} TIFF_STRIP;
+
+/* Compress len bytes of a strip and write them.
+ * len = 0 ends the strip, and the next call starts a new strip.
+ * Returns the count of bytes written, or -1 on error.
+ */
+static int
+tiff_strip_write(TIFF_STRIP *ts, GFile *f, const unsigned char *in, int len)
+{
+    int used = 0;
+    int count = 0;
+    int inlen, outlen;
+    int code = 0;
+    if (ts->fax) {
+	if (len != 0)
+	    count = fax_encode_row(ts->fax, in, ts->buf);
+	else
+	    count = fax_finish(ts->fax, ts->buf);
+	gfile_write(f, ts->buf, count);
+	return count;
+    }
+    do {
+	inlen = len - used;
+	outlen = ts->buf_len;
+	if (ts->lzw)
+	    lzw_compress(ts->lzw, in + used, &inlen, ts->buf, &outlen);
+	else if ((code = flate_compress(ts->flate, in + used, &inlen, 
+	    ts->buf, &outlen)) < 0)
+	    return -1;
+	used += inlen;
+	gfile_write(f, ts->buf, outlen);
+	count += outlen;
+    } while ((len != 0) ? (used < len) : (code == 1));
+    if (len == 0) {
+	/* EOD written, so start again for the next strip */
+	if (ts->lzw)
+	    lzw_restart(ts->lzw);
+	else if (flate_reset(ts->flate) != 0)
+	    return -1;
+    }
+    return count;
+}
+
 /* Write tiff file from IMAGE.
  * Since this will be used by a DOS EPS file, we write an Intel TIFF file.
  * Include the pixels specified in devbbox, which is in pixel coordinates
@@ -1045,36 +1542,46 @@ struct tiff_head_s {
  * Resolution of bitmap is xdpi,ydpi.
  * If tiff4 is true, write a monochrome file compatible with TIFF 4,
  * otherwise make it compatible with TIFF 6.
- * If use_packbits is true and tiff4 is false, use packbits to
- * compress the bitmap.
+ * compress is TIFF_COMPRESS_NONE, PACKBITS, LZW, DEFLATE or CCITT, 
+ * optionally with TIFF_COMPRESS_PREDICTOR.
  */
 int image_to_tiff(GFile *f, IMAGE *img, 
     int xoffset, int yoffset, int width, int height, 
     float xdpi, float ydpi, 
-    BOOL tiff4, BOOL use_packbits)
+    BOOL tiff4, int compress)
 {
 #define IFD_MAX_ENTRY 12
     WORD ifd_length;
     DWORD ifd_next;
     DWORD tiff_end, end;
-    int i, j;
+    int i;
+    int row;
     unsigned char *preview;
     BYTE *line;
+    TIFF_ROWS t;
+    int chunk_rows;
+    int code = 0;
     const unsigned char nulchar = '\0';
     int temp_bwidth, bwidth;
     BOOL soft_extra = FALSE;
     int bitoffset;
-    WORD *comp_length=NULL;	/* lengths of compressed lines */
-    BYTE *comp_line=NULL;	/* compressed line buffer */
+    int method = compress & TIFF_COMPRESS_MASK;
+    BOOL predictor;
+    TIFF_STRIP ts;
+    DWORD *comp_length=NULL;	/* lengths of compressed strips */
+    BYTE *comp_strip=NULL;	/* compressed strip buffer */
+    int comp_size;		/* of comp_strip */
+    FILE_POS counts_pos = 0;	/* of StripByteCounts, to fill in later */
+    FILE_POS offsets_pos = 0;	/* of StripOffsets, to fill in later */
     int rowsperstrip;
     int stripsperimage;
     int strip, is;
-    int strip_len;
     int lastrow;
 
     int depth;
     int preview_depth;
     int topfirst;
+    IMAGE_CONVERT *cv = NULL;
 
     if (img == NULL)
 	return -1;
@@ -1092,6 +1599,15 @@ int image_to_tiff(GFile *f, IMAGE *img,
 	preview_depth = 24;
     if (tiff4)
 	preview_depth = 1;
+    if ((method == TIFF_COMPRESS_DEFLATE) && !flate_available())
+	return -1;
+    if (tiff4 && (method != TIFF_COMPRESS_PACKBITS))
+	method = TIFF_COMPRESS_NONE;	/* LZW and Deflate are not TIFF 4 */
+    if ((method == TIFF_COMPRESS_CCITT) && (preview_depth != 1))
+	method = TIFF_COMPRESS_PACKBITS;
+    predictor = (compress & TIFF_COMPRESS_PREDICTOR) && 
+	((method == TIFF_COMPRESS_LZW) || (method == TIFF_COMPRESS_DEFLATE)) &&
+	(preview_depth == 24);
 
     /* byte width of source bitmap is img->raster */
     /* byte width of intermediate line, after conversion
@@ -1106,6 +1622,16 @@ int image_to_tiff(GFile *f, IMAGE *img,
 
     if (tiff4)
 	rowsperstrip = 1; /* make TIFF 4 very simple */
+    else if ((method == TIFF_COMPRESS_LZW) || 
+	(method == TIFF_COMPRESS_DEFLATE) || (method == TIFF_COMPRESS_CCITT)) {
+	/* Each strip starts with an empty dictionary, or for Group 4
+	 * a white reference row, so use
+	 * 64k strips, which compress about 25% smaller than 8k.
+	 */
+	rowsperstrip = (65536 - 256) / bwidth;
+	if (rowsperstrip == 0)
+	    rowsperstrip = 1;
+    }
     else {
 	/* work out RowsPerStrip, to give < 8k compressed */
 	/* or uncompressed data per strip */
@@ -1117,59 +1643,76 @@ int image_to_tiff(GFile *f, IMAGE *img,
     if (stripsperimage == 1)
 	rowsperstrip = height;
 
-    preview = (unsigned char *) malloc(img->raster);
-    if (preview == NULL)
+    if (preview_depth == 1)
+	cv = image_convert_new(img, IMAGE_CONVERT_MONO);
+    else if (preview_depth == 24)
+	cv = image_convert_new(img, IMAGE_CONVERT_24RGB);
+    if ((cv == NULL) && ((preview_depth == 1) || (preview_depth == 24)))
 	return -1;
-    memset(preview,0xff,img->raster);
 
-    /* compress bitmap, throwing away result, to find out compressed size */
-    if (use_packbits) {
-	comp_length = (WORD *)malloc(stripsperimage * sizeof(WORD));
-	if (comp_length == NULL) {
-	    free(preview);
-	    return -1;
-	}
-	comp_line = (BYTE *)malloc(bwidth + bwidth/64 + 1);
-	if (comp_line == NULL) {
-	    free(preview);
-	    free(comp_length);
+    /* Rows are prepared in chunks, by several threads if available.
+     * 16-bit images are wider after conversion to 24-bit.
+     */
+    memset(&t, 0, sizeof(t));
+    t.img = img;
+    t.cv = cv;
+    t.row_bytes = max((int)img->raster, temp_bwidth);
+    t.depth = depth;
+    t.preview_depth = preview_depth;
+    t.temp_bwidth = temp_bwidth;
+    t.bitoffset = bitoffset;
+    t.bwidth = bwidth;
+    t.predictor = predictor;
+    /* Group 4 is written as WhiteIsZero, others as BlackIsZero */
+    t.invert = (preview_depth == 1) && (method != TIFF_COMPRESS_CCITT);
+    t.step = topfirst ? (long)img->raster : -(long)img->raster;
+    if (topfirst) 
+	line = img->image + img->raster * (img->height - yoffset - height);
+    else
+	line = img->image + img->raster * (yoffset + height-1);
+    chunk_rows = TIFF_BAND_ROWS * 2 * pool_threads();
+    t.rows = (unsigned char *) malloc(chunk_rows * t.row_bytes);
+    if (t.rows == NULL) {
+	image_convert_free(cv);
+	return -1;
+    }
+
+    /* Each strip is compressed once, as it is written.
+     * The strip offsets and lengths before the strips are
+     * filled in afterwards.
+     */
+    memset(&ts, 0, sizeof(ts));
+    if (method != TIFF_COMPRESS_NONE) {
+	comp_size = rowsperstrip * (bwidth + bwidth/64 + 1);
+	if (method == TIFF_COMPRESS_CCITT)
+	    comp_size = max(comp_size, FAX_MAX_ROW(width));
+	comp_length = (DWORD *)malloc(stripsperimage * sizeof(DWORD));
+	comp_strip = (BYTE *)malloc(comp_size);
+	if (method == TIFF_COMPRESS_LZW)
+	    ts.lzw = lzw_new();
+	else if (method == TIFF_COMPRESS_DEFLATE)
+	    ts.flate = flate_new(FLATE_LEVEL_DEFAULT);
+	else if (method == TIFF_COMPRESS_CCITT)
+	    ts.fax = fax_new(width);
+	ts.buf = comp_strip;
+	ts.buf_len = comp_size;
+	if ((comp_length == NULL) || (comp_strip == NULL) ||
+	    ((method == TIFF_COMPRESS_LZW) && (ts.lzw == NULL)) ||
+	    ((method == TIFF_COMPRESS_DEFLATE) && (ts.flate == NULL)) ||
+	    ((method == TIFF_COMPRESS_CCITT) && (ts.fax == NULL))) {
+	    if (comp_length)
+		free(comp_length);
+	    if (comp_strip)
+		free(comp_strip);
+	    if (ts.lzw)
+		lzw_free(ts.lzw);
+	    flate_free(ts.flate);
+	    fax_free(ts.fax);
+	    free(t.rows);
+	    image_convert_free(cv);
 	    return -1;
 	}
-	if (topfirst) 
-	    line = img->image + img->raster * (img->height - yoffset - height);
-	else
-	    line = img->image + img->raster * (yoffset + height-1);
-
-	/* process each strip */
-	for (strip = 0; strip < stripsperimage; strip++) {
-	    is = strip * rowsperstrip;
-	    lastrow = min( rowsperstrip, height - is);
-	    comp_length[strip] = 0;
-	    strip_len = 0;
-	    /* process each line within strip */
-	    for (i = 0; i< lastrow; i++) {
-		if (preview_depth == 1) {
-		    memset(preview,0xff,img->raster);
-		    image_to_mono(img, preview, line);
-		    for (j=0; j<temp_bwidth; j++)
-			preview[j] ^= 0xff;
-		}
-		else if (preview_depth == 24)
-		    image_to_24RGB(img, preview, line);
-		else if (depth == preview_depth)
-		    memmove(preview,  line, img->raster);
-		if (bitoffset)
-		    shift_bits(preview, temp_bwidth, bitoffset);
-		strip_len += packbits(comp_line, preview, bwidth);
-		if (topfirst)
-		    line += img->raster;
-		else
-		    line -= img->raster;
-	    }
-	    comp_length[strip] = (WORD)strip_len;
-	}
     }
-     
 
     /* write header */
     tiff_end = TIFF_HEAD_SIZE;
@@ -1195,6 +1738,8 @@ int image_to_tiff(GFile *f, IMAGE *img,
 	    default:	/* bi-level */
 		ifd_length = 13;
 	}
+	if (predictor)
+	    ifd_length++;
     }
     tiff_word(ifd_length, f);
 
@@ -1256,15 +1801,23 @@ int image_to_tiff(GFile *f, IMAGE *img,
     tiff_word(0x103, f);	/* Compression */
     tiff_word(TIFF_SHORT, f);
     tiff_long(1, f);
-    if (use_packbits)
+    if (method == TIFF_COMPRESS_PACKBITS)
 	tiff_short(32773U, f);	/* packbits compression */
+    else if (method == TIFF_COMPRESS_LZW)
+	tiff_short(5, f);		/* LZW compression */
+    else if (method == TIFF_COMPRESS_DEFLATE)
+	tiff_short(8, f);		/* Deflate compression */
+    else if (method == TIFF_COMPRESS_CCITT)
+	tiff_short(4, f);		/* CCITT Group 4 compression */
     else
 	tiff_short(1, f);		/* no compression */
 
     tiff_word(0x106, f);	/* PhotometricInterpretation */
     tiff_word(TIFF_SHORT, f);
     tiff_long(1, f);
-    if (tiff4 || preview_depth==1)
+    if (method == TIFF_COMPRESS_CCITT)
+	tiff_short(0, f);		/* white is zero */
+    else if (tiff4 || preview_depth==1)
 	tiff_short(1, f);		/* black is zero */
     else if (preview_depth==24)
 	tiff_short(2, f);		/* RGB */
@@ -1307,8 +1860,10 @@ int image_to_tiff(GFile *f, IMAGE *img,
     tiff_word(TIFF_LONG, f);
     if (stripsperimage == 1) {
 	tiff_long(1, f);
-	if (use_packbits)
-	    tiff_long(comp_length[0], f);
+	if (method != TIFF_COMPRESS_NONE) {
+	    counts_pos = gfile_get_position(f);
+	    tiff_long(0, f);
+	}
 	else
 	    tiff_long(bwidth * rowsperstrip, f);
     }
@@ -1353,6 +1908,13 @@ int image_to_tiff(GFile *f, IMAGE *img,
 	tiff_long(tiff_end, f);
 	tiff_end += 20;
 
+	if (predictor) {
+	    tiff_word(0x13d, f);	/* Predictor */
+	    tiff_word(TIFF_SHORT, f);
+	    tiff_long(1, f);
+	    tiff_short(2, f);		/* horizontal differencing */
+	}
+
 	if (preview_depth==4 || preview_depth==8) {
 	    int palcount = 1<<preview_depth;
 	    tiff_word(0x140, f);	/* ColorMap */
@@ -1378,20 +1940,19 @@ int image_to_tiff(GFile *f, IMAGE *img,
     end = tiff_end;
     if (stripsperimage > 1) {
 	int stripwidth = bwidth * rowsperstrip;
+	offsets_pos = gfile_get_position(f);
 	for (i=0; i<stripsperimage; i++) {
 	    tiff_long(end, f);
-	    if (use_packbits)
-		end += comp_length[i];
-	    else
-		end += stripwidth;
+	    end += stripwidth;
 	}
     }
 
     /* strip byte counts (after compression) */
     if (stripsperimage > 1) {
+	counts_pos = gfile_get_position(f);
 	for (i=0; i<stripsperimage; i++) {
-	    if (use_packbits)
-		tiff_long(comp_length[i], f);
+	    if (method != TIFF_COMPRESS_NONE)
+		tiff_long(0, f);
 	    else {
 		is = i * rowsperstrip;
 		lastrow = min( rowsperstrip, height - is);
@@ -1444,59 +2005,86 @@ int image_to_tiff(GFile *f, IMAGE *img,
     }
 
 
-    if (topfirst) 
-	line = img->image + img->raster * (img->height - yoffset - height);
-    else
-	line = img->image + img->raster * (yoffset+height-1);
-
     /* process each strip of bitmap */
-    for (strip = 0; strip < stripsperimage; strip++) {
-	int len;
+    for (strip = 0; (strip < stripsperimage) && (code == 0); strip++) {
+	int len = 0;
+	int n;
 	is = strip * rowsperstrip;
 	lastrow = min( rowsperstrip, height - is);
 	/* process each row of strip */
-	for (i = 0; i < lastrow; i++) {
-		if (preview_depth == 1) {
-		    memset(preview,0,img->raster);
-		    image_to_mono(img, preview, line);
-		    for (j=0; j<temp_bwidth; j++)
-			preview[j] ^= 0xff;
-		}
-		else if (preview_depth == 24)
-		    image_to_24RGB(img, preview, line);
-		else if (depth == preview_depth)
-		    memmove(preview,  line, img->raster);
-		if (bitoffset)
-		    shift_bits(preview, temp_bwidth, bitoffset);
-		if (use_packbits) {
-		    len = (WORD)packbits(comp_line, preview, bwidth);
-		    gfile_write(f, comp_line, len);
+	for (i = 0; (i < lastrow) && (code == 0); i++) {
+		row = is + i;
+		if ((row % chunk_rows) == 0)
+		    code = tiff_rows(&t, line, row, 
+			min(chunk_rows, height - row));
+		preview = t.rows + (row % chunk_rows) * t.row_bytes;
+		if (method == TIFF_COMPRESS_PACKBITS)
+		    len += packbits(comp_strip + len, preview, bwidth);
+		else if (method != TIFF_COMPRESS_NONE) {
+		    n = tiff_strip_write(&ts, f, preview, bwidth);
+		    if (n < 0)
+			code = -1;
+		    len += n;
 		}
 		else
 		    gfile_write(f, preview, bwidth);
-		if (topfirst)
-		    line += img->raster;
-		else
-		    line -= img->raster;
+	}
+	if (method == TIFF_COMPRESS_PACKBITS) {
+	    comp_length[strip] = len;
+	    gfile_write(f, comp_strip, len);
+	}
+	else if ((method != TIFF_COMPRESS_NONE) && (code == 0)) {
+	    /* end of strip */
+	    n = tiff_strip_write(&ts, f, NULL, 0);
+	    if (n < 0)
+		code = -1;
+	    comp_length[strip] = len + n;
 	}
     }
 
-    if (use_packbits) {
-	free(comp_length);
-	free(comp_line);
+    if ((method != TIFF_COMPRESS_NONE) && (code == 0)) {
+	/* Go back and fill in the strip offsets and lengths */
+	FILE_POS data_end = gfile_get_position(f);
+	if (stripsperimage > 1) {
+	    gfile_seek(f, (FILE_OFFSET)offsets_pos, gfile_begin);
+	    end = tiff_end;
+	    for (i=0; i<stripsperimage; i++) {
+		tiff_long(end, f);
+		end += comp_length[i];
+	    }
+	}
+	gfile_seek(f, (FILE_OFFSET)counts_pos, gfile_begin);
+	for (i=0; i<stripsperimage; i++)
+	    tiff_long(comp_length[i], f);
+	gfile_seek(f, (FILE_OFFSET)data_end, gfile_begin);
     }
-    free(preview);
-    return 0;
+
+    if (method != TIFF_COMPRESS_NONE) {
+	free(comp_length);
+	free(comp_strip);
+	if (ts.lzw)
+	    lzw_free(ts.lzw);
+	flate_free(ts.flate);
+	fax_free(ts.fax);
+    }
+    free(t.rows);
+    image_convert_free(cv);
+    return code;
 }
 
 /* Write an IMAGE as a TIFF file */
 /* This is typically used to copy the display bitmap to a file */
+/* Monochrome images are written as TIFF 4, without compression,
+ * unless Group 4 compression is requested.
+ */
 int
-image_to_tifffile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi)
+image_to_tifffile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi,
+    int compress)
 {
     GFile *f;
     int code = 0;
-    BOOL tiff4 = ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1);
+    BOOL tiff4 = ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) &&
+	((compress & TIFF_COMPRESS_MASK) != TIFF_COMPRESS_CCITT);
 
     if ((img == NULL) || (img->image == NULL))
 	return -1;
@@ -1506,7 +2094,7 @@ image_to_tifffile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi)
 	return -1;
 
     code = image_to_tiff(f, img, 0, 0, img->width, img->height,
-	xdpi, ydpi, tiff4, !tiff4);
+	xdpi, ydpi, tiff4, tiff4 ? TIFF_COMPRESS_NONE : compress);
 
     gfile_close(f);
     return 0;
@@ -1524,6 +2112,7 @@ image_to_pnmfile(IMAGE* img, LPCTSTR filename, PNM_FORMAT pnm_format)
     unsigned char *bits;
     int topfirst;
     int i;
+    IMAGE_CONVERT *cv;
     if ((img == NULL) || (img->image == NULL))
 	return -1;
     
@@ -1569,20 +2158,31 @@ image_to_pnmfile(IMAGE* img, LPCTSTR filename, PNM_FORMAT pnm_format)
 	    break;
       }
     }
-    if (format == PPMRAW)
+    if (format == PPMRAW) {
 	bytewidth = img->width * 3;
-    else if (format == PGMRAW)
+	cv = image_convert_new(img, IMAGE_CONVERT_24RGB);
+    }
+    else if (format == PGMRAW) {
 	bytewidth = img->width;
-    else
+	cv = image_convert_new(img, IMAGE_CONVERT_GREY);
+    }
+    else {
 	bytewidth = (img->width + 7) >> 3;
+	cv = image_convert_new(img, IMAGE_CONVERT_MONO);
+    }
+    if (cv == NULL)
+	return -1;
     row = (unsigned char *)malloc(bytewidth);
-    if (row == NULL)
+    if (row == NULL) {
+	image_convert_free(cv);
 	return -1;
+    }
     topfirst = ((img->format & DISPLAY_FIRSTROW_MASK) == DISPLAY_TOPFIRST);
 
     f = csfopen(filename, TEXT("wb"));
     if (f == NULL) {
 	free(row);
+	image_convert_free(cv);
 	return -1;
     }
 
@@ -1596,16 +2196,12 @@ image_to_pnmfile(IMAGE* img, LPCTSTR filename, PNM_FORMAT pnm_format)
 	    bits = img->image + img->raster * i;
 	else
 	    bits = img->image + img->raster * (img->height - i - 1);
-	if (format == PPMRAW)
-	    image_to_24RGB(img, row, bits);
-	else if (format == PGMRAW)
-	    image_to_grey(img, row, bits);
-	else
-	    image_to_mono(img, row, bits);
+	image_convert_row(cv, row, bits);
         fwrite(row, 1, bytewidth, f);
     }
     
     free(row);
+    image_convert_free(cv);
     fclose(f);
     return 0;
 }
@@ -1642,11 +2238,14 @@ write_pict_pixdata(IMAGE *img, GFile *f)
      * we must use 32-bits/pixel.
       */
     int qdrowwidth = img->width * 4;
+    IMAGE_CONVERT *cv;
 
+    cv = image_convert_new(img, IMAGE_CONVERT_24RGB);
     row = (unsigned char *)malloc(rowwidth);	/* 24-bit RGB */
     sep = (unsigned char *)malloc(qdrowwidth);	/* xRGB or RRGGBB */
     packed = (unsigned char *)malloc(rowwidth + rowwidth / 128 + 1);
-    if ((row == NULL) || (sep == NULL) || (packed == NULL)) {
+    if ((cv == NULL) || (row == NULL) || (sep == NULL) || (packed == NULL)) {
+	image_convert_free(cv);
 	if (row != NULL)
 	    free(row);
 	if (sep != NULL)
@@ -1664,7 +2263,7 @@ write_pict_pixdata(IMAGE *img, GFile *f)
 	    bits = img->image + img->raster * i;
 	else
 	    bits = img->image + img->raster * (img->height - i - 1);
-	image_to_24RGB(img, row, bits);
+	image_convert_row(cv, row, bits);
 	p = row;
 	if (qdrowwidth < 8) {
 	    /* Never compress short rows */
@@ -1712,6 +2311,10 @@ write_pict_pixdata(IMAGE *img, GFile *f)
 	wcount++;
     }
 
+    image_convert_free(cv);
+    free(row);
+    free(sep);
+    free(packed);
     return wcount;
 }
 
@@ -1850,6 +2453,9 @@ image_png_read_data(png_structp png_ptr, png_bytep data, png_size_t length)
       png_error(png_ptr, "Read Error!");
 }
 
+/* Rows converted at once for each thread */
+#define PNG_CHUNK_ROWS 64
+
 int
 image_to_pngfile(IMAGE* img, LPCTSTR filename)
 {
@@ -1864,6 +2470,8 @@ image_to_pngfile(IMAGE* img, LPCTSTR filename)
     BOOL topfirst;
     unsigned char *bits;
     unsigned char *row = NULL;
+    IMAGE_CONVERT *cv = NULL;
+    int chunk_rows = PNG_CHUNK_ROWS * pool_threads();
     int i;
 
     if ((img == NULL) || (img->image == NULL))
@@ -1932,15 +2540,22 @@ image_to_pngfile(IMAGE* img, LPCTSTR filename)
     if (num_palette > sizeof(palette)/sizeof(palette[0]))
 	return -1;
     if (colour_type == PNG_COLOR_TYPE_RGB) {
-	row = (unsigned char *)malloc(img->width * 3);
-	if (row == NULL)
+	/* convert a chunk of rows at a time */
+	cv = image_convert_new(img, IMAGE_CONVERT_24RGB);
+	if (cv == NULL)
 	    return -1;
+	row = (unsigned char *)malloc(chunk_rows * img->width * 3);
+	if (row == NULL) {
+	    image_convert_free(cv);
+	    return -1;
+	}
     }
 
     f = csfopen(filename, TEXT("wb"));
     if (f == NULL) {
 	if (row)
 	    free(row);
+	image_convert_free(cv);
 	return -1;
     }
 
@@ -1950,6 +2565,7 @@ image_to_pngfile(IMAGE* img, LPCTSTR filename)
 	fclose(f);
 	if (row)
 	    free(row);
+	image_convert_free(cv);
 	return -1;
     }
 
@@ -1957,6 +2573,9 @@ image_to_pngfile(IMAGE* img, LPCTSTR filename)
     if (info_ptr == NULL) {
 	png_destroy_write_struct(&png_ptr, (png_infopp)NULL);
 	fclose(f);
+	if (row)
+	    free(row);
+	image_convert_free(cv);
 	return -1;
     }
 
@@ -1965,6 +2584,7 @@ image_to_pngfile(IMAGE* img, LPCTSTR filename)
 	fclose(f);
 	if (row)
 	    free(row);
+	image_convert_free(cv);
 	return -1;
     }
 
@@ -1994,8 +2614,11 @@ image_to_pngfile(IMAGE* img, LPCTSTR filename)
 	else
 	    bits = img->image + img->raster * (img->height - i - 1);
 	if (colour_type == PNG_COLOR_TYPE_RGB) {
-	    image_to_24RGB(img, row, bits);
-	    bits = row;
+	    if ((i % chunk_rows) == 0)
+		image_convert_rows(cv, row, img->width * 3, bits, 
+		    topfirst ? (long)img->raster : -(long)img->raster,
+		    min(chunk_rows, (int)img->height - i));
+	    bits = row + (i % chunk_rows) * img->width * 3;
 	}
 	png_write_row(png_ptr, bits);
     }
@@ -2004,6 +2627,7 @@ image_to_pngfile(IMAGE* img, LPCTSTR filename)
     fclose(f);
     if (row)
 	free(row);
+    image_convert_free(cv);
     return 0;
 }
 
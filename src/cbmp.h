@@ -61,23 +61,64 @@ typedef enum PNM_FORMAT_s {
     PNMANY=99	/* use any */
 } PNM_FORMAT;
 
+typedef struct BITMAP_READER_s BITMAP_READER;
+
+/* Called by a BITMAP_READER for each row in raster order,
+ * which is bottom row first for BMP.
+ * img describes the bitmap, but img->image is not valid.
+ * row is only valid until this function returns.
+ * Return 0 to continue, or -ve on error.
+ */
+typedef int (*BITMAP_ROW_FN)(void *caller, IMAGE *img, unsigned int y,
+    const unsigned char *row);
+
 /* Prototypes */
 
 IMAGE * bmpfile_to_image(LPCTSTR filename);
 IMAGE * bmp_to_image(unsigned char *pbitmap, unsigned int length);
 IMAGE * pnmfile_to_image(LPCTSTR filename);
 void bitmap_image_free(IMAGE *img);
+
+/* Read a BMP or raw PNM bitmap incrementally.
+ * bitmap_reader_write() returns 0 on success, -1 on error.
+ * bitmap_reader_finish() frees the reader and returns the image,
+ * or NULL if the bitmap was incomplete or invalid.
+ */
+BITMAP_READER *bitmap_reader_new(void);
+/* Read a bitmap one row at a time, without keeping the rows.
+ * bitmap_reader_finish() always returns NULL.
+ */
+BITMAP_READER *bitmap_reader_new_rows(BITMAP_ROW_FN row_fn, void *caller);
+int bitmap_reader_write(BITMAP_READER *r, const unsigned char *buf,
+    unsigned int len);
+IMAGE *bitmap_reader_finish(BITMAP_READER *r);
+
 int image_to_bmpfile(IMAGE*img, LPCTSTR filename, float xdpi, float ydpi);
 int image_to_pnmfile(IMAGE* img, LPCTSTR filename, PNM_FORMAT pnm_format);
-int image_to_tifffile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi);
+int image_to_tifffile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi,
+    int compress);
 int image_to_pngfile(IMAGE* img, LPCTSTR filename);
 int image_to_pictfile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi);
 IMAGE * pngfile_to_image(LPCTSTR filename);
-int image_to_tifffile(IMAGE* img, LPCTSTR filename, float xdpi, float ydpi);
+
+/* TIFF compression for image_to_tiff().
+ * TIFF_COMPRESS_DEFLATE needs zlib, see flate_available().
+ * TIFF_COMPRESS_CCITT is Group 4, for 1 bit previews only,
+ * and other previews use PACKBITS instead.
+ * TIFF_COMPRESS_PREDICTOR may be added to LZW or DEFLATE,
+ * and is used for RGB images.
+ */
+#define TIFF_COMPRESS_NONE 0
+#define TIFF_COMPRESS_PACKBITS 1
+#define TIFF_COMPRESS_LZW 2
+#define TIFF_COMPRESS_DEFLATE 3
+#define TIFF_COMPRESS_CCITT 4
+#define TIFF_COMPRESS_MASK 0xff
+#define TIFF_COMPRESS_PREDICTOR 0x100
 int image_to_tiff(GFile *f, IMAGE *img, 
     int xoffset, int yoffset, int width, int height, 
     float xdpi, float ydpi, 
-    BOOL tiff4, BOOL use_packbits);
+    BOOL tiff4, int compress);
 
 void write_dword(DWORD val, GFile *f);
 void write_word_as_dword(WORD val, GFile *f);
@@ -0,0 +1,432 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: ccache.c,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* Persistent cache of results, keyed by content */
+
+/* Each entry is a file in the cache directory named "key.type",
+ * where key is a digest of everything that affects the result.
+ * Entries are written to a temporary file and renamed, so several
+ * processes can share a cache.
+ * Hits and misses are counted in the fixed size "stats" record,
+ * which is locked while it is updated on Unix.
+ * On Unix, an entry is touched when it is used, and the least
+ * recently used entries are removed when the cache is too large.
+ * The size is estimated from what this process has written, and the
+ * directory is only scanned when the estimate passes the limit or
+ * every CACHE_TRIM_PUTS writes, to notice other processes.
+ */
+
+#include "common.h"
+#include "capp.h"
+#include "chash.h"
+#include "ccache.h"
+#ifdef UNIX
+#include <sys/stat.h>
+#include <dirent.h>
+#include <utime.h>
+#include <fcntl.h>
+#endif
+
+#if defined(UNICODE) && defined(_Windows)
+# define cache_rename(s,t) _wrename(s,t)
+#else
+# define cache_rename(s,t) rename(s,t)
+#endif
+
+#define CACHE_STATS_FILE "stats"
+#define CACHE_STATS_FORMAT "%010lu %010lu\n"
+#define CACHE_STATS_LENGTH 22
+#define CACHE_STATS_MAX 0xffffffffUL	/* counts stop here */
+#define CACHE_MAXTYPE 15
+#define CACHE_TRIM_PUTS 64
+
+struct CACHE_s {
+    GSview *app;
+    TCHAR dirname[MAXSTR];
+    unsigned long max_bytes;
+    BOOL sized;			/* bytes has been set by a scan */
+    unsigned long bytes;	/* estimated size of the cache */
+    int puts;			/* since the last scan */
+};
+
+#ifdef UNIX
+typedef struct CACHE_ENTRY_s {
+    char name[HASH_HEXLEN+CACHE_MAXTYPE+2];
+    unsigned long size;
+    time_t mtime;
+} CACHE_ENTRY;
+#endif
+
+/* Return TRUE if name is "key.type" */
+static BOOL
+cache_is_entry(const char *name)
+{
+    int i;
+    for (i=0; i<HASH_HEXLEN; i++)
+	if (!(((name[i] >= '0') && (name[i] <= '9')) ||
+	      ((name[i] >= 'a') && (name[i] <= 'f'))))
+	    return FALSE;
+    if (name[i++] != '.')
+	return FALSE;
+    for (; name[i]; i++)
+	if (!(((name[i] >= '0') && (name[i] <= '9')) ||
+	      ((name[i] >= 'a') && (name[i] <= 'z'))) ||
+	    (i > HASH_HEXLEN + CACHE_MAXTYPE))
+	    return FALSE;
+    return (name[HASH_HEXLEN+1] != '\0');
+}
+
+/* Get the full name of a file in the cache directory */
+static void
+cache_filename(CACHE *cache, const char *leaf, TCHAR *name, int len)
+{
+    TCHAR wleaf[MAXSTR];
+    memset(wleaf, 0, sizeof(wleaf));
+    narrow_to_cs(wleaf, (int)(sizeof(wleaf)/sizeof(TCHAR)-1),
+	leaf, (int)strlen(leaf)+1);
+    csnprintf(name, len, TEXT("%s%s%s"), cache->dirname,
+	TEXT(PATHSEP), wleaf);
+    name[len-1] = '\0';
+}
+
+/* Get the full name of an entry.  Returns -1 if key or type is invalid */
+static int
+cache_entry_name(CACHE *cache, const char *key, const char *type,
+    TCHAR *name, int len)
+{
+    char leaf[HASH_HEXLEN+CACHE_MAXTYPE+2];
+    if ((strlen(key) != HASH_HEXLEN) || (strlen(type) > CACHE_MAXTYPE))
+	return -1;
+    snprintf(leaf, sizeof(leaf), "%s.%s", key, type);
+    if (!cache_is_entry(leaf))
+	return -1;
+    cache_filename(cache, leaf, name, len);
+    return 0;
+}
+
+/* Read the hit and miss counts from the start of the stats file.
+ * A missing or damaged record counts as 0.
+ */
+static void
+cache_read_stats(FILE *f, unsigned long *phits, unsigned long *pmisses)
+{
+    char buf[CACHE_STATS_LENGTH+1];
+    *phits = *pmisses = 0;
+    memset(buf, 0, sizeof(buf));
+    if ((fseek(f, 0, SEEK_SET) != 0) ||
+	(fread(buf, 1, CACHE_STATS_LENGTH, f) != CACHE_STATS_LENGTH) ||
+	(sscanf(buf, "%lu %lu", phits, pmisses) != 2))
+	*phits = *pmisses = 0;
+}
+
+static unsigned long
+cache_add_count(unsigned long a, unsigned long b)
+{
+    if ((a > CACHE_STATS_MAX) || (b > CACHE_STATS_MAX - a))
+	return CACHE_STATS_MAX;
+    return a + b;
+}
+
+/* Add a hit or a miss to the stats file */
+static void
+cache_count(CACHE *cache, BOOL hit)
+{
+    TCHAR name[MAXSTR];
+    char buf[CACHE_STATS_LENGTH+1];
+    unsigned long hits, misses;
+    FILE *f = NULL;
+#ifdef UNIX
+    struct flock lock;
+    int fd;
+#endif
+    cache_filename(cache, CACHE_STATS_FILE, name,
+	sizeof(name)/sizeof(TCHAR));
+#ifdef UNIX
+    /* don't truncate, another process may have just created it */
+    if ((fd = open(name, O_RDWR | O_CREAT, 0666)) != -1) {
+	if ((f = fdopen(fd, "r+b")) == (FILE *)NULL)
+	    close(fd);
+    }
+#else
+    if ((f = csfopen(name, TEXT("r+b"))) == (FILE *)NULL)
+	f = csfopen(name, TEXT("w+b"));
+#endif
+    if (f == (FILE *)NULL)
+	return;
+#ifdef UNIX
+    memset(&lock, 0, sizeof(lock));
+    lock.l_type = F_WRLCK;
+    lock.l_whence = SEEK_SET;
+    fcntl(fileno(f), F_SETLKW, &lock);
+#endif
+    cache_read_stats(f, &hits, &misses);
+    snprintf(buf, sizeof(buf), CACHE_STATS_FORMAT, 
+	cache_add_count(hits, hit ? 1 : 0),
+	cache_add_count(misses, hit ? 0 : 1));
+    if (fseek(f, 0, SEEK_SET) == 0)
+	fwrite(buf, 1, CACHE_STATS_LENGTH, f);
+    fflush(f);
+#ifdef UNIX
+    lock.l_type = F_UNLCK;
+    fcntl(fileno(f), F_SETLK, &lock);
+#endif
+    fclose(f);
+}
+
+#ifdef UNIX
+/* List the entries in the cache.
+ * *pentries is allocated with malloc and must be freed by the caller.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+cache_scan(CACHE *cache, CACHE_ENTRY **pentries, unsigned long *pcount,
+    unsigned long *pbytes)
+{
+    DIR *dir;
+    struct dirent *de;
+    struct stat fstat;
+    TCHAR name[MAXSTR];
+    CACHE_ENTRY *entries = NULL;
+    CACHE_ENTRY *newentries;
+    unsigned long count = 0;
+    unsigned long allocated = 0;
+    unsigned long bytes = 0;
+
+    *pentries = NULL;
+    *pcount = *pbytes = 0;
+    if ((dir = opendir(cache->dirname)) == NULL)
+	return -1;
+    while ((de = readdir(dir)) != NULL) {
+	if (!cache_is_entry(de->d_name))
+	    continue;
+	cache_filename(cache, de->d_name, name, sizeof(name)/sizeof(TCHAR));
+	if ((stat(name, &fstat) != 0) || !S_ISREG(fstat.st_mode))
+	    continue;
+	if (count >= allocated) {
+	    allocated = allocated ? allocated * 2 : 256;
+	    newentries = (CACHE_ENTRY *)
+		realloc(entries, allocated * sizeof(CACHE_ENTRY));
+	    if (newentries == NULL) {
+		free(entries);
+		closedir(dir);
+		return -1;
+	    }
+	    entries = newentries;
+	}
+	strncpy(entries[count].name, de->d_name,
+	    sizeof(entries[count].name)-1);
+	entries[count].name[sizeof(entries[count].name)-1] = '\0';
+	entries[count].size = (unsigned long)fstat.st_size;
+	entries[count].mtime = fstat.st_mtime;
+	bytes += entries[count].size;
+	count++;
+    }
+    closedir(dir);
+    *pentries = entries;
+    *pcount = count;
+    *pbytes = bytes;
+    return 0;
+}
+
+static int
+cache_entry_compare(const void *a, const void *b)
+{
+    const CACHE_ENTRY *ea = (const CACHE_ENTRY *)a;
+    const CACHE_ENTRY *eb = (const CACHE_ENTRY *)b;
+    if (ea->mtime < eb->mtime)
+	return -1;
+    if (ea->mtime > eb->mtime)
+	return 1;
+    return strcmp(ea->name, eb->name);
+}
+
+/* Find the size of the cache, and if it is too large remove the
+ * least recently used entries until it is 3/4 of the limit, 
+ * so that the next few writes don't need another scan.
+ */
+static void
+cache_trim(CACHE *cache)
+{
+    CACHE_ENTRY *entries;
+    unsigned long count, bytes, i;
+    unsigned long target = cache->max_bytes - cache->max_bytes / 4;
+    TCHAR name[MAXSTR];
+    if (cache->max_bytes == 0)
+	return;
+    cache->puts = 0;
+    if (cache_scan(cache, &entries, &count, &bytes) != 0)
+	return;
+    if (bytes > cache->max_bytes) {
+	qsort(entries, count, sizeof(CACHE_ENTRY), cache_entry_compare);
+	for (i=0; (i<count) && (bytes > target); i++) {
+	    cache_filename(cache, entries[i].name, name,
+		sizeof(name)/sizeof(TCHAR));
+	    if (csunlink(name) == 0)
+		bytes -= entries[i].size;
+	}
+    }
+    if (entries)
+	free(entries);
+    cache->bytes = bytes;
+    cache->sized = TRUE;
+}
+#endif
+
+CACHE *
+cache_open(GSview *app, LPCTSTR dirname, unsigned long max_bytes)
+{
+    CACHE *cache;
+#ifdef UNIX
+    struct stat fstat;
+    if ((stat(dirname, &fstat) != 0) && (mkdir(dirname, 0777) != 0)) {
+	app_csmsgf(app, TEXT("Can't create cache directory \042%s\042\n"),
+	    dirname);
+	return NULL;
+    }
+    if ((stat(dirname, &fstat) != 0) || !S_ISDIR(fstat.st_mode)) {
+	app_csmsgf(app, TEXT("Cache \042%s\042 is not a directory\n"),
+	    dirname);
+	return NULL;
+    }
+#endif
+    cache = (CACHE *)malloc(sizeof(CACHE));
+    if (cache == NULL)
+	return NULL;
+    memset(cache, 0, sizeof(CACHE));
+    cache->app = app;
+    csncpy(cache->dirname, dirname, sizeof(cache->dirname)/sizeof(TCHAR)-1);
+    cache->max_bytes = max_bytes;
+    return cache;
+}
+
+void
+cache_close(CACHE *cache)
+{
+    if (cache == NULL)
+	return;
+    memset(cache, 0, sizeof(CACHE));
+    free(cache);
+}
+
+int
+cache_get(CACHE *cache, const char *key, const char *type,
+    unsigned char **pdata, unsigned int *plength)
+{
+    TCHAR name[MAXSTR];
+    FILE *f = NULL;
+    long length = -1;
+    unsigned char *data = NULL;
+
+    *pdata = NULL;
+    *plength = 0;
+    if (cache_entry_name(cache, key, type, name,
+	sizeof(name)/sizeof(TCHAR)) == 0)
+	f = csfopen(name, TEXT("rb"));
+    if (f != (FILE *)NULL) {
+	if (fseek(f, 0, SEEK_END) == 0)
+	    length = ftell(f);
+	if ((length >= 0) && (fseek(f, 0, SEEK_SET) == 0))
+	    data = (unsigned char *)malloc(length > 0 ? length : 1);
+	if ((data != NULL) &&
+	    (fread(data, 1, length, f) != (size_t)length)) {
+	    free(data);
+	    data = NULL;
+	}
+	fclose(f);
+    }
+    if (data == NULL) {
+	cache_count(cache, FALSE);
+	return 1;
+    }
+#ifdef UNIX
+    utime(name, NULL);	/* mark as recently used */
+#endif
+    cache_count(cache, TRUE);
+    *pdata = data;
+    *plength = (unsigned int)length;
+    return 0;
+}
+
+int
+cache_put(CACHE *cache, const char *key, const char *type,
+    const unsigned char *data, unsigned int length)
+{
+    TCHAR name[MAXSTR];
+    TCHAR tempname[MAXSTR];
+    char leaf[MAXSTR];
+    FILE *f;
+    int code = 0;
+
+    if (cache_entry_name(cache, key, type, name,
+	sizeof(name)/sizeof(TCHAR)) != 0)
+	return_error(-1);
+#ifdef UNIX
+    snprintf(leaf, sizeof(leaf), "%s.%s.%ld", key, type, (long)getpid());
+#else
+    snprintf(leaf, sizeof(leaf), "%s.%s.tmp", key, type);
+#endif
+    cache_filename(cache, leaf, tempname, sizeof(tempname)/sizeof(TCHAR));
+    if ((f = csfopen(tempname, TEXT("wb"))) == (FILE *)NULL) {
+	app_csmsgf(cache->app,
+	    TEXT("Can't write cache file \042%s\042\n"), tempname);
+	return_error(-1);
+    }
+    if (fwrite(data, 1, length, f) != length)
+	code = -1;
+    if (fclose(f) != 0)
+	code = -1;
+    if ((code == 0) && (cache_rename(tempname, name) != 0)) {
+	/* rename may not replace an existing file */
+	csunlink(name);
+	if (cache_rename(tempname, name) != 0)
+	    code = -1;
+    }
+    if (code != 0) {
+	app_csmsgf(cache->app,
+	    TEXT("Can't write cache file \042%s\042\n"), name);
+	csunlink(tempname);
+	return_error(-1);
+    }
+#ifdef UNIX
+    if (cache->max_bytes) {
+	cache->bytes += length;
+	if (!cache->sized || (cache->bytes > cache->max_bytes) ||
+	    (++cache->puts >= CACHE_TRIM_PUTS))
+	    cache_trim(cache);
+    }
+#endif
+    return 0;
+}
+
+int
+cache_stats(CACHE *cache, CACHE_STATS *stats)
+{
+    TCHAR name[MAXSTR];
+    FILE *f;
+#ifdef UNIX
+    CACHE_ENTRY *entries;
+#endif
+
+    memset(stats, 0, sizeof(CACHE_STATS));
+#ifdef UNIX
+    if (cache_scan(cache, &entries, &stats->entries, &stats->bytes) != 0)
+	return_error(-1);
+    if (entries)
+	free(entries);
+#endif
+    cache_filename(cache, CACHE_STATS_FILE, name,
+	sizeof(name)/sizeof(TCHAR));
+    if ((f = csfopen(name, TEXT("rb"))) != (FILE *)NULL) {
+	cache_read_stats(f, &stats->hits, &stats->misses);
+	fclose(f);
+    }
+    return 0;
+}
@@ -0,0 +1,56 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: ccache.h,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* Persistent cache of results, keyed by content */
+
+/* Public */
+
+#ifndef CCACHE_INCLUDED
+#define CCACHE_INCLUDED
+
+typedef struct CACHE_s CACHE;
+
+typedef struct CACHE_STATS_s {
+    unsigned long entries;	/* files in the cache */
+    unsigned long bytes;	/* total size of entries */
+    unsigned long hits;		/* since the cache was created */
+    unsigned long misses;
+} CACHE_STATS;
+
+/* Open a cache directory, creating it if needed.
+ * If max_bytes is not 0, the least recently used entries
+ * are removed when the cache grows larger than this.
+ * Returns NULL on error.
+ */
+CACHE *cache_open(GSview *app, LPCTSTR dirname, unsigned long max_bytes);
+void cache_close(CACHE *cache);
+
+/* An entry is named by key, which is a hex digest from chash.h,
+ * and type, which is a short lower case name such as "bbox".
+ */
+
+/* Read an entry.  On a hit, *pdata is allocated with malloc
+ * and must be freed by the caller.
+ * Returns 0 on a hit, 1 on a miss.
+ */
+int cache_get(CACHE *cache, const char *key, const char *type,
+    unsigned char **pdata, unsigned int *plength);
+
+/* Add or replace an entry.
+ * Returns 0 on success, -1 on error.
+ */
+int cache_put(CACHE *cache, const char *key, const char *type,
+    const unsigned char *data, unsigned int length);
+
+/* Get the size and use of the cache */
+int cache_stats(CACHE *cache, CACHE_STATS *stats);
+
+#endif /* CCACHE_INCLUDED */
@@ -30,7 +30,6 @@
 
 /* Local prototypes */
 static void write_doseps_header(CDSCDOSEPS *doseps, GFile *outfile);
-static void shift_preview(unsigned char *preview, int bwidth, int offset);
 static void validate_devbbox(IMAGE *img, CDSCBBOX *devbbox);
 int write_interchange(GFile *f, IMAGE *img, CDSCBBOX devbbox);
 static void write_bitmap_info(IMAGE *img, LPBITMAP2 pbmi, GFile *f);
@@ -86,40 +85,6 @@ write_doseps_header(CDSCDOSEPS *doseps, GFile *outfile)
     write_word((WORD)(doseps->checksum), outfile);
 }
 
-/* shift preview by offset bits to the left */
-/* width is in bytes */
-/* fill exposed bits with 1's */
-static void
-shift_preview(unsigned char *preview, int bwidth, int offset)
-{
-int bitoffset;
-int byteoffset;
-int newwidth;
-int shifter;
-int i;
-    if (offset == 0)
-	return;
-    byteoffset = offset / 8;
-    newwidth = bwidth - byteoffset;
-    /* first remove byte offset */
-    memmove(preview, preview+byteoffset, newwidth);
-    memset(preview+newwidth, 0xff, bwidth-newwidth);
-    /* next remove bit offset */
-    bitoffset = offset - byteoffset*8;
-    if (bitoffset==0)
-	return;
-    bitoffset = 8 - bitoffset;
-    for (i=0; i<newwidth; i++) {
-       shifter = preview[i] << 8;
-       if (i==newwidth-1)
-	   shifter += 0xff;	/* can't access preview[bwidth] */
-       else
-	   shifter += preview[i+1];  
-       preview[i] = (unsigned char)(shifter>>bitoffset);
-    }
-}
-
-
 static void
 validate_devbbox(IMAGE *img, CDSCBBOX *devbbox)
 {
@@ -437,7 +402,7 @@ CMACFILE *mac;
 int
 make_eps_tiff(Doc *doc, IMAGE *img, CDSCBBOX devbbox, 
     CDSCBBOX *bbox, CDSCFBBOX *hires_bbox,
-    float xdpi, float ydpi, BOOL tiff4, BOOL use_packbits, BOOL reverse,
+    float xdpi, float ydpi, BOOL tiff4, int compress, BOOL reverse,
     LPCTSTR epsname)
 {
 GFile *epsfile;
@@ -466,7 +431,7 @@ CDSC *dsc = doc->dsc;
     }
     code = image_to_tiff(tiff_file, img, 
 	devbbox.llx, devbbox.lly, devbbox.urx, devbbox.ury, 
-	xdpi, ydpi, tiff4, use_packbits);
+	xdpi, ydpi, tiff4, compress);
     gfile_close(tiff_file);
     if (code) {
 	app_csmsgf(doc->app, 
@@ -600,7 +565,6 @@ CDSC *dsc = doc->dsc;
 
 /*********************************************************/
 
-static char hex[17] = "0123456789ABCDEF";
 
 #define MAXHEXWIDTH 70
 
@@ -609,7 +573,7 @@ static char hex[17] = "0123456789ABCDEF";
 int
 write_interchange(GFile *f, IMAGE *img, CDSCBBOX devbbox)
 {
-    int i, j;
+    int i;
     unsigned char *preview;
     char buf[MAXSTR];
     const char *eol_str = EOLSTR;
@@ -618,10 +582,9 @@ write_interchange(GFile *f, IMAGE *img, CDSCBBOX devbbox)
     int preview_width, bwidth;
     int lines_per_scan;
     int topfirst = ((img->format & DISPLAY_FIRSTROW_MASK) == DISPLAY_TOPFIRST);
-    char hexline[MAXHEXWIDTH+6];
-    int hexcount = 0;
-    unsigned int value;
+    IMAGE_TEXT text;
     unsigned int depth = 8;
+    IMAGE_CONVERT *cv;
     
     validate_devbbox(img, &devbbox);
 
@@ -647,7 +610,15 @@ write_interchange(GFile *f, IMAGE *img, CDSCBBOX devbbox)
 	    return -1;
     }
 
+    cv = image_convert_new(img,
+	(depth == 1) ? IMAGE_CONVERT_MONO : IMAGE_CONVERT_GREY);
+    if (cv == NULL)
+	return -1;
     preview = (unsigned char *) malloc(preview_width);
+    if (preview == NULL) {
+	image_convert_free(cv);
+	return -1;
+    }
 
     lines_per_scan = (bwidth + (MAXHEXWIDTH/2) - 1) / (MAXHEXWIDTH/2);
     buf[sizeof(buf)-1] = '\0';
@@ -661,45 +632,24 @@ write_interchange(GFile *f, IMAGE *img, CDSCBBOX devbbox)
     else
 	line = img->image + img->raster * (devbbox.ury-1);
 
+    image_text_init(&text, f, IMAGE_TEXT_HEX_UPPER, MAXHEXWIDTH, "% ", 
+	eol_str);
     /* process each line of bitmap */
     for (i = 0; i < (devbbox.ury-devbbox.lly); i++) {
 	memset(preview,0xff,preview_width);
+	image_convert_row(cv, preview, line);
 	if (depth == 1) {
-	    image_to_mono(img, preview, line);
 	    if (devbbox.llx)
-		shift_preview(preview, preview_width, devbbox.llx);
+		image_shift_bits(preview, preview_width, devbbox.llx);
 	}
 	else {
-	    image_to_grey(img, preview, line);
 	    if (devbbox.llx)
 		memmove(preview, preview+devbbox.llx, preview_width);
 	}
-	hexcount = 0;
-	hexline[hexcount++] = '%';
-	hexline[hexcount++] = ' ';
-	for (j=0; j<bwidth; j++) {
-	    if (hexcount >= 2 + MAXHEXWIDTH) {
-		if (strlen(eol_str) <= sizeof(hexline)-hexcount) {
-		    memcpy(hexline+hexcount, eol_str, strlen(eol_str));
-		    hexcount += (int)strlen(eol_str);
-		}
-		gfile_write(f, hexline, hexcount);
-		hexcount = 0;
-		hexline[hexcount++] = '%';
-		hexline[hexcount++] = ' ';
-	    }
-	    value = preview[j];
-	    if (depth == 8)
-		value = 255 - value;
-	    hexline[hexcount++] = hex[(value>>4)&15];
-	    hexline[hexcount++] = hex[value&15];
-	}
-	if (hexcount && (strlen(eol_str) <= sizeof(hexline)-hexcount)) {
-	    memcpy(hexline+hexcount, eol_str, strlen(eol_str));
-	    hexcount += (int)strlen(eol_str);
-	}
-	if (hexcount)
-	    gfile_write(f, hexline, hexcount);
+	if (depth == 8)
+	    image_invert_bits(preview, preview, bwidth);
+	image_text_write(&text, preview, bwidth);
+	image_text_end_line(&text);
 
 	if (topfirst)
 	    line += img->raster;
@@ -707,11 +657,12 @@ write_interchange(GFile *f, IMAGE *img, CDSCBBOX devbbox)
 	    line -= img->raster;
 
     }
+    image_text_flush(&text);
 
-    
     gfile_puts(f, endpreview_str);
     gfile_puts(f, eol_str);
     free(preview);
+    image_convert_free(cv);
 
     return 0;
 }
@@ -1002,6 +953,7 @@ write_metafile(GFile *f, IMAGE *img, CDSCBBOX devbbox,
     unsigned long size;
     int depth = image_depth(img);
     int topfirst = ((img->format & DISPLAY_FIRSTROW_MASK) == DISPLAY_TOPFIRST);
+    IMAGE_CONVERT *cv = NULL;
 
     dy = 0;
     wx = devbbox.urx - devbbox.llx;
@@ -1027,9 +979,18 @@ write_metafile(GFile *f, IMAGE *img, CDSCBBOX devbbox,
     pbmi->biClrUsed = 0;		/* write out full palette */
     pbmi->biClrImportant = 0;
 
-    line2 = (BYTE *)malloc(img->raster);
-    if (line2 == (BYTE *)NULL)
-       return -1;
+    /* the row written may be wider than the image raster */
+    line2 = (BYTE *)malloc(max((int)img->raster, bytewidth));
+    if (line2 == (BYTE *)NULL) {
+	free((char *)pbmi);
+	return -1;
+    }
+    if ((depth == 24) &&
+	((cv = image_convert_new(img, IMAGE_CONVERT_24BGR)) == NULL)) {
+	free((char *)pbmi);
+	free(line2);
+	return -1;
+    }
     pbmi->biWidth = wx;
 
     if (topfirst) 
@@ -1085,10 +1046,10 @@ write_metafile(GFile *f, IMAGE *img, CDSCBBOX devbbox,
 	/* write bitmap rows */
 	for (i=0; i<ny; i++) {
 	    if (depth == 24)
-		image_to_24BGR(img, line2, line);
+		image_convert_row(cv, line2, line);
 	    else
 		memmove(line2, line, img->raster);
-	    shift_preview(line2, img->raster, bitoffset);
+	    image_shift_bits(line2, img->raster, bitoffset);
 	    if (activewidth < bytewidth)
 		memset(line2+activewidth, 0xff, bytewidth-activewidth);
 	    gfile_write(f, line2, bytewidth);
@@ -1123,10 +1084,10 @@ write_metafile(GFile *f, IMAGE *img, CDSCBBOX devbbox,
     /* copy last chunk */
     for (i=0; i<wy; i++) {
 	if (depth == 24)
-	    image_to_24BGR(img, line2, line);
+	    image_convert_row(cv, line2, line);
 	else
 	    memmove(line2, line, img->raster);
-	shift_preview(line2, img->raster, bitoffset);
+	image_shift_bits(line2, img->raster, bitoffset);
 	if (activewidth < bytewidth)
 	    memset(line2+activewidth, 0xff, bytewidth-activewidth);
 	gfile_write(f, line2, bytewidth);
@@ -1142,6 +1103,7 @@ write_metafile(GFile *f, IMAGE *img, CDSCBBOX devbbox,
 
     free((char *)pbmi);
     free(line2);
+    image_convert_free(cv);
 
     return 0;
 }
@@ -2332,6 +2294,84 @@ copy_page_temp(Doc *doc, GFile *f, int page)
     return code;
 }
 
+/* Copy several pages to one file, so Ghostscript is run once.
+ * The prolog and setup are copied once, then each page inside
+ * its own save and restore, followed by one showpage.
+ * showpage resets the graphics state, so anything that must
+ * apply to every page, such as a translate, is given in 
+ * page_setup, which is written after each save.
+ * A separation in a separate file is copied whole as its page,
+ * and the document prolog is only copied for pages that need it.
+ */
+int
+copy_pages_temp(Doc *doc, GFile *f, const int *pages, int count,
+    const char *page_setup)
+{
+    const char save_str[] = 
+	"%!\nsave /GSview_save exch def\n/showpage {} def\n";
+    const char page_save_str[] = 
+	"\nuserdict /GSview_page save put\n"
+	"userdict /GSview_dicts countdictstack put\n";
+    const char page_restore_str[] = 
+	"\nclear {countdictstack userdict /GSview_dicts get le {exit} if end}"
+	" loop\nuserdict /GSview_page get restore\n"
+	"systemdict /showpage get exec\n";
+    const char restore_str[] = 
+        "\nclear cleardictstack GSview_save restore\n";
+    CDSC *dsc = doc->dsc;
+    GFile *docfile;
+    GFile *platefile;
+    const char *fname;
+    TCHAR wfname[MAXSTR];
+    BOOL local = FALSE;		/* some pages are in the document file */
+    int i;
+    if (dsc == NULL)
+	return -1;
+    for (i=0; i<count; i++)
+	if (dsc_find_platefile(dsc, pages[i]) == NULL)
+	    local = TRUE;
+    if ((docfile = gfile_open(doc_name(doc), gfile_modeRead)) 
+	== (GFile *)NULL) {
+	app_csmsgf(doc->app, 
+	    TEXT("Can't open document file \042%s\042\n"),
+	    doc_name(doc));
+	return -1;
+    }
+    gfile_puts(f, save_str);
+    if (local) {
+	ps_copy(f, docfile, dsc->begincomments, dsc->endcomments);
+	ps_copy(f, docfile, dsc->begindefaults, dsc->enddefaults);
+	ps_copy(f, docfile, dsc->beginprolog, dsc->endprolog);
+	ps_copy(f, docfile, dsc->beginsetup, dsc->endsetup);
+    }
+    for (i=0; i<count; i++) {
+	gfile_puts(f, page_save_str);
+	if (page_setup)
+	    gfile_puts(f, page_setup);
+	fname = dsc_find_platefile(dsc, pages[i]);
+	if (fname) {
+	    narrow_to_cs(wfname, (int)sizeof(wfname), fname, 
+		(int)strlen(fname)+1);
+	    platefile = gfile_open(wfname, gfile_modeRead);
+	    if (platefile != (GFile *)NULL) {
+		ps_copy(f, platefile, 0, gfile_get_length(platefile));
+		gfile_close(platefile);
+	    }
+	    /* else separation is missing, don't flag an error */
+	}
+	else if (dsc->page_count && (pages[i] >= 0) && 
+	    (pages[i] < (int)dsc->page_count))
+	    ps_copy(f, docfile, dsc->page[pages[i]].begin, 
+		dsc->page[pages[i]].end);
+	gfile_puts(f, page_restore_str);
+    }
+    if (local)
+	ps_copy(f, docfile, dsc->begintrailer, dsc->endtrailer);
+    gfile_puts(f, restore_str);
+    gfile_close(docfile);
+    return 0;
+}
+
 int
 copy_page_nosave(Doc *doc, GFile *f, int page)
 {
@@ -16,7 +16,7 @@ int extract_doseps(Doc *doc, LPCTSTR outname, BOOL preview);
 int extract_macbin(Doc *doc, LPCTSTR outname, BOOL preview);
 int make_eps_tiff(Doc *doc, IMAGE *img, CDSCBBOX devbbox, 
     CDSCBBOX *bbox, CDSCFBBOX *hires_bbox,
-    float xdpi, float ydpi, BOOL tiff4, BOOL use_packbits, BOOL reverse,
+    float xdpi, float ydpi, BOOL tiff4, int compress, BOOL reverse,
     LPCTSTR epsname);
 int make_eps_user(Doc *doc, LPCTSTR preview_name, BOOL reverse, 
     LPCTSTR epsname);
@@ -30,6 +30,8 @@ int make_eps_pict(Doc *doc, IMAGE *img,
     CDSCBBOX *bbox, CDSCFBBOX *hires_bbox,
     float xdpi, float ydpi, CMAC_TYPE type, LPCTSTR epsname);
 int copy_page_temp(Doc *doc, GFile *f, int page);
+int copy_pages_temp(Doc *doc, GFile *f, const int *pages, int count,
+    const char *page_setup);
 int copy_page_nosave(Doc *doc, GFile *f, int page);
 int copy_eps(Doc *doc, LPCTSTR epsname, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox,
     int offset, BOOL dcs2_multi);
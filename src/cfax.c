@@ -0,0 +1,276 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: cfax.c,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* CCITT Group 4 compression, compatible with TIFF Compression=4
+ * and PostScript CCITTFaxDecode filter with K -1.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include "cfax.h"
+
+/*
+ * Group 4 is described in ITU-T Recommendation T.6, and uses
+ * the run length codes of Recommendation T.4.
+ * Each row is coded against the row above, which is white for
+ * the first row.  The coding follows the changing elements,
+ * where a pixel has a different colour to the one before it.
+ */
+
+typedef struct FAX_CODE_s {
+    unsigned short code;
+    unsigned short length;
+} FAX_CODE;
+
+/* Terminating codes for runs of 0 to 63, then make-up codes for
+ * runs of 64 to 2560 in steps of 64.
+ * The make-up codes from 1792 are the same for both colours.
+ */
+static const FAX_CODE fax_white[104] = {
+    {0x035,  8}, {0x007,  6}, {0x007,  4}, {0x008,  4},
+    {0x00b,  4}, {0x00c,  4}, {0x00e,  4}, {0x00f,  4},
+    {0x013,  5}, {0x014,  5}, {0x007,  5}, {0x008,  5},
+    {0x008,  6}, {0x003,  6}, {0x034,  6}, {0x035,  6},
+    {0x02a,  6}, {0x02b,  6}, {0x027,  7}, {0x00c,  7},
+    {0x008,  7}, {0x017,  7}, {0x003,  7}, {0x004,  7},
+    {0x028,  7}, {0x02b,  7}, {0x013,  7}, {0x024,  7},
+    {0x018,  7}, {0x002,  8}, {0x003,  8}, {0x01a,  8},
+    {0x01b,  8}, {0x012,  8}, {0x013,  8}, {0x014,  8},
+    {0x015,  8}, {0x016,  8}, {0x017,  8}, {0x028,  8},
+    {0x029,  8}, {0x02a,  8}, {0x02b,  8}, {0x02c,  8},
+    {0x02d,  8}, {0x004,  8}, {0x005,  8}, {0x00a,  8},
+    {0x00b,  8}, {0x052,  8}, {0x053,  8}, {0x054,  8},
+    {0x055,  8}, {0x024,  8}, {0x025,  8}, {0x058,  8},
+    {0x059,  8}, {0x05a,  8}, {0x05b,  8}, {0x04a,  8},
+    {0x04b,  8}, {0x032,  8}, {0x033,  8}, {0x034,  8},
+    {0x01b,  5}, {0x012,  5}, {0x017,  6}, {0x037,  7},
+    {0x036,  8}, {0x037,  8}, {0x064,  8}, {0x065,  8},
+    {0x068,  8}, {0x067,  8}, {0x0cc,  9}, {0x0cd,  9},
+    {0x0d2,  9}, {0x0d3,  9}, {0x0d4,  9}, {0x0d5,  9},
+    {0x0d6,  9}, {0x0d7,  9}, {0x0d8,  9}, {0x0d9,  9},
+    {0x0da,  9}, {0x0db,  9}, {0x098,  9}, {0x099,  9},
+    {0x09a,  9}, {0x018,  6}, {0x09b,  9}, {0x008, 11},
+    {0x00c, 11}, {0x00d, 11}, {0x012, 12}, {0x013, 12},
+    {0x014, 12}, {0x015, 12}, {0x016, 12}, {0x017, 12},
+    {0x01c, 12}, {0x01d, 12}, {0x01e, 12}, {0x01f, 12}
+};
+
+static const FAX_CODE fax_black[104] = {
+    {0x037, 10}, {0x002,  3}, {0x003,  2}, {0x002,  2},
+    {0x003,  3}, {0x003,  4}, {0x002,  4}, {0x003,  5},
+    {0x005,  6}, {0x004,  6}, {0x004,  7}, {0x005,  7},
+    {0x007,  7}, {0x004,  8}, {0x007,  8}, {0x018,  9},
+    {0x017, 10}, {0x018, 10}, {0x008, 10}, {0x067, 11},
+    {0x068, 11}, {0x06c, 11}, {0x037, 11}, {0x028, 11},
+    {0x017, 11}, {0x018, 11}, {0x0ca, 12}, {0x0cb, 12},
+    {0x0cc, 12}, {0x0cd, 12}, {0x068, 12}, {0x069, 12},
+    {0x06a, 12}, {0x06b, 12}, {0x0d2, 12}, {0x0d3, 12},
+    {0x0d4, 12}, {0x0d5, 12}, {0x0d6, 12}, {0x0d7, 12},
+    {0x06c, 12}, {0x06d, 12}, {0x0da, 12}, {0x0db, 12},
+    {0x054, 12}, {0x055, 12}, {0x056, 12}, {0x057, 12},
+    {0x064, 12}, {0x065, 12}, {0x052, 12}, {0x053, 12},
+    {0x024, 12}, {0x037, 12}, {0x038, 12}, {0x027, 12},
+    {0x028, 12}, {0x058, 12}, {0x059, 12}, {0x02b, 12},
+    {0x02c, 12}, {0x05a, 12}, {0x066, 12}, {0x067, 12},
+    {0x00f, 10}, {0x0c8, 12}, {0x0c9, 12}, {0x05b, 12},
+    {0x033, 12}, {0x034, 12}, {0x035, 12}, {0x06c, 13},
+    {0x06d, 13}, {0x04a, 13}, {0x04b, 13}, {0x04c, 13},
+    {0x04d, 13}, {0x072, 13}, {0x073, 13}, {0x074, 13},
+    {0x075, 13}, {0x076, 13}, {0x077, 13}, {0x052, 13},
+    {0x053, 13}, {0x054, 13}, {0x055, 13}, {0x05a, 13},
+    {0x05b, 13}, {0x064, 13}, {0x065, 13}, {0x008, 11},
+    {0x00c, 11}, {0x00d, 11}, {0x012, 12}, {0x013, 12},
+    {0x014, 12}, {0x015, 12}, {0x016, 12}, {0x017, 12},
+    {0x01c, 12}, {0x01d, 12}, {0x01e, 12}, {0x01f, 12}
+};
+
+
+#define FAX_MAKEUP_2560 103
+
+/* Vertical mode codes, for b1 - a1 = -3 to 3 */
+static const FAX_CODE fax_vertical[7] = {
+    {0x03, 7}, {0x03, 6}, {0x03, 3}, {0x01, 1},
+    {0x02, 3}, {0x02, 6}, {0x02, 7}
+};
+
+#define FAX_PASS 0x1, 4
+#define FAX_HORIZONTAL 0x1, 3
+#define FAX_EOL 0x001, 12
+
+struct fax_state_s {
+    int columns;
+    int bytes;			/* in a row */
+    unsigned char *ref;		/* reference row, the one above */
+    unsigned int bits;		/* bits that didn't fit in a whole byte */
+    int bit_count;		/* number of bits that didn't fit */
+    unsigned char *out;		/* next output byte */
+};
+
+#define FAX_PIXEL(row, x) (((row)[(x)>>3] >> (7 - ((x) & 7))) & 1)
+
+fax_state_t *
+fax_new(int columns)
+{
+    fax_state_t *state;
+    if (columns <= 0)
+	return NULL;
+    state = (fax_state_t *)malloc(sizeof(fax_state_t));
+    if (state == (fax_state_t *)NULL)
+	return NULL;
+    memset(state, 0, sizeof(fax_state_t));
+    state->columns = columns;
+    state->bytes = (columns + 7) >> 3;
+    state->ref = (unsigned char *)malloc(state->bytes);
+    if (state->ref == NULL) {
+	free(state);
+	return NULL;
+    }
+    memset(state->ref, 0, state->bytes);
+    return state;
+}
+
+static void
+fax_put(fax_state_t *state, unsigned int code, int length)
+{
+    state->bits = (state->bits << length) | code;
+    state->bit_count += length;
+    while (state->bit_count >= 8) {
+	state->bit_count -= 8;
+	*state->out++ = (unsigned char)(state->bits >> state->bit_count);
+    }
+}
+
+static void
+fax_put_run(fax_state_t *state, const FAX_CODE *table, int run)
+{
+    const FAX_CODE *c;
+    while (run >= 2560 + 64) {
+	c = &table[FAX_MAKEUP_2560];
+	fax_put(state, c->code, c->length);
+	run -= 2560;
+    }
+    if (run >= 64) {
+	c = &table[63 + (run >> 6)];
+	fax_put(state, c->code, c->length);
+	run &= 63;
+    }
+    fax_put(state, table[run].code, table[run].length);
+}
+
+/* Return the first pixel at or after x that is not colour,
+ * or end if there is none.
+ * Whole bytes of one colour are skipped at once.
+ */
+static int
+fax_find_diff(const unsigned char *row, int x, int end, int colour)
+{
+    unsigned int flip = colour ? 0xff : 0;
+    unsigned int b;
+    const unsigned char *p;
+    if (x >= end)
+	return end;
+    p = row + (x >> 3);
+    b = (*p ^ flip) & (0xff >> (x & 7));
+    x &= ~7;
+    while (b == 0) {
+	x += 8;
+	if (x >= end)
+	    return end;
+	b = *++p ^ flip;
+    }
+    while (!(b & 0x80)) {
+	b <<= 1;
+	x++;
+    }
+    return (x < end) ? x : end;
+}
+
+int
+fax_encode_row(fax_state_t *state, const unsigned char *row,
+    unsigned char *outbuf)
+{
+    const unsigned char *ref = state->ref;
+    int columns = state->columns;
+    int a0 = 0;
+    int a1, a2, b1, b2, d;
+    int colour;
+
+    state->out = outbuf;
+    /* a0 starts on an imaginary white pixel before the row */
+    a1 = FAX_PIXEL(row, 0) ? 0 : fax_find_diff(row, 0, columns, 0);
+    b1 = FAX_PIXEL(ref, 0) ? 0 : fax_find_diff(ref, 0, columns, 0);
+    for (;;) {
+	b2 = (b1 < columns) ?
+	    fax_find_diff(ref, b1, columns, FAX_PIXEL(ref, b1)) : columns;
+	if (b2 < a1) {
+	    fax_put(state, FAX_PASS);
+	    a0 = b2;
+	}
+	else {
+	    d = b1 - a1;
+	    if ((d >= -3) && (d <= 3)) {
+		fax_put(state, fax_vertical[d+3].code,
+		    fax_vertical[d+3].length);
+		a0 = a1;
+	    }
+	    else {
+		a2 = (a1 < columns) ?
+		    fax_find_diff(row, a1, columns, FAX_PIXEL(row, a1)) :
+		    columns;
+		fax_put(state, FAX_HORIZONTAL);
+		if ((a0 + a1 == 0) || (FAX_PIXEL(row, a0) == 0)) {
+		    fax_put_run(state, fax_white, a1 - a0);
+		    fax_put_run(state, fax_black, a2 - a1);
+		}
+		else {
+		    fax_put_run(state, fax_black, a1 - a0);
+		    fax_put_run(state, fax_white, a2 - a1);
+		}
+		a0 = a2;
+	    }
+	}
+	if (a0 >= columns)
+	    break;
+	colour = FAX_PIXEL(row, a0);
+	a1 = fax_find_diff(row, a0, columns, colour);
+	/* b1 is the next change on the reference row to the
+	 * opposite colour of a0
+	 */
+	b1 = fax_find_diff(ref, a0, columns, !colour);
+	b1 = fax_find_diff(ref, b1, columns, colour);
+    }
+    memcpy(state->ref, row, state->bytes);
+    return (int)(state->out - outbuf);
+}
+
+int
+fax_finish(fax_state_t *state, unsigned char *outbuf)
+{
+    state->out = outbuf;
+    /* end of facsimile block is two EOL */
+    fax_put(state, FAX_EOL);
+    fax_put(state, FAX_EOL);
+    if (state->bit_count > 0)
+	*state->out++ = (unsigned char)(state->bits << (8 - state->bit_count));
+    state->bits = 0;
+    state->bit_count = 0;
+    memset(state->ref, 0, state->bytes);
+    return (int)(state->out - outbuf);
+}
+
+void
+fax_free(fax_state_t *state)
+{
+    if (state == NULL)
+	return;
+    free(state->ref);
+    free(state);
+}
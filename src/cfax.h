@@ -0,0 +1,54 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: cfax.h,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* CCITT Group 4 compression, compatible with TIFF Compression=4
+ * and PostScript CCITTFaxDecode filter with K -1.
+ */
+
+/* Public */
+
+#ifndef CFAX_INCLUDED
+#define CFAX_INCLUDED
+
+/* Structure for holding Group 4 compressor state */
+typedef struct fax_state_s fax_state_t;
+
+/* Maximum bytes written by one call to fax_encode_row()
+ * or fax_finish(), for rows of columns pixels.
+ */
+#define FAX_MAX_ROW(columns) (2 * (columns) + 16)
+
+/* Allocate and initialise a Group 4 compressor for rows
+ * of columns pixels.
+ */
+fax_state_t *fax_new(int columns);
+
+/*
+ * Compress one row of 1-bit pixels, where 1 is black and the
+ * first pixel is in the most significant bit.
+ * Writes at most FAX_MAX_ROW(columns) bytes to outbuf,
+ * and returns the count of bytes written.
+ * Bits that don't fill a byte are kept for the next call.
+ */
+int fax_encode_row(fax_state_t *state, const unsigned char *row,
+    unsigned char *outbuf);
+
+/*
+ * Write the end of facsimile block and the last bits,
+ * and return the count of bytes written.
+ * The next row starts a new block, as if from fax_new().
+ */
+int fax_finish(fax_state_t *state, unsigned char *outbuf);
+
+/* Free the Group 4 structure */
+void fax_free(fax_state_t *state);
+
+#endif /* CFAX_INCLUDED */
@@ -0,0 +1,135 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: cflate.c,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* Flate compression, compatible with PostScript FlateDecode filter */
+
+#include "common.h"
+#include "cflate.h"
+
+/* The parts of zlib.h that we use.
+ * deflateInit_() is given the version and size of this structure,
+ * and fails if they don't match the library.
+ */
+#define FLATE_ZLIB_VERSION "1.2.3"
+#define Z_OK 0
+#define Z_STREAM_END 1
+#define Z_BUF_ERROR (-5)
+#define Z_NO_FLUSH 0
+#define Z_FINISH 4
+
+typedef struct flate_zstream_s {
+    const unsigned char *next_in;
+    unsigned int avail_in;
+    unsigned long total_in;
+    unsigned char *next_out;
+    unsigned int avail_out;
+    unsigned long total_out;
+    const char *msg;
+    void *state;
+    void *zalloc;
+    void *zfree;
+    void *opaque;
+    int data_type;
+    unsigned long adler;
+    unsigned long reserved;
+} flate_zstream_t;
+
+struct flate_state_s {
+    flate_zstream_t zs;
+    BOOL finished;
+};
+
+static PFN_deflateInit_ flate_deflateInit_;
+static PFN_deflate flate_deflate;
+static PFN_deflateEnd flate_deflateEnd;
+static PFN_deflateReset flate_deflateReset;
+
+void
+flate_set_zlib(PFN_deflateInit_ init, PFN_deflate deflate,
+    PFN_deflateEnd end, PFN_deflateReset reset)
+{
+    flate_deflateInit_ = init;
+    flate_deflate = deflate;
+    flate_deflateEnd = end;
+    flate_deflateReset = reset;
+}
+
+BOOL
+flate_available(void)
+{
+    return (flate_deflateInit_ != NULL) && (flate_deflate != NULL) &&
+	(flate_deflateEnd != NULL) && (flate_deflateReset != NULL);
+}
+
+flate_state_t *
+flate_new(int level)
+{
+    flate_state_t *state;
+    if (!flate_available())
+	return NULL;
+    if ((level < 0) || (level > 9))
+	level = FLATE_LEVEL_DEFAULT;
+    state = (flate_state_t *)malloc(sizeof(flate_state_t));
+    if (state == (flate_state_t *)NULL)
+	return NULL;
+    memset(state, 0, sizeof(flate_state_t));
+    if (flate_deflateInit_(&state->zs, level, FLATE_ZLIB_VERSION,
+	(int)sizeof(flate_zstream_t)) != Z_OK) {
+	free(state);
+	return NULL;
+    }
+    return state;
+}
+
+int
+flate_compress(flate_state_t *state,
+    const unsigned char *inbuf, int *inlen,
+    unsigned char *outbuf, int *outlen)
+{
+    int code;
+    BOOL eod = (*inlen == 0);
+    if (state->finished) {
+	*outlen = 0;
+	return 0;
+    }
+    state->zs.next_in = inbuf;
+    state->zs.avail_in = (unsigned int)*inlen;
+    state->zs.next_out = outbuf;
+    state->zs.avail_out = (unsigned int)*outlen;
+    code = flate_deflate(&state->zs, eod ? Z_FINISH : Z_NO_FLUSH);
+    *inlen -= (int)state->zs.avail_in;	/* input bytes used */
+    *outlen -= (int)state->zs.avail_out;	/* bytes written */
+    if (code == Z_STREAM_END) {
+	state->finished = TRUE;
+	return 0;
+    }
+    if ((code != Z_OK) && (code != Z_BUF_ERROR))
+	return_error(-1);
+    return eod ? 1 : 0;
+}
+
+int
+flate_reset(flate_state_t *state)
+{
+    state->finished = FALSE;
+    if (flate_deflateReset(&state->zs) != Z_OK)
+	return_error(-1);
+    return 0;
+}
+
+void
+flate_free(flate_state_t *state)
+{
+    if (state == NULL)
+	return;
+    flate_deflateEnd(&state->zs);
+    free(state);
+}
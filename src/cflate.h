@@ -0,0 +1,71 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: cflate.h,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* Flate compression, compatible with PostScript FlateDecode filter */
+
+/* Public */
+
+#ifndef CFLATE_INCLUDED
+#define CFLATE_INCLUDED
+
+/* zlib is loaded at run time by zlib_load(), which passes
+ * these functions to flate_set_zlib().
+ */
+#ifdef __cplusplus
+extern "C" {
+#endif
+    typedef int (WINAPI *PFN_deflateInit_)(void *strm, int level,
+	const char *version, int stream_size);
+    typedef int (WINAPI *PFN_deflate)(void *strm, int flush);
+    typedef int (WINAPI *PFN_deflateEnd)(void *strm);
+    typedef int (WINAPI *PFN_deflateReset)(void *strm);
+#ifdef __cplusplus
+}
+#endif
+void flate_set_zlib(PFN_deflateInit_ init, PFN_deflate deflate,
+    PFN_deflateEnd end, PFN_deflateReset reset);
+
+/* Returns TRUE if zlib has been loaded */
+BOOL flate_available(void);
+
+#define FLATE_LEVEL_DEFAULT 6
+
+/* Structure for holding Flate compressor state */
+typedef struct flate_state_s flate_state_t;
+
+/* Allocate and initialise a Flate compressor.
+ * level is 0 (no compression) to 9 (smallest).
+ * Returns NULL if zlib is not loaded.
+ */
+flate_state_t *flate_new(int level);
+
+/*
+ * Compress a buffer with Flate, with the same arguments as
+ * lzw_compress().
+ * To signal EOD, call with *inlen = 0.  This may need several
+ * calls, until it returns 0.
+ * Returns 0 on success, 1 if EOD output is incomplete because
+ * the output buffer is full, or -1 on error.
+ */
+int flate_compress(flate_state_t *state,
+    const unsigned char *inbuf, int *inlen,
+    unsigned char *outbuf, int *outlen);
+
+/* Start a new Flate stream with the same level.
+ * This is cheaper than flate_free() and flate_new().
+ * Returns 0 on success, -1 on error.
+ */
+int flate_reset(flate_state_t *state);
+
+/* Free the Flate structure */
+void flate_free(flate_state_t *state);
+
+#endif /* CFLATE_INCLUDED */
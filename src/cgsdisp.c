@@ -0,0 +1,385 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: cgsdisp.c,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* In-process Ghostscript rendering to the display device */
+
+/* The Ghostscript shared library or DLL is loaded at run time
+ * and the page is rendered with the display device.
+ * The raster is passed back through the display callback,
+ * so no child process or temporary bitmap file is needed.
+ */
+
+#include "common.h"
+#include "errors.h"
+#include "iapi.h"
+#include "gdevdsp.h"
+#include "capp.h"
+#include "cdll.h"
+#include "cimg.h"
+#include "cgsdisp.h"
+
+struct GSDISP_s {
+    GSview *app;
+    GGMODULE hmodule;
+    PFN_gsapi_revision revision;
+    PFN_gsapi_new_instance new_instance;
+    PFN_gsapi_delete_instance delete_instance;
+    PFN_gsapi_set_display_callback set_display_callback;
+    PFN_gsapi_init_with_args init_with_args;
+    PFN_gsapi_exit exit;
+};
+
+/* State for one call to gsdisp_render() */
+typedef struct GSDISP_RENDER_s {
+    GSDISP *gsdisp;
+    unsigned int format;	/* requested format */
+    IMAGE img;			/* display device raster */
+    GSDISP_PAGE_FN page_fn;
+    void *caller;
+    int code;			/* error returned by page_fn */
+} GSDISP_RENDER;
+
+#define GSDISP_MAXARG 64
+static char gsdisp_progname[] = "gs";
+static char gsdisp_device[] = "-sDEVICE=display";
+
+/*********************************************************/
+/* display device callbacks */
+
+static int
+gsdisp_display_open(void *handle, void *device)
+{
+    return 0;
+}
+
+static int
+gsdisp_display_preclose(void *handle, void *device)
+{
+    return 0;
+}
+
+static int
+gsdisp_display_close(void *handle, void *device)
+{
+    GSDISP_RENDER *r = (GSDISP_RENDER *)handle;
+    r->img.image = NULL;
+    return 0;
+}
+
+static int
+gsdisp_display_presize(void *handle, void *device, int width, int height,
+	int raster, unsigned int format)
+{
+    GSDISP_RENDER *r = (GSDISP_RENDER *)handle;
+    /* refuse anything other than the format we asked for */
+    if (format != r->format)
+	return e_rangecheck;
+    return 0;
+}
+
+static int
+gsdisp_display_size(void *handle, void *device, int width, int height,
+	int raster, unsigned int format, unsigned char *pimage)
+{
+    GSDISP_RENDER *r = (GSDISP_RENDER *)handle;
+    r->img.width = width;
+    r->img.height = height;
+    r->img.raster = raster;
+    r->img.format = format;
+    r->img.image = pimage;
+    return 0;
+}
+
+static int
+gsdisp_display_sync(void *handle, void *device)
+{
+    return 0;
+}
+
+static int
+gsdisp_display_page(void *handle, void *device, int copies, int flush)
+{
+    GSDISP_RENDER *r = (GSDISP_RENDER *)handle;
+    int code = 0;
+    if ((r->page_fn != NULL) && (r->img.image != NULL) && (r->code == 0))
+	code = r->page_fn(r->caller, &r->img);
+    if (code < 0) {
+	/* stop Ghostscript and remember why */
+	r->code = code;
+	return e_Fatal;
+    }
+    return 0;
+}
+
+static int
+gsdisp_display_update(void *handle, void *device,
+	int x, int y, int w, int h)
+{
+    return 0;
+}
+
+static display_callback gsdisp_display = {
+    sizeof(display_callback),
+    DISPLAY_VERSION_MAJOR,
+    DISPLAY_VERSION_MINOR,
+    gsdisp_display_open,
+    gsdisp_display_preclose,
+    gsdisp_display_close,
+    gsdisp_display_presize,
+    gsdisp_display_size,
+    gsdisp_display_sync,
+    gsdisp_display_page,
+    gsdisp_display_update,
+    NULL,	/* memalloc */
+    NULL	/* memfree */
+};
+
+/*********************************************************/
+
+GSDISP *
+gsdisp_load(GSview *app, LPCTSTR name)
+{
+    int code = 0;
+    TCHAR buf[1024];
+    GSDISP *gsdisp;
+    gsapi_revision_t rv;
+
+    gsdisp = (GSDISP *)malloc(sizeof(GSDISP));
+    if (gsdisp == NULL)
+	return NULL;
+    memset(gsdisp, 0, sizeof(GSDISP));
+    gsdisp->app = app;
+
+    memset(buf, 0, sizeof(buf));
+    code = dll_open(&gsdisp->hmodule, name, buf, sizeof(buf)/sizeof(TCHAR)-1);
+    if (code != 0) {
+	app_csmsg(app, buf);
+	free(gsdisp);
+	return NULL;
+    }
+
+    gsdisp->revision = (PFN_gsapi_revision)
+	dll_sym(&gsdisp->hmodule, "gsapi_revision");
+    gsdisp->new_instance = (PFN_gsapi_new_instance)
+	dll_sym(&gsdisp->hmodule, "gsapi_new_instance");
+    gsdisp->delete_instance = (PFN_gsapi_delete_instance)
+	dll_sym(&gsdisp->hmodule, "gsapi_delete_instance");
+    gsdisp->set_display_callback = (PFN_gsapi_set_display_callback)
+	dll_sym(&gsdisp->hmodule, "gsapi_set_display_callback");
+    gsdisp->init_with_args = (PFN_gsapi_init_with_args)
+	dll_sym(&gsdisp->hmodule, "gsapi_init_with_args");
+    gsdisp->exit = (PFN_gsapi_exit)
+	dll_sym(&gsdisp->hmodule, "gsapi_exit");
+    if ((gsdisp->revision == NULL) || (gsdisp->new_instance == NULL) ||
+	(gsdisp->delete_instance == NULL) ||
+	(gsdisp->set_display_callback == NULL) ||
+	(gsdisp->init_with_args == NULL) ||
+	(gsdisp->exit == NULL)) {
+	app_msg(app, "Can't find gsapi functions in Ghostscript library\n");
+	code = -1;
+    }
+
+    if (code == 0) {
+	memset(&rv, 0, sizeof(rv));
+	if (gsdisp->revision(&rv, sizeof(rv)) != 0) {
+	    app_msg(app, "Ghostscript library revision check failed\n");
+	    code = -1;
+	}
+	else if (debug & DEBUG_GENERAL)
+	    app_msgf(app, "Loaded %s %ld.%02ld\n", rv.product,
+		rv.revision / 100, rv.revision % 100);
+    }
+
+    if (code != 0) {
+	dll_close(&gsdisp->hmodule);
+	free(gsdisp);
+	return NULL;
+    }
+    return gsdisp;
+}
+
+void
+gsdisp_version(GSDISP *gsdisp, char *buf, int len)
+{
+    gsapi_revision_t rv;
+    memset(&rv, 0, sizeof(rv));
+    buf[0] = '\0';
+    if (gsdisp->revision(&rv, sizeof(rv)) == 0)
+	snprintf(buf, len, "%s %ld.%02ld %ld", 
+	    rv.product ? rv.product : "", 
+	    rv.revision / 100, rv.revision % 100, rv.revisiondate);
+    buf[len-1] = '\0';
+}
+
+void
+gsdisp_unload(GSDISP *gsdisp)
+{
+    if (gsdisp == NULL)
+	return;
+    dll_close(&gsdisp->hmodule);
+    memset(gsdisp, 0, sizeof(GSDISP));
+    free(gsdisp);
+}
+
+/* Split a command line into arguments, removing quotes.
+ * argv[0] is set to a dummy program name.
+ * Returns the number of arguments, or -1 on error.
+ * The caller must free *pbuf.
+ */
+static int
+gsdisp_split_args(LPCTSTR args, char **pbuf, char *argv[], int maxarg)
+{
+    int argc = 0;
+    int len;
+    char *buf, *d, *e, *p;
+    len = (int)cslen(args) * 2 + 1;	/* allow for multibyte */
+    buf = (char *)malloc(len * 2);
+    if (buf == NULL)
+	return -1;
+    memset(buf, 0, len * 2);
+    cs_to_narrow(buf, len, args, (int)cslen(args)+1);
+    argv[argc++] = gsdisp_progname;
+    p = buf;
+    d = buf + len;
+    while ((*p) && (*p == ' '))
+	p++;
+    while (*p) {
+	if (argc >= maxarg - 1) {
+	    free(buf);
+	    return -1;
+	}
+	e = d;
+	while ((*p) && (*p != ' ')) {
+	    if (*p == '\042') {
+		/* Remove quotes, skipping over embedded spaces. */
+		p++;
+		while ((*p) && (*p != '\042'))
+		    *d++ = *p++;
+	    }
+	    else
+		*d++ = *p;
+	    if (*p)
+		p++;
+	}
+	*d++ = '\0';
+	argv[argc++] = e;
+	while ((*p) && (*p == ' '))
+	    p++;
+    }
+    argv[argc] = NULL;
+    *pbuf = buf;
+    return argc;
+}
+
+int
+gsdisp_render(GSDISP *gsdisp, LPCTSTR args, unsigned int format,
+    GSDISP_PAGE_FN page_fn, void *caller)
+{
+    int code = 0;
+    gs_main_instance *instance = NULL;
+    GSDISP_RENDER r;
+    char *argv[GSDISP_MAXARG+4];
+    char *buf = NULL;
+    int argc;
+    int i;
+    char dformat[64];
+    char dhandle[64];
+
+    memset(&r, 0, sizeof(r));
+    r.gsdisp = gsdisp;
+    r.format = format;
+    r.page_fn = page_fn;
+    r.caller = caller;
+
+    argc = gsdisp_split_args(args, &buf, argv, GSDISP_MAXARG);
+    if (argc < 0) {
+	app_msg(gsdisp->app, "Too many Ghostscript arguments\n");
+	return_error(-1);
+    }
+    /* insert the display device arguments after the program name */
+    for (i = argc; i > 0; i--)
+	argv[i+3] = argv[i];
+    snprintf(dformat, sizeof(dformat), "-dDisplayFormat=%u", format);
+    snprintf(dhandle, sizeof(dhandle), "-sDisplayHandle=" INTPTR_FORMAT,
+	(INTPTR)(&r));
+    argv[1] = gsdisp_device;
+    argv[2] = dformat;
+    argv[3] = dhandle;
+    argc += 3;
+
+    if (debug & DEBUG_GENERAL) {
+	for (i = 0; i < argc; i++)
+	    app_msgf(gsdisp->app, "%s ", argv[i]);
+	app_msg(gsdisp->app, "\n");
+    }
+
+    code = gsdisp->new_instance(&instance, &r);
+    if (code < 0) {
+	app_msg(gsdisp->app, "Can't create Ghostscript instance\n");
+	free(buf);
+	return_error(-1);
+    }
+    code = gsdisp->set_display_callback(instance, &gsdisp_display);
+    if (code == 0) {
+	code = gsdisp->init_with_args(instance, argc, argv);
+	if (code == e_Quit)
+	    code = 0;	/* -dBATCH causes quit after processing files */
+	gsdisp->exit(instance);
+    }
+    gsdisp->delete_instance(instance);
+    free(buf);
+
+    if (r.code < 0)
+	code = r.code;
+    if (code < 0)
+	return_error(code);
+    return 0;
+}
+
+/* Copy the first page only */
+static int
+gsdisp_copy_page(void *caller, IMAGE *img)
+{
+    IMAGE **pimg = (IMAGE **)caller;
+    IMAGE *newimg;
+    if (*pimg != NULL)
+	return 0;
+    newimg = (IMAGE *)malloc(sizeof(IMAGE));
+    if (newimg == NULL)
+	return_error(-1);
+    memset(newimg, 0, sizeof(IMAGE));
+    newimg->width = img->width;
+    newimg->height = img->height;
+    newimg->raster = img->raster;
+    newimg->format = img->format;
+    newimg->image = (unsigned char *)malloc(img->raster * img->height);
+    if (newimg->image == NULL) {
+	free(newimg);
+	return_error(-1);
+    }
+    memcpy(newimg->image, img->image, img->raster * img->height);
+    *pimg = newimg;
+    return 0;
+}
+
+IMAGE *
+gsdisp_render_image(GSDISP *gsdisp, LPCTSTR args, unsigned int format)
+{
+    IMAGE *img = NULL;
+    if (gsdisp_render(gsdisp, args, format, gsdisp_copy_page, &img) != 0) {
+	if (img) {
+	    free(img->image);
+	    free(img);
+	}
+	return NULL;
+    }
+    return img;
+}
@@ -0,0 +1,54 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: cgsdisp.h,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* In-process Ghostscript rendering to the display device */
+
+/* Public */
+
+#ifndef CGSDISP_INCLUDED
+#define CGSDISP_INCLUDED
+
+typedef struct GSDISP_s GSDISP;
+
+/* Called by gsdisp_render() once for each page.
+ * img describes the Ghostscript display device raster and
+ * is only valid until this function returns.
+ * Return 0 to continue, or -ve to abort rendering.
+ */
+typedef int (*GSDISP_PAGE_FN)(void *caller, IMAGE *img);
+
+/* Load the Ghostscript shared library or DLL.
+ * Returns NULL if it can't be loaded.
+ */
+GSDISP *gsdisp_load(GSview *app, LPCTSTR name);
+void gsdisp_unload(GSDISP *gsdisp);
+
+/* Write the product and revision of the loaded library to buf,
+ * such as "GPL Ghostscript 9.99 20260101".
+ */
+void gsdisp_version(GSDISP *gsdisp, char *buf, int len);
+
+/* Run Ghostscript with the display device.
+ * args are Ghostscript arguments, without the program name
+ * or -sDEVICE, using the same quoting as exec_program().
+ * format is the DISPLAY_* format requested for the raster.
+ * Returns 0 on success, -ve on error.
+ */
+int gsdisp_render(GSDISP *gsdisp, LPCTSTR args, unsigned int format,
+    GSDISP_PAGE_FN page_fn, void *caller);
+
+/* Run Ghostscript and return a copy of the first page.
+ * Free the IMAGE with bitmap_image_free().
+ */
+IMAGE *gsdisp_render_image(GSDISP *gsdisp, LPCTSTR args,
+    unsigned int format);
+
+#endif /* CGSDISP_INCLUDED */
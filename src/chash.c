@@ -0,0 +1,226 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: chash.c,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* MD5 message digest, used for cache keys */
+
+/* This follows the description in RFC 1321.
+ * It is used to name cache entries after their content,
+ * not for security.
+ */
+
+#include "common.h"
+#include "chash.h"
+
+#define MD5_MASK 0xffffffffUL
+#define MD5_ROTL(x, n) \
+    ((((x) << (n)) | (((x) & MD5_MASK) >> (32 - (n)))) & MD5_MASK)
+
+#define MD5_F(x, y, z) (((x) & (y)) | (~(x) & (z)))
+#define MD5_G(x, y, z) (((x) & (z)) | ((y) & ~(z)))
+#define MD5_H(x, y, z) ((x) ^ (y) ^ (z))
+#define MD5_I(x, y, z) ((y) ^ ((x) | (~(z) & MD5_MASK)))
+
+#define MD5_STEP(f, a, b, c, d, x, s, t) \
+    (a) = (((a) + f((b), (c), (d)) + (x) + (t)) & MD5_MASK); \
+    (a) = (MD5_ROTL((a), (s)) + (b)) & MD5_MASK;
+
+static DWORD
+md5_get_dword(const unsigned char *p)
+{
+    return (DWORD)p[0] | ((DWORD)p[1] << 8) |
+	((DWORD)p[2] << 16) | ((DWORD)p[3] << 24);
+}
+
+static void
+md5_put_dword(unsigned char *p, DWORD val)
+{
+    p[0] = (unsigned char)(val & 0xff);
+    p[1] = (unsigned char)((val >> 8) & 0xff);
+    p[2] = (unsigned char)((val >> 16) & 0xff);
+    p[3] = (unsigned char)((val >> 24) & 0xff);
+}
+
+static void
+md5_transform(DWORD state[4], const unsigned char block[64])
+{
+    DWORD a = state[0];
+    DWORD b = state[1];
+    DWORD c = state[2];
+    DWORD d = state[3];
+    DWORD x[16];
+    int i;
+
+    for (i=0; i<16; i++)
+	x[i] = md5_get_dword(block + i*4);
+
+    /* Round 1 */
+    MD5_STEP(MD5_F, a, b, c, d, x[ 0],  7, 0xd76aa478UL)
+    MD5_STEP(MD5_F, d, a, b, c, x[ 1], 12, 0xe8c7b756UL)
+    MD5_STEP(MD5_F, c, d, a, b, x[ 2], 17, 0x242070dbUL)
+    MD5_STEP(MD5_F, b, c, d, a, x[ 3], 22, 0xc1bdceeeUL)
+    MD5_STEP(MD5_F, a, b, c, d, x[ 4],  7, 0xf57c0fafUL)
+    MD5_STEP(MD5_F, d, a, b, c, x[ 5], 12, 0x4787c62aUL)
+    MD5_STEP(MD5_F, c, d, a, b, x[ 6], 17, 0xa8304613UL)
+    MD5_STEP(MD5_F, b, c, d, a, x[ 7], 22, 0xfd469501UL)
+    MD5_STEP(MD5_F, a, b, c, d, x[ 8],  7, 0x698098d8UL)
+    MD5_STEP(MD5_F, d, a, b, c, x[ 9], 12, 0x8b44f7afUL)
+    MD5_STEP(MD5_F, c, d, a, b, x[10], 17, 0xffff5bb1UL)
+    MD5_STEP(MD5_F, b, c, d, a, x[11], 22, 0x895cd7beUL)
+    MD5_STEP(MD5_F, a, b, c, d, x[12],  7, 0x6b901122UL)
+    MD5_STEP(MD5_F, d, a, b, c, x[13], 12, 0xfd987193UL)
+    MD5_STEP(MD5_F, c, d, a, b, x[14], 17, 0xa679438eUL)
+    MD5_STEP(MD5_F, b, c, d, a, x[15], 22, 0x49b40821UL)
+
+    /* Round 2 */
+    MD5_STEP(MD5_G, a, b, c, d, x[ 1],  5, 0xf61e2562UL)
+    MD5_STEP(MD5_G, d, a, b, c, x[ 6],  9, 0xc040b340UL)
+    MD5_STEP(MD5_G, c, d, a, b, x[11], 14, 0x265e5a51UL)
+    MD5_STEP(MD5_G, b, c, d, a, x[ 0], 20, 0xe9b6c7aaUL)
+    MD5_STEP(MD5_G, a, b, c, d, x[ 5],  5, 0xd62f105dUL)
+    MD5_STEP(MD5_G, d, a, b, c, x[10],  9, 0x02441453UL)
+    MD5_STEP(MD5_G, c, d, a, b, x[15], 14, 0xd8a1e681UL)
+    MD5_STEP(MD5_G, b, c, d, a, x[ 4], 20, 0xe7d3fbc8UL)
+    MD5_STEP(MD5_G, a, b, c, d, x[ 9],  5, 0x21e1cde6UL)
+    MD5_STEP(MD5_G, d, a, b, c, x[14],  9, 0xc33707d6UL)
+    MD5_STEP(MD5_G, c, d, a, b, x[ 3], 14, 0xf4d50d87UL)
+    MD5_STEP(MD5_G, b, c, d, a, x[ 8], 20, 0x455a14edUL)
+    MD5_STEP(MD5_G, a, b, c, d, x[13],  5, 0xa9e3e905UL)
+    MD5_STEP(MD5_G, d, a, b, c, x[ 2],  9, 0xfcefa3f8UL)
+    MD5_STEP(MD5_G, c, d, a, b, x[ 7], 14, 0x676f02d9UL)
+    MD5_STEP(MD5_G, b, c, d, a, x[12], 20, 0x8d2a4c8aUL)
+
+    /* Round 3 */
+    MD5_STEP(MD5_H, a, b, c, d, x[ 5],  4, 0xfffa3942UL)
+    MD5_STEP(MD5_H, d, a, b, c, x[ 8], 11, 0x8771f681UL)
+    MD5_STEP(MD5_H, c, d, a, b, x[11], 16, 0x6d9d6122UL)
+    MD5_STEP(MD5_H, b, c, d, a, x[14], 23, 0xfde5380cUL)
+    MD5_STEP(MD5_H, a, b, c, d, x[ 1],  4, 0xa4beea44UL)
+    MD5_STEP(MD5_H, d, a, b, c, x[ 4], 11, 0x4bdecfa9UL)
+    MD5_STEP(MD5_H, c, d, a, b, x[ 7], 16, 0xf6bb4b60UL)
+    MD5_STEP(MD5_H, b, c, d, a, x[10], 23, 0xbebfbc70UL)
+    MD5_STEP(MD5_H, a, b, c, d, x[13],  4, 0x289b7ec6UL)
+    MD5_STEP(MD5_H, d, a, b, c, x[ 0], 11, 0xeaa127faUL)
+    MD5_STEP(MD5_H, c, d, a, b, x[ 3], 16, 0xd4ef3085UL)
+    MD5_STEP(MD5_H, b, c, d, a, x[ 6], 23, 0x04881d05UL)
+    MD5_STEP(MD5_H, a, b, c, d, x[ 9],  4, 0xd9d4d039UL)
+    MD5_STEP(MD5_H, d, a, b, c, x[12], 11, 0xe6db99e5UL)
+    MD5_STEP(MD5_H, c, d, a, b, x[15], 16, 0x1fa27cf8UL)
+    MD5_STEP(MD5_H, b, c, d, a, x[ 2], 23, 0xc4ac5665UL)
+
+    /* Round 4 */
+    MD5_STEP(MD5_I, a, b, c, d, x[ 0],  6, 0xf4292244UL)
+    MD5_STEP(MD5_I, d, a, b, c, x[ 7], 10, 0x432aff97UL)
+    MD5_STEP(MD5_I, c, d, a, b, x[14], 15, 0xab9423a7UL)
+    MD5_STEP(MD5_I, b, c, d, a, x[ 5], 21, 0xfc93a039UL)
+    MD5_STEP(MD5_I, a, b, c, d, x[12],  6, 0x655b59c3UL)
+    MD5_STEP(MD5_I, d, a, b, c, x[ 3], 10, 0x8f0ccc92UL)
+    MD5_STEP(MD5_I, c, d, a, b, x[10], 15, 0xffeff47dUL)
+    MD5_STEP(MD5_I, b, c, d, a, x[ 1], 21, 0x85845dd1UL)
+    MD5_STEP(MD5_I, a, b, c, d, x[ 8],  6, 0x6fa87e4fUL)
+    MD5_STEP(MD5_I, d, a, b, c, x[15], 10, 0xfe2ce6e0UL)
+    MD5_STEP(MD5_I, c, d, a, b, x[ 6], 15, 0xa3014314UL)
+    MD5_STEP(MD5_I, b, c, d, a, x[13], 21, 0x4e0811a1UL)
+    MD5_STEP(MD5_I, a, b, c, d, x[ 4],  6, 0xf7537e82UL)
+    MD5_STEP(MD5_I, d, a, b, c, x[11], 10, 0xbd3af235UL)
+    MD5_STEP(MD5_I, c, d, a, b, x[ 2], 15, 0x2ad7d2bbUL)
+    MD5_STEP(MD5_I, b, c, d, a, x[ 9], 21, 0xeb86d391UL)
+
+    state[0] = (state[0] + a) & MD5_MASK;
+    state[1] = (state[1] + b) & MD5_MASK;
+    state[2] = (state[2] + c) & MD5_MASK;
+    state[3] = (state[3] + d) & MD5_MASK;
+}
+
+void
+hash_init(HASH *h)
+{
+    memset(h, 0, sizeof(HASH));
+    h->state[0] = 0x67452301UL;
+    h->state[1] = 0xefcdab89UL;
+    h->state[2] = 0x98badcfeUL;
+    h->state[3] = 0x10325476UL;
+}
+
+void
+hash_update(HASH *h, const void *data, unsigned int len)
+{
+    const unsigned char *p = (const unsigned char *)data;
+    unsigned int index = (unsigned int)((h->count[0] >> 3) & 0x3f);
+    unsigned int n;
+    DWORD bits = ((DWORD)len << 3) & MD5_MASK;
+
+    h->count[0] = (h->count[0] + bits) & MD5_MASK;
+    if (h->count[0] < bits)
+	h->count[1] = (h->count[1] + 1) & MD5_MASK;
+    h->count[1] = (h->count[1] + ((DWORD)len >> 29)) & MD5_MASK;
+
+    while (len > 0) {
+	n = 64 - index;
+	if (n > len)
+	    n = len;
+	memcpy(h->buffer + index, p, n);
+	index += n;
+	p += n;
+	len -= n;
+	if (index == 64) {
+	    md5_transform(h->state, h->buffer);
+	    index = 0;
+	}
+    }
+}
+
+void
+hash_string(HASH *h, const char *str)
+{
+    /* include the terminating null so that strings can't run together */
+    hash_update(h, str, (unsigned int)strlen(str) + 1);
+}
+
+int
+hash_file(HASH *h, LPCTSTR filename)
+{
+    unsigned char buf[16384];
+    unsigned int count;
+    GFile *f = gfile_open(filename, gfile_modeRead);
+    if (f == NULL)
+	return -1;
+    while ((count = gfile_read(f, buf, sizeof(buf))) > 0)
+	hash_update(h, buf, count);
+    gfile_close(f);
+    return 0;
+}
+
+void
+hash_final(HASH *h, char *hex)
+{
+    static const char hexdigit[] = "0123456789abcdef";
+    unsigned char pad[64];
+    unsigned char bits[8];
+    unsigned char digest[16];
+    unsigned int index;
+    int i;
+
+    md5_put_dword(bits, h->count[0]);
+    md5_put_dword(bits+4, h->count[1]);
+    index = (unsigned int)((h->count[0] >> 3) & 0x3f);
+    memset(pad, 0, sizeof(pad));
+    pad[0] = 0x80;
+    hash_update(h, pad, (index < 56) ? (56 - index) : (120 - index));
+    hash_update(h, bits, 8);
+    for (i=0; i<4; i++)
+	md5_put_dword(digest + i*4, h->state[i]);
+    for (i=0; i<16; i++) {
+	hex[i*2] = hexdigit[digest[i] >> 4];
+	hex[i*2+1] = hexdigit[digest[i] & 0xf];
+    }
+    hex[HASH_HEXLEN] = '\0';
+    memset(h, 0, sizeof(HASH));
+}
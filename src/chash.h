@@ -0,0 +1,36 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: chash.h,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* MD5 message digest, used for cache keys */
+
+/* Public */
+
+#ifndef CHASH_INCLUDED
+#define CHASH_INCLUDED
+
+/* Length of a digest as hexadecimal, excluding the null */
+#define HASH_HEXLEN 32
+
+typedef struct HASH_s {
+    DWORD state[4];
+    DWORD count[2];		/* bits, low word first */
+    unsigned char buffer[64];
+} HASH;
+
+void hash_init(HASH *h);
+void hash_update(HASH *h, const void *data, unsigned int len);
+void hash_string(HASH *h, const char *str);
+/* Add the contents of a file.  Returns 0 on success, -1 on error. */
+int hash_file(HASH *h, LPCTSTR filename);
+/* Write the digest to hex, which must hold HASH_HEXLEN+1 characters */
+void hash_final(HASH *h, char *hex);
+
+#endif /* CHASH_INCLUDED */
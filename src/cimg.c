@@ -11,12 +11,32 @@
 /* $Id: cimg.c,v 1.21 2005/06/10 09:39:24 ghostgum Exp $ */
 /* Common image format and conversion functions */
 
+#include <math.h>
 #include "common.h"
 #include "gdevdsp.h"
 #include "cimg.h"
+#include "cfax.h"
+#include "cflate.h"
 #include "clzw.h"
+#include "cpool.h"
 
-static int a85write(char *line, unsigned char *buf, int count);
+#if defined(__SSE2__) || defined(_M_X64) || \
+    (defined(_M_IX86_FP) && (_M_IX86_FP >= 2))
+#define IMAGE_SSE2
+#include <emmintrin.h>
+#endif
+
+/* Converters for AVX2 are built with the target attribute,
+ * so they don't need -mavx2, and are chosen at run time.
+ */
+#if defined(__GNUC__) && ((__GNUC__ >= 5) || defined(__clang__)) && \
+    (defined(__x86_64__) || defined(__i386__))
+#define IMAGE_AVX2
+#define IMAGE_TARGET_AVX2 __attribute__((target("avx2")))
+#include <immintrin.h>
+#endif
+
+static void image_convert_ready(void);
 
 /* Return a palette entry for given format and index */
 void
@@ -77,6 +97,414 @@ colour_to_grey(unsigned char r, unsigned char g, unsigned char b)
 }
 
 
+/********************************************************/
+/* Fast row converters */
+
+/* The row converters use tables made from image_colour() and
+ * colour_to_grey(), and a multiply instead of dividing by 255,
+ * so they give exactly the same results as converting each
+ * pixel with those functions.
+ * Where the CPU has a faster version of a converter, it is
+ * chosen once by image_convert_init().
+ */
+
+/* n/255 for 0 <= n <= 65535 */
+#define DIV255(n) ((unsigned int)((n) * 0x8081U) >> 23)
+
+static BOOL convert_init_done = FALSE;
+static unsigned char grey_r[256];	/* colour_to_grey() by component */
+static unsigned char grey_g[256];
+static unsigned char grey_b[256];
+static unsigned char native4_rgb[16][3];
+static unsigned char native4_grey[16];
+static unsigned char native8_rgb[256][3];
+static unsigned char native8_grey[256];
+static unsigned char expand5[32];	/* 5 bits to 8 bits */
+static unsigned char expand6[64];	/* 6 bits to 8 bits */
+static unsigned char mono_grey[256][8];	/* 8 pixels of 1-bit grey */
+static unsigned char bit_count[256];	/* number of bits set */
+static unsigned char bit_reverse[256];	/* bit order reversed */
+static char a85_pair[85*85][2];		/* two ASCII85 digits */
+#ifdef IMAGE_AVX2
+static BOOL convert_avx2 = FALSE;	/* CPU has AVX2 */
+static unsigned char native4_comp[3][16];	/* native4_rgb by component */
+/* byte shuffles from 3 components of 16 bytes to 48 bytes of 24-bit */
+static unsigned char rgb_interleave[3][3][16];
+/* byte shuffles from bytes 0-15 and 8-23 of 8 pixels of 24-bit
+ * to one component in 16-bit lanes
+ */
+static unsigned char rgb24_split[2][3][16];
+#endif
+
+typedef void (*CMYK_ROW_FN)(int width, unsigned char *dest, 
+    const unsigned char *source, int sep, BOOL bgr);
+
+static void cmyk_row(int width, unsigned char *dest, 
+    const unsigned char *source, int sep, BOOL bgr);
+#ifdef IMAGE_SSE2
+static void cmyk_row_sse2(int width, unsigned char *dest, 
+    const unsigned char *source, int sep, BOOL bgr);
+#endif
+
+static CMYK_ROW_FN convert_cmyk = cmyk_row;
+
+/* Make the tables and choose the row converters.
+ * This is called before the first conversion, but an application 
+ * with several threads should call it first.
+ */
+void
+image_convert_init(void)
+{
+    int i, j;
+    unsigned char r, g, b;
+    if (convert_init_done)
+	return;
+    for (i=0; i<256; i++) {
+	grey_r[i] = (unsigned char)((i * 77) / 255);
+	grey_g[i] = (unsigned char)((i * 150) / 255);
+	grey_b[i] = (unsigned char)((i * 28) / 255);
+	image_colour(DISPLAY_COLORS_NATIVE | DISPLAY_DEPTH_8, i, &r, &g, &b);
+	native8_rgb[i][0] = r;
+	native8_rgb[i][1] = g;
+	native8_rgb[i][2] = b;
+	native8_grey[i] = colour_to_grey(r, g, b);
+	for (j=0; j<8; j++)
+	    mono_grey[i][j] = (unsigned char)((i & (0x80 >> j)) ? 255 : 0);
+	bit_count[i] = (unsigned char)((i & 1) + bit_count[i >> 1]);
+	bit_reverse[i] = (unsigned char)((bit_reverse[i >> 1] >> 1) |
+	    ((i & 1) << 7));
+    }
+    for (i=0; i<16; i++) {
+	image_colour(DISPLAY_COLORS_NATIVE | DISPLAY_DEPTH_4, i, &r, &g, &b);
+	native4_rgb[i][0] = r;
+	native4_rgb[i][1] = g;
+	native4_rgb[i][2] = b;
+	native4_grey[i] = colour_to_grey(r, g, b);
+    }
+    for (i=0; i<85*85; i++) {
+	a85_pair[i][0] = (char)(i / 85 + '!');
+	a85_pair[i][1] = (char)(i % 85 + '!');
+    }
+    for (i=0; i<32; i++)
+	expand5[i] = (unsigned char)((i << 3) + (i >> 2));
+    for (i=0; i<64; i++)
+	expand6[i] = (unsigned char)((i << 2) + (i >> 4));
+    convert_cmyk = cmyk_row;
+#ifdef IMAGE_SSE2
+    /* always present when the compiler may use it */
+    convert_cmyk = cmyk_row_sse2;
+#endif
+#ifdef IMAGE_AVX2
+    for (i=0; i<16; i++)
+	for (j=0; j<3; j++)
+	    native4_comp[j][i] = native4_rgb[i][j];
+    for (i=0; i<48; i++)
+	for (j=0; j<3; j++)
+	    rgb_interleave[i/16][j][i%16] =
+		(unsigned char)((i % 3 == j) ? i / 3 : 0x80);
+    for (i=0; i<16; i++) {
+	for (j=0; j<3; j++) {
+	    int n = (i / 2) * 3 + j;	/* byte of the component */
+	    rgb24_split[0][j][i] =
+		(unsigned char)(((i & 1) || (n >= 16)) ? 0x80 : n);
+	    rgb24_split[1][j][i] =
+		(unsigned char)(((i & 1) || (n < 16)) ? 0x80 : n - 8);
+	}
+    }
+    __builtin_cpu_init();
+    convert_avx2 = __builtin_cpu_supports("avx2") ? TRUE : FALSE;
+#endif
+    convert_init_done = TRUE;
+}
+
+static void
+image_convert_ready(void)
+{
+    if (!convert_init_done)
+	image_convert_init();
+}
+
+/* Convert 32CMYK to 24RGB, or 24BGR if bgr is TRUE */
+static void
+cmyk_row(int width, unsigned char *dest, const unsigned char *source,
+    int sep, BOOL bgr)
+{
+    int i;
+    unsigned int cyan, magenta, yellow, white;
+    unsigned int cmask = (sep & SEP_CYAN) ? 0xff : 0;
+    unsigned int mmask = (sep & SEP_MAGENTA) ? 0xff : 0;
+    unsigned int ymask = (sep & SEP_YELLOW) ? 0xff : 0;
+    unsigned int kmask = (sep & SEP_BLACK) ? 0xff : 0;
+    for (i=0; i<width; i++) {
+	white = 255 - (source[3] & kmask);
+	cyan = DIV255((255 - (source[0] & cmask)) * white);
+	magenta = DIV255((255 - (source[1] & mmask)) * white);
+	yellow = DIV255((255 - (source[2] & ymask)) * white);
+	if (bgr) {
+	    dest[0] = (unsigned char)yellow;
+	    dest[2] = (unsigned char)cyan;
+	}
+	else {
+	    dest[0] = (unsigned char)cyan;
+	    dest[2] = (unsigned char)yellow;
+	}
+	dest[1] = (unsigned char)magenta;
+	source += 4;
+	dest += 3;
+    }
+}
+
+#ifdef IMAGE_SSE2
+/* As cmyk_row, but 4 pixels at a time */
+static void
+cmyk_row_sse2(int width, unsigned char *dest, const unsigned char *source,
+    int sep, BOOL bgr)
+{
+    int i, j;
+    unsigned char buf[16];
+    unsigned int mask = ((sep & SEP_CYAN) ? 0x000000ffU : 0) |
+	((sep & SEP_MAGENTA) ? 0x0000ff00U : 0) |
+	((sep & SEP_YELLOW) ? 0x00ff0000U : 0) |
+	((sep & SEP_BLACK) ? 0xff000000U : 0);
+    __m128i vmask = _mm_set1_epi32((int)mask);
+    __m128i zero = _mm_setzero_si128();
+    __m128i v255 = _mm_set1_epi16(255);
+    __m128i vdiv = _mm_set1_epi16((short)0x8081);
+    __m128i v, lo, hi, klo, khi;
+    int ir = bgr ? 2 : 0;
+    int ib = bgr ? 0 : 2;
+    for (i=0; i+4<=width; i+=4) {
+	v = _mm_and_si128(_mm_loadu_si128((const __m128i *)source), vmask);
+	/* 255 - component, as 16 bits */
+	lo = _mm_sub_epi16(v255, _mm_unpacklo_epi8(v, zero));
+	hi = _mm_sub_epi16(v255, _mm_unpackhi_epi8(v, zero));
+	/* 255 - black in every component of each pixel */
+	klo = _mm_shufflehi_epi16(_mm_shufflelo_epi16(lo, 0xff), 0xff);
+	khi = _mm_shufflehi_epi16(_mm_shufflelo_epi16(hi, 0xff), 0xff);
+	/* products are at most 65025 so fit in 16 bits */
+	lo = _mm_mullo_epi16(lo, klo);
+	hi = _mm_mullo_epi16(hi, khi);
+	lo = _mm_srli_epi16(_mm_mulhi_epu16(lo, vdiv), 7);
+	hi = _mm_srli_epi16(_mm_mulhi_epu16(hi, vdiv), 7);
+	_mm_storeu_si128((__m128i *)buf, _mm_packus_epi16(lo, hi));
+	for (j=0; j<16; j+=4) {
+	    dest[ir] = buf[j];
+	    dest[1] = buf[j+1];
+	    dest[ib] = buf[j+2];
+	    dest += 3;
+	}
+	source += 16;
+    }
+    if (i < width)
+	cmyk_row(width - i, dest, source, sep, bgr);
+}
+#endif
+
+#ifdef IMAGE_AVX2
+/* The AVX2 row converters are compiled for AVX2 whatever the
+ * compiler options, and only used if the CPU has it.
+ * Each returns the number of pixels done, and the caller
+ * converts the rest.
+ */
+
+/* Write 16 pixels of 24-bit from 16 bytes of each component */
+static IMAGE_TARGET_AVX2 void
+rgb_interleave_avx2(unsigned char *dest, __m128i c0, __m128i c1,
+    __m128i c2)
+{
+    int o;
+    __m128i v;
+    for (o=0; o<3; o++) {
+	v = _mm_or_si128(
+	    _mm_shuffle_epi8(c0, _mm_loadu_si128(
+		(const __m128i *)rgb_interleave[o][0])),
+	    _mm_shuffle_epi8(c1, _mm_loadu_si128(
+		(const __m128i *)rgb_interleave[o][1])));
+	v = _mm_or_si128(v, _mm_shuffle_epi8(c2, _mm_loadu_si128(
+	    (const __m128i *)rgb_interleave[o][2])));
+	_mm_storeu_si128((__m128i *)(dest + 16 * o), v);
+    }
+}
+
+/* As image_24RGB_to_8grey, or image_24BGR_to_8grey if bgr is TRUE,
+ * 16 pixels at a time.
+ */
+static IMAGE_TARGET_AVX2 int
+grey24_avx2(int width, unsigned char *dest, const unsigned char *source,
+    BOOL bgr)
+{
+    int i, c;
+    __m256i a, b, v, sum;
+    __m256i split[2][3];
+    __m256i mul[3];
+    __m256i vdiv = _mm256_set1_epi16((short)0x8081);
+    mul[0] = _mm256_set1_epi16(bgr ? 28 : 77);
+    mul[1] = _mm256_set1_epi16(150);
+    mul[2] = _mm256_set1_epi16(bgr ? 77 : 28);
+    for (c=0; c<3; c++) {
+	split[0][c] = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)rgb24_split[0][c]));
+	split[1][c] = _mm256_broadcastsi128_si256(
+	    _mm_loadu_si128((const __m128i *)rgb24_split[1][c]));
+    }
+    for (i=0; i+16<=width; i+=16) {
+	/* 8 pixels in each half, from bytes 0-15 and 8-23 */
+	a = _mm256_inserti128_si256(_mm256_castsi128_si256(
+	    _mm_loadu_si128((const __m128i *)source)),
+	    _mm_loadu_si128((const __m128i *)(source + 24)), 1);
+	b = _mm256_inserti128_si256(_mm256_castsi128_si256(
+	    _mm_loadu_si128((const __m128i *)(source + 8))),
+	    _mm_loadu_si128((const __m128i *)(source + 32)), 1);
+	sum = _mm256_setzero_si256();
+	for (c=0; c<3; c++) {
+	    /* component as 16 bits, then the same as grey_r[] etc. */
+	    v = _mm256_or_si256(_mm256_shuffle_epi8(a, split[0][c]),
+		_mm256_shuffle_epi8(b, split[1][c]));
+	    v = _mm256_mullo_epi16(v, mul[c]);
+	    v = _mm256_srli_epi16(_mm256_mulhi_epu16(v, vdiv), 7);
+	    sum = _mm256_add_epi16(sum, v);
+	}
+	_mm_storeu_si128((__m128i *)dest,
+	    _mm_packus_epi16(_mm256_castsi256_si128(sum),
+	    _mm256_extracti128_si256(sum, 1)));
+	dest += 16;
+	source += 48;
+    }
+    return i;
+}
+
+/* Expand 5 or 6 bits in each 16-bit lane to 8 bits,
+ * as expand5[] and expand6[].
+ */
+#define EXPAND5_AVX2(v) \
+    _mm256_or_si256(_mm256_slli_epi16(v, 3), _mm256_srli_epi16(v, 2))
+#define EXPAND6_AVX2(v) \
+    _mm256_or_si256(_mm256_slli_epi16(v, 2), _mm256_srli_epi16(v, 4))
+
+/* 16 bits in each lane to 16 bytes */
+#define PACK16_AVX2(v) \
+    _mm_packus_epi16(_mm256_castsi256_si128(v), \
+	_mm256_extracti128_si256(v, 1))
+
+/* 16-bit 565 to 24-bit, 16 pixels at a time.
+ * The source is RGB565 if bigendian is TRUE, otherwise BGR565.
+ * The output is in the order red, green, blue if high_first is TRUE,
+ * so that the 5 bits at the top of the word are written first.
+ */
+static IMAGE_TARGET_AVX2 int
+rgb565_avx2(int width, unsigned char *dest, const unsigned char *source,
+    BOOL bigendian, BOOL high_first)
+{
+    int i;
+    __m256i w, hi, mid, lo;
+    __m256i swap = _mm256_setr_epi8(
+	1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14,
+	1, 0, 3, 2, 5, 4, 7, 6, 9, 8, 11, 10, 13, 12, 15, 14);
+    __m256i mask5 = _mm256_set1_epi16(0x1f);
+    __m256i mask6 = _mm256_set1_epi16(0x3f);
+    __m128i c0, c1, c2;
+    for (i=0; i+16<=width; i+=16) {
+	w = _mm256_loadu_si256((const __m256i *)source);
+	if (bigendian)
+	    w = _mm256_shuffle_epi8(w, swap);
+	hi = _mm256_srli_epi16(w, 11);
+	mid = _mm256_and_si256(_mm256_srli_epi16(w, 5), mask6);
+	lo = _mm256_and_si256(w, mask5);
+	hi = EXPAND5_AVX2(hi);
+	mid = EXPAND6_AVX2(mid);
+	lo = EXPAND5_AVX2(lo);
+	c0 = PACK16_AVX2(hi);
+	c1 = PACK16_AVX2(mid);
+	c2 = PACK16_AVX2(lo);
+	if (high_first)
+	    rgb_interleave_avx2(dest, c0, c1, c2);
+	else
+	    rgb_interleave_avx2(dest, c2, c1, c0);
+	dest += 48;
+	source += 32;
+    }
+    return i;
+}
+
+/* As image_4native_to_24RGB, or image_4native_to_24BGR if bgr is TRUE,
+ * 64 pixels at a time.
+ */
+static IMAGE_TARGET_AVX2 int
+native4_avx2(int width, unsigned char *dest, const unsigned char *source,
+    BOOL bgr)
+{
+    int i, j, c;
+    __m256i s, hi, lo, index[2];
+    __m256i table[3];
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i v[2][3];
+    for (c=0; c<3; c++)
+	table[c] = _mm256_broadcastsi128_si256(_mm_loadu_si128(
+	    (const __m128i *)native4_comp[bgr ? 2 - c : c]));
+    for (i=0; i+64<=width; i+=64) {
+	s = _mm256_loadu_si256((const __m256i *)source);
+	hi = _mm256_and_si256(_mm256_srli_epi16(s, 4), nibble);
+	lo = _mm256_and_si256(s, nibble);
+	/* the high nibble is the first pixel of each byte.
+	 * index[0] has pixels 0-15 and 32-47, index[1] 16-31 and 48-63.
+	 */
+	index[0] = _mm256_unpacklo_epi8(hi, lo);
+	index[1] = _mm256_unpackhi_epi8(hi, lo);
+	for (j=0; j<2; j++)
+	    for (c=0; c<3; c++)
+		v[j][c] = _mm256_shuffle_epi8(table[c], index[j]);
+	rgb_interleave_avx2(dest, _mm256_castsi256_si128(v[0][0]),
+	    _mm256_castsi256_si128(v[0][1]),
+	    _mm256_castsi256_si128(v[0][2]));
+	rgb_interleave_avx2(dest + 48, _mm256_castsi256_si128(v[1][0]),
+	    _mm256_castsi256_si128(v[1][1]),
+	    _mm256_castsi256_si128(v[1][2]));
+	rgb_interleave_avx2(dest + 96, _mm256_extracti128_si256(v[0][0], 1),
+	    _mm256_extracti128_si256(v[0][1], 1),
+	    _mm256_extracti128_si256(v[0][2], 1));
+	rgb_interleave_avx2(dest + 144, _mm256_extracti128_si256(v[1][0], 1),
+	    _mm256_extracti128_si256(v[1][1], 1),
+	    _mm256_extracti128_si256(v[1][2], 1));
+	dest += 192;
+	source += 32;
+    }
+    return i;
+}
+
+/* As image_4native_to_8grey, 64 pixels at a time.
+ * That takes an even pixel from the low nibble of a byte and
+ * the next odd pixel from the high nibble of the following byte,
+ * and this does the same.
+ */
+static IMAGE_TARGET_AVX2 int
+native4_grey_avx2(int width, unsigned char *dest,
+    const unsigned char *source)
+{
+    int i;
+    __m256i even, odd, a, b;
+    __m256i nibble = _mm256_set1_epi8(0x0f);
+    __m256i table = _mm256_broadcastsi128_si256(
+	_mm_loadu_si128((const __m128i *)native4_grey));
+    for (i=0; i+64<=width; i+=64) {
+	even = _mm256_and_si256(
+	    _mm256_loadu_si256((const __m256i *)source), nibble);
+	odd = _mm256_and_si256(_mm256_srli_epi16(
+	    _mm256_loadu_si256((const __m256i *)(source + 1)), 4), nibble);
+	/* a has pixels 0-15 and 32-47, b has 16-31 and 48-63 */
+	a = _mm256_shuffle_epi8(table, _mm256_unpacklo_epi8(even, odd));
+	b = _mm256_shuffle_epi8(table, _mm256_unpackhi_epi8(even, odd));
+	_mm256_storeu_si256((__m256i *)dest,
+	    _mm256_permute2x128_si256(a, b, 0x20));
+	_mm256_storeu_si256((__m256i *)(dest + 32),
+	    _mm256_permute2x128_si256(a, b, 0x31));
+	dest += 64;
+	source += 32;
+    }
+    return i;
+}
+#endif
+
+
 /********************************************************/
 /* 24BGR */
 
@@ -84,17 +512,24 @@ colour_to_grey(unsigned char r, unsigned char g, unsigned char b)
 void
 image_4native_to_24BGR(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
-    int val;
-    for (i=0; i<width; i++) {
-	val = *source;
+    int i = 0;
+    const unsigned char *c;
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = native4_avx2(width, dest, source, TRUE);
+	dest += i * 3;
+	source += i / 2;
+    }
+#endif
+    for (; i<width; i++) {
 	if (i & 1)
-	    source++;
+	    c = native4_rgb[*source++ & 0x0f];
 	else
-	    val >>= 4;
-	val &= 0x0f;
-	image_colour(DISPLAY_COLORS_NATIVE | DISPLAY_DEPTH_4,
-		val, dest+2, dest+1, dest);
+	    c = native4_rgb[*source >> 4];
+	dest[0] = c[2];
+	dest[1] = c[1];
+	dest[2] = c[0];
 	dest += 3;
     }
 }
@@ -107,15 +542,12 @@ image_16BGR555_to_24BGR(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
     WORD w;
-    unsigned char value;
+    image_convert_ready();
     for (i=0; i<width; i++) {
 	w = (WORD)(source[0] + (source[1] << 8));
-	value =   (unsigned char)(w & 0x1f);		/* blue */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 5) & 0x1f);	/* green */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 10) & 0x1f);	/* red */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
+	*dest++ = expand5[w & 0x1f];
+	*dest++ = expand5[(w >> 5) & 0x1f];
+	*dest++ = expand5[(w >> 10) & 0x1f];
 	source += 2;
     }
 }
@@ -125,17 +557,21 @@ image_16BGR555_to_24BGR(int width, unsigned char *dest, unsigned char *source)
 void
 image_16BGR565_to_24BGR(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
+    int i = 0;
     WORD w;
-    unsigned char value;
-    for (i=0; i<width; i++) {
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = rgb565_avx2(width, dest, source, FALSE, FALSE);
+	dest += i * 3;
+	source += i * 2;
+    }
+#endif
+    for (; i<width; i++) {
 	w = (WORD)(source[0] + (source[1] << 8));
-	value =   (unsigned char)(w & 0x1f);		/* blue */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 5) & 0x3f);	/* green */
-	*dest++ = (unsigned char)((value << 2) + (value >> 4));
-	value =   (unsigned char)((w >> 11) & 0x1f);	/* red */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
+	*dest++ = expand5[w & 0x1f];
+	*dest++ = expand6[(w >> 5) & 0x3f];
+	*dest++ = expand5[(w >> 11) & 0x1f];
 	source += 2;
     }
 }
@@ -147,15 +583,12 @@ image_16RGB555_to_24BGR(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
     WORD w;
-    unsigned char value;
+    image_convert_ready();
     for (i=0; i<width; i++) {
 	w = (WORD)((source[0] << 8) + source[1]);
-	value =   (unsigned char)(w & 0x1f);		/* blue */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 5) & 0x1f);	/* green */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 10) & 0x1f);	/* red */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
+	*dest++ = expand5[w & 0x1f];
+	*dest++ = expand5[(w >> 5) & 0x1f];
+	*dest++ = expand5[(w >> 10) & 0x1f];
 	source += 2;
     }
 }
@@ -165,17 +598,21 @@ image_16RGB555_to_24BGR(int width, unsigned char *dest, unsigned char *source)
 void
 image_16RGB565_to_24BGR(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
+    int i = 0;
     WORD w;
-    unsigned char value;
-    for (i=0; i<width; i++) {
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = rgb565_avx2(width, dest, source, TRUE, FALSE);
+	dest += i * 3;
+	source += i * 2;
+    }
+#endif
+    for (; i<width; i++) {
 	w = (WORD)((source[0] << 8) + source[1]);
-	value =   (unsigned char)(w & 0x1f);		/* blue */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 5) & 0x3f);	/* green */
-	*dest++ = (unsigned char)((value << 2) + (value >> 4));
-	value =   (unsigned char)((w >> 11) & 0x1f);	/* red */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
+	*dest++ = expand5[w & 0x1f];
+	*dest++ = expand6[(w >> 5) & 0x3f];
+	*dest++ = expand5[(w >> 11) & 0x1f];
 	source += 2;
     }
 }
@@ -186,129 +623,8 @@ void
 image_32CMYK_to_24BGR(int width, unsigned char *dest, unsigned char *source,
     int sep)
 {
-    int i;
-    int cyan, magenta, yellow, black;
-    for (i=0; i<width; i++) {
-	cyan = source[0];
-	magenta = source[1];
-	yellow = source[2];
-	black = source[3];
-	if (!(sep & SEP_CYAN))
-	    cyan = 0;
-	if (!(sep & SEP_MAGENTA))
-	    magenta = 0;
-	if (!(sep & SEP_YELLOW))
-	    yellow = 0;
-	if (!(sep & SEP_BLACK))
-	    black = 0;
-	*dest++ = 
-	    (unsigned char)((255 - yellow)  * (255 - black)/255); /* blue */
-	*dest++ = 
-	    (unsigned char)((255 - magenta) * (255 - black)/255); /* green */
-	*dest++ = 
-	     (unsigned char)((255 - cyan)    * (255 - black)/255); /* red */
-	source += 4;
-    }
-}
-
-int
-image_to_24BGR(IMAGE *img, unsigned char *dest, unsigned char *source)
-{
-    unsigned char *d = dest;
-    unsigned char *s = source;
-    int width = img->width; 
-    unsigned int alpha = img->format & DISPLAY_ALPHA_MASK;
-    BOOL bigendian = (img->format & DISPLAY_ENDIAN_MASK) == DISPLAY_BIGENDIAN;
-    int code = -1;
-    int i;
-
-    switch (img->format & DISPLAY_COLORS_MASK) {
-	case DISPLAY_COLORS_NATIVE:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) {
-		image_1native_to_24RGB(width, dest, source); /* monochrome */
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_4) {
-		image_4native_to_24BGR(width, dest, source);
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-	        for (i=0; i<width; i++) {
-		    image_colour(img->format, *s++, d+2, d+1, d);
-		    d+= 3;
-		}
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_16) {
-		if (bigendian) {
-		    if ((img->format & DISPLAY_555_MASK)
-			== DISPLAY_NATIVE_555)
-			image_16RGB555_to_24BGR(img->width, 
-			    dest, source);
-		    else
-			image_16RGB565_to_24BGR(img->width, 
-			    dest, source);
-		}
-		else {
-		    if ((img->format & DISPLAY_555_MASK)
-			== DISPLAY_NATIVE_555) {
-			image_16BGR555_to_24BGR(img->width, 
-			    dest, source);
-		    }
-		    else
-			image_16BGR565_to_24BGR(img->width, 
-			    dest, source);
-		}
-		code = 0;
-	    }
-	    break;
-	case DISPLAY_COLORS_GRAY:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) {
-		image_1grey_to_24RGB(width, dest, source);
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_4) {
-		image_4grey_to_24RGB(width, dest, source);
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		image_8grey_to_24RGB(width, dest, source);
-		code = 0;
-	    }
-	    break;
-	case DISPLAY_COLORS_RGB:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		for (i=0; i<width; i++) {
-		    if ((alpha == DISPLAY_ALPHA_FIRST) || 
-			(alpha == DISPLAY_UNUSED_FIRST))
-			s++;
-		    if (bigendian) {
-			*d++ = s[2];
-			*d++ = s[1];
-			*d++ = s[0];
-			s+=3;
-		    }
-		    else {
-			*d++ = *s++;
-			*d++ = *s++;
-			*d++ = *s++;
-		    }
-		    if ((alpha == DISPLAY_ALPHA_LAST) || 
-			(alpha == DISPLAY_UNUSED_LAST))
-			s++;
-		}
-		code = 0;
-	    }
-	    break;
-	case DISPLAY_COLORS_CMYK:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		image_32CMYK_to_24BGR(width, dest, source, 
-		    SEP_CYAN | SEP_MAGENTA | SEP_YELLOW | SEP_BLACK);
-		code = 0;
-	    }
-	    break;
-    }
-    return code;
+    image_convert_ready();
+    convert_cmyk(width, dest, source, sep, TRUE);
 }
 
 /********************************************************/
@@ -321,15 +637,12 @@ image_16BGR555_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
     WORD w;
-    unsigned char value;
+    image_convert_ready();
     for (i=0; i<width; i++) {
 	w = (WORD)(source[0] + (source[1] << 8));
-	value =   (unsigned char)((w >> 10) & 0x1f);	/* red */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 5) & 0x1f);	/* green */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)(w & 0x1f);		/* blue */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
+	*dest++ = expand5[(w >> 10) & 0x1f];
+	*dest++ = expand5[(w >> 5) & 0x1f];
+	*dest++ = expand5[w & 0x1f];
 	source += 2;
     }
 }
@@ -339,17 +652,21 @@ image_16BGR555_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 void
 image_16BGR565_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
+    int i = 0;
     WORD w;
-    unsigned char value;
-    for (i=0; i<width; i++) {
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = rgb565_avx2(width, dest, source, FALSE, TRUE);
+	dest += i * 3;
+	source += i * 2;
+    }
+#endif
+    for (; i<width; i++) {
 	w = (WORD)(source[0] + (source[1] << 8));
-	value =   (unsigned char)((w >> 11) & 0x1f);	/* red */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 5) & 0x3f);	/* green */
-	*dest++ = (unsigned char)((value << 2) + (value >> 4));
-	value =   (unsigned char)(w & 0x1f);		/* blue */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
+	*dest++ = expand5[(w >> 11) & 0x1f];
+	*dest++ = expand6[(w >> 5) & 0x3f];
+	*dest++ = expand5[w & 0x1f];
 	source += 2;
     }
 }
@@ -361,15 +678,12 @@ image_16RGB555_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
     WORD w;
-    unsigned char value;
+    image_convert_ready();
     for (i=0; i<width; i++) {
 	w = (WORD)((source[0] << 8) + source[1]);
-	value =   (unsigned char)((w >> 10) & 0x1f);	/* red */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 5) & 0x1f);	/* green */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)(w & 0x1f);		/* blue */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
+	*dest++ = expand5[(w >> 10) & 0x1f];
+	*dest++ = expand5[(w >> 5) & 0x1f];
+	*dest++ = expand5[w & 0x1f];
 	source += 2;
     }
 }
@@ -379,17 +693,21 @@ image_16RGB555_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 void
 image_16RGB565_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
+    int i = 0;
     WORD w;
-    unsigned char value;
-    for (i=0; i<width; i++) {
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = rgb565_avx2(width, dest, source, TRUE, TRUE);
+	dest += i * 3;
+	source += i * 2;
+    }
+#endif
+    for (; i<width; i++) {
 	w = (WORD)((source[0] << 8) + source[1]);
-	value =   (unsigned char)((w >> 11) & 0x1f);	/* red */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
-	value =   (unsigned char)((w >> 5) & 0x3f);	/* green */
-	*dest++ = (unsigned char)((value << 2) + (value >> 4));
-	value =   (unsigned char)(w & 0x1f);		/* blue */
-	*dest++ = (unsigned char)((value << 3) + (value >> 2));
+	*dest++ = expand5[(w >> 11) & 0x1f];
+	*dest++ = expand6[(w >> 5) & 0x3f];
+	*dest++ = expand5[w & 0x1f];
 	source += 2;
     }
 }
@@ -400,29 +718,8 @@ void
 image_32CMYK_to_24RGB(int width, unsigned char *dest, unsigned char *source,
     int sep)
 {
-    int i;
-    int cyan, magenta, yellow, black;
-    for (i=0; i<width; i++) {
-	cyan = source[0];
-	magenta = source[1];
-	yellow = source[2];
-	black = source[3];
-	if (!(sep & SEP_CYAN))
-	    cyan = 0;
-	if (!(sep & SEP_MAGENTA))
-	    magenta = 0;
-	if (!(sep & SEP_YELLOW))
-	    yellow = 0;
-	if (!(sep & SEP_BLACK))
-	    black = 0;
-	*dest++ = (unsigned char)
-	    ((255 - cyan)    * (255 - black)/255); /* red */
-	*dest++ = (unsigned char)
-	    ((255 - magenta) * (255 - black)/255); /* green */
-	*dest++ = (unsigned char)
-	    ((255 - yellow)  * (255 - black)/255); /* blue */
-	source += 4;
-    }
+    image_convert_ready();
+    convert_cmyk(width, dest, source, sep, FALSE);
 }
 
 /* convert one line of 1-bit gray to 24RGB */
@@ -430,14 +727,13 @@ void
 image_1grey_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
+    const unsigned char *g = NULL;
+    image_convert_ready();
     for (i=0; i<width; i++) {
-	if (*source & (1 << (7 - (i & 7))))
-	    dest[0] = dest[1] = dest[2] = 255;
-	else 
-	    dest[0] = dest[1] = dest[2] = 0;
+	if ((i & 7) == 0)
+	    g = mono_grey[*source++];
+	dest[0] = dest[1] = dest[2] = g[i & 7];
 	dest += 3;
-	if ((i & 7) == 7)
-	    source++;
     }
 }
 
@@ -476,14 +772,14 @@ void
 image_1native_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
+    const unsigned char *g = NULL;
+    image_convert_ready();
     for (i=0; i<width; i++) {
-	if (*source & (1 << (7 - (i & 7))))
-	    dest[0] = dest[1] = dest[2] = 0;
-	else 
-	    dest[0] = dest[1] = dest[2] = 255;
+	/* 1 is black */
+	if ((i & 7) == 0)
+	    g = mono_grey[(unsigned char)~*source++];
+	dest[0] = dest[1] = dest[2] = g[i & 7];
 	dest += 3;
-	if ((i & 7) == 7)
-	    source++;
     }
 }
 
@@ -491,119 +787,42 @@ image_1native_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 void
 image_4native_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
-    int val;
-    for (i=0; i<width; i++) {
-	val = *source;
+    int i = 0;
+    const unsigned char *c;
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = native4_avx2(width, dest, source, FALSE);
+	dest += i * 3;
+	source += i / 2;
+    }
+#endif
+    for (; i<width; i++) {
 	if (i & 1)
-	    source++;
+	    c = native4_rgb[*source++ & 0x0f];
 	else
-	    val >>= 4;
-	val &= 0x0f;
-	image_colour(DISPLAY_COLORS_NATIVE | DISPLAY_DEPTH_4,
-		val, dest, dest+1, dest+2);
+	    c = native4_rgb[*source >> 4];
+	dest[0] = c[0];
+	dest[1] = c[1];
+	dest[2] = c[2];
 	dest += 3;
     }
 }
 
-int
-image_to_24RGB(IMAGE *img, unsigned char *dest, unsigned char *source)
+/* convert one line of 8-bit native to 24RGB */
+void
+image_8native_to_24RGB(int width, unsigned char *dest, unsigned char *source)
 {
-    unsigned char *d = dest;
-    unsigned char *s = source;
-    int width = img->width; 
-    unsigned int alpha = img->format & DISPLAY_ALPHA_MASK;
-    BOOL bigendian = (img->format & DISPLAY_ENDIAN_MASK) == DISPLAY_BIGENDIAN;
     int i;
-    int code = -1;
-
-    switch (img->format & DISPLAY_COLORS_MASK) {
-	case DISPLAY_COLORS_NATIVE:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) {
-		image_1native_to_24RGB(img->width, dest, source);
-		code = 0;
-	    }
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_4) {
-		image_4native_to_24RGB(img->width, dest, source);
-		code = 0;
-	    }
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-	        for (i=0; i<width; i++) {
-		    image_colour(img->format, *s++, d, d+1, d+2);
-		    d+= 3;
-		}
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_16) {
-		if (bigendian) {
-		    if ((img->format & DISPLAY_555_MASK)
-			== DISPLAY_NATIVE_555)
-			image_16RGB555_to_24RGB(img->width, 
-			    dest, source);
-		    else
-			image_16RGB565_to_24RGB(img->width, 
-			    dest, source);
-		}
-		else {
-		    if ((img->format & DISPLAY_555_MASK)
-			== DISPLAY_NATIVE_555) {
-			image_16BGR555_to_24RGB(img->width, 
-			    dest, source);
-		    }
-		    else
-			image_16BGR565_to_24RGB(img->width, 
-			    dest, source);
-		}
-		code = 0;
-	    }
-	    break;
-	case DISPLAY_COLORS_GRAY:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) {
-		image_1grey_to_24RGB(width, dest, source);
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_4) {
-		image_4grey_to_24RGB(width, dest, source);
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		image_8grey_to_24RGB(width, dest, source);
-		code = 0;
-	    }
-	    break;
-	case DISPLAY_COLORS_RGB:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		for (i=0; i<width; i++) {
-		    if ((alpha == DISPLAY_ALPHA_FIRST) || 
-			(alpha == DISPLAY_UNUSED_FIRST))
-			s++;
-		    if (bigendian) {
-			*d++ = *s++;
-			*d++ = *s++;
-			*d++ = *s++;
-		    }
-		    else {
-			*d++ = s[2];
-			*d++ = s[1];
-			*d++ = s[0];
-			s+=3;
-		    }
-		    if ((alpha == DISPLAY_ALPHA_LAST) || 
-			(alpha == DISPLAY_UNUSED_LAST))
-			s++;
-		}
-		code = 0;
-	    }
-	    break;
-	case DISPLAY_COLORS_CMYK:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		image_32CMYK_to_24RGB(width, dest, source, 
-		    SEP_CYAN | SEP_MAGENTA | SEP_YELLOW | SEP_BLACK);
-		code = 0;
-	    }
-	    break;
+    const unsigned char *c;
+    image_convert_ready();
+    for (i=0; i<width; i++) {
+	c = native8_rgb[*source++];
+	dest[0] = c[0];
+	dest[1] = c[1];
+	dest[2] = c[2];
+	dest += 3;
     }
-    return code;
 }
 
 /********************************************************/
@@ -613,13 +832,18 @@ void
 image_1grey_to_8grey(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
-    for (i=0; i<width; i++) {
-	if (*source & (1 << (7 - (i & 7))))
-	    *dest++ = 255;
-	else 
-	    *dest++ = 0;
-	if ((i & 7) == 7)
-	    source++;
+    const unsigned char *g;
+    image_convert_ready();
+    for (i=0; i+8<=width; i+=8) {
+	g = mono_grey[*source++];
+	dest[0] = g[0]; dest[1] = g[1]; dest[2] = g[2]; dest[3] = g[3];
+	dest[4] = g[4]; dest[5] = g[5]; dest[6] = g[6]; dest[7] = g[7];
+	dest += 8;
+    }
+    if (i < width) {
+	g = mono_grey[*source];
+	for (; i<width; i++)
+	    *dest++ = g[i & 7];
     }
 }
 
@@ -643,32 +867,43 @@ void
 image_1native_to_8grey(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
-    for (i=0; i<width; i++) {
-	if (*source & (1 << (7 - (i & 7))))
-	    *dest++ = 0;
-	else 
-	    *dest++ = 255;
-	if ((i & 7) == 7)
-	    source++;
+    const unsigned char *g;
+    image_convert_ready();
+    /* 1 is black */
+    for (i=0; i+8<=width; i+=8) {
+	g = mono_grey[(unsigned char)~*source++];
+	dest[0] = g[0]; dest[1] = g[1]; dest[2] = g[2]; dest[3] = g[3];
+	dest[4] = g[4]; dest[5] = g[5]; dest[6] = g[6]; dest[7] = g[7];
+	dest += 8;
+    }
+    if (i < width) {
+	g = mono_grey[(unsigned char)~*source];
+	for (; i<width; i++)
+	    *dest++ = g[i & 7];
     }
 }
 
 void
 image_4native_to_8grey(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
+    int i = 0;
     int value;
-    unsigned char r, g, b;
-    for (i=0; i<width; i++) {
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = native4_grey_avx2(width, dest, source);
+	dest += i;
+	source += i / 2;
+    }
+#endif
+    for (; i<width; i++) {
 	if (i & 1)
 	    value = (*source >> 4) & 0x0f;
 	else {
 	    value = (*source) & 0x0f;
 	    source++;
 	}
-	image_colour(DISPLAY_COLORS_NATIVE | DISPLAY_DEPTH_4,
-	    value, &r, &g, &b);
-	*dest++ = colour_to_grey(r,g,b);
+	*dest++ = native4_grey[value];
     }
 }
 
@@ -676,23 +911,27 @@ void
 image_8native_to_8grey(int width, unsigned char *dest, unsigned char *source)
 {
     int i;
-    int value;
-    unsigned char r, g, b;
-    for (i=0; i<width; i++) {
-	value = *source++;
-	image_colour(DISPLAY_COLORS_NATIVE | DISPLAY_DEPTH_8,
-	    value, &r, &g, &b);
-	*dest++ = colour_to_grey(r,g,b);
-    }
+    image_convert_ready();
+    for (i=0; i<width; i++)
+	*dest++ = native8_grey[*source++];
 }
 
 
 void
 image_24RGB_to_8grey(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
-    for (i=0; i<width; i++) {
-	*dest++ = colour_to_grey(source[0], source[1], source[2]);
+    int i = 0;
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = grey24_avx2(width, dest, source, FALSE);
+	dest += i;
+	source += i * 3;
+    }
+#endif
+    for (; i<width; i++) {
+	*dest++ = (unsigned char)
+	    (grey_r[source[0]] + grey_g[source[1]] + grey_b[source[2]]);
 	source+=3;
     }
 }
@@ -700,296 +939,779 @@ image_24RGB_to_8grey(int width, unsigned char *dest, unsigned char *source)
 void
 image_24BGR_to_8grey(int width, unsigned char *dest, unsigned char *source)
 {
-    int i;
-    for (i=0; i<width; i++) {
-	*dest++ = colour_to_grey(source[2], source[1], source[0]);
+    int i = 0;
+    image_convert_ready();
+#ifdef IMAGE_AVX2
+    if (convert_avx2) {
+	i = grey24_avx2(width, dest, source, TRUE);
+	dest += i;
+	source += i * 3;
+    }
+#endif
+    for (; i<width; i++) {
+	*dest++ = (unsigned char)
+	    (grey_r[source[2]] + grey_g[source[1]] + grey_b[source[0]]);
 	source+=3;
     }
 }
 
-static int
-image_to_8grey(IMAGE *img, unsigned char *dest, unsigned char *source)
-{
-    /* This is the fallback method which converts to 24RGB first */
-    unsigned char *row = (unsigned char *)malloc(img->width*3);
-    int code = -1;
-    if (row) {
-	code = image_to_24RGB(img, row, source);
-	image_24RGB_to_8grey(img->width, dest, row);
-	free(row);
-    }
-    return code;
+/********************************************************/
+/* Converter plans */
+
+/* A converter plan decodes the image format once and chooses
+ * a row converter for it, so that the format is not examined
+ * again for every row.
+ * image_to_24BGR(), image_to_24RGB(), image_to_grey() and
+ * image_to_mono() make a plan on the stack for one row.
+ * Code that converts many rows should use image_convert_new().
+ */
+
+typedef void (*IMAGE_CONVERT_FN)(int width, unsigned char *dest,
+    unsigned char *source);
+
+struct IMAGE_CONVERT_s {
+    /* convert one row */
+    void (*row)(IMAGE_CONVERT *cv, unsigned char *dest,
+	unsigned char *source);
+    IMAGE_CONVERT_FN fn;	/* row converter */
+    IMAGE_CONVERT_FN fn2;	/* second step, from temp to dest */
+    int width;			/* pixels */
+    int bytes;			/* bytes to copy */
+    unsigned char mask[2];	/* for 16-bit to mono */
+    unsigned char *temp;	/* intermediate 24RGB row */
+};
+
+/* 8-bit RGB with or without an alpha or unused byte.
+ * The source is skipped by first bytes, then each pixel
+ * is step bytes with red, green and blue at r, g and b.
+ */
+#define IMAGE_CONVERT_RGB8(name, first, r, g, b, step) \
+static void \
+name(int width, unsigned char *dest, unsigned char *source) \
+{ \
+    int i; \
+    source += first; \
+    for (i=0; i<width; i++) { \
+	dest[0] = source[r]; \
+	dest[1] = source[g]; \
+	dest[2] = source[b]; \
+	dest += 3; \
+	source += step; \
+    } \
 }
 
-/* Convert any format to 8-bit grey.
- * Returns -ve if unsupported format.
+#define IMAGE_CONVERT_GREY8(name, first, r, g, b, step) \
+static void \
+name(int width, unsigned char *dest, unsigned char *source) \
+{ \
+    int i; \
+    image_convert_ready(); \
+    source += first; \
+    for (i=0; i<width; i++) { \
+	*dest++ = (unsigned char) \
+	    (grey_r[source[r]] + grey_g[source[g]] + grey_b[source[b]]); \
+	source += step; \
+    } \
+}
+
+/* 1-bit output with 0=white, 1=black.
+ * Pixels are collected in bits, which is written every 8 pixels.
  */
-int
-image_to_grey(IMAGE *img, unsigned char *dest, unsigned char *source)
+#define IMAGE_CONVERT_MONO_PUT(black) \
+    bits = (bits << 1) | ((black) ? 1 : 0); \
+    if ((i & 7) == 7) { \
+	*dest++ = (unsigned char)bits; \
+	bits = 0; \
+    }
+
+/* 8-bit RGB to mono, where white has each component equal to white.
+ * Pixels of 4 bytes are packed 8 at a time by mono32_pack(),
+ * ignoring the bits of the alpha or unused byte in ignore.
+ */
+#define IMAGE_CONVERT_MONO_RGB8(name, first, step, white, ignore) \
+static void \
+name(int width, unsigned char *dest, unsigned char *source) \
+{ \
+    int i = 0; \
+    unsigned int bits = 0; \
+    if (step == 4) { \
+	i = mono32_pack(width, dest, source, ignore, 0xffffffffU); \
+	dest += i >> 3; \
+	source += i * step; \
+    } \
+    source += first; \
+    for (; i<width; i++) { \
+	IMAGE_CONVERT_MONO_PUT((source[0] != white) || \
+	    (source[1] != white) || (source[2] != white)) \
+	source += step; \
+    } \
+    mono_last(dest, bits, width, FALSE); \
+}
+
+/* Pack pixels of 4 bytes to 1-bit, 8 pixels at a time.
+ * A pixel is white if it equals white after the bits in ignore are
+ * set.  The bytes of a pixel are in memory order, so the value of
+ * the first byte is in the lowest 8 bits of ignore and white.
+ * Returns the number of pixels done, which is a multiple of 8.
+ */
+static int
+mono32_pack(int width, unsigned char *dest, const unsigned char *source,
+    unsigned int ignore, unsigned int white)
 {
-    int width = img->width;
-    int code = -1;
-    unsigned int alpha = img->format & DISPLAY_ALPHA_MASK;
-    switch (img->format & DISPLAY_COLORS_MASK) {
+    int i = 0;
+#ifdef IMAGE_SSE2
+    __m128i vignore = _mm_set1_epi32((int)ignore);
+    __m128i vwhite = _mm_set1_epi32((int)white);
+    __m128i a, b;
+    image_convert_ready();
+    for (; i+8<=width; i+=8) {
+	a = _mm_cmpeq_epi32(_mm_or_si128(vignore,
+	    _mm_loadu_si128((const __m128i *)source)), vwhite);
+	b = _mm_cmpeq_epi32(_mm_or_si128(vignore,
+	    _mm_loadu_si128((const __m128i *)(source + 16))), vwhite);
+	a = _mm_packs_epi32(a, b);
+	/* bit n of the mask is set if pixel n is white */
+	*dest++ = bit_reverse[~_mm_movemask_epi8(_mm_packs_epi16(a, a)) 
+	    & 0xff];
+	source += 32;
+    }
+#endif
+    return i;
+}
+
+/* Write the last partial byte of a 1-bit row.
+ * The unused bits are kept from dest if keep is TRUE,
+ * otherwise they are set.
+ */
+static void
+mono_last(unsigned char *dest, unsigned int bits, int width, BOOL keep)
+{
+    int n = width & 7;
+    unsigned char unused = (unsigned char)(0xff >> n);
+    if (n == 0)
+	return;
+    bits <<= 8 - n;
+    if (keep)
+	*dest = (unsigned char)((bits & ~unused) | (*dest & unused));
+    else
+	*dest = (unsigned char)(bits | unused);
+}
+
+/* to 24RGB or 24BGR */
+IMAGE_CONVERT_RGB8(rgb8_swap, 0, 2, 1, 0, 3)
+IMAGE_CONVERT_RGB8(rgb8_skip, 1, 0, 1, 2, 4)
+IMAGE_CONVERT_RGB8(rgb8_skip_swap, 1, 2, 1, 0, 4)
+IMAGE_CONVERT_RGB8(rgb8_pad, 0, 0, 1, 2, 4)
+IMAGE_CONVERT_RGB8(rgb8_pad_swap, 0, 2, 1, 0, 4)
+
+/* to grey */
+IMAGE_CONVERT_GREY8(grey8_skip_rgb, 1, 0, 1, 2, 4)
+IMAGE_CONVERT_GREY8(grey8_skip_bgr, 1, 2, 1, 0, 4)
+IMAGE_CONVERT_GREY8(grey8_pad_rgb, 0, 0, 1, 2, 4)
+IMAGE_CONVERT_GREY8(grey8_pad_bgr, 0, 2, 1, 0, 4)
+
+/* to mono */
+IMAGE_CONVERT_MONO_RGB8(mono_rgb, 0, 3, 0xff, 0)
+IMAGE_CONVERT_MONO_RGB8(mono_rgb_skip, 1, 4, 0xff, 0x000000ffU)
+IMAGE_CONVERT_MONO_RGB8(mono_rgb_pad, 0, 4, 0xff, 0xff000000U)
+
+static void
+image_8native_to_24BGR(int width, unsigned char *dest, unsigned char *source)
+{
+    int i;
+    const unsigned char *c;
+    image_convert_ready();
+    for (i=0; i<width; i++) {
+	c = native8_rgb[*source++];
+	dest[0] = c[2];
+	dest[1] = c[1];
+	dest[2] = c[0];
+	dest += 3;
+    }
+}
+
+static void
+image_cmyk_to_24RGB(int width, unsigned char *dest, unsigned char *source)
+{
+    image_32CMYK_to_24RGB(width, dest, source,
+	SEP_CYAN | SEP_MAGENTA | SEP_YELLOW | SEP_BLACK);
+}
+
+static void
+image_cmyk_to_24BGR(int width, unsigned char *dest, unsigned char *source)
+{
+    image_32CMYK_to_24BGR(width, dest, source,
+	SEP_CYAN | SEP_MAGENTA | SEP_YELLOW | SEP_BLACK);
+}
+
+static void
+mono_cmyk(int width, unsigned char *dest, unsigned char *source)
+{
+    int i;
+    unsigned int bits = 0;
+    /* only 0,0,0,0 is white */
+    i = mono32_pack(width, dest, source, 0, 0);
+    dest += i >> 3;
+    source += i * 4;
+    for (; i<width; i++) {
+	IMAGE_CONVERT_MONO_PUT(source[0] | source[1] | source[2] | source[3])
+	source += 4;
+    }
+    mono_last(dest, bits, width, FALSE);
+}
+
+static void
+mono_grey8(int width, unsigned char *dest, unsigned char *source)
+{
+    int i = 0;
+    unsigned int bits = 0;
+#ifdef IMAGE_SSE2
+    __m128i white = _mm_set1_epi8((char)0xff);
+    unsigned int mask;
+    image_convert_ready();
+    for (; i+16<=width; i+=16) {
+	/* bit n of the mask is set if pixel n is black */
+	mask = ~_mm_movemask_epi8(_mm_cmpeq_epi8(
+	    _mm_loadu_si128((const __m128i *)source), white));
+	*dest++ = bit_reverse[mask & 0xff];
+	*dest++ = bit_reverse[(mask >> 8) & 0xff];
+	source += 16;
+    }
+#endif
+    for (; i<width; i++) {
+	IMAGE_CONVERT_MONO_PUT(*source++ != 0xff)
+    }
+    mono_last(dest, bits, width, FALSE);
+}
+
+/* 4-bit native or grey, where only 0x0f is white.
+ * Unused bits of the last byte are not changed.
+ */
+static void
+mono_4bit(int width, unsigned char *dest, unsigned char *source)
+{
+    int i;
+    unsigned int bits = 0;
+    for (i=0; i<width; i++) {
+	if (i & 1) {
+	    IMAGE_CONVERT_MONO_PUT((*source++ & 0x0f) != 0x0f)
+	}
+	else {
+	    IMAGE_CONVERT_MONO_PUT((*source & 0xf0) != 0xf0)
+	}
+    }
+    mono_last(dest, bits, width, TRUE);
+}
+
+/* 8-bit native, where 0x3f and 0x5f are white.
+ * Unused bits of the last byte are not changed.
+ */
+static void
+mono_8native(int width, unsigned char *dest, unsigned char *source)
+{
+    int i;
+    unsigned int bits = 0;
+    for (i=0; i<width; i++) {
+	IMAGE_CONVERT_MONO_PUT((*source != 0x3f) && (*source != 0x5f))
+	source++;
+    }
+    mono_last(dest, bits, width, TRUE);
+}
+
+static void
+convert_row_fn(IMAGE_CONVERT *cv, unsigned char *dest, unsigned char *source)
+{
+    cv->fn(cv->width, dest, source);
+}
+
+static void
+convert_row_temp(IMAGE_CONVERT *cv, unsigned char *dest,
+    unsigned char *source)
+{
+    cv->fn(cv->width, cv->temp, source);
+    cv->fn2(cv->width, dest, cv->temp);
+}
+
+static void
+convert_row_copy(IMAGE_CONVERT *cv, unsigned char *dest,
+    unsigned char *source)
+{
+    memcpy(dest, source, cv->bytes);
+}
+
+static void
+convert_row_invert(IMAGE_CONVERT *cv, unsigned char *dest,
+    unsigned char *source)
+{
+    image_invert_bits(dest, source, cv->bytes);
+}
+
+/* 16-bit native to mono, where white has all colour bits set */
+static void
+convert_row_mono16(IMAGE_CONVERT *cv, unsigned char *dest,
+    unsigned char *source)
+{
+    int i;
+    int width = cv->width;
+    unsigned int bits = 0;
+    unsigned char mask0 = cv->mask[0];
+    unsigned char mask1 = cv->mask[1];
+    for (i=0; i<width; i++) {
+	IMAGE_CONVERT_MONO_PUT(((source[0] & mask0) != mask0) ||
+	    ((source[1] & mask1) != mask1))
+	source += 2;
+    }
+    mono_last(dest, bits, width, FALSE);
+}
+
+/* Choose a converter from format to 24RGB, or 24BGR if bgr is TRUE.
+ * Returns 0 if OK, 1 if no conversion is needed, -1 if the
+ * format is not supported.
+ */
+static int
+convert_rgb_fn(unsigned int format, BOOL bgr, IMAGE_CONVERT_FN *pfn)
+{
+    unsigned int depth = format & DISPLAY_DEPTH_MASK;
+    unsigned int alpha = format & DISPLAY_ALPHA_MASK;
+    BOOL bigendian = (format & DISPLAY_ENDIAN_MASK) == DISPLAY_BIGENDIAN;
+    BOOL swap = (bigendian == bgr);	/* source order differs from dest */
+    IMAGE_CONVERT_FN fn = NULL;
+
+    switch (format & DISPLAY_COLORS_MASK) {
 	case DISPLAY_COLORS_NATIVE:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) {
-		image_1native_to_8grey(width, dest, source);
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_4) {
-		image_4native_to_8grey(width, dest, source);
-		code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		image_8native_to_8grey(width, dest, source);
-		code = 0;
+	    if (depth == DISPLAY_DEPTH_1)
+		fn = image_1native_to_24RGB;	/* monochrome */
+	    else if (depth == DISPLAY_DEPTH_4)
+		fn = bgr ? image_4native_to_24BGR : image_4native_to_24RGB;
+	    else if (depth == DISPLAY_DEPTH_8)
+		fn = bgr ? image_8native_to_24BGR : image_8native_to_24RGB;
+	    else if (depth == DISPLAY_DEPTH_16) {
+		if ((format & DISPLAY_555_MASK) == DISPLAY_NATIVE_555) {
+		    if (bigendian)
+			fn = bgr ? image_16RGB555_to_24BGR
+			    : image_16RGB555_to_24RGB;
+		    else
+			fn = bgr ? image_16BGR555_to_24BGR
+			    : image_16BGR555_to_24RGB;
+		}
+		else {
+		    if (bigendian)
+			fn = bgr ? image_16RGB565_to_24BGR
+			    : image_16RGB565_to_24RGB;
+		    else
+			fn = bgr ? image_16BGR565_to_24BGR
+			    : image_16BGR565_to_24RGB;
+		}
 	    }
-	    else
-		code = image_to_8grey(img, dest, source);
 	    break;
 	case DISPLAY_COLORS_GRAY:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) {
-		image_1grey_to_8grey(width, dest, source);
-	        code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_4) {
-		image_4grey_to_8grey(width, dest, source);
-	        code = 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		memcpy(dest, source, width);
-		code = 0;
-	    }
+	    if (depth == DISPLAY_DEPTH_1)
+		fn = image_1grey_to_24RGB;
+	    else if (depth == DISPLAY_DEPTH_4)
+		fn = image_4grey_to_24RGB;
+	    else if (depth == DISPLAY_DEPTH_8)
+		fn = image_8grey_to_24RGB;
 	    break;
 	case DISPLAY_COLORS_RGB:
-	    if ((img->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8)
-		code = -1;
-	    else if (alpha == DISPLAY_ALPHA_NONE) {
-		if ((img->format & DISPLAY_ENDIAN_MASK) == DISPLAY_BIGENDIAN)
-		    image_24RGB_to_8grey(width, dest, source);
-		else
-		    image_24BGR_to_8grey(width, dest, source);
-		code = 0;
-	    }
+	    if (depth != DISPLAY_DEPTH_8)
+		break;
+	    if ((alpha == DISPLAY_ALPHA_FIRST) ||
+		(alpha == DISPLAY_UNUSED_FIRST))
+		fn = swap ? rgb8_skip_swap : rgb8_skip;
+	    else if ((alpha == DISPLAY_ALPHA_LAST) ||
+		(alpha == DISPLAY_UNUSED_LAST))
+		fn = swap ? rgb8_pad_swap : rgb8_pad;
+	    else if (swap)
+		fn = rgb8_swap;
 	    else
-		code = image_to_8grey(img, dest, source);
+		return 1;
 	    break;
 	case DISPLAY_COLORS_CMYK:
-	    if ((img->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8)
-		code = -1;
-	    else
-		code = image_to_8grey(img, dest, source);
+	    if (depth == DISPLAY_DEPTH_8)
+		fn = bgr ? image_cmyk_to_24BGR : image_cmyk_to_24RGB;
 	    break;
     }
-
-    return code;
+    if (fn == NULL)
+	return -1;
+    *pfn = fn;
+    return 0;
 }
 
-/********************************************************/
+/* Choose a converter from format to 8-bit grey.
+ * Returns 0 if OK, 1 if no conversion is needed, 2 if conversion
+ * must go through 24RGB, or -1 if the format is not supported.
+ */
+static int
+convert_grey_fn(unsigned int format, IMAGE_CONVERT_FN *pfn)
+{
+    unsigned int depth = format & DISPLAY_DEPTH_MASK;
+    unsigned int alpha = format & DISPLAY_ALPHA_MASK;
+    BOOL bigendian = (format & DISPLAY_ENDIAN_MASK) == DISPLAY_BIGENDIAN;
+    IMAGE_CONVERT_FN fn = NULL;
 
+    switch (format & DISPLAY_COLORS_MASK) {
+	case DISPLAY_COLORS_NATIVE:
+	    if (depth == DISPLAY_DEPTH_1)
+		fn = image_1native_to_8grey;
+	    else if (depth == DISPLAY_DEPTH_4)
+		fn = image_4native_to_8grey;
+	    else if (depth == DISPLAY_DEPTH_8)
+		fn = image_8native_to_8grey;
+	    else
+		return 2;
+	    break;
+	case DISPLAY_COLORS_GRAY:
+	    if (depth == DISPLAY_DEPTH_1)
+		fn = image_1grey_to_8grey;
+	    else if (depth == DISPLAY_DEPTH_4)
+		fn = image_4grey_to_8grey;
+	    else if (depth == DISPLAY_DEPTH_8)
+		return 1;
+	    break;
+	case DISPLAY_COLORS_RGB:
+	    if (depth != DISPLAY_DEPTH_8)
+		break;
+	    if ((alpha == DISPLAY_ALPHA_FIRST) ||
+		(alpha == DISPLAY_UNUSED_FIRST))
+		fn = bigendian ? grey8_skip_rgb : grey8_skip_bgr;
+	    else if ((alpha == DISPLAY_ALPHA_LAST) ||
+		(alpha == DISPLAY_UNUSED_LAST))
+		fn = bigendian ? grey8_pad_rgb : grey8_pad_bgr;
+	    else
+		fn = bigendian ? image_24RGB_to_8grey : image_24BGR_to_8grey;
+	    break;
+	case DISPLAY_COLORS_CMYK:
+	    if (depth == DISPLAY_DEPTH_8)
+		return 2;
+	    break;
+    }
+    if (fn == NULL)
+	return -1;
+    *pfn = fn;
+    return 0;
+}
 
-/* Convert a line of image to monochrome with 0=white, 1=black.
- * Returns -ve if unsupported format.
+/* Choose a converter from format to 1-bit with 0=white, 1=black.
+ * Returns 0 if OK, -1 if the format is not supported.
  */
-int
-image_to_mono(IMAGE *img, unsigned char *dest, unsigned char *source)
+static int
+convert_mono(IMAGE_CONVERT *cv, unsigned int format)
 {
-    int width = img->width;
-    unsigned int alpha = img->format & DISPLAY_ALPHA_MASK;
-    BOOL bigendian = (img->format & DISPLAY_ENDIAN_MASK) == DISPLAY_BIGENDIAN;
-    int bwidth = ((width + 7) & ~7) >> 3; /* byte width with 1 bit/pixel */
-    unsigned char omask = 0x80;
-    int oroll = 7;
-    int black;
-    unsigned char *s = source;
-    unsigned char mask0 = 0;
-    unsigned char mask1 = 0;
-    unsigned char mask2 = 0;
-    unsigned char mask3 = 0;
-    int bytes_per_pixel = 0;
-    BOOL additive = TRUE;
-    int j;
+    unsigned int depth = format & DISPLAY_DEPTH_MASK;
+    unsigned int alpha = format & DISPLAY_ALPHA_MASK;
+    BOOL bigendian = (format & DISPLAY_ENDIAN_MASK) == DISPLAY_BIGENDIAN;
+    BOOL native555 = (format & DISPLAY_555_MASK) == DISPLAY_NATIVE_555;
+    IMAGE_CONVERT_FN fn = NULL;
 
-    switch (img->format & DISPLAY_COLORS_MASK) {
+    switch (format & DISPLAY_COLORS_MASK) {
 	case DISPLAY_COLORS_NATIVE:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) {
-		for (j = 0; j < bwidth ; j++)
-		    dest[j] = source[j];
+	    if (depth == DISPLAY_DEPTH_1) {
+		cv->row = convert_row_copy;
+		cv->bytes = (cv->width + 7) >> 3;
 		return 0;
 	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_4) {
-		for (j = 0; j < width; j++) {
-		    if (j & 1) {
-			black = (*s & 0x0f) != 0x0f;
-			s++;
-		    }
-		    else
-			black = (*s & 0xf0) != 0xf0;
-		    if (black) 
-			dest[j/8] |= omask;
-		    else
-			dest[j/8] &= (unsigned char)(~omask);
-		    oroll--;
-		    omask >>= 1;
-		    if (oroll < 0) {
-			omask = 0x80;
-			oroll = 7;
-		    }
-		}
+	    else if (depth == DISPLAY_DEPTH_4)
+		fn = mono_4bit;
+	    else if (depth == DISPLAY_DEPTH_8)
+		fn = mono_8native;
+	    else if (depth == DISPLAY_DEPTH_16) {
+		/* the unused bit of 555 is ignored */
+		cv->mask[0] = (unsigned char)
+		    ((bigendian && native555) ? 0x7f : 0xff);
+		cv->mask[1] = (unsigned char)
+		    ((!bigendian && native555) ? 0x7f : 0xff);
+		cv->row = convert_row_mono16;
 		return 0;
 	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		for (j = 0; j < width; j++) {
-		    black = (*s != 0x3f) && (*s != 0x5f);
-		    s++;
-		    if (black) 
-			dest[j/8] |= omask;
-		    else
-			dest[j/8] &= (unsigned char)(~omask);
-		    oroll--;
-		    omask >>= 1;
-		    if (oroll < 0) {
-			omask = 0x80;
-			oroll = 7;
-		    }
-		}
-		return 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_16) {
-		bytes_per_pixel = 2;
-		if (bigendian) {
-		    if ((img->format & DISPLAY_555_MASK)
-			== DISPLAY_NATIVE_555) {
-			mask0 = 0x7f;
-			mask1 = 0xff;
-		    }
-		    else {
-			mask0 = 0xff;
-			mask1 = 0xff;
-		    }
-		}
-		else {
-		    if ((img->format & DISPLAY_555_MASK)
-			== DISPLAY_NATIVE_555) {
-			mask0 = 0xff;
-			mask1 = 0x7f;
-		    }
-		    else {
-			mask0 = 0xff;
-			mask1 = 0xff;
-		    }
-		}
-	    }
 	    break;
 	case DISPLAY_COLORS_GRAY:
-	    if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_1) {
-		for (j = 0; j < bwidth ; j++)
-		    dest[j] = (unsigned char)~source[j];
-		return 0;
-	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_4) {
-		for (j = 0; j < width; j++) {
-		    if (j & 1) {
-			black = (*s & 0x0f) != 0x0f;
-		        s++;
-		    }
-		    else
-			black = (*s & 0xf0) != 0xf0;
-		    if (black) 
-			dest[j/8] |= omask;
-		    else
-			dest[j/8] &= (unsigned char)(~omask);
-		    oroll--;
-		    omask >>= 1;
-		    if (oroll < 0) {
-			omask = 0x80;
-			oroll = 7;
-		    }
-		}
+	    if (depth == DISPLAY_DEPTH_1) {
+		cv->row = convert_row_invert;
+		cv->bytes = (cv->width + 7) >> 3;
 		return 0;
 	    }
-	    else if ((img->format & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8) {
-		bytes_per_pixel = 1;
-		mask0 = 0xff;
-	    }
-	    else
-		return -1;
+	    else if (depth == DISPLAY_DEPTH_4)
+		fn = mono_4bit;
+	    else if (depth == DISPLAY_DEPTH_8)
+		fn = mono_grey8;
 	    break;
 	case DISPLAY_COLORS_RGB:
-	    if ((img->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8)
-		return -1;
-
-	    if ((alpha == DISPLAY_ALPHA_FIRST) || 
-		(alpha == DISPLAY_UNUSED_FIRST)) {
-		bytes_per_pixel = 4;
-		mask0 = 0;
-		mask1 = 0xff;
-		mask2 = 0xff;
-		mask3 = 0xff;
-	    }
-	    else {
-		bytes_per_pixel = 3;
-		mask0 = 0xff;
-		mask1 = 0xff;
-		mask2 = 0xff;
-		mask3 = 0;
-	    }
-	    if ((alpha == DISPLAY_ALPHA_LAST) || 
+	    if (depth != DISPLAY_DEPTH_8)
+		break;
+	    if ((alpha == DISPLAY_ALPHA_FIRST) ||
+		(alpha == DISPLAY_UNUSED_FIRST))
+		fn = mono_rgb_skip;
+	    else if ((alpha == DISPLAY_ALPHA_LAST) ||
 		(alpha == DISPLAY_UNUSED_LAST))
-		bytes_per_pixel++;
+		fn = mono_rgb_pad;
+	    else
+		fn = mono_rgb;
 	    break;
 	case DISPLAY_COLORS_CMYK:
-	    if ((img->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8)
-		return -1;
+	    if (depth == DISPLAY_DEPTH_8)
+		fn = mono_cmyk;
+	    break;
+    }
+    if (fn == NULL)
+	return -1;
+    cv->fn = fn;
+    return 0;
+}
 
-	    additive = FALSE;
-	    bytes_per_pixel = 4;
-	    mask0 = 0xff;
-	    mask1 = 0xff;
-	    mask2 = 0xff;
-	    mask3 = 0xff;
+/* Make a plan in cv.  Returns 0 if OK, -1 if not supported.
+ * If cv->temp is not NULL, it must be freed by the caller.
+ */
+static int
+convert_init(IMAGE_CONVERT *cv, IMAGE *img, int dest)
+{
+    int code = -1;
+    memset(cv, 0, sizeof(IMAGE_CONVERT));
+    cv->width = (int)img->width;
+    cv->row = convert_row_fn;
+    image_convert_ready();
+    switch (dest) {
+	case IMAGE_CONVERT_24RGB:
+	case IMAGE_CONVERT_24BGR:
+	    code = convert_rgb_fn(img->format,
+		(dest == IMAGE_CONVERT_24BGR), &cv->fn);
+	    if (code == 1) {
+		cv->row = convert_row_copy;
+		cv->bytes = cv->width * 3;
+		code = 0;
+	    }
 	    break;
+	case IMAGE_CONVERT_GREY:
+	    code = convert_grey_fn(img->format, &cv->fn);
+	    if (code == 1) {
+		cv->row = convert_row_copy;
+		cv->bytes = cv->width;
+		code = 0;
+	    }
+	    else if (code == 2) {
+		/* convert to 24RGB first */
+		code = convert_rgb_fn(img->format, FALSE, &cv->fn);
+		if (code == 0) {
+		    cv->fn2 = image_24RGB_to_8grey;
+		    cv->row = convert_row_temp;
+		    cv->temp = (unsigned char *)malloc(cv->width * 3 + 1);
+		    if (cv->temp == NULL)
+			code = -1;
+		}
+		else
+		    code = -1;
+	    }
+	    break;
+	case IMAGE_CONVERT_MONO:
+	    code = convert_mono(cv, img->format);
+	    break;
+    }
+    return code;
+}
+
+IMAGE_CONVERT *
+image_convert_new(IMAGE *img, int dest)
+{
+    IMAGE_CONVERT *cv = (IMAGE_CONVERT *)malloc(sizeof(IMAGE_CONVERT));
+    if (cv == NULL)
+	return NULL;
+    if (convert_init(cv, img, dest) != 0) {
+	image_convert_free(cv);
+	return NULL;
     }
+    return cv;
+}
 
-    /* one or more bytes per pixel */
+void
+image_convert_row(IMAGE_CONVERT *cv, unsigned char *dest,
+    unsigned char *source)
+{
+    cv->row(cv, dest, source);
+}
 
-    memset(dest, 0xff, bwidth);
-    omask = 0x80;
-    oroll = 7;
+/* Rows for image_convert_rows() */
+typedef struct CONVERT_ROWS_s {
+    IMAGE_CONVERT *cv;
+    unsigned char *dest;
+    long dest_raster;
+    unsigned char *source;
+    long source_raster;
+} CONVERT_ROWS;
 
-    for (j = 0; j < width; j++) {
-	if (additive) {
-	    /* RGB */
-	    black =  (s[0] & mask0) != mask0;
-	    if (bytes_per_pixel > 1)
-		black |= (s[1] & mask1) != mask1;
-	    if (bytes_per_pixel > 2)
-		black |= (s[2] & mask2) != mask2;
-	    if (bytes_per_pixel > 3)
-		black |= (s[3] & mask3) != mask3;
-	}
-	else {
-	    /* CMYK */
-	    black =  (s[0] & mask0) != 0;
-	    black |= (s[1] & mask1) != 0;
-	    black |= (s[2] & mask2) != 0;
-	    black |= (s[3] & mask3) != 0;
-	}
-	s += bytes_per_pixel;
-	if (black) 
-	    dest[j/8] |= omask;
-	else
-	    dest[j/8] &= (unsigned char)(~omask);
-	oroll--;
-	omask >>= 1;
-	if (oroll < 0) {
-	    omask = 0x80;
-	    oroll = 7;
-	}
+#define CONVERT_BAND_ROWS 32
+
+/* Copy a plan for one band of rows.  Bands may run at the same
+ * time, so each needs its own intermediate row.
+ * Returns 0 if OK, -1 if out of memory.
+ */
+static int
+convert_band_begin(IMAGE_CONVERT *cv, IMAGE_CONVERT *shared)
+{
+    *cv = *shared;
+    if (cv->temp != NULL) {
+	cv->temp = (unsigned char *)malloc(cv->width * 3 + 1);
+	if (cv->temp == NULL)
+	    return -1;
     }
     return 0;
 }
 
+static void
+convert_band_end(IMAGE_CONVERT *cv)
+{
+    if (cv->temp != NULL)
+	free(cv->temp);
+    cv->temp = NULL;
+}
+
+static int
+convert_rows_band(void *arg, int first, int last)
+{
+    CONVERT_ROWS *c = (CONVERT_ROWS *)arg;
+    IMAGE_CONVERT cv;
+    int y;
+    if (convert_band_begin(&cv, c->cv) != 0)
+	return -1;
+    for (y=first; y<last; y++)
+	cv.row(&cv, c->dest + y * c->dest_raster,
+	    c->source + y * c->source_raster);
+    convert_band_end(&cv);
+    return 0;
+}
+
+int
+image_convert_rows(IMAGE_CONVERT *cv, unsigned char *dest,
+    long dest_raster, unsigned char *source, long source_raster, int rows)
+{
+    CONVERT_ROWS c;
+    c.cv = cv;
+    c.dest = dest;
+    c.dest_raster = dest_raster;
+    c.source = source;
+    c.source_raster = source_raster;
+    return pool_for(rows, CONVERT_BAND_ROWS, convert_rows_band, &c);
+}
+
+void
+image_convert_free(IMAGE_CONVERT *cv)
+{
+    if (cv == NULL)
+	return;
+    if (cv->temp)
+	free(cv->temp);
+    free(cv);
+}
+
+/* Convert one row using a plan on the stack */
+static int
+image_convert_once(IMAGE *img, int dest_format, unsigned char *dest,
+    unsigned char *source)
+{
+    IMAGE_CONVERT cv;
+    int code = convert_init(&cv, img, dest_format);
+    if (code == 0)
+	cv.row(&cv, dest, source);
+    if (cv.temp)
+	free(cv.temp);
+    return code;
+}
+
+int
+image_to_24BGR(IMAGE *img, unsigned char *dest, unsigned char *source)
+{
+    return image_convert_once(img, IMAGE_CONVERT_24BGR, dest, source);
+}
+
+int
+image_to_24RGB(IMAGE *img, unsigned char *dest, unsigned char *source)
+{
+    return image_convert_once(img, IMAGE_CONVERT_24RGB, dest, source);
+}
+
+/* Convert any format to 8-bit grey.
+ * Returns -ve if unsupported format.
+ */
+int
+image_to_grey(IMAGE *img, unsigned char *dest, unsigned char *source)
+{
+    return image_convert_once(img, IMAGE_CONVERT_GREY, dest, source);
+}
+
+/* Convert a line of image to monochrome with 0=white, 1=black.
+ * Returns -ve if unsupported format.
+ */
+int
+image_to_mono(IMAGE *img, unsigned char *dest, unsigned char *source)
+{
+    return image_convert_once(img, IMAGE_CONVERT_MONO, dest, source);
+}
+
+/* Invert count bytes of 1-bit pixels.
+ * dest and source may be the same.
+ */
+void
+image_invert_bits(unsigned char *dest, const unsigned char *source, int count)
+{
+    int i = 0;
+#ifdef IMAGE_SSE2
+    __m128i ones = _mm_set1_epi8((char)0xff);
+    for (; i+16<=count; i+=16)
+	_mm_storeu_si128((__m128i *)(dest + i), _mm_xor_si128(ones,
+	    _mm_loadu_si128((const __m128i *)(source + i))));
+#endif
+    for (; i<count; i++)
+	dest[i] = (unsigned char)~source[i];
+}
+
+/* Shift a row of bits by offset bits to the left.
+ * bwidth is in bytes.  Exposed bits are set to 1.
+ */
+void
+image_shift_bits(unsigned char *bits, int bwidth, int offset)
+{
+    int byteoffset = offset >> 3;
+    int shift = offset & 7;
+    int newwidth = bwidth - byteoffset;
+    const unsigned char *source = bits + byteoffset;
+    int i = 0;
+#ifdef IMAGE_SSE2
+    __m128i hi_mask, lo_mask, a, b;
+    __m128i left = _mm_cvtsi32_si128(shift);
+    __m128i right = _mm_cvtsi32_si128(8 - shift);
+#endif
+    if (offset <= 0)
+	return;
+    if (newwidth <= 0) {
+	memset(bits, 0xff, bwidth);
+	return;
+    }
+    if (shift == 0) {
+	memmove(bits, source, newwidth);
+	memset(bits+newwidth, 0xff, byteoffset);
+	return;
+    }
+    /* Each byte takes bits from the source byte and the next one.
+     * The source is never behind the destination, so this can
+     * be done in place.
+     */
+#ifdef IMAGE_SSE2
+    hi_mask = _mm_set1_epi8((char)((0xff << shift) & 0xff));
+    lo_mask = _mm_set1_epi8((char)(0xff >> (8 - shift)));
+    for (; i+17<=newwidth; i+=16) {
+	a = _mm_loadu_si128((const __m128i *)(source + i));
+	b = _mm_loadu_si128((const __m128i *)(source + i + 1));
+	a = _mm_and_si128(_mm_sll_epi16(a, left), hi_mask);
+	b = _mm_and_si128(_mm_srl_epi16(b, right), lo_mask);
+	_mm_storeu_si128((__m128i *)(bits + i), _mm_or_si128(a, b));
+    }
+#endif
+    for (; i<newwidth-1; i++)
+	bits[i] = (unsigned char)((source[i] << shift) |
+	    (source[i+1] >> (8 - shift)));
+    /* can't access bits[bwidth] */
+    bits[i] = (unsigned char)((source[i] << shift) | (0xff >> (8 - shift)));
+    memset(bits+newwidth, 0xff, byteoffset);
+}
+
 
 /* Return number of bits per pixel.
  * If format unknown, return -ve.
@@ -1046,10 +1768,8 @@ int image_copy(IMAGE *newimg, IMAGE *oldimg, unsigned int format)
     int code = 0;
     int depth;
     int colour_format = (format & DISPLAY_COLORS_MASK);
-    BOOL mono = FALSE;
-    BOOL grey = FALSE;
-    BOOL rgb24 = FALSE;
-    BOOL bgr24 = FALSE;
+    int convert = 0;
+    IMAGE_CONVERT *cv = NULL;
     memset(newimg, 0, sizeof(IMAGE));
     newimg->width = oldimg->width;
     newimg->height = oldimg->height;
@@ -1077,18 +1797,21 @@ int image_copy(IMAGE *newimg, IMAGE *oldimg, unsigned int format)
     /* We support 1-bit monochrome, 8-bit grey, 24-bit RGB and 24-bit BGR */
     depth = image_depth(newimg);
     if ((depth == 1) && (colour_format == DISPLAY_COLORS_NATIVE))
-	mono = TRUE;
+	convert = IMAGE_CONVERT_MONO;
     else if ((depth == 8) && (colour_format == DISPLAY_COLORS_GRAY))
-	grey = TRUE;
+	convert = IMAGE_CONVERT_GREY;
     else if ((depth == 24) && (colour_format == DISPLAY_COLORS_RGB)) {
         if ((format & DISPLAY_ENDIAN_MASK) == DISPLAY_BIGENDIAN)
-	    rgb24 = TRUE;
+	    convert = IMAGE_CONVERT_24RGB;
 	else
-	    bgr24 = TRUE;
+	    convert = IMAGE_CONVERT_24BGR;
     }
     else
 	code = -1;
 
+    if ((code == 0) && ((cv = image_convert_new(oldimg, convert)) == NULL))
+	code = -1;
+
     if (code == 0) {
 	newimg->raster = (((depth * newimg->width + 7) >> 3) + 3) & ~3;
 	newimg->image = (unsigned char *)
@@ -1099,105 +1822,685 @@ int image_copy(IMAGE *newimg, IMAGE *oldimg, unsigned int format)
 	code = -1;
     else if (code == 0) {
 	/* convert each row */
-	unsigned char *source, *dest;
         BOOL invert = (newimg->format & DISPLAY_FIRSTROW_MASK) !=
 		      (oldimg->format & DISPLAY_FIRSTROW_MASK);
-	int i;
-	for (i=0; i<(int)newimg->height; i++) {
-	    source = oldimg->image + oldimg->raster * i;
-	    if (invert)
-	        dest = newimg->image + newimg->raster * (newimg->height-1-i);
-	    else
-	        dest = newimg->image + newimg->raster * i;
-	    if (mono)
-		code = image_to_mono(oldimg, dest, source);
-	    else if (grey)
-		code = image_to_grey(oldimg, dest, source);
-	    else if (rgb24)
-		code = image_to_24RGB(oldimg, dest, source);
-	    else if (bgr24)
-		code = image_to_24BGR(oldimg, dest, source);
-	    if (code)
+	if (invert)
+	    code = image_convert_rows(cv,
+		newimg->image + newimg->raster * (newimg->height-1),
+		-(long)newimg->raster, oldimg->image, oldimg->raster,
+		(int)newimg->height);
+	else
+	    code = image_convert_rows(cv, newimg->image, newimg->raster,
+		oldimg->image, oldimg->raster, (int)newimg->height);
+    }
+    image_convert_free(cv);
+
+    if (code == 0)
+        code = image_platform_init(newimg);
+    if (code) {
+	if (newimg->image) {
+	    free(newimg->image);
+	    newimg->image = NULL;
+	}
+    }
+    return code;
+}
+
+/********************************************************/
+
+/* Find the bounding box of the marked (non-white) pixels.
+ * Coordinates are in pixels from the bottom left corner,
+ * with urx and ury exclusive.
+ * Returns 0 if OK, 1 if the image is blank, -ve on error.
+ */
+int
+image_marked_bbox(IMAGE *img, int *pllx, int *plly, int *purx, int *pury)
+{
+    int x, y;
+    int llx, lly, urx, ury;
+    unsigned char *row;
+    unsigned char *grey;
+    int topfirst;
+    int width;
+    IMAGE_CONVERT *cv;
+
+    if ((img == NULL) || (img->image == NULL))
+	return -1;
+    width = (int)img->width;
+    if ((cv = image_convert_new(img, IMAGE_CONVERT_GREY)) == NULL)
+	return -1;
+    grey = (unsigned char *)malloc(width);
+    if (grey == NULL) {
+	image_convert_free(cv);
+	return -1;
+    }
+    topfirst = ((img->format & DISPLAY_FIRSTROW_MASK) == DISPLAY_TOPFIRST);
+
+    llx = width;
+    lly = (int)img->height;
+    urx = ury = 0;
+    for (y=0; y<(int)img->height; y++) {
+	row = img->image + img->raster *
+	    (topfirst ? ((int)img->height - y - 1) : y);
+	image_convert_row(cv, grey, row);
+	for (x=0; x<width; x++)
+	    if (grey[x] != 255)
 		break;
-	} 
+	if (x == width)
+	    continue;	/* blank row */
+	if (x < llx)
+	    llx = x;
+	for (x=width-1; x>=urx; x--) {
+	    if (grey[x] != 255) {
+		urx = x + 1;
+		break;
+	    }
+	}
+	if (y < lly)
+	    lly = y;
+	ury = y + 1;
+    }
+    free(grey);
+    image_convert_free(cv);
+    if ((urx <= llx) || (ury <= lly))
+	return 1;
+    *pllx = llx;
+    *plly = lly;
+    *purx = urx;
+    *pury = ury;
+    return 0;
+}
+
+/* Crop an image in place.
+ * Coordinates are in pixels from the bottom left corner,
+ * with urx and ury exclusive.
+ * Only depths of 1 bit/pixel or whole bytes per pixel are supported.
+ * Returns 0 if OK, -ve on error.
+ */
+int
+image_crop(IMAGE *img, int llx, int lly, int urx, int ury)
+{
+    int depth = image_depth(img);
+    int topfirst;
+    int width = urx - llx;
+    int height = ury - lly;
+    int raster;
+    int bitoffset;
+    int x, y;
+    unsigned char *src;
+    unsigned char *dest;
+
+    if ((img == NULL) || (img->image == NULL))
+	return -1;
+    if ((llx < 0) || (lly < 0) || (width <= 0) || (height <= 0) ||
+	(urx > (int)img->width) || (ury > (int)img->height))
+	return -1;
+    if ((depth != 1) && ((depth <= 0) || (depth & 7)))
+	return -1;
+    topfirst = ((img->format & DISPLAY_FIRSTROW_MASK) == DISPLAY_TOPFIRST);
+    if (depth == 1)
+	raster = (width + 7) >> 3;
+    else
+	raster = width * (depth >> 3);
+    /* keep rows aligned in the same way as the original */
+    if ((img->raster & 3) == 0)
+	raster = (raster + 3) & ~3;
+
+    /* Rows are copied in increasing address order, and the
+     * destination is never after the source, so this works in place.
+     */
+    for (y=0; y<height; y++) {
+	dest = img->image + raster * y;
+	if (topfirst)
+	    src = img->image + img->raster * ((int)img->height - ury + y);
+	else
+	    src = img->image + img->raster * (lly + y);
+	if (depth == 1) {
+	    src += llx >> 3;
+	    bitoffset = llx & 7;
+	    if (bitoffset == 0)
+		memmove(dest, src, (width + 7) >> 3);
+	    else {
+		for (x=0; x<((width + 7) >> 3); x++) {
+		    /* the last byte may read one past the crop region,
+		     * but not past the row */
+		    dest[x] = (unsigned char)((src[x] << bitoffset) | 
+			(((llx >> 3) + x + 1 < (int)img->raster) ?
+			 (src[x+1] >> (8 - bitoffset)) : 0));
+		}
+	    }
+	}
+	else
+	    memmove(dest, src + llx * (depth >> 3), width * (depth >> 3));
+    }
+    img->width = width;
+    img->height = height;
+    img->raster = raster;
+    return 0;
+}
+
+/********************************************************/
+
+/* Merge a separation stored as greyscale into a CMYK composite.
+ * The amount added to each component for each separation value
+ * is looked up in a table, and added with saturation.
+ * The table holds the whole part of (255-val)*weight, so the result
+ * is the same as adding in floating point and truncating, except
+ * that it may be 1 less when (255-val)*weight is within about
+ * 1/32768 below a whole number, where the floating point sum
+ * rounds up.  Negative weights are treated as 0.
+ */
+
+typedef union MERGE_ADD_u {
+    unsigned char c[4];		/* C, M, Y, K */
+    unsigned int i;		/* for loading 4 components at once */
+} MERGE_ADD;
+
+typedef struct MERGE_CMYK_s {
+    IMAGE *img;
+    IMAGE *layer;
+    int img_topfirst;
+    int layer_topfirst;
+    MERGE_ADD add[256];		/* indexed by separation value */
+} MERGE_CMYK;
+
+/* Rows are merged in bands which do not depend on each other,
+ * so the bands may run in several threads */
+#define MERGE_BAND_ROWS 64
+
+static void
+merge_cmyk_table(MERGE_CMYK *m, float cyan, float magenta, float yellow,
+    float black)
+{
+    int val, i;
+    float weight[4];
+    float f;
+    weight[0] = cyan;
+    weight[1] = magenta;
+    weight[2] = yellow;
+    weight[3] = black;
+    for (val=0; val<256; val++) {
+	for (i=0; i<4; i++) {
+	    f = (255-val) * weight[i];
+	    if (f >= 255)
+		m->add[val].c[i] = 255;
+	    else if (f > 0)
+		m->add[val].c[i] = (unsigned char)f;
+	    else
+		m->add[val].c[i] = 0;
+	}
+    }
+}
+
+static int
+merge_cmyk_band(void *arg, int y0, int y1)
+{
+    MERGE_CMYK *m = (MERGE_CMYK *)arg;
+    int x, y;
+    int width = (int)m->img->width;
+    int height = (int)m->img->height;
+    unsigned char *img_row;
+    unsigned char *layer_row;
+    unsigned char *p;
+    const unsigned char *a;
+    unsigned int v;
+#ifdef IMAGE_SSE2
+    __m128i vp, va;
+#endif
+
+    for (y=y0; y<y1; y++) {
+        img_row = m->img->image + m->img->raster * 
+	    (m->img_topfirst ? y : (height - y - 1));
+        layer_row = m->layer->image + m->layer->raster * 
+	    (m->layer_topfirst ? y : (height - y - 1));
+	x = 0;
+#ifdef IMAGE_SSE2
+	for (; x+4<=width; x+=4) {
+	    p = &img_row[x*4];
+	    vp = _mm_loadu_si128((const __m128i *)p);
+	    va = _mm_set_epi32((int)m->add[layer_row[x+3]].i,
+		(int)m->add[layer_row[x+2]].i,
+		(int)m->add[layer_row[x+1]].i,
+		(int)m->add[layer_row[x]].i);
+	    _mm_storeu_si128((__m128i *)p, _mm_adds_epu8(vp, va));
+	}
+#endif
+	for (; x<width; x++) {
+	    p = &img_row[x*4];
+	    a = m->add[layer_row[x]].c;
+	    v = p[0] + a[0];
+	    p[0] = (unsigned char)(v > 255 ? 255 : v);
+	    v = p[1] + a[1];
+	    p[1] = (unsigned char)(v > 255 ? 255 : v);
+	    v = p[2] + a[2];
+	    p[2] = (unsigned char)(v > 255 ? 255 : v);
+	    v = p[3] + a[3];
+	    p[3] = (unsigned char)(v > 255 ? 255 : v);
+	}
+    }    return 0;
+}
+
+int 
+image_merge_cmyk(IMAGE *img, IMAGE *layer, float cyan, float magenta,
+   float yellow, float black)
+{
+    MERGE_CMYK m;
+    if ((img == NULL) || (img->image == NULL))
+	return -1;
+    if ((layer == NULL) || (layer->image == NULL))
+	return -1;
+    if ((img->format & DISPLAY_COLORS_MASK) != DISPLAY_COLORS_CMYK)
+	return -1;
+    if ((img->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8)
+	return -1;
+    if ((img->format & DISPLAY_ENDIAN_MASK) != DISPLAY_BIGENDIAN)
+	return -1;
+    if ((layer->format & DISPLAY_COLORS_MASK) != DISPLAY_COLORS_GRAY)
+	return -1;
+    if ((layer->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8)
+	return -1;
+    if (img->width != layer->width)
+	return -1;
+    if (img->height != layer->height)
+	return -1;
+
+    memset(&m, 0, sizeof(m));
+    m.img = img;
+    m.layer = layer;
+    m.img_topfirst = 
+	((img->format & DISPLAY_FIRSTROW_MASK) == DISPLAY_TOPFIRST);
+    m.layer_topfirst = 
+	((layer->format & DISPLAY_FIRSTROW_MASK) == DISPLAY_TOPFIRST);
+    merge_cmyk_table(&m, cyan, magenta, yellow, black);
+
+    return pool_for((int)img->height, MERGE_BAND_ROWS, merge_cmyk_band, &m);
+}
+
+/********************************************************/
+
+/* The down scaler averages the source pixels under each output pixel.
+ * Positions are in 1/16 of a source pixel.  Output pixel xo covers
+ * source positions from (xo * 16 * width_in / width_out) to
+ * ((xo+1) * 16 * width_in / width_out), so each source pixel has a
+ * weight of 16 except the first and last of the span, which may be
+ * partly covered.  The spans are calculated once for each column
+ * and for each row.  Rows are first summed horizontally, then the
+ * sums of the rows under each output row are added, and the total
+ * is divided by the nominal weight of an output pixel.
+ */
+
+typedef struct SCALE_SPAN_s {
+    unsigned int first;		/* first source pixel */
+    unsigned int last;		/* last source pixel */
+    unsigned int wfirst;	/* weight of first pixel, 0 if same as last */
+    unsigned int wlast;		/* weight of last pixel */
+} SCALE_SPAN;
+
+/* Running sums for a band of output rows */
+typedef struct SCALE_BAND_s {
+    unsigned int *sum1;	/* horizontal merge of one source row */
+    unsigned int *sumn;	/* merge of several rows */
+    unsigned int yi;	/* next source row */
+    unsigned int yo;	/* next output row */
+    unsigned int yo_end;	/* end of band */
+} SCALE_BAND;
+
+struct IMAGE_SCALER_s {
+    IMAGE *newimg;
+    IMAGE *oldimg;	/* for image_down_scale() */
+    unsigned int width_in;
+    unsigned int height_in;
+    unsigned int width_out;
+    unsigned int height_out;
+    BOOL mono_wb;
+    BOOL mono_bw;
+    BOOL cmyk_out;
+    unsigned int ncomp_in;
+    unsigned int ncomp_out;
+    unsigned int ncomp_out_first;
+    unsigned int ncomp_out_last;
+    unsigned int maxval;
+    SCALE_SPAN *spx;
+    SCALE_SPAN *spy;
+    SCALE_BAND band;	/* for image_scaler_row() */
+};
+
+/* Output rows are scaled in bands which do not depend on each other,
+ * so the bands may run in several threads */
+#define SCALE_BAND_ROWS 32
+
+static void
+scale_spans(SCALE_SPAN *sp, unsigned int len_in, unsigned int len_out)
+{
+    unsigned int o;
+    unsigned int last, end, frac;
+    unsigned int prev_end = 0;
+    unsigned int prev_frac = 0;
+    for (o=0; o<len_out; o++) {
+	last = (o+1) * 16 * len_in / len_out;
+	end = last >> 4;
+	frac = last & 0xf;
+	if (frac == 0) {
+	    end--;
+	    frac = 16;
+	}
+	if (o == 0) {
+	    sp[o].first = 0;
+	    sp[o].wfirst = 16;
+	}
+	else {
+	    /* the pixel shared with the previous span */
+	    sp[o].first = prev_end;
+	    sp[o].wfirst = 16 - prev_frac;
+	}
+	sp[o].last = end;
+	sp[o].wlast = frac;
+	if (sp[o].first == sp[o].last)
+	    sp[o].wfirst = 0;
+	prev_end = end;
+	prev_frac = frac;
+    }
+}
+
+/* Count the set bits from a to b-1 */
+static unsigned int
+scale_count_bits(const unsigned char *row, unsigned int a, unsigned int b)
+{
+    unsigned int i, last;
+    unsigned int n;
+    unsigned int first_mask, last_mask;
+    if (a >= b)
+	return 0;
+    i = a >> 3;
+    last = (b - 1) >> 3;
+    first_mask = 0xff >> (a & 7);
+    last_mask = (0xff << (7 - ((b - 1) & 7))) & 0xff;
+    if (i == last)
+	return bit_count[row[i] & first_mask & last_mask];
+    n = bit_count[row[i] & first_mask];
+    for (i++; i<last; i++)
+	n += bit_count[row[i]];
+    return n + bit_count[row[last] & last_mask];
+}
+
+/* Sum one row of 1-bit pixels, where white is 1 if white1 is TRUE */
+static void
+scale_row_mono(IMAGE_SCALER *s, const unsigned char *row_in,
+    unsigned int *sum1, BOOL white1)
+{
+    unsigned int xo;
+    unsigned int n, white;
+    const SCALE_SPAN *sp = s->spx;
+#define SCALE_WHITE(x) \
+    ((((row_in[(x)>>3] >> (7 - ((x) & 7))) & 1) != 0) == white1)
+    for (xo=0; xo<s->width_out; xo++, sp++) {
+	/* pixels between first and last */
+	n = sp->last - sp->first - (sp->first < sp->last ? 1 : 0);
+	white = scale_count_bits(row_in, sp->first + 1, sp->last);
+	if (!white1)
+	    white = n - white;
+	white <<= 4;
+	if (SCALE_WHITE(sp->first))
+	    white += sp->wfirst;
+	if (SCALE_WHITE(sp->last))
+	    white += sp->wlast;
+	sum1[xo] = white * 255;
+    }
+#undef SCALE_WHITE
+}
+
+/* Sum one row of 8-bit grey */
+static void
+scale_row_grey(IMAGE_SCALER *s, const unsigned char *row_in,
+    unsigned int *sum1)
+{
+    unsigned int xo, xi, last;
+    unsigned int sum;
+    const SCALE_SPAN *sp = s->spx;
+#ifdef IMAGE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i vsum;
+#endif
+    for (xo=0; xo<s->width_out; xo++, sp++) {
+	sum = 0;
+	xi = sp->first + 1;
+	last = sp->last;
+#ifdef IMAGE_SSE2
+	if (xi + 16 <= last) {
+	    vsum = zero;
+	    for (; xi+16<=last; xi+=16)
+		vsum = _mm_add_epi64(vsum, _mm_sad_epu8(
+		    _mm_loadu_si128((const __m128i *)(row_in + xi)), zero));
+	    sum = (unsigned int)_mm_cvtsi128_si32(vsum) +
+		(unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(vsum, 8));
+	}
+#endif
+	for (; xi<last; xi++)
+	    sum += row_in[xi];
+	sum1[xo] = (sum << 4) + row_in[sp->first] * sp->wfirst +
+	    row_in[last] * sp->wlast;
     }
+}
 
-    if (code == 0)
-        code = image_platform_init(newimg);
-    if (code) {
-	if (newimg->image) {
-	    free(newimg->image);
-	    newimg->image = NULL;
+/* Sum one row of 8-bit RGB, CMYK etc. with ncomp components */
+static void
+scale_row_colour(IMAGE_SCALER *s, const unsigned char *row_in,
+    unsigned int *sum1)
+{
+    unsigned int xo, xi, last, i;
+    unsigned int ncomp = s->ncomp_in;
+    unsigned int sum[4];
+    const unsigned char *p;
+    const unsigned char *pf;
+    const unsigned char *pl;
+    const SCALE_SPAN *sp = s->spx;
+#ifdef IMAGE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i v, acc, acc32;
+    int n;
+#endif
+    for (xo=0; xo<s->width_out; xo++, sp++) {
+	sum[0] = sum[1] = sum[2] = sum[3] = 0;
+	xi = sp->first + 1;
+	last = sp->last;
+#ifdef IMAGE_SSE2
+	if ((ncomp == 4) && (xi + 4 <= last)) {
+	    /* 4 pixels at a time, summed in 16 bits then 32 bits */
+	    acc32 = zero;
+	    while (xi + 4 <= last) {
+		acc = zero;
+		for (n=0; (n < 64) && (xi+4 <= last); n++, xi+=4) {
+		    v = _mm_loadu_si128((const __m128i *)(row_in + xi*4));
+		    acc = _mm_add_epi16(acc, _mm_unpacklo_epi8(v, zero));
+		    acc = _mm_add_epi16(acc, _mm_unpackhi_epi8(v, zero));
+		}
+		acc = _mm_add_epi16(acc, _mm_srli_si128(acc, 8));
+		acc32 = _mm_add_epi32(acc32, _mm_unpacklo_epi16(acc, zero));
+	    }
+	    sum[0] = (unsigned int)_mm_cvtsi128_si32(acc32);
+	    sum[1] = (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(acc32, 4));
+	    sum[2] = (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(acc32, 8));
+	    sum[3] = (unsigned int)_mm_cvtsi128_si32(_mm_srli_si128(acc32, 12));
 	}
+#endif
+	for (p = row_in + xi*ncomp; xi<last; xi++)
+	    for (i=0; i<ncomp; i++)
+		sum[i] += *p++;
+	pf = row_in + sp->first * ncomp;
+	pl = row_in + last * ncomp;
+	for (i=0; i<ncomp; i++)
+	    *sum1++ = (sum[i] << 4) + pf[i] * sp->wfirst + pl[i] * sp->wlast;
     }
-    return code;
 }
 
-/********************************************************/
+/* Add weight * sum1 to sumn, or set sumn to this if set is TRUE */
+static void
+scale_add(unsigned int *sumn, const unsigned int *sum1, unsigned int count,
+    unsigned int weight, BOOL set)
+{
+    unsigned int i = 0;
+#ifdef IMAGE_SSE2
+    __m128i v, lo, hi;
+    __m128i w = _mm_set1_epi32((int)weight);
+    for (; i+4<=count; i+=4) {
+	v = _mm_loadu_si128((const __m128i *)(sum1 + i));
+	/* multiply 4 x 32 bits, keeping the low 32 bits */
+	lo = _mm_mul_epu32(v, w);
+	hi = _mm_mul_epu32(_mm_srli_si128(v, 4), w);
+	v = _mm_unpacklo_epi32(_mm_shuffle_epi32(lo, _MM_SHUFFLE(0,0,2,0)),
+	    _mm_shuffle_epi32(hi, _MM_SHUFFLE(0,0,2,0)));
+	if (!set)
+	    v = _mm_add_epi32(v,
+		_mm_loadu_si128((const __m128i *)(sumn + i)));
+	_mm_storeu_si128((__m128i *)(sumn + i), v);
+    }
+#endif
+    if (set) {
+	for (; i<count; i++)
+	    sumn[i] = sum1[i] * weight;
+    }
+    else {
+	for (; i<count; i++)
+	    sumn[i] += sum1[i] * weight;
+    }
+}
 
-/* Merge a separation stored as greyscale into a CMYK composite */
-int 
-image_merge_cmyk(IMAGE *img, IMAGE *layer, float cyan, float magenta,
-   float yellow, float black)
+/* Write one output row */
+static void
+scale_output(IMAGE_SCALER *s, const unsigned int *sumn, unsigned int yo)
 {
-    int x;
-    int y;
-    unsigned char *img_row;
-    unsigned char *layer_row;
-    unsigned char *p;
-    int img_topfirst;
-    int layer_topfirst;
+    unsigned int xo, i;
     unsigned int val;
-    if ((img == NULL) || (img->image == NULL))
-	return -1;
-    if ((layer == NULL) || (layer->image == NULL))
-	return -1;
-    if ((img->format & DISPLAY_COLORS_MASK) != DISPLAY_COLORS_CMYK)
-	return -1;
-    if ((img->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8)
-	return -1;
-    if ((img->format & DISPLAY_ENDIAN_MASK) != DISPLAY_BIGENDIAN)
-	return -1;
-    if ((layer->format & DISPLAY_COLORS_MASK) != DISPLAY_COLORS_GRAY)
-	return -1;
-    if ((layer->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8)
-	return -1;
-    if (img->width != layer->width)
-	return -1;
-    if (img->height != layer->height)
-	return -1;
+    unsigned int count = s->width_out * s->ncomp_in;
+    unsigned int ncomp_out = s->ncomp_out;
+    unsigned int maxval = s->maxval;
+    unsigned char *row_out = s->newimg->image + yo * s->newimg->raster;
+    for (xo=0; xo < count; xo++) {
+	val = sumn[xo] / maxval;
+	if (val > 255)
+	    val = 255;
+	if (s->ncomp_in == ncomp_out) {
+	    row_out[xo] = (unsigned char)val;
+	}
+	else {
+	    /* we are converting grey to colour */
+	    if (s->cmyk_out) {
+		row_out[xo*ncomp_out+0] =
+		row_out[xo*ncomp_out+1] =
+		row_out[xo*ncomp_out+2] = (unsigned char)0;
+		row_out[xo*ncomp_out+3] = (unsigned char)val;
+	    }
+	    else {
+		/* RGB */
+		for (i=0; i<s->ncomp_out_first; i++)
+		    row_out[xo*ncomp_out+i] = (unsigned char)0;
+		for (; i<s->ncomp_out_last; i++)
+		    row_out[xo*ncomp_out+i] = (unsigned char)val;
+		for (; i<ncomp_out; i++)
+		    row_out[xo*ncomp_out+i] = (unsigned char)0;
+	    }
+	}
+    }
+}
 
-    img_topfirst = ((img->format & DISPLAY_FIRSTROW_MASK) == DISPLAY_TOPFIRST);
-    layer_topfirst = ((layer->format & DISPLAY_FIRSTROW_MASK) 
-	== DISPLAY_TOPFIRST);
+/* Sum one source row horizontally into band->sum1 */
+static void
+scale_row(IMAGE_SCALER *s, SCALE_BAND *band, const unsigned char *row_in)
+{
+    if (s->mono_wb)
+	scale_row_mono(s, row_in, band->sum1, FALSE);
+    else if (s->mono_bw)
+	scale_row_mono(s, row_in, band->sum1, TRUE);
+    else if (s->ncomp_in == 1)
+	scale_row_grey(s, row_in, band->sum1);
+    else
+	scale_row_colour(s, row_in, band->sum1);
+}
 
-    for (y=0; y<(int)img->height; y++) {
-        img_row = img->image + img->raster * 
-	    (img_topfirst ? y : ((int)img->height - y - 1));
-        layer_row = layer->image + layer->raster * 
-	    (layer_topfirst ? y : ((int)layer->height - y - 1));
-	for (x=0; x<(int)img->width; x++) {
-	    val = layer_row[x];
-	    p = &img_row[x*4];
-	    p[0] = (unsigned char)min(255, p[0] + (255-val) * cyan);
-	    p[1] = (unsigned char)min(255, p[1] + (255-val) * magenta);
-	    p[2] = (unsigned char)min(255, p[2] + (255-val) * yellow);
-	    p[3] = (unsigned char)min(255, p[3] + (255-val) * black);
-	}
+/* Add the next source row to a band */
+static void
+scale_band_row(IMAGE_SCALER *s, SCALE_BAND *band, const unsigned char *row_in)
+{
+    unsigned int count = s->width_out * s->ncomp_in;
+    unsigned int yo = band->yo;
+    unsigned int frac;
+    scale_row(s, band, row_in);
+    if ((yo < band->yo_end) && (band->yi >= s->spy[yo].last)) {
+	/* add last partial row and write out merged row */
+	frac = s->spy[yo].wlast;
+	scale_add(band->sumn, band->sum1, count, frac, FALSE);
+	scale_output(s, band->sumn, yo);
+	/* Put first partial row in sumn */
+	yo++;
+	if (yo < band->yo_end)
+	    scale_add(band->sumn, band->sum1, count, 16 - frac, TRUE);
+	band->yo = yo;
+    }
+    else {
+	/* add whole row to sumn */
+	scale_add(band->sumn, band->sum1, count, 16, FALSE);
     }
+    band->yi++;
+}
+
+static int
+scale_band_init(IMAGE_SCALER *s, SCALE_BAND *band,
+    unsigned int yo, unsigned int yo_end)
+{
+    unsigned int count = s->width_out * s->ncomp_in;
+    memset(band, 0, sizeof(SCALE_BAND));
+    band->sum1 = (unsigned int *)malloc(count * sizeof(unsigned int));
+    band->sumn = (unsigned int *)malloc(count * sizeof(unsigned int));
+    if ((band->sum1 == NULL) || (band->sumn == NULL))
+	return -1;
+    memset(band->sumn, 0, count * sizeof(unsigned int));
+    band->yo = yo;
+    band->yo_end = yo_end;
+    /* start at the source row shared with the previous output row */
+    band->yi = (yo == 0) ? 0 : s->spy[yo].first;
     return 0;
 }
 
-/********************************************************/
+static void
+scale_band_finish(SCALE_BAND *band)
+{
+    if (band->sum1 != NULL)
+	free(band->sum1);
+    if (band->sumn != NULL)
+	free(band->sumn);
+    band->sum1 = band->sumn = NULL;
+}
 
-typedef struct scale_pixels_s {
-   unsigned int end;	/* index of last pixel (full or partial) */
-   unsigned int frac;	/* fraction * 16 of last pixel */
-} scale_pixels_t;
+/* Scale output rows yo to yo_end-1 of the whole image s->oldimg */
+static int
+scale_band(void *arg, int first, int last)
+{
+    IMAGE_SCALER *s = (IMAGE_SCALER *)arg;
+    IMAGE *oldimg = s->oldimg;
+    unsigned int yo = (unsigned int)first;
+    unsigned int yo_end = (unsigned int)last;
+    SCALE_BAND band;
+    unsigned int count = s->width_out * s->ncomp_in;
+    if (scale_band_init(s, &band, yo, yo_end) != 0) {
+	scale_band_finish(&band);
+	return -1;
+    }
+    if (yo != 0) {
+	/* only part of the shared row belongs to this band */
+	scale_row(s, &band, oldimg->image + band.yi * oldimg->raster);
+	scale_add(band.sumn, band.sum1, count, s->spy[yo].wfirst, TRUE);
+	band.yi++;
+    }
+    while (band.yo < yo_end)
+	scale_band_row(s, &band, oldimg->image + band.yi * oldimg->raster);
+    scale_band_finish(&band);
+    return 0;
+}
 
-/* Down scale an image.
- * This is intended to scale a hires resolution monochrome image 
+/* Start down scaling an image one source row at a time.
+ * This is intended to scale a hires resolution monochrome image
  * to a lower resolution greyscale image.
+ * oldimg describes the source image, but oldimg->image is not used.
  * Input can be:
  *   1bit/pixel native or grey
  *   8bit/pixel grey,
@@ -1209,23 +2512,14 @@ typedef struct scale_pixels_s {
  *   32bit/pixel CMYK.
  * If the input format is RGB or CMYK, the output format must match.
  * Row order must be the same for both images.
+ * Only the running sums for one output row are kept, so the
+ * source image does not need to be held in memory.
+ * Returns NULL if the formats are not supported.
  */
-int image_down_scale(IMAGE *newimg, IMAGE *oldimg)
+IMAGE_SCALER *
+image_scaler_new(IMAGE *newimg, IMAGE *oldimg)
 {
-    unsigned int i;
-    unsigned int xi, xo, yi, yo;
-    unsigned int end, last;
-    scale_pixels_t *spx = NULL;
-    scale_pixels_t *spy = NULL;
-    unsigned int *sum1 = NULL;	/* horizontal merge of one source row */
-    unsigned int *sumn = NULL;	/* merge of several rows */
-    unsigned int frac;
-    unsigned int val;
-    unsigned int maxval;
-    unsigned char *row_in;
-    unsigned char *row_out;
-    unsigned int mask;
-    unsigned int byteval = 0;
+    IMAGE_SCALER *s;
     unsigned int width_in = oldimg->width;
     unsigned int height_in = oldimg->height;
     unsigned int width_out = newimg->width;
@@ -1280,7 +2574,7 @@ int image_down_scale(IMAGE *newimg, IMAGE *oldimg)
     }
 
     if (ncomp_in == 0)
-	return -1;
+	return NULL;
 
     /* Check if output image format is supported */
     switch (newimg->format & DISPLAY_COLORS_MASK) {
@@ -1324,219 +2618,534 @@ int image_down_scale(IMAGE *newimg, IMAGE *oldimg)
     }
 
     if (ncomp_out == 0)
-	return -1;
+	return NULL;
     if (ncomp_out < ncomp_in)
-	return -1;
+	return NULL;
     if ((ncomp_out != ncomp_in) && (ncomp_in != 1))
-	return -1;
+	return NULL;
     if (cmyk_out != cmyk_in)
-	return -1;
+	return NULL;
 
     if ((newimg->format && DISPLAY_FIRSTROW_MASK) != 
         (oldimg->format && DISPLAY_FIRSTROW_MASK))
-	return -1;
+	return NULL;
 
     if (width_out > width_in)
 	width_out = width_in;
     if (height_out > height_in)
 	height_out = height_in;
+    if ((width_out == 0) || (height_out == 0))
+	return NULL;
 
-    maxval = (int)(16 * width_in / width_out) * 
+    s = (IMAGE_SCALER *)malloc(sizeof(IMAGE_SCALER));
+    if (s == NULL)
+	return NULL;
+    memset(s, 0, sizeof(IMAGE_SCALER));
+    s->newimg = newimg;
+    s->width_in = width_in;
+    s->height_in = height_in;
+    s->width_out = width_out;
+    s->height_out = height_out;
+    s->mono_wb = mono_wb;
+    s->mono_bw = mono_bw;
+    s->cmyk_out = cmyk_out;
+    s->ncomp_in = ncomp_in;
+    s->ncomp_out = ncomp_out;
+    s->ncomp_out_first = ncomp_out_first;
+    s->ncomp_out_last = ncomp_out_last;
+    s->maxval = (int)(16 * width_in / width_out) * 
 	     (int)(16 * height_in / height_out); 
 
-    spy = (scale_pixels_t *)malloc(height_out * sizeof(scale_pixels_t));
-    spx = (scale_pixels_t *)malloc(width_out * sizeof(scale_pixels_t));
-    sum1 = (unsigned int *)malloc(width_out * ncomp_in * sizeof(unsigned int));
-    sumn = (unsigned int *)malloc(width_out * ncomp_in * sizeof(unsigned int));
-    if ((spy == NULL) || (spx == NULL) || (sum1 == NULL) || (sumn == NULL)) {
-	if (spy != NULL)
-	    free(spy);
-	if (spx != NULL)
-	    free(spx);
-	if (sum1 != NULL)
-	    free(sum1);
-	if (sumn == NULL)
-	    free(sumn);
+    image_convert_ready();
+    s->spy = (SCALE_SPAN *)malloc(height_out * sizeof(SCALE_SPAN));
+    s->spx = (SCALE_SPAN *)malloc(width_out * sizeof(SCALE_SPAN));
+    if ((s->spy == NULL) || (s->spx == NULL) ||
+	(scale_band_init(s, &s->band, 0, height_out) != 0)) {
+	image_scaler_finish(s);
+	return NULL;
+    }
+
+    /* precalculate the source pixels and weights of each output pixel */
+    scale_spans(s->spx, width_in, width_out);
+    scale_spans(s->spy, height_in, height_out);
+    return s;
+}
+
+/* Add the next source row.
+ * Each output row is written to newimg as soon as the
+ * last source row that contributes to it has been added.
+ * Returns 0 on success, -1 if all rows have already been added.
+ */
+int
+image_scaler_row(IMAGE_SCALER *s, const unsigned char *row_in)
+{
+    if (s->band.yi >= s->height_in)
+	return -1;
+    scale_band_row(s, &s->band, row_in);
+    return 0;
+}
+
+/* Free the scaler.
+ * Returns 0 if every source row was added, otherwise -1.
+ */
+int
+image_scaler_finish(IMAGE_SCALER *s)
+{
+    int code;
+    if (s == NULL)
+	return -1;
+    code = (s->band.yi == s->height_in) ? 0 : -1;
+    if (s->spy != NULL)
+	free(s->spy);
+    if (s->spx != NULL)
+	free(s->spx);
+    scale_band_finish(&s->band);
+    memset(s, 0, sizeof(IMAGE_SCALER));
+    free(s);
+    return code;
+}
+
+/* Down scale an image.
+ * See image_scaler_new() for the supported formats.
+ * The whole source image is available, so each band of output rows
+ * is made from its own source rows.
+ */
+int image_down_scale(IMAGE *newimg, IMAGE *oldimg)
+{
+    int code;
+    IMAGE_SCALER *s = image_scaler_new(newimg, oldimg);
+    if (s == NULL)
+	return -1;
+    s->oldimg = oldimg;
+    code = pool_for((int)s->height_out, SCALE_BAND_ROWS, scale_band, s);
+    /* all source rows have been used */
+    s->band.yi = s->height_in;
+    image_scaler_finish(s);
+    return code;
+}
+
+/********************************************************/
+/* Resampling with a separable filter.
+ * Each output pixel is a weighted sum of the source pixels under
+ * the filter, which is stretched when reducing so that every
+ * source pixel contributes.  The weights are calculated once for
+ * each output column and row, in fixed point.
+ * Source rows are filtered horizontally into a ring of rows, and
+ * each output row is made from the rows in the ring.
+ */
+
+#define RESIZE_SHIFT 14			/* bits of weight fraction */
+#define RESIZE_HFRAC 6			/* bits of fraction after first pass */
+#define RESIZE_HSHIFT (RESIZE_SHIFT - RESIZE_HFRAC)
+#define RESIZE_VSHIFT (RESIZE_SHIFT + RESIZE_HFRAC)
+#define RESIZE_BAND_ROWS 32
+
+typedef struct RESIZE_TAPS_s {
+    int count;		/* weights for each output pixel */
+    int *start;		/* first source pixel for each output pixel */
+    short *weight;	/* count weights for each output pixel */
+} RESIZE_TAPS;
+
+typedef struct RESIZE_s {
+    IMAGE *newimg;
+    IMAGE *oldimg;
+    int ncomp;
+    BOOL mono_wb;
+    BOOL mono_bw;
+    RESIZE_TAPS tx;
+    RESIZE_TAPS ty;
+} RESIZE;
+
+static double
+resize_sinc(double x)
+{
+    if (x == 0.0)
+	return 1.0;
+    x *= 3.14159265358979323846;
+    return sin(x) / x;
+}
+
+/* Filter value at distance x, in source pixels when enlarging */
+static double
+resize_filter(int filter, double x)
+{
+    if (x < 0)
+	x = -x;
+    switch (filter) {
+	case IMAGE_RESIZE_BILINEAR:
+	    return (x < 1.0) ? 1.0 - x : 0.0;
+	case IMAGE_RESIZE_LANCZOS3:
+	    return (x < 3.0) ? resize_sinc(x) * resize_sinc(x / 3.0) : 0.0;
+	default:
+	    return (x <= 0.5) ? 1.0 : 0.0;
+    }
+}
+
+static double
+resize_radius(int filter)
+{
+    switch (filter) {
+	case IMAGE_RESIZE_BILINEAR:
+	    return 1.0;
+	case IMAGE_RESIZE_LANCZOS3:
+	    return 3.0;
+	default:
+	    return 0.5;
+    }
+}
+
+static void
+resize_taps_free(RESIZE_TAPS *taps)
+{
+    if (taps->start != NULL)
+	free(taps->start);
+    if (taps->weight != NULL)
+	free(taps->weight);
+    taps->start = NULL;
+    taps->weight = NULL;
+}
+
+/* Calculate the weights for resizing from len_in to len_out pixels.
+ * Source pixels beyond the edges are replaced by the edge pixel.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+resize_taps(RESIZE_TAPS *taps, int filter, int len_in, int len_out)
+{
+    double scale = (double)len_in / len_out;
+    double fscale = (scale > 1.0) ? scale : 1.0;
+    double support = resize_radius(filter) * fscale;
+    double centre, total;
+    double *w;
+    short *pw;
+    int o, i, j, left, right, start, count, sum, big;
+
+#define RESIZE_CLAMP(i) ((i) < 0 ? 0 : ((i) >= len_in ? len_in - 1 : (i)))
+    memset(taps, 0, sizeof(RESIZE_TAPS));
+    /* find the most source pixels used by one output pixel */
+    count = 1;
+    for (o=0; o<len_out; o++) {
+	centre = (o + 0.5) * scale - 0.5;
+	i = RESIZE_CLAMP((int)ceil(centre + support)) -
+	    RESIZE_CLAMP((int)floor(centre - support)) + 1;
+	if (i > count)
+	    count = i;
+    }
+    taps->count = count;
+    taps->start = (int *)malloc(len_out * sizeof(int));
+    taps->weight = (short *)malloc(len_out * count * sizeof(short));
+    w = (double *)malloc(count * sizeof(double));
+    if ((taps->start == NULL) || (taps->weight == NULL) || (w == NULL)) {
+	if (w != NULL)
+	    free(w);
+	resize_taps_free(taps);
 	return -1;
     }
+    for (o=0; o<len_out; o++) {
+	centre = (o + 0.5) * scale - 0.5;
+	left = (int)floor(centre - support);
+	right = (int)ceil(centre + support);
+	/* the weights must not pass the end of the row */
+	start = RESIZE_CLAMP(left);
+	if (start + count > len_in)
+	    start = len_in - count;
+	memset(w, 0, count * sizeof(double));
+	for (i=left; i<=right; i++) {
+	    j = RESIZE_CLAMP(i);
+	    w[j-start] += resize_filter(filter, (i - centre) / fscale);
+	}
+	total = 0.0;
+	for (i=0; i<count; i++)
+	    total += w[i];
+	if (total == 0.0) {
+	    /* use the nearest pixel */
+	    j = RESIZE_CLAMP((int)floor(centre + 0.5));
+	    w[j-start] = total = 1.0;
+	}
+	/* round the weights so that they add to 1 */
+	pw = taps->weight + o * count;
+	sum = 0;
+	big = 0;
+	for (i=0; i<count; i++) {
+	    pw[i] = (short)floor(w[i] / total * (1<<RESIZE_SHIFT) + 0.5);
+	    sum += pw[i];
+	    if (pw[i] > pw[big])
+		big = i;
+	}
+	pw[big] = (short)(pw[big] + (1<<RESIZE_SHIFT) - sum);
+	taps->start[o] = start;
+    }
+#undef RESIZE_CLAMP
+    free(w);
+    return 0;
+}
 
-    /* precalculate the integer pixel offsets and fractions */
-    for (xo=0; xo<width_out; xo++) {
-	last = (xo+1) * 16 * width_in / width_out;
-	end = (last) & (~0xf);
-	spx[xo].end= end>>4;
-	spx[xo].frac = last - end;
-	if (spx[xo].frac == 0) {
-	    spx[xo].end--;
-	    spx[xo].frac = 16;
-	}
-    }
-    for (yo=0; yo<height_out; yo++) {
-	last = (yo+1) *  16 * height_in / height_out;
-	end = (last) & (~0xf);
-	spy[yo].end= end>>4;
-	spy[yo].frac = last - end;
-	if (spy[yo].frac == 0) {
-	    spy[yo].end--;
-	    spy[yo].frac = 16;
-	}
-    }
-    yo = 0;
-    memset(sumn, 0, width_out * ncomp_in * sizeof(unsigned int));
-    for (yi=0; yi<height_in; yi++) {
-	xo = 0;
-	for (i=0; i<ncomp_in; i++)
-	    sum1[xo*ncomp_in+i] = 0;
-	row_in = oldimg->image + yi * oldimg->raster;
-	if (mono_wb) {
-	    /* 1bit/pixel, 0 is white, 1 is black  */
-	    mask = 0;
-	    end = spx[xo].end;
-	    for (xi=0; xi<width_in; xi++) {
-		if ((mask >>= 1) == 0) {
-		    mask = 0x80;
-		    byteval = row_in[xi>>3];
-		}
-		val = (byteval & mask) ? 0 : 255;
-		if (xi >= end) {
-		    /* last (possibly partial) pixel of group */
-		    sum1[xo] += val * (frac = spx[xo].frac);
-		    if (++xo < width_out)
-			sum1[xo] = val * (16 - frac);
-		    end = spx[xo].end;
-		}
-		else
-		    sum1[xo] += val << 4;
+/* Filter one source row horizontally */
+static void
+resize_row_h(RESIZE *r, short *out, const unsigned char *row_in)
+{
+    int xo, k, i;
+    int nc = r->ncomp;
+    int count = r->tx.count;
+    int width = (int)r->newimg->width;
+    const short *w = r->tx.weight;
+    const unsigned char *p;
+    int sum[4];
+#ifdef IMAGE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i v, acc;
+    int tmp[4];
+#endif
+    for (xo=0; xo<width; xo++, w+=count) {
+	p = row_in + r->tx.start[xo] * nc;
+	k = 0;
+	sum[0] = sum[1] = sum[2] = sum[3] = 0;
+#ifdef IMAGE_SSE2
+	if (nc == 4) {
+	    /* two pixels at a time, with components paired up */
+	    acc = zero;
+	    for (; k+2<=count; k+=2, p+=8) {
+		v = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)p),
+		    zero);
+		v = _mm_unpacklo_epi16(v, _mm_srli_si128(v, 8));
+		acc = _mm_add_epi32(acc, _mm_madd_epi16(v,
+		    _mm_set_epi16(w[k+1], w[k], w[k+1], w[k],
+			w[k+1], w[k], w[k+1], w[k])));
 	    }
+	    _mm_storeu_si128((__m128i *)tmp, acc);
+	    for (i=0; i<4; i++)
+		sum[i] = tmp[i];
 	}
-	else if (mono_bw) {
-	    /* 0 is black, 1 is white */
-	    mask = 0;
-	    end = spx[xo].end;
-	    for (xi=0; xi<width_in; xi++) {
-		if ((mask >>= 1) == 0) {
-		    mask = 0x80;
-		    byteval = row_in[xi>>3];
+#endif
+	switch (nc) {
+	    case 1:
+		for (; k<count; k++)
+		    sum[0] += p[k] * w[k];
+		break;
+	    case 3:
+		for (; k<count; k++, p+=3) {
+		    sum[0] += p[0] * w[k];
+		    sum[1] += p[1] * w[k];
+		    sum[2] += p[2] * w[k];
 		}
-		val = (byteval & mask) ? 255 : 0;
-		if (xi >= end) {
-		    /* last (possibly partial) pixel of group */
-		    sum1[xo] += val * (frac = spx[xo].frac);
-		    if (++xo < width_out)
-			sum1[xo] = val * (16 - frac);
-		    end = spx[xo].end;
+		break;
+	    default:
+		for (; k<count; k++, p+=4) {
+		    sum[0] += p[0] * w[k];
+		    sum[1] += p[1] * w[k];
+		    sum[2] += p[2] * w[k];
+		    sum[3] += p[3] * w[k];
 		}
-		else
-		    sum1[xo] += val << 4;
-	    }
 	}
-	else if (ncomp_in == 1) {
-	    /* 8bits/component grey */
-	    for (xi=0; xi<width_in; xi++) {
-		val = row_in[xi];
-		if (xi >= spx[xo].end) {
-		    /* last (possibly partial) pixel of group */
-		    sum1[xo] += val * (frac = spx[xo].frac);
-		    if (++xo < width_out)
-			sum1[xo] = val * (16 - frac);
-		}
-		else
-		    sum1[xo] += val << 4;
+	for (i=0; i<nc; i++)
+	    *out++ = (short)((sum[i] + (1<<(RESIZE_HSHIFT-1))) >> RESIZE_HSHIFT);
+    }
+}
+
+/* Make one output row from count horizontally filtered rows */
+static void
+resize_row_v(RESIZE *r, unsigned char *row_out, short **rows,
+    const short *w)
+{
+    int i, k;
+    int sum;
+    int count = r->ty.count;
+    int len = (int)r->newimg->width * r->ncomp;
+#ifdef IMAGE_SSE2
+    __m128i zero = _mm_setzero_si128();
+    __m128i round = _mm_set1_epi32(1<<(RESIZE_VSHIFT-1));
+    __m128i a, b, lo, hi, wk;
+    for (i=0; i+8<=len; i+=8) {
+	lo = hi = round;
+	for (k=0; k<count; k+=2) {
+	    /* pairs of rows, interleaved for multiply and add */
+	    a = _mm_loadu_si128((const __m128i *)(rows[k] + i));
+	    if (k+1 < count) {
+		b = _mm_loadu_si128((const __m128i *)(rows[k+1] + i));
+		wk = _mm_set1_epi32((int)((unsigned short)w[k] |
+		    ((unsigned int)(unsigned short)w[k+1] << 16)));
 	    }
-	}
-	else if (ncomp_in >= 3) {
-	    /* 8bits/component RGB, BGR, xRGB, CMYK etc. */
-	    for (xi=0; xi<width_in; xi++) {
-		for (i=0; i<ncomp_in; i++) {
-		    val = row_in[xi*ncomp_in+i];
-		    if (xi >= spx[xo].end) {
-			/* last (possibly partial) pixel of group */
-			frac = spx[xo].frac;
-			sum1[xo*ncomp_in+i] += val * frac;
-			if (xo+1 < width_out)
-			    sum1[(xo+1)*ncomp_in+i] = val * (16 - frac);
-		    }
-		    else
-			sum1[xo*ncomp_in+i] += val << 4;
-		}
-		if (xi >= spx[xo].end)
-		    xo++;
+	    else {
+		b = zero;
+		wk = _mm_set1_epi32((int)(unsigned short)w[k]);
 	    }
+	    lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), wk));
+	    hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), wk));
 	}
-	if (yi >= spy[yo].end) {
-	    frac = spy[yo].frac;
-	    /* add last partial row to sumn */
-	    for (xo=0; xo<width_out*ncomp_in; xo++)
-		sumn[xo] += sum1[xo] * frac;
-	    /* write out merged row */
-	    row_out = newimg->image + yo * newimg->raster;
-	    for (xo=0; xo < width_out*ncomp_in; xo++) {
-		val = sumn[xo] / maxval;
-		if (val > 255)
-		    val = 255;
-		if (ncomp_in == ncomp_out) {
-		    row_out[xo] = (unsigned char)val;
-		}
-		else {
-		    /* we are converting grey to colour */
-		    if (cmyk_out) {
-			row_out[xo*ncomp_out+0] = 
-			row_out[xo*ncomp_out+1] = 
-			row_out[xo*ncomp_out+2] = (unsigned char)0;
-			row_out[xo*ncomp_out+3] = (unsigned char)val;
-			
-		    }
-		    else {
-			/* RGB */
-			for (i=0; i<ncomp_out_first; i++)
-			    row_out[xo*ncomp_out+i] = (unsigned char)0;
-			for (; i<ncomp_out_last; i++)
-			    row_out[xo*ncomp_out+i] = (unsigned char)val;
-			for (; i<ncomp_out; i++)
-			    row_out[xo*ncomp_out+i] = (unsigned char)0;
-		    }
+	lo = _mm_srai_epi32(lo, RESIZE_VSHIFT);
+	hi = _mm_srai_epi32(hi, RESIZE_VSHIFT);
+	a = _mm_packs_epi32(lo, hi);
+	_mm_storel_epi64((__m128i *)(row_out + i), _mm_packus_epi16(a, a));
+    }
+#else
+    i = 0;
+#endif
+    for (; i<len; i++) {
+	sum = 1<<(RESIZE_VSHIFT-1);
+	for (k=0; k<count; k++)
+	    sum += rows[k][i] * w[k];
+	sum >>= RESIZE_VSHIFT;
+	row_out[i] = (unsigned char)((sum < 0) ? 0 : ((sum > 255) ? 255 : sum));
+    }
+}
+
+/* Resize output rows yo to yo_end-1 */
+static int
+resize_band(void *arg, int yo, int yo_end)
+{
+    RESIZE *r = (RESIZE *)arg;
+    int count = r->ty.count;
+    int len = (int)r->newimg->width * r->ncomp;
+    int width_in = (int)r->oldimg->width;
+    short *ring;
+    short **rows;
+    int *ring_row;
+    unsigned char *mono = NULL;
+    const unsigned char *row_in;
+    int i, k, y, slot;
+
+    ring = (short *)malloc(count * len * sizeof(short));
+    rows = (short **)malloc(count * sizeof(short *));
+    ring_row = (int *)malloc(count * sizeof(int));
+    if (r->mono_wb || r->mono_bw)
+	mono = (unsigned char *)malloc(width_in + 8);
+    if ((ring == NULL) || (rows == NULL) || (ring_row == NULL) ||
+	((mono == NULL) && (r->mono_wb || r->mono_bw))) {
+	if (ring != NULL)
+	    free(ring);
+	if (rows != NULL)
+	    free(rows);
+	if (ring_row != NULL)
+	    free(ring_row);
+	if (mono != NULL)
+	    free(mono);
+	return -1;
+    }
+    for (k=0; k<count; k++)
+	ring_row[k] = -1;
+    for (; yo<yo_end; yo++) {
+	for (k=0; k<count; k++) {
+	    y = r->ty.start[yo] + k;
+	    slot = y % count;
+	    if (ring_row[slot] != y) {
+		row_in = r->oldimg->image + y * r->oldimg->raster;
+		if (mono != NULL) {
+		    /* expand to 8-bit grey */
+		    for (i=0; i<width_in; i+=8)
+			memcpy(mono+i, mono_grey[r->mono_wb ?
+			    (~row_in[i>>3] & 0xff) : row_in[i>>3]], 8);
+		    row_in = mono;
 		}
+		resize_row_h(r, ring + slot * len, row_in);
+		ring_row[slot] = y;
 	    }
-	    /* Put first partial row in sumn */
-	    yo++;
-	    frac = 16 - frac;
-	    if (yo < height_out) {
-		for (xo=0; xo<width_out*ncomp_in; xo++)
-		    sumn[xo] = sum1[xo] * frac;
-	    }
-	}
-	else {
-	    /* add whole row to sumn */
-	    for (xo=0; xo<width_out*ncomp_in; xo++)
-		sumn[xo] += sum1[xo]*16;
+	    rows[k] = ring + slot * len;
 	}
+	resize_row_v(r, r->newimg->image + yo * r->newimg->raster, rows,
+	    r->ty.weight + yo * count);
     }
+    free(ring);
+    free(rows);
+    free(ring_row);
+    if (mono != NULL)
+	free(mono);
+    return 0;
+}
 
-    free(spy);
-    free(spx);
-    free(sum1);
-    free(sumn);
+/* Resize an image using filter, which is one of IMAGE_RESIZE_*.
+ * The image may be made larger or smaller.
+ * Input can be 1bit/pixel native or grey, 8bit/pixel grey,
+ * 24 or 32bit/pixel RGB or 32bit/pixel CMYK.
+ * The output format must match, except that 1bit/pixel input
+ * needs 8bit/pixel grey output.
+ * Returns 0 on success, -1 if the formats are not supported.
+ */
+int
+image_resize(IMAGE *newimg, IMAGE *oldimg, int filter)
+{
+    RESIZE r;
+    int code;
+    unsigned int in_colors = oldimg->format & DISPLAY_COLORS_MASK;
+    unsigned int in_depth = oldimg->format & DISPLAY_DEPTH_MASK;
+    unsigned int out_colors = newimg->format & DISPLAY_COLORS_MASK;
+    int ncomp_out;
 
-    return 0;
+    if ((newimg->width == 0) || (newimg->height == 0) ||
+	(oldimg->width == 0) || (oldimg->height == 0))
+	return -1;
+    if ((newimg->format & DISPLAY_FIRSTROW_MASK) !=
+	(oldimg->format & DISPLAY_FIRSTROW_MASK))
+	return -1;
+    memset(&r, 0, sizeof(r));
+    r.newimg = newimg;
+    r.oldimg = oldimg;
+    if ((in_depth == DISPLAY_DEPTH_1) && (in_colors == DISPLAY_COLORS_NATIVE))
+	r.mono_wb = TRUE;
+    else if ((in_depth == DISPLAY_DEPTH_1) &&
+	(in_colors == DISPLAY_COLORS_GRAY))
+	r.mono_bw = TRUE;
+    else if (in_depth != DISPLAY_DEPTH_8)
+	return -1;
+    ncomp_out = image_depth(newimg) / 8;
+    if ((out_colors == DISPLAY_COLORS_NATIVE) ||
+	((newimg->format & DISPLAY_DEPTH_MASK) != DISPLAY_DEPTH_8))
+	return -1;
+    if (r.mono_wb || r.mono_bw) {
+	if (out_colors != DISPLAY_COLORS_GRAY)
+	    return -1;
+	r.ncomp = 1;
+    }
+    else {
+	if ((in_colors != out_colors) ||
+	    ((oldimg->format & DISPLAY_ALPHA_MASK) !=
+	     (newimg->format & DISPLAY_ALPHA_MASK)) ||
+	    (in_colors == DISPLAY_COLORS_NATIVE))
+	    return -1;
+	r.ncomp = ncomp_out;
+    }
+    if ((r.ncomp != 1) && (r.ncomp != 3) && (r.ncomp != 4))
+	return -1;
+
+    image_convert_ready();
+    if ((resize_taps(&r.tx, filter, oldimg->width, newimg->width) != 0) ||
+	(resize_taps(&r.ty, filter, oldimg->height, newimg->height) != 0)) {
+	resize_taps_free(&r.tx);
+	resize_taps_free(&r.ty);
+	return -1;
+    }
+    code = pool_for((int)newimg->height, RESIZE_BAND_ROWS, resize_band, &r);
+    resize_taps_free(&r.tx);
+    resize_taps_free(&r.ty);
+    return code;
 }
 
+static int
+image_resize_filter(IMAGE *newimg, IMAGE *oldimg, int filter)
+{
+    if (filter == IMAGE_RESIZE_BOX)
+	return image_down_scale(newimg, oldimg);
+    return image_resize(newimg, oldimg, filter);
+}
 
 /* Copy an image, resizing it if needed.
- * Currently only supports resizing down.
+ * IMAGE_RESIZE_BOX only supports resizing down, by averaging.
+ * The other filters can also enlarge.
  */
 int
 image_copy_resize(IMAGE *newimg, IMAGE *oldimg, unsigned int format,
-    float xddpi, float yddpi, float xrdpi, float yrdpi)
+    float xddpi, float yddpi, float xrdpi, float yrdpi, int filter)
 {
-    if ((xddpi != xrdpi) && (yddpi != yrdpi) &&
-        (xddpi <= xrdpi) && (yddpi <= yrdpi)) {
+    if ((filter == IMAGE_RESIZE_BOX) ?
+	((xddpi != xrdpi) && (yddpi != yrdpi) &&
+         (xddpi <= xrdpi) && (yddpi <= yrdpi)) :
+	((xddpi != xrdpi) || (yddpi != yrdpi))) {
 	int temp_format = 
 	    DISPLAY_COLORS_RGB | DISPLAY_ALPHA_NONE | DISPLAY_DEPTH_8 | 
 	    DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST;	/* 24-bit BGR */
 	int grey_format = 
 	    DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE | DISPLAY_DEPTH_8 | 
 	    DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST;	/* 8-bit grey */
-	/* Down scale image */
+	/* Resize image */
 	memset(newimg, 0, sizeof(IMAGE));
 	newimg->width = (unsigned int)(oldimg->width * xddpi / xrdpi + 0.5);
 	newimg->height = (unsigned int)(oldimg->height * yddpi / yrdpi + 0.5);
@@ -1555,7 +3164,7 @@ image_copy_resize(IMAGE *newimg, IMAGE *oldimg, unsigned int format,
 	newimg->image = malloc(newimg->raster * newimg->height);
 	if (newimg->image == NULL)
 	    return -1;
-	if (image_down_scale(newimg, oldimg) != 0) {
+	if (image_resize_filter(newimg, oldimg, filter) != 0) {
 	    /* Conversion failed, so input format probably not OK.
 	     * Convert to RGB and try again.
 	     * Ignore requested format.
@@ -1595,7 +3204,7 @@ image_copy_resize(IMAGE *newimg, IMAGE *oldimg, unsigned int format,
 		return -1;
 	    }
 	    image_copy(&tempimg, oldimg, tempimg.format);
-	    if (image_down_scale(newimg, &tempimg) != 0) {
+	    if (image_resize_filter(newimg, &tempimg, filter) != 0) {
 		/* nothing worked */
 		free(tempimg.image);
 		free(newimg->image);
@@ -1613,52 +3222,269 @@ image_copy_resize(IMAGE *newimg, IMAGE *oldimg, unsigned int format,
 	    return 0;	/* succesfully resized */
 	}
     }
-
-    /* Not resized, or failed resize, so just copy image */
-    return image_copy(newimg, oldimg, format);
+
+    /* Not resized, or failed resize, so just copy image */
+    return image_copy(newimg, oldimg, format);
+}
+
+
+/********************************************************/
+
+
+/* ASCIIHex encode count bytes, writing 2*count characters to text */
+static void
+text_hex(char *text, const unsigned char *buf, int count, BOOL upper)
+{
+    const char *hex = upper ? "0123456789ABCDEF" : "0123456789abcdef";
+    int i = 0;
+#ifdef IMAGE_SSE2
+    const __m128i mask = _mm_set1_epi8(0x0f);
+    const __m128i nine = _mm_set1_epi8(9);
+    const __m128i digit = _mm_set1_epi8('0');
+    const __m128i alpha = 
+	_mm_set1_epi8((char)((upper ? 'A' : 'a') - '0' - 10));
+    __m128i x, hi, lo;
+    for (; i+16 <= count; i+=16) {
+	x = _mm_loadu_si128((const __m128i *)(buf+i));
+	hi = _mm_and_si128(_mm_srli_epi16(x, 4), mask);
+	lo = _mm_and_si128(x, mask);
+	hi = _mm_add_epi8(_mm_add_epi8(hi, digit),
+	    _mm_and_si128(_mm_cmpgt_epi8(hi, nine), alpha));
+	lo = _mm_add_epi8(_mm_add_epi8(lo, digit),
+	    _mm_and_si128(_mm_cmpgt_epi8(lo, nine), alpha));
+	_mm_storeu_si128((__m128i *)(text+2*i), _mm_unpacklo_epi8(hi, lo));
+	_mm_storeu_si128((__m128i *)(text+2*i+16), _mm_unpackhi_epi8(hi, lo));
+    }
+#endif
+    for (; i<count; i++) {
+	text[2*i] = hex[(buf[i]>>4) & 0xf];
+	text[2*i+1] = hex[buf[i] & 0xf];
+    }
+}
+
+/* ASCII85 encode groups of 4 bytes, writing 5 characters
+ * for each group to text, with no 'z' for zero groups.
+ * There may be up to 4 groups.
+ * Returns a bit mask of the groups that are zero.
+ */
+static int
+text_a85_groups(char *text, const unsigned char *buf, int groups)
+{
+    int k;
+    int zero = 0;
+    unsigned int value, q, r;
+    for (k=0; k<groups; k++) {
+	value = ((unsigned int)(buf[0])<<24) + 
+	    ((unsigned int)(buf[1])<<16) + 
+	    ((unsigned int)(buf[2])<<8) + 
+	    (unsigned int)(buf[3]);
+	if (value == 0)
+	    zero |= 1 << k;
+	/* two digits at a time */
+	q = value / (85*85);
+	r = value - q * (85*85);
+	text[3] = a85_pair[r][0];
+	text[4] = a85_pair[r][1];
+	value = q;
+	q = value / (85*85);
+	r = value - q * (85*85);
+	text[1] = a85_pair[r][0];
+	text[2] = a85_pair[r][1];
+	text[0] = (char)(q + '!');
+	text += 5;
+	buf += 4;
+    }
+    return zero;
+}
+
+static void
+text_output(IMAGE_TEXT *t)
+{
+    if (t->count)
+	gfile_write(t->f, t->buf, t->count);
+    t->count = 0;
+}
+
+static void
+text_eol(IMAGE_TEXT *t)
+{
+    int len = (int)strlen(t->eol);
+    memcpy(t->buf+t->count, t->eol, len);
+    t->count += len;
+    t->column = 0;
+    t->started = FALSE;
+}
+
+/* Get ready to write data to the current line.  Starts a new 
+ * line if this one is full, and makes sure the buffer has room 
+ * for the rest of the line.
+ */
+static void
+text_begin(IMAGE_TEXT *t)
+{
+    int len;
+    if (t->count + t->reserve > (int)sizeof(t->buf))
+	text_output(t);
+    if (t->column >= t->width)
+	text_eol(t);
+    if (!t->started) {
+	len = (int)strlen(t->prefix);
+	memcpy(t->buf+t->count, t->prefix, len);
+	t->count += len;
+	t->started = TRUE;
+    }
+}
+
+/* Write ASCII85 groups of 4 bytes */
+static void
+text_a85(IMAGE_TEXT *t, const unsigned char *buf, int groups)
+{
+    char group[20];
+    int full;			/* characters until the line is full */
+    int zero;
+    int j, k, n;
+    char *p, *q;
+    if (groups <= 0)
+	return;
+    text_begin(t);
+    full = t->width - t->column;
+    p = t->buf + t->count;
+    while (groups > 0) {
+	n = min(groups, 4);
+	if ((n == 4) && (full > 15)) {
+	    /* The line can't end before the last of these groups,
+	     * so write them in place then replace any zero groups.
+	     */
+	    zero = text_a85_groups(p, buf, 4);
+	    if (zero == 0) {
+		p += 20;
+		full -= 20;
+	    }
+	    else {
+		q = p;
+		for (k=0; k<4; k++) {
+		    if (zero & (1 << k))
+			*p++ = 'z';
+		    else {
+			for (j=0; j<5; j++)
+			    *p++ = q[j];
+		    }
+		    q += 5;
+		}
+		full -= 20 - (int)(q - p);
+	    }
+	}
+	else {
+	    zero = text_a85_groups(group, buf, n);
+	    for (k=0; k<n; k++) {
+		if (full <= 0) {
+		    t->count = (int)(p - t->buf);
+		    t->column = t->width - full;
+		    text_begin(t);
+		    full = t->width - t->column;
+		    p = t->buf + t->count;
+		}
+		if (zero & (1 << k)) {
+		    *p++ = 'z';
+		    full--;
+		}
+		else {
+		    for (j=0; j<5; j++)
+			*p++ = group[5*k+j];
+		    full -= 5;
+		}
+	    }
+	}
+	buf += 4 * n;
+	groups -= n;
+    }
+    t->count = (int)(p - t->buf);
+    t->column = t->width - full;
 }
 
+void
+image_text_init(IMAGE_TEXT *t, GFile *f, int encoding, int width,
+    const char *prefix, const char *eol)
+{
+    image_convert_ready();
+    memset(t, 0, sizeof(IMAGE_TEXT));
+    t->f = f;
+    t->encoding = encoding;
+    t->width = width;
+    t->prefix = prefix ? prefix : "";
+    t->eol = eol;
+    /* a whole line, which ASCII85 may overrun by 4 characters */
+    t->reserve = (int)(strlen(t->eol) + strlen(t->prefix)) + width + 4;
+}
 
-/********************************************************/
+void
+image_text_write(IMAGE_TEXT *t, const unsigned char *buf, int count)
+{
+    int n;
+    if (t->encoding == IMAGE_TEXT_A85) {
+	if (t->tail_count) {
+	    n = min(count, 4 - t->tail_count);
+	    memcpy(t->tail + t->tail_count, buf, n);
+	    t->tail_count += n;
+	    buf += n;
+	    count -= n;
+	    if (t->tail_count < 4)
+		return;
+	    text_a85(t, t->tail, 1);
+	    t->tail_count = 0;
+	}
+	text_a85(t, buf, count / 4);
+	n = count & ~3;
+	memcpy(t->tail, buf + n, count - n);
+	t->tail_count = count - n;
+    }
+    else {
+	while (count > 0) {
+	    text_begin(t);
+	    n = min(count, (t->width - t->column + 1) / 2);
+	    text_hex(t->buf + t->count, buf, n,
+		t->encoding == IMAGE_TEXT_HEX_UPPER);
+	    t->count += 2 * n;
+	    t->column += 2 * n;
+	    buf += n;
+	    count -= n;
+	}
+    }
+}
 
+void
+image_text_end_line(IMAGE_TEXT *t)
+{
+    if (t->started) {
+	if (t->count + t->reserve > (int)sizeof(t->buf))
+	    text_output(t);
+	text_eol(t);
+    }
+}
 
-/* ASCII85Encode to a character line.
- * Returns the number of characters produced, which can be
- * no more than count+1
- */
-static int 
-a85write(char *line, unsigned char *buf, int count)
+void
+image_text_flush(IMAGE_TEXT *t)
 {
+    char group[5];
     int i;
-    unsigned long value;
-    unsigned char abuf[5];
-    if (count == 0)
-	return 0;
-    if (count < 4) {
-	for (i = count; i < 4; i++)
-	    buf[i] = 0;
-    }
-    if ((count == 4) && 
-	(buf[0] == 0) && (buf[1] == 0) && (buf[2] == 0) && (buf[3] == 0)) {
-	line[0] = 'z';
-	return 1;
+    if (t->count + t->reserve > (int)sizeof(t->buf))
+	text_output(t);
+    if (t->column >= t->width)
+	text_eol(t);
+    if (t->tail_count) {
+	/* A partial group is padded with zeros, and written
+	 * without the padding and never as 'z'.
+	 */
+	for (i=t->tail_count; i<4; i++)
+	    t->tail[i] = 0;
+	text_a85_groups(group, t->tail, 1);
+	text_begin(t);
+	for (i=0; i<t->tail_count+1; i++)
+	    t->buf[t->count++] = group[i];
+	t->column += t->tail_count + 1;
+	t->tail_count = 0;
     }
-    value = ((unsigned int)(buf[0])<<24) + 
-	((unsigned int)(buf[1])<<16) + 
-	((unsigned int)(buf[2])<<8) + 
-	(unsigned int)(buf[3]);
-    abuf[0] = (unsigned char)(value / (85L*85*85*85));
-    value -= abuf[0] * (85L*85*85*85);
-    abuf[1] = (unsigned char)(value / (85L*85*85));
-    value -= abuf[1] * (85L*85*85);
-    abuf[2] = (unsigned char)(value / (85L*85));
-    value -= abuf[2] * (85L*85);
-    abuf[3] = (unsigned char)(value / (85L));
-    value -= abuf[3] * (85L);
-    abuf[4] = (unsigned char)(value);
-    for (i=0; i<count+1; i++)
-	line[i] = (char)(abuf[i]+'!');
-    return count+1;
+    text_output(t);
 }
 
 /* Simple byte RLE, known as PackBits on the Macintosh and
@@ -1786,6 +3612,478 @@ packbits(BYTE *comp, BYTE *raw, int length)
     return (int)(cp - comp);	/* number of code bytes */
 }
 
+/* Decode PackBits.
+ * The input buffer is comp, containing length bytes.
+ * The output buffer is raw, which can hold rawlen bytes.
+ * Returns the number of input bytes used to fill raw,
+ * or -1 if the input is too short.
+ */
+int
+unpackbits(BYTE *raw, int rawlen, const BYTE *comp, int length)
+{
+    const BYTE *cp = comp;
+    const BYTE *cend = comp + length;
+    BYTE *rp = raw;
+    BYTE *rend = raw + rawlen;
+    int n;
+    while (rp < rend) {
+	if (cp >= cend)
+	    return -1;
+	n = *cp++;
+	if (n < 128) {
+	    /* n+1 literal bytes */
+	    n++;
+	    if ((cp + n > cend) || (rp + n > rend))
+		return -1;
+	    memcpy(rp, cp, n);
+	    cp += n;
+	    rp += n;
+	}
+	else if (n > 128) {
+	    /* next byte repeated 257-n times */
+	    n = 257 - n;
+	    if ((cp >= cend) || (rp + n > rend))
+		return -1;
+	    memset(rp, *cp++, n);
+	    rp += n;
+	}
+	/* 128 is a no-op */
+    }
+    return (int)(cp - comp);
+}
+
+#define IMAGE_PACK_MAGIC "EIMG"
+#define IMAGE_PACK_HEADER 20
+
+static void
+image_pack_dword(unsigned char *p, unsigned int val)
+{
+    p[0] = (unsigned char)((val >> 24) & 0xff);
+    p[1] = (unsigned char)((val >> 16) & 0xff);
+    p[2] = (unsigned char)((val >> 8) & 0xff);
+    p[3] = (unsigned char)(val & 0xff);
+}
+
+static unsigned int
+image_unpack_dword(const unsigned char *p)
+{
+    return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) |
+	((unsigned int)p[2] << 8) | (unsigned int)p[3];
+}
+
+/* Write an image to a memory buffer, with each row compressed 
+ * by PackBits.  *pdata is allocated with malloc and must be freed
+ * by the caller.
+ * Returns 0 on success, -1 on error.
+ */
+int
+image_pack(IMAGE *img, unsigned char **pdata, unsigned int *plength)
+{
+    unsigned char *data;
+    unsigned char *p;
+    unsigned int i;
+    unsigned int maxlen;
+    int row;
+    *pdata = NULL;
+    *plength = 0;
+    if ((img->image == NULL) || (img->raster == 0))
+	return_error(-1);
+    maxlen = IMAGE_PACK_HEADER + 
+	img->height * (img->raster + (img->raster + 127) / 128);
+    data = (unsigned char *)malloc(maxlen);
+    if (data == NULL)
+	return_error(-1);
+    memcpy(data, IMAGE_PACK_MAGIC, 4);
+    image_pack_dword(data+4, img->width);
+    image_pack_dword(data+8, img->height);
+    image_pack_dword(data+12, img->raster);
+    image_pack_dword(data+16, img->format);
+    p = data + IMAGE_PACK_HEADER;
+    for (i=0; i<img->height; i++) {
+	row = packbits(p, img->image + i * img->raster, img->raster);
+	p += row;
+    }
+    *pdata = data;
+    *plength = (unsigned int)(p - data);
+    return 0;
+}
+
+/* Read an image written by image_pack.
+ * Returns NULL if the data is not valid.
+ * The image must be freed with bitmap_image_free.
+ */
+IMAGE *
+image_unpack(const unsigned char *data, unsigned int length)
+{
+    IMAGE *img;
+    unsigned int i;
+    int count;
+    unsigned int offset = IMAGE_PACK_HEADER;
+    if ((length < IMAGE_PACK_HEADER) || 
+	(memcmp(data, IMAGE_PACK_MAGIC, 4) != 0))
+	return NULL;
+    img = (IMAGE *)malloc(sizeof(IMAGE));
+    if (img == NULL)
+	return NULL;
+    memset(img, 0, sizeof(IMAGE));
+    img->width = image_unpack_dword(data+4);
+    img->height = image_unpack_dword(data+8);
+    img->raster = image_unpack_dword(data+12);
+    img->format = image_unpack_dword(data+16);
+    /* each row takes at least 2 bytes */
+    if ((img->raster == 0) || (img->height == 0) ||
+	(img->height > (length - offset) / 2)) {
+	free(img);
+	return NULL;
+    }
+    img->image = (unsigned char *)malloc(img->raster * img->height);
+    if (img->image == NULL) {
+	free(img);
+	return NULL;
+    }
+    for (i=0; i<img->height; i++) {
+	count = unpackbits(img->image + i * img->raster, img->raster,
+	    data + offset, length - offset);
+	if (count < 0) {
+	    free(img->image);
+	    free(img);
+	    return NULL;
+	}
+	offset += count;
+    }
+    return img;
+}
+
+
+/* Colours of an image with no more than 256 colours,
+ * written by image_to_eps() with an Indexed colour space.
+ * Colours are found with an open addressing hash table.
+ */
+#define EPS_PALETTE_MAX 256
+#define EPS_PALETTE_HASH_BITS 10
+#define EPS_PALETTE_HASH (1<<EPS_PALETTE_HASH_BITS)
+typedef struct EPS_PALETTE_s {
+    int ncomp;
+    int max;			/* of colours, at most EPS_PALETTE_MAX */
+    int count;			/* of colours */
+    int bits;			/* per index, 1, 2, 4 or 8 */
+    DWORD colour[EPS_PALETTE_MAX];	/* components packed, first lowest */
+    short slot[EPS_PALETTE_HASH];	/* colour index + 1, or 0 if empty */
+} EPS_PALETTE;
+
+static DWORD
+eps_palette_key(const unsigned char *p, int ncomp)
+{
+    DWORD key = p[0];
+    int i;
+    for (i=1; i<ncomp; i++)
+	key |= (DWORD)p[i] << (8*i);
+    return key;
+}
+
+/* Return the hash slot for a colour, which is either empty
+ * or holds the colour.
+ */
+static int
+eps_palette_slot(const EPS_PALETTE *pal, DWORD key)
+{
+    int h = (int)(((key * 2654435761UL) & 0xffffffffUL) >> 
+	(32 - EPS_PALETTE_HASH_BITS));
+    while (pal->slot[h] && (pal->colour[pal->slot[h]-1] != key))
+	h = (h + 1) & (EPS_PALETTE_HASH - 1);
+    return h;
+}
+
+/* Add the colours of a row of width pixels to the palette.
+ * Returns -1 if there are now too many colours.
+ */
+static int
+eps_palette_add_row(EPS_PALETTE *pal, const unsigned char *row, int width)
+{
+    int ncomp = pal->ncomp;
+    DWORD key;
+    DWORD last = 0;
+    int x, h;
+    for (x=0; x<width; x++, row += ncomp) {
+	key = eps_palette_key(row, ncomp);
+	if ((x > 0) && (key == last))
+	    continue;	/* runs of one colour are common */
+	last = key;
+	h = eps_palette_slot(pal, key);
+	if (pal->slot[h] == 0) {
+	    if (pal->count == pal->max)
+		return -1;
+	    pal->colour[pal->count++] = key;
+	    pal->slot[h] = (short)pal->count;
+	}
+    }
+    return 0;
+}
+
+/* Replace a row of width pixels with their colour indices,
+ * packed with the first pixel in the most significant bits.
+ * This is done in place, since the indices are never longer
+ * than the pixels.
+ */
+static void
+eps_palette_index_row(const EPS_PALETTE *pal, unsigned char *row, int width)
+{
+    const unsigned char *p = row;
+    unsigned char *q = row;
+    int ncomp = pal->ncomp;
+    int bits = pal->bits;
+    int index = 0;
+    int acc = 0;
+    int nbits = 0;
+    DWORD key;
+    DWORD last = 0;
+    int x;
+    for (x=0; x<width; x++, p += ncomp) {
+	key = eps_palette_key(p, ncomp);
+	if ((x == 0) || (key != last)) {
+	    index = pal->slot[eps_palette_slot(pal, key)] - 1;
+	    last = key;
+	}
+	acc = (acc << bits) | index;
+	nbits += bits;
+	if (nbits == 8) {
+	    *q++ = (unsigned char)acc;
+	    acc = 0;
+	    nbits = 0;
+	}
+    }
+    if (nbits)
+	*q = (unsigned char)(acc << (8 - nbits));
+}
+
+/* Rows of an image in the order and layout written by image_to_eps() */
+typedef struct EPS_ROWS_s {
+    IMAGE *img;
+    IMAGE_CONVERT *cv;		/* to 24RGB, or NULL */
+    unsigned char *rows;	/* prepared rows */
+    int y0;			/* output row of rows[0] */
+    int ncomp;
+    int compwidth;
+    BOOL topfirst;
+    BOOL bigendian;
+    BOOL separate;
+    EPS_PALETTE *palette;	/* write colour indices, or NULL */
+} EPS_ROWS;
+
+#define EPS_BAND_ROWS 8
+
+/* Prepare rows first to last-1 of e->rows */
+static int
+eps_rows_band(void *arg, int first, int last)
+{
+    EPS_ROWS *e = (EPS_ROWS *)arg;
+    IMAGE *img = e->img;
+    IMAGE_CONVERT cv;
+    int ncomp = e->ncomp;
+    int compwidth = e->compwidth;
+    int rowbytes = compwidth * ncomp;
+    unsigned char *convert_row = NULL;
+    unsigned char *row;
+    unsigned char *packin;
+    int packin_count;
+    int x, y, i;
+
+    if (e->cv != NULL) {
+	if (convert_band_begin(&cv, e->cv) != 0)
+	    return -1;
+	convert_row = (unsigned char *)malloc(rowbytes);
+	if (convert_row == NULL) {
+	    convert_band_end(&cv);
+	    return -1;
+	}
+    }
+    for (y=first; y<last; y++) {
+        row = img->image + img->raster * 
+	    (e->topfirst ? e->y0 + y : ((int)img->height - e->y0 - y - 1));
+	if (convert_row != NULL) {
+	    cv.row(&cv, convert_row, row);
+	    row = convert_row;
+	}
+	packin = e->rows + y * rowbytes;
+	packin_count = 0;
+	if (e->separate) {
+	    if (e->bigendian) {
+		for (i=0; i<ncomp; i++)
+		    for (x=0; x<compwidth; x++)
+			packin[packin_count++] = row[x*ncomp+i];
+	    }
+	    else {
+		for (i=ncomp-1; i>=0; i--)
+		    for (x=0; x<compwidth; x++)
+			packin[packin_count++] = row[x*ncomp+i];
+	    }
+	}
+	else if (e->bigendian || (ncomp == 1)) {
+	    memcpy(packin, row, rowbytes);
+	}
+	else {
+	    for (x=0; x<compwidth; x++) {
+		for (i=ncomp-1; i>=0; i--)
+		    packin[packin_count++] = row[x*ncomp+i];
+	    }
+	}
+	if (e->palette != NULL)
+	    eps_palette_index_row(e->palette, packin, img->width);
+    }
+    if (convert_row != NULL) {
+	free(convert_row);
+	convert_band_end(&cv);
+    }
+    return 0;
+}
+
+/* Count the colours of an image, preparing rows as image_to_eps()
+ * in chunks of chunk_rows.
+ * Returns 0 if pal holds all the colours, 1 if there are more
+ * than max, or -1 on error.
+ * The scan stops as soon as there are more than max colours,
+ * so most images with too many are found in the first chunk.
+ */
+static int
+eps_palette_scan(EPS_ROWS *e, EPS_PALETTE *pal, int max, int chunk_rows)
+{
+    int height = (int)e->img->height;
+    int rowbytes = e->compwidth * e->ncomp;
+    int y, i, n;
+    memset(pal, 0, sizeof(EPS_PALETTE));
+    pal->ncomp = e->ncomp;
+    pal->max = min(max, EPS_PALETTE_MAX);
+    for (y=0; y<height; y+=chunk_rows) {
+	n = min(chunk_rows, height - y);
+	e->y0 = y;
+	if (pool_for(n, EPS_BAND_ROWS, eps_rows_band, e) != 0)
+	    return -1;
+	for (i=0; i<n; i++) {
+	    if (eps_palette_add_row(pal, e->rows + i * rowbytes, 
+		(int)e->img->width) != 0)
+		return 1;
+	}
+    }
+    if (pal->count <= 2)
+	pal->bits = 1;
+    else if (pal->count <= 4)
+	pal->bits = 2;
+    else if (pal->count <= 16)
+	pal->bits = 4;
+    else
+	pal->bits = 8;
+    return 0;
+}
+
+/* Bands of EPS_BAND_ROWS rows sampled for IMAGE_COMPRESS_AUTO */
+#define EPS_SAMPLE_BANDS 16
+
+/* Compress rows with RLE, LZW and Flate without writing them,
+ * and return the count of bytes for each.
+ * Each call continues the same LZW and Flate streams,
+ * and count = 0 ends them.
+ */
+typedef struct EPS_ESTIMATE_s {
+    long size[IMAGE_COMPRESS_FLATE+1];
+    lzw_state_t *lzw;
+    flate_state_t *flate;	/* NULL if zlib isn't available */
+    unsigned char *buf;		/* for the discarded output */
+    int buf_len;
+} EPS_ESTIMATE;
+
+static int
+eps_estimate_rows(EPS_ESTIMATE *est, unsigned char *in, int count)
+{
+    int inused = 0;
+    int inlen, outlen;
+    int code = 0;
+    if (count > 0) {
+	est->size[IMAGE_COMPRESS_NONE] += count;
+	est->size[IMAGE_COMPRESS_RLE] += packbits(est->buf, in, count);
+    }
+    do {
+	inlen = count - inused;
+	outlen = est->buf_len;
+	lzw_compress(est->lzw, in + inused, &inlen, est->buf, &outlen);
+	inused += inlen;
+	est->size[IMAGE_COMPRESS_LZW] += outlen;
+    } while (inused < count);
+    if (est->flate == NULL)
+	return 0;
+    inused = 0;
+    do {
+	inlen = count - inused;
+	outlen = est->buf_len;
+	code = flate_compress(est->flate, in + inused, &inlen, 
+	    est->buf, &outlen);
+	if (code < 0)
+	    return -1;
+	inused += inlen;
+	est->size[IMAGE_COMPRESS_FLATE] += outlen;
+    } while ((count != 0) ? (inused < count) : (code == 1));
+    return 0;
+}
+
+/* Choose the compression for IMAGE_COMPRESS_AUTO, by compressing
+ * bands of rows spread through the image.  Rows are prepared as 
+ * for image_to_eps(), and each has count bytes.
+ * buf of buf_len bytes must hold the RLE of a row.
+ * Returns the compression, or -1 on error.
+ */
+static int
+eps_choose_compress(EPS_ROWS *e, int count, unsigned char *buf, int buf_len,
+    int flate_level)
+{
+    int height = (int)e->img->height;
+    int rowbytes = e->compwidth * e->ncomp;
+    int nbands;
+    int band, y, i, n;
+    int compress = IMAGE_COMPRESS_NONE;
+    int code = 0;
+    EPS_ESTIMATE est;
+
+    memset(&est, 0, sizeof(est));
+    est.buf = buf;
+    est.buf_len = buf_len;
+    est.lzw = lzw_new();
+    if (est.lzw == (lzw_state_t *)NULL)
+	return -1;
+    if (flate_available()) {
+	est.flate = flate_new(flate_level);
+	if (est.flate == (flate_state_t *)NULL) {
+	    lzw_free(est.lzw);
+	    return -1;
+	}
+    }
+
+    nbands = (height + EPS_BAND_ROWS - 1) / EPS_BAND_ROWS;
+    if (nbands > EPS_SAMPLE_BANDS)
+	nbands = EPS_SAMPLE_BANDS;
+    for (band = 0; (band < nbands) && (code == 0); band++) {
+	if (nbands < EPS_SAMPLE_BANDS)
+	    y = band * EPS_BAND_ROWS;	/* the whole image */
+	else
+	    y = (int)((double)(height - EPS_BAND_ROWS) * band / (nbands - 1));
+	n = min(EPS_BAND_ROWS, height - y);
+	e->y0 = y;
+	code = pool_for(n, EPS_BAND_ROWS, eps_rows_band, e);
+	for (i=0; (i<n) && (code == 0); i++)
+	    code = eps_estimate_rows(&est, e->rows + i * rowbytes, count);
+    }
+    if (code == 0)
+	code = eps_estimate_rows(&est, NULL, 0);	/* end of data */
+    if (code == 0) {
+	for (i = IMAGE_COMPRESS_RLE; i <= IMAGE_COMPRESS_FLATE; i++) {
+	    if ((i == IMAGE_COMPRESS_FLATE) && (est.flate == NULL))
+		break;
+	    if (est.size[i] < est.size[compress])
+		compress = i;
+	}
+    }
+    lzw_free(est.lzw);
+    flate_free(est.flate);
+    return (code == 0) ? compress : -1;
+}
 
 /* Write an image as an EPS file.
  * Currently we support 8bits/component RGB or CMYK without conversion,
@@ -1794,33 +4092,51 @@ packbits(BYTE *comp, BYTE *raw, int length)
  * and a number of other formats by conversion to 24RGB.
  * Output can be ASCII85 or ASCIIHex encoded, and can be
  * compressed with RunLengthEncode.
+ * IMAGE_COMPRESS_CCITT writes 1 bit grey or native images as an
+ * imagemask, painting only the black pixels, and other images
+ * with LZW.
+ * 8 bit images with few colours are written with an Indexed
+ * colour space and 1, 2, 4 or 8 bits for each pixel,
+ * when this is smaller.
+ * IMAGE_COMPRESS_AUTO uses the smallest of none, RLE, LZW and
+ * Flate (if available) for a sample of rows, and the choice is
+ * returned in *pcompress if pcompress isn't NULL.
+ * Flate uses flate_level, from 0 to 9.
  */
 int 
 image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
-    float fllx, float flly, float furx, float fury, int use_a85, int compress)
+    float fllx, float flly, float furx, float fury, int use_a85, int compress,
+    int flate_level, int *pcompress)
 {
-    int x, y;
+    int y;
     int topfirst;
     int bigendian;
     int hires_bbox_valid = 1;
-    unsigned char *row;
     int i;
     int ncomp;			/* number of components per source pixel */
-    int count = 0;
-    const char hex[] = "0123456789abcdef";
     unsigned char *packin;
+    unsigned char *rows;	/* a chunk of prepared rows */
+    int chunk_rows;
     unsigned char *packout;
     int packin_count;
     int packout_count;
     int packout_len;
+    int rowbytes;		/* of each prepared row */
     int separate = 0;		/* Write components separately */
     int depth;
     int compwidth;		/* width of one row of one component in bytes */
     BOOL convert = FALSE;	/* convert to RGB24 */
     BOOL invert = FALSE;	/* black=0 for FALSE, black=1 for TRUE */
-    unsigned char *convert_row = NULL;
+    BOOL mask = FALSE;		/* write with imagemask */
+    BOOL indexed = FALSE;	/* write colour indices */
+    EPS_PALETTE palette;
+    IMAGE_CONVERT *cv = NULL;
+    EPS_ROWS e;
     char buf[MAXSTR];
+    IMAGE_TEXT text;
     lzw_state_t *lzw = NULL;
+    flate_state_t *flate = NULL;
+    fax_state_t *fax = NULL;
 
     if ((fllx >= furx) || (flly >= fury))
 	hires_bbox_valid = 0;
@@ -1871,30 +4187,102 @@ image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
     else
 	return -1;
 
-    packin = (unsigned char *)malloc(compwidth * ncomp);
-    if (packin == NULL)
+    if (compress == IMAGE_COMPRESS_CCITT) {
+	if ((depth == 1) && (ncomp == 1))
+	    mask = TRUE;
+	else
+	    compress = IMAGE_COMPRESS_LZW;
+    }
+
+    /* Rows are prepared in chunks, by several threads if available,
+     * then compressed and encoded in order.
+     */
+    chunk_rows = EPS_BAND_ROWS * 2 * pool_threads();
+    rowbytes = compwidth * ncomp;
+    rows = (unsigned char *)malloc(chunk_rows * rowbytes);
+    if (rows == NULL)
 	return -1;
     packout_len = compwidth * ncomp * 5 / 4 + 4;
+    if (mask)
+	packout_len = max(packout_len, FAX_MAX_ROW((int)img->width));
     packout = (unsigned char *)malloc(packout_len);
     if (packout == NULL) {
-	free(packin);
+	free(rows);
 	return -1;
     }
     if (convert) {
-	convert_row = (unsigned char *)malloc(compwidth * ncomp);
-	if (convert_row == NULL) {
-	    free(packin);
+	cv = image_convert_new(img, IMAGE_CONVERT_24RGB);
+	if (cv == NULL) {
+	    free(rows);
+	    free(packout);
+	    return -1;
+	}
+    }
+    memset(&e, 0, sizeof(e));
+    e.img = img;
+    e.cv = cv;
+    e.rows = rows;
+    e.ncomp = ncomp;
+    e.compwidth = compwidth;
+    e.topfirst = topfirst;
+    e.bigendian = bigendian;
+    if (depth == 8) {
+	/* Use an Indexed colour space if the indices are smaller.
+	 * For grey that needs no more than 16 colours.
+	 */
+	i = eps_palette_scan(&e, &palette, (ncomp == 1) ? 16 : 256,
+	    chunk_rows);
+	if (i < 0) {
+	    free(rows);
+	    free(packout);
+	    image_convert_free(cv);
+	    return -1;
+	}
+	indexed = (i == 0) && (palette.bits < 8 * ncomp);
+    }
+    if (indexed) {
+	e.palette = &palette;
+	packin_count = ((int)img->width * palette.bits + 7) >> 3;
+    }
+    else
+	packin_count = rowbytes;
+    if (compress == IMAGE_COMPRESS_AUTO) {
+	/* Compressed components are written separately, see below */
+	e.separate = (ncomp > 1) && !indexed;
+	compress = eps_choose_compress(&e, packin_count, 
+	    packout, packout_len, flate_level);
+	if (compress < 0) {
+	    free(rows);
 	    free(packout);
+	    image_convert_free(cv);
 	    return -1;
 	}
     }
+    if (pcompress != NULL)
+	*pcompress = compress;
     if (compress == IMAGE_COMPRESS_LZW) {
 	lzw = lzw_new();
 	if (lzw == (lzw_state_t *)NULL) {
-	    free(packin);
+	    free(rows);
+	    free(packout);
+	    image_convert_free(cv);
+	    return -1;
+	}
+    }
+    else if (compress == IMAGE_COMPRESS_FLATE) {
+	flate = flate_new(flate_level);
+	if (flate == (flate_state_t *)NULL) {
+	    free(rows);
+	    free(packout);
+	    image_convert_free(cv);
+	    return -1;
+	}
+    }
+    else if (compress == IMAGE_COMPRESS_CCITT) {
+	fax = fax_new((int)img->width);
+	if (fax == (fax_state_t *)NULL) {
+	    free(rows);
 	    free(packout);
- 	    if (convert_row)
-	        free(convert_row);
 	    return -1;
 	}
     }
@@ -1908,6 +4296,8 @@ image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
 	    fllx, flly, furx, fury);
         gfile_puts(f, buf);
     }
+    if (compress == IMAGE_COMPRESS_FLATE)
+	gfile_puts(f, "%%LanguageLevel: 3\n");
     gfile_puts(f, "%%Pages: 1\n");
     gfile_puts(f, "%%EndComments\n");
     gfile_puts(f, "%%Page: 1 1\n");
@@ -1924,13 +4314,32 @@ image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
 	snprintf(buf, sizeof(buf)-1,  "%d %d scale\n", urx - llx, ury - lly);
         gfile_puts(f, buf);
     }
-    if (ncomp == 1)
+    if (indexed) {
+	/* Lookup table has components in the order written */
+	unsigned char lookup[4];
+	int j;
+	snprintf(buf, sizeof(buf)-1, "[/Indexed %s %d <\n", 
+	    (ncomp == 1) ? "/DeviceGray" : 
+	    ((ncomp == 3) ? "/DeviceRGB" : "/DeviceCMYK"),
+	    palette.count - 1);
+        gfile_puts(f, buf);
+	image_text_init(&text, f, IMAGE_TEXT_HEX, 70, NULL, "\n");
+	for (i=0; i<palette.count; i++) {
+	    for (j=0; j<ncomp; j++)
+		lookup[j] = (unsigned char)(palette.colour[i] >> (8*j));
+	    image_text_write(&text, lookup, ncomp);
+	}
+	image_text_end_line(&text);
+	image_text_flush(&text);
+	gfile_puts(f, ">] setcolorspace\n");
+    }
+    else if (ncomp == 1)
         gfile_puts(f, "/DeviceGray setcolorspace\n");
     else if (ncomp == 3)
         gfile_puts(f, "/DeviceRGB setcolorspace\n");
     else if (ncomp == 4)
         gfile_puts(f, "/DeviceCMYK setcolorspace\n");
-    if ((ncomp > 1) && (compress != IMAGE_COMPRESS_NONE)) {
+    if ((ncomp > 1) && !indexed && (compress != IMAGE_COMPRESS_NONE)) {
 	/* Include as RRRRGGGGBBBB not RGBRGBRGBRGB
 	 * (or CCCCMMMMYYYYKKKK not CMYKCMYKCMYKCMYK)
 	 * Since this compresses with RLE better.
@@ -1948,6 +4357,8 @@ image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
 	    gfile_puts(f, " /LZWDecode filter");
 	else if (compress == IMAGE_COMPRESS_RLE)
 	    gfile_puts(f, " /RunLengthDecode filter");
+	else if (compress == IMAGE_COMPRESS_FLATE)
+	    gfile_puts(f, " /FlateDecode filter");
 	gfile_puts(f, " def\n");
 	for (i=0; i<ncomp; i++) {
 	    snprintf(buf, sizeof(buf)-1, 
@@ -1960,14 +4371,21 @@ image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
     gfile_puts(f, buf);
     snprintf(buf, sizeof(buf)-1, " /Height %d\n", img->height);
     gfile_puts(f, buf);
-    snprintf(buf, sizeof(buf)-1, " /BitsPerComponent %d\n", depth);
+    snprintf(buf, sizeof(buf)-1, " /BitsPerComponent %d\n", 
+	indexed ? palette.bits : depth);
     gfile_puts(f, buf);
     gfile_puts(f, " /Decode [ ");
-    for (i=0; i<ncomp; i++) {
-	if (invert)
-	    gfile_puts(f, "1 0 ");
-	else
-            gfile_puts(f, "0 1 ");
+    if (indexed) {
+	snprintf(buf, sizeof(buf)-1, "0 %d ", (1 << palette.bits) - 1);
+	gfile_puts(f, buf);
+    }
+    else {
+	for (i=0; i<ncomp; i++) {
+	    if (invert || mask)
+		gfile_puts(f, "1 0 ");
+	    else
+		gfile_puts(f, "0 1 ");
+	}
     }
     gfile_puts(f, "]\n");
     snprintf(buf, sizeof(buf)-1, " /ImageMatrix [%d 0 0 %d 0 %d]\n",
@@ -1992,55 +4410,92 @@ image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
 	    gfile_puts(f, " /LZWDecode filter\n");
 	else if (compress == IMAGE_COMPRESS_RLE)
 	    gfile_puts(f, " /RunLengthDecode filter\n");
+	else if (compress == IMAGE_COMPRESS_FLATE)
+	    gfile_puts(f, " /FlateDecode filter\n");
+	else if (compress == IMAGE_COMPRESS_CCITT) {
+	    /* Group 4, with black=1 after the decode */
+	    snprintf(buf, sizeof(buf)-1, 
+		" << /K -1 /Columns %d /Rows %d /BlackIs1 true >>"
+		" /CCITTFaxDecode filter\n", 
+		img->width, img->height);
+	    gfile_puts(f, buf);
+	}
     }
-    gfile_puts(f, ">>\nimage\n");
-    count = 0;
+    if (mask)
+	gfile_puts(f, ">>\nimagemask\n");
+    else
+	gfile_puts(f, ">>\nimage\n");
+    e.separate = separate;
+    image_text_init(&text, f, use_a85 ? IMAGE_TEXT_A85 : IMAGE_TEXT_HEX,
+	70, NULL, "\n");
     packout_count = 0;
     for (y=0; y<(int)img->height; y++) {
-        row = img->image + img->raster * 
-	    (topfirst != 0 ? y : ((int)img->height - y - 1));
-	if (convert) {
-	    image_to_24RGB(img, convert_row, row);
-	    row = convert_row;
+	if ((y % chunk_rows) == 0) {
+	    e.y0 = y;
+	    if (pool_for(min(chunk_rows, (int)img->height - y), 
+		EPS_BAND_ROWS, eps_rows_band, &e) != 0)
+		break;
 	}
-	packin_count = 0;
-	if (separate) {
-	    if (bigendian) {
-		for (i=0; i<ncomp; i++)
-		    for (x=0; x<compwidth; x++)
-			packin[packin_count++] = row[x*ncomp+i];
+	packin = rows + (y % chunk_rows) * rowbytes;
+	if (compress == IMAGE_COMPRESS_LZW) {
+	    int inused = 0;
+	    int inlen, outlen;
+	    while (inused < packin_count) {
+		/* LZW can expand, so the row may need several calls */
+		inlen = packin_count - inused;
+		outlen = packout_len;
+		lzw_compress(lzw, packin+inused, &inlen, packout, &outlen);
+		inused += inlen;
+		image_text_write(&text, packout, outlen);
 	    }
-	    else {
-		for (i=ncomp-1; i>=0; i--)
-		    for (x=0; x<compwidth; x++)
-			packin[packin_count++] = row[x*ncomp+i];
+	    if (y == (int)img->height-1) {
+		/* This is the last row */
+		/* Flush and EOD */
+		inlen = 0;	/* EOD */
+		outlen = packout_len;
+		lzw_compress(lzw, packin, &inlen, packout, &outlen);
+		packout_count = outlen;
 	    }
 	}
-	else {
-	    for (x=0; x<compwidth; x++) {
-		if (bigendian) {
-		    for (i=0; i<ncomp; i++)
-			packin[packin_count++] = row[x*ncomp+i];
-		}
-		else {
-		    for (i=ncomp-1; i>=0; i--)
-			packin[packin_count++] = row[x*ncomp+i];
-		}
+	else if (compress == IMAGE_COMPRESS_FLATE) {
+	    int inused = 0;
+	    int inlen, outlen;
+	    while (inused < packin_count) {
+		inlen = packin_count - inused;
+		outlen = packout_len;
+		if (flate_compress(flate, packin+inused, &inlen, 
+		    packout, &outlen) < 0)
+		    break;
+		inused += inlen;
+		image_text_write(&text, packout, outlen);
+	    }
+	    if (inused < packin_count)
+		break;
+	    if (y == (int)img->height-1) {
+		/* This is the last row */
+		int code;
+		do {
+		    inlen = 0;	/* EOD */
+		    outlen = packout_len;
+		    code = flate_compress(flate, packin, &inlen, 
+			packout, &outlen);
+		    image_text_write(&text, packout, outlen);
+		} while (code == 1);
+		if (code < 0)
+		    break;
 	    }
 	}
-	if (compress == IMAGE_COMPRESS_LZW) {
-	    int inlen = packin_count;
-	    int outlen = packout_len - packout_count;
-	    lzw_compress(lzw, packin, &inlen, packout+packout_count, &outlen);
-	    packout_count += outlen;
+	else if (compress == IMAGE_COMPRESS_CCITT) {
+	    if (!invert) {
+		/* grey has black=0, Group 4 wants black=1 */
+		for (i=0; i<packin_count; i++)
+		    packin[i] = (unsigned char)~packin[i];
+	    }
+	    packout_count = fax_encode_row(fax, packin, packout);
 	    if (y == (int)img->height-1) {
 		/* This is the last row */
-		/* Flush and EOD */
-		inlen = 0;	/* EOD */
-		outlen = packout_len - packout_count;
-		lzw_compress(lzw, packin, &inlen, packout+packout_count, 
-		    &outlen);
-		packout_count += outlen;
+		image_text_write(&text, packout, packout_count);
+		packout_count = fax_finish(fax, packout);
 	    }
 	}
 	else if (compress == IMAGE_COMPRESS_RLE) {
@@ -2051,52 +4506,26 @@ image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
 	    memcpy(packout+packout_count, packin, packin_count);
 	    packout_count += packin_count;
 	}
-	for (i=0; i<packout_count; i++) {
-	    if (use_a85) {
-		if (packout_count-i < 4)
-		    break;
-		else
-		    count += a85write(buf+count, packout+i, 4);
-		i += 3;
-	    }
-	    else {
-		buf[count++] = hex[(packout[i]>>4) & 0xf];
-		buf[count++] = hex[packout[i] & 0xf];
-	    }
-	    if (count >= 70) {
-		buf[count++] = '\n';
-		gfile_write(f, buf, count);
-		count = 0;
-	    }
-	    
-	}
-	if (packout_count-i > 0)
-	    memmove(packout, packout+i, packout_count-i);
-	packout_count -= i;
-    }
-    if (use_a85) {
-	if (packout_count)
-	    count += a85write(buf+count, packout, packout_count);
-	buf[count++] = '~';
-	buf[count++] = '>';
-	buf[count++] = '\n';
-    }
-    else {
-	buf[count++] = '>';
-	buf[count++] = '\n';
+	image_text_write(&text, packout, packout_count);
+	packout_count = 0;
     }
-    gfile_write(f, buf, count);
+    image_text_flush(&text);
+    if (use_a85)
+	gfile_puts(f, "~>\n");
+    else
+	gfile_puts(f, ">\n");
     gfile_puts(f, "grestore\n");
     gfile_puts(f, "showpage\n");
     gfile_puts(f, "%%Trailer\n");
     gfile_puts(f, "%%EOF\n");
     if (lzw)
 	lzw_free(lzw);
-    if (convert)
-	free(convert_row);
-    free(packin);
+    flate_free(flate);
+    fax_free(fax);
+    image_convert_free(cv);
+    free(rows);
     free(packout);
-    return 0;
+    return (y < (int)img->height) ? -1 : 0;
 }
 
 int 
@@ -2117,7 +4546,7 @@ image_to_epsfile(IMAGE *img, LPCTSTR filename, float xdpi, float ydpi)
 
     code = image_to_eps(f, img, 0, 0, width, height, 
 	0.0, 0.0, (float)width, (float)height,
-	TRUE, IMAGE_COMPRESS_LZW);
+	TRUE, IMAGE_COMPRESS_LZW, FLATE_LEVEL_DEFAULT, NULL);
 
     gfile_close(f);
     return code;
@@ -67,9 +67,17 @@ int image_platform_finish(IMAGE *img);
 unsigned int image_platform_format(unsigned int format);
 
 /* platform independent */
+/* Prepare the row converters.  This is done by the first
+ * conversion, but should be called before starting threads.
+ */
+void image_convert_init(void);
 int image_copy(IMAGE *newimg, IMAGE *oldimg, unsigned int format);
+/* filter parameter */
+#define IMAGE_RESIZE_BOX 0
+#define IMAGE_RESIZE_BILINEAR 1
+#define IMAGE_RESIZE_LANCZOS3 2
 int image_copy_resize(IMAGE *newimg, IMAGE *oldimg, unsigned int format,
-    float xddpi, float yddpi, float xrdpi, float yrdpi);
+    float xddpi, float yddpi, float xrdpi, float yrdpi, int filter);
 unsigned char colour_to_grey(unsigned char r, unsigned char g, 
     unsigned char b);
 void image_colour(unsigned int format, int index, 
@@ -77,6 +85,9 @@ void image_colour(unsigned int format, int index,
 int image_depth(IMAGE *img);
 
 int image_to_mono(IMAGE *img, unsigned char *dest, unsigned char *source);
+void image_invert_bits(unsigned char *dest, const unsigned char *source, 
+    int count);
+void image_shift_bits(unsigned char *bits, int bwidth, int offset);
 
 int image_to_grey(IMAGE *img, unsigned char *dest, unsigned char *source);
 void image_1grey_to_8grey(int width, unsigned char *dest, unsigned char *source);
@@ -111,9 +122,38 @@ void image_16RGB555_to_24RGB(int width, unsigned char *dest, unsigned char *sour
 void image_16BGR565_to_24RGB(int width, unsigned char *dest, unsigned char *source);
 void image_16BGR555_to_24RGB(int width, unsigned char *dest, unsigned char *source);
 
+/* Converter plans.
+ * Decide once how to convert rows of img to dest, which is one
+ * of IMAGE_CONVERT_*, then convert each row with image_convert_row().
+ * Returns NULL if the format is not supported.
+ */
+#define IMAGE_CONVERT_MONO 1	/* 1-bit, 0=white, 1=black */
+#define IMAGE_CONVERT_GREY 2	/* 8-bit grey */
+#define IMAGE_CONVERT_24RGB 3
+#define IMAGE_CONVERT_24BGR 4
+typedef struct IMAGE_CONVERT_s IMAGE_CONVERT;
+IMAGE_CONVERT *image_convert_new(IMAGE *img, int dest);
+void image_convert_row(IMAGE_CONVERT *cv, unsigned char *dest,
+    unsigned char *source);
+/* Convert rows, in bands which may run in several threads.
+ * Row y is at dest + y * dest_raster and source + y * source_raster,
+ * so a negative raster reverses the row order.
+ * Returns 0 on success, -1 on error.
+ */
+int image_convert_rows(IMAGE_CONVERT *cv, unsigned char *dest,
+    long dest_raster, unsigned char *source, long source_raster, int rows);
+void image_convert_free(IMAGE_CONVERT *cv);
+
+int image_marked_bbox(IMAGE *img, int *pllx, int *plly, int *purx, int *pury);
+int image_crop(IMAGE *img, int llx, int lly, int urx, int ury);
 int image_merge_cmyk(IMAGE *img, IMAGE *layer, float cyan, float magenta,
    float yellow, float black);
 int image_down_scale(IMAGE *newimg, IMAGE *oldimg);
+typedef struct IMAGE_SCALER_s IMAGE_SCALER;
+IMAGE_SCALER *image_scaler_new(IMAGE *newimg, IMAGE *oldimg);
+int image_scaler_row(IMAGE_SCALER *s, const unsigned char *row_in);
+int image_scaler_finish(IMAGE_SCALER *s);
+int image_resize(IMAGE *newimg, IMAGE *oldimg, int filter);
 /* use_85 parameter */
 #define IMAGE_ENCODE_HEX 0
 #define IMAGE_ENCODE_ASCII85 1
@@ -121,7 +161,52 @@ int image_down_scale(IMAGE *newimg, IMAGE *oldimg);
 #define IMAGE_COMPRESS_NONE 0
 #define IMAGE_COMPRESS_RLE 1
 #define IMAGE_COMPRESS_LZW 2
+#define IMAGE_COMPRESS_FLATE 3	/* needs zlib, and LanguageLevel 3 */
+#define IMAGE_COMPRESS_CCITT 4	/* Group 4 imagemask, 1 bit images only */
+#define IMAGE_COMPRESS_AUTO 5	/* smallest of NONE, RLE, LZW, FLATE */
+
+/* Write binary data as lines of text.
+ * Lines have up to width characters of data, or up to width+4 for
+ * ASCII85, which only breaks lines between groups of 5 characters.
+ * Each line starts with prefix and ends with eol.  A new line
+ * is started when data is written to a full line.
+ */
+#define IMAGE_TEXT_HEX 0	/* ASCIIHex, lower case */
+#define IMAGE_TEXT_HEX_UPPER 1	/* ASCIIHex, upper case */
+#define IMAGE_TEXT_A85 2	/* ASCII85 */
+typedef struct IMAGE_TEXT_s {
+    GFile *f;
+    int encoding;
+    int width;			/* characters of data per line */
+    const char *prefix;		/* start of each line */
+    const char *eol;		/* end of each line */
+    int reserve;		/* buffer space for a whole line */
+    int column;			/* characters of data on this line */
+    BOOL started;		/* prefix has been written */
+    unsigned char tail[4];	/* ASCII85 bytes not yet encoded */
+    int tail_count;
+    int count;			/* characters in buf */
+    char buf[4096];
+} IMAGE_TEXT;
+void image_text_init(IMAGE_TEXT *t, GFile *f, int encoding, int width,
+    const char *prefix, const char *eol);
+void image_text_write(IMAGE_TEXT *t, const unsigned char *buf, int count);
+/* End the current line, if anything has been written to it */
+void image_text_end_line(IMAGE_TEXT *t);
+/* End a full line, write any partial ASCII85 group,
+ * then write the buffered text to the file.
+ */
+void image_text_flush(IMAGE_TEXT *t);
+
+/* flate_level is 0 to 9, used for IMAGE_COMPRESS_FLATE and AUTO.
+ * If pcompress isn't NULL, it is set to the compression used,
+ * which is the choice made for IMAGE_COMPRESS_AUTO.
+ */
 int image_to_eps(GFile *f, IMAGE *img, int llx, int lly, int urx, int ury,
-    float fllx, float flly, float furx, float fury, int use_a85, int compress);
+    float fllx, float flly, float furx, float fury, int use_a85, int compress,
+    int flate_level, int *pcompress);
 int image_to_epsfile(IMAGE *img, LPCTSTR filename, float xdpi, float ydpi);
 int packbits(BYTE *comp, BYTE *raw, int length);
+int unpackbits(BYTE *raw, int rawlen, const BYTE *comp, int length);
+int image_pack(IMAGE *img, unsigned char **pdata, unsigned int *plength);
+IMAGE *image_unpack(const unsigned char *data, unsigned int length);
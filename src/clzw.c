@@ -24,25 +24,31 @@
  * PostScript LZWDecode filter.
  */
 
-#define LZW_HASH_SIZE 5021
+#define LZW_HASH_BITS 13
+#define LZW_HASH_SIZE (1<<LZW_HASH_BITS)	/* at least twice LZW_MAX */
 #define LZW_MAX 4094
 #define LZW_RESET 256
 #define LZW_EOD 257
 #define LZW_FIRST 258
 
-typedef struct lzw_code_s {
-    short code;
-    short base_code;
-    unsigned char ch;
-} lzw_code_t;
+/* A table entry is in use if its key has the current generation,
+ * so the table is emptied by changing the generation.
+ * Keys are kept apart from codes so that the keys, which are read
+ * for every input byte, fit in a small data cache.
+ */
+#define LZW_GENERATION_SHIFT 20
+#define LZW_GENERATION_MAX 4095
+#define LZW_KEY_MASK ((1U << LZW_GENERATION_SHIFT) - 1)
 
 struct lzw_state_s {
     short next_code;
     short lzwstr;
-    lzw_code_t table[LZW_HASH_SIZE];
+    unsigned int key[LZW_HASH_SIZE];	/* generation << 20 | code << 8 | ch */
+    short code[LZW_HASH_SIZE];
+    unsigned int generation;	/* of entries in use, 1 to LZW_GENERATION_MAX */
     int code_bit_length;  	/* length of current codes, 9, 10, 11 or 12 */
     short code_change;		/* code at which code_bit_length increases */
-    int output_bits;      	/* bits that didn't fit in a whole byte */
+    unsigned int output_bits;  	/* bits that didn't fit in a whole byte */
 				/* This must be a 32-bit or larger type */
     int output_bits_count;	/* number of bits that didn't fit */
     int bytes_in;		/* for checking compression efficiency */
@@ -54,16 +60,16 @@ static void
 lzw_reset(lzw_state_t *state)
 {
     int i;
-    lzw_code_t *table = state->table;
     state->next_code = LZW_FIRST;
     state->code_bit_length = 9;
     state->code_change = (short)((1<<state->code_bit_length)-1);
     state->bytes_in = 0;
     state->bytes_out = 0;
-    for (i=0; i<LZW_HASH_SIZE; i++) {
-	table[i].code = -1;
-	table[i].base_code = -1;
-	table[i].ch = 0;
+    if (++state->generation > LZW_GENERATION_MAX) {
+	/* start again, so that old entries can't look current */
+	for (i=0; i<LZW_HASH_SIZE; i++)
+	    state->key[i] = 0;
+	state->generation = 1;
     }
 }
 
@@ -88,31 +94,244 @@ lzw_new(void)
     return state;
 }
 
-    
-/* Returns hash index of code/ch if found, or index of an empty location */
+/* Hash of a code and the next character.
+ * Only the character is mixed, with a Fibonacci hash, so that
+ * the multiply can start before the code is known.
+ */
+#define LZW_HASH(code, ch) \
+    ((unsigned int)(code) ^ \
+    ((((unsigned int)(ch) * 2654435761U) & 0xffffffffU) >> (32 - LZW_HASH_BITS)))
+
+void
+lzw_compress(lzw_state_t *state,
+    const unsigned char *inbuf, int *inlen,
+    unsigned char *outbuf, int *outlen)
+{
+    int icount = 0;
+    int ilen = *inlen;
+    int ocount = 0;
+    int olen = *outlen;
+    unsigned char ch;
+    int hash_index;
+    unsigned int key;
+    unsigned int bits = state->output_bits;
+    int len = state->output_bits_count;
+    int code_len = state->code_bit_length;
+    short lzwstr = state->lzwstr;
+    short next_code = state->next_code;
+    short code_change = state->code_change;
+    unsigned int generation = state->generation << LZW_GENERATION_SHIFT;
+    unsigned int *table = state->key;
+    int do_reset = 0;
+    int bytes_in = state->bytes_in;
+    int bytes_out = state->bytes_out;
+
+    if ((lzwstr == -1) && (ilen > 0)) {
+	/* get first char */
+	lzwstr = inbuf[icount++];
+	/* PostScript LZWEncode always starts with LZW_RESET */
+	bits = LZW_RESET;
+	len = code_len;
+    }
+    /* Write out any bits we couldn't fit last time */
+    while ((len >= 8) && (ocount < olen)) {
+	outbuf[ocount++] = (unsigned char)(bits >> (len-8));
+	len -= 8;
+    }
+    while ((icount < ilen) && (ocount < olen) && (len < 8)) {
+	ch = inbuf[icount++];
+	key = generation | ((unsigned int)lzwstr << 8) | ch;
+	/* The table is never more than half full, so this ends */
+	hash_index = (int)LZW_HASH(lzwstr, ch);
+	while (table[hash_index] != key) {
+	    if ((table[hash_index] & ~LZW_KEY_MASK) != generation)
+		break;		/* empty */
+	    hash_index = (hash_index + 1) & (LZW_HASH_SIZE - 1);
+	}
+	if (table[hash_index] == key) {
+	    lzwstr = state->code[hash_index];
+	    continue;
+	}
+
+	/* Output this code.
+	 * With the 7 bits left over this makes at most 2 whole bytes,
+	 * so write them without checking each one if there is room.
+	 */
+	bits = (bits << code_len) | (unsigned int)lzwstr;
+	len += code_len;
+	if (ocount + 2 <= olen) {
+	    while (len >= 8) {
+		len -= 8;
+		outbuf[ocount++] = (unsigned char)(bits >> len);
+	    }
+	}
+	else {
+	    while ((len >= 8) && (ocount < olen)) {
+		len -= 8;
+		outbuf[ocount++] = (unsigned char)(bits >> len);
+	    }
+	}
+
+	if (next_code == code_change) {
+	    code_len++;
+	    code_change = (short)((1 << code_len) - 1);
+	    /* Monitor compression efficiency */
+	    bytes_in = state->bytes_in + icount;
+	    bytes_out = state->bytes_out + ocount;
+	    if (bytes_out > bytes_in + bytes_in/16) {
+		/* Data is not compressing */
+		/* Reset the table to avoid ratio getting worse */
+		do_reset = 1;
+	    }
+	}
+
+	if (do_reset || (next_code >= LZW_MAX)) {
+	    /* Table is full or poor efficiency, so start again */
+	    bits = (bits << code_len) | LZW_RESET;
+	    len += code_len;
+	    while ((len >= 8) && (ocount < olen)) {
+		len -= 8;
+		outbuf[ocount++] = (unsigned char)(bits >> len);
+	    }
+	    lzw_reset(state);
+	    lzwstr = ch;
+	    next_code = state->next_code;
+	    code_len = state->code_bit_length;
+	    code_change = state->code_change;
+	    generation = state->generation << LZW_GENERATION_SHIFT;
+	    do_reset = 0;
+	}
+	else {
+	    /* Add new code to table */
+	    table[hash_index] = key;
+	    state->code[hash_index] = next_code++;
+	    lzwstr = ch;
+	}
+    }
+    if (*inlen == 0) {
+	/* Flush and EOD */
+	if (lzwstr != -1) {
+	    bits = (bits << code_len) | (unsigned int)lzwstr;
+	    len += code_len;
+	    while ((len >= 8) && (ocount < olen)) {
+		len -= 8;
+		outbuf[ocount++] = (unsigned char)(bits >> len);
+	    }
+	}
+	bits = (bits << code_len) | LZW_EOD;
+	len += code_len;
+	while ((len >= 8) && (ocount < olen)) {
+	    len -= 8;
+	    outbuf[ocount++] = (unsigned char)(bits >> len);
+	}
+	if ((len > 0) && (ocount < olen)) {
+	    outbuf[ocount++] = (unsigned char)(bits << (8-len));
+	    len = 0;
+	}
+    }
+
+    /* Save state for next time */
+    state->output_bits = bits;
+    state->output_bits_count = len;
+    state->code_bit_length = code_len;
+    state->code_change = code_change;
+    state->lzwstr = lzwstr;
+    state->next_code = next_code;
+    state->bytes_in += icount;
+    state->bytes_out += ocount;
+    *outlen = ocount;	/* bytes written to output buffer */
+    *inlen = icount;	/* input bytes used */
+}
+
+void
+lzw_restart(lzw_state_t *state)
+{
+    state->output_bits = 0;
+    state->output_bits_count = 0;
+    state->lzwstr = -1;
+    lzw_reset(state);
+}
+
+void
+lzw_free(lzw_state_t *state)
+{
+    free(state);
+}
+
+
+#ifdef STANDALONE
+#include <stdio.h>
+#include <time.h>
+
+/* The previous compressor, with a 5021 entry table and a table
+ * clear on each reset, kept to compare speed and output.
+ */
+#define REF_HASH_SIZE 5021
+
+typedef struct ref_code_s {
+    short code;
+    short base_code;
+    unsigned char ch;
+} ref_code_t;
+
+typedef struct ref_state_s {
+    short next_code;
+    short lzwstr;
+    ref_code_t table[REF_HASH_SIZE];
+    int code_bit_length;
+    short code_change;
+    int output_bits;
+    int output_bits_count;
+    int bytes_in;
+    int bytes_out;
+} ref_state_t;
+
+static void
+ref_reset(ref_state_t *state)
+{
+    int i;
+    ref_code_t *table = state->table;
+    state->next_code = LZW_FIRST;
+    state->code_bit_length = 9;
+    state->code_change = (short)((1<<state->code_bit_length)-1);
+    state->bytes_in = 0;
+    state->bytes_out = 0;
+    for (i=0; i<REF_HASH_SIZE; i++) {
+	table[i].code = -1;
+	table[i].base_code = -1;
+	table[i].ch = 0;
+    }
+}
+
+static void
+ref_init(ref_state_t *state)
+{
+    memset(state, 0, sizeof(ref_state_t));
+    state->lzwstr = -1;
+    ref_reset(state);
+}
+
 static int
-lzw_find_match(lzw_code_t *table, short code, unsigned char ch)
+ref_find_match(ref_code_t *table, short code, unsigned char ch)
 {
     int i = (ch << 4) ^ code;
-    int hash_offset = (i == 0) ? 1 : LZW_HASH_SIZE - i;
-    
-    while (table) { /* while (true) */
+    int hash_offset = (i == 0) ? 1 : REF_HASH_SIZE - i;
+    while (table) {
 	if (table[i].code == -1)
-	    break;	/* not in table */
+	    break;
 	else if ((table[i].base_code == code) && (table[i].ch == ch))
-	    break;	/* found it */
+	    break;
 	else {
-	    /* search forwards from here */
 	    i += hash_offset;
-	    if (i >= LZW_HASH_SIZE)
-		i -= LZW_HASH_SIZE;
+	    if (i >= REF_HASH_SIZE)
+		i -= REF_HASH_SIZE;
 	}
     }
     return i;
 }
 
-void
-lzw_compress(lzw_state_t *state,
+static void
+ref_compress(ref_state_t *state,
     const unsigned char *inbuf, int *inlen,
     unsigned char *outbuf, int *outlen)
 {
@@ -127,66 +346,54 @@ lzw_compress(lzw_state_t *state,
     int code_len = state->code_bit_length;
     short lzwstr = state->lzwstr;
     short next_code = state->next_code;
-    lzw_code_t *table = state->table;
+    ref_code_t *table = state->table;
     int do_reset = 0;
     int bytes_in = state->bytes_in;
     int bytes_out = state->bytes_out;
 
     if (lzwstr == -1) {
-	/* get first char */
 	lzwstr = inbuf[icount++];
-	/* PostScript LZWEncode always starts with LZW_RESET */
 	bits = LZW_RESET;
 	len = code_len;
     }
-    /* Write out any bits we couldn't fit last time */
     while ((len >= 8) && (ocount < olen)) {
 	outbuf[ocount++] = (unsigned char)(bits >> (len-8));
 	len -= 8;
     }
     while ((icount < ilen) && (ocount < olen)) {
 	ch = inbuf[icount++];
-	hash_index = lzw_find_match(table, lzwstr, ch);
+	hash_index = ref_find_match(table, lzwstr, ch);
 	if (table[hash_index].code != -1)
 	    lzwstr = table[hash_index].code;
 	else {
-	    /* Output this code */
 	    bits = (bits << code_len) + lzwstr;
 	    len += code_len;
 	    while ((len >= 8) && (ocount < olen)) {
 		outbuf[ocount++] = (unsigned char)(bits >> (len-8));
 		len -= 8;
 	    }
-
 	    if (next_code == state->code_change) {
     		state->code_bit_length = ++code_len;
 		state->code_change = (short)((1 << code_len) - 1);
-		/* Monitor compression efficiency */
 		bytes_in = state->bytes_in + icount;
 		bytes_out = state->bytes_out + ocount;
-		if (bytes_out > bytes_in + bytes_in/16) {
-		    /* Data is not compressing */
-		    /* Reset the table to avoid ratio getting worse */
+		if (bytes_out > bytes_in + bytes_in/16)
 		    do_reset = 1;
-		}
 	    }
-
 	    if (do_reset || (next_code >= LZW_MAX)) {
-		/* Table is full or poor efficiency, so start again */
 		bits = (bits << code_len) + LZW_RESET;
 		len += code_len;
 		while ((len >= 8) && (ocount < olen)) {
 		    outbuf[ocount++] = (unsigned char)(bits >> (len-8));
 		    len -= 8;
 		}
-		lzw_reset(state);
+		ref_reset(state);
 		lzwstr = ch;
     		next_code = state->next_code;
 		code_len = state->code_bit_length;
 		do_reset = 0;
 	    }
 	    else {
-		/* Add new code to table */
 		table[hash_index].code = next_code++;
 		table[hash_index].base_code = lzwstr;
 		table[hash_index].ch = ch;
@@ -195,7 +402,6 @@ lzw_compress(lzw_state_t *state,
 	}
     }
     if (*inlen == 0) {
-	/* Flush and EOD */
 	bits = (bits << 2*code_len) + (lzwstr << code_len) + LZW_EOD;
 	len += 2*code_len;
 	while ((len >= 8) && (ocount < olen)) {
@@ -205,8 +411,6 @@ lzw_compress(lzw_state_t *state,
 	if ((len > 0) && (ocount < olen))
 	    outbuf[ocount++] = (unsigned char)(bits << (8-len));
     }
-
-    /* Save state for next time */
     state->output_bits = bits;
     state->output_bits_count = len;
     state->code_bit_length = code_len;
@@ -214,25 +418,106 @@ lzw_compress(lzw_state_t *state,
     state->next_code = next_code;
     state->bytes_in += icount;
     state->bytes_out += ocount;
-    *outlen = ocount;	/* bytes written to output buffer */
-    *inlen = icount;	/* input bytes used */
+    *outlen = ocount;
+    *inlen = icount;
 }
 
-void
-lzw_free(lzw_state_t *state)
+/* Compress data in rows of rowlen bytes, as image_to_eps() does.
+ * Returns the length of the output.
+ */
+static long
+compress_rows(int reference, const unsigned char *data, long length,
+    int rowlen, unsigned char *out, long outlen)
 {
-    free(state);
+    static ref_state_t ref;
+    lzw_state_t *lzw = NULL;
+    long used = 0;
+    long count = 0;
+    int inlen, olen;
+    if (reference)
+	ref_init(&ref);
+    else
+	lzw = lzw_new();
+    while (used < length) {
+	inlen = (int)((length - used < rowlen) ? length - used : rowlen);
+	olen = (int)(outlen - count);
+	if (reference)
+	    ref_compress(&ref, data+used, &inlen, out+count, &olen);
+	else
+	    lzw_compress(lzw, data+used, &inlen, out+count, &olen);
+	used += inlen;
+	count += olen;
+    }
+    inlen = 0;	/* EOD */
+    olen = (int)(outlen - count);
+    if (reference)
+	ref_compress(&ref, data, &inlen, out+count, &olen);
+    else {
+	lzw_compress(lzw, data, &inlen, out+count, &olen);
+	lzw_free(lzw);
+    }
+    return count + olen;
 }
 
+/* Time both compressors on a file, and check they agree */
+static int
+benchmark(const char *filename, int repeat)
+{
+    FILE *f;
+    unsigned char *data, *out, *refout;
+    long length, outlen, count = 0, refcount = 0;
+    double t, reft;
+    clock_t start;
+    int i;
 
-#ifdef STANDALONE
-#include <stdio.h>
+    f = fopen(filename, "rb");
+    if (f == (FILE *)NULL)
+	return 1;
+    fseek(f, 0, SEEK_END);
+    length = ftell(f);
+    fseek(f, 0, SEEK_SET);
+    outlen = length * 2 + 16;
+    data = (unsigned char *)malloc(length + 1);
+    out = (unsigned char *)malloc(outlen);
+    refout = (unsigned char *)malloc(outlen);
+    if ((data == NULL) || (out == NULL) || (refout == NULL) ||
+	(fread(data, 1, length, f) != (size_t)length)) {
+	fclose(f);
+	return 1;
+    }
+    fclose(f);
+
+    start = clock();
+    for (i=0; i<repeat; i++)
+	refcount = compress_rows(1, data, length, 4096, refout, outlen);
+    reft = (double)(clock() - start) / CLOCKS_PER_SEC;
+    start = clock();
+    for (i=0; i<repeat; i++)
+	count = compress_rows(0, data, length, 4096, out, outlen);
+    t = (double)(clock() - start) / CLOCKS_PER_SEC;
+
+    fprintf(stdout, "in=%ld out=%ld\n", length, count);
+    fprintf(stdout, "previous %.1f ms, now %.1f ms, %.2fx\n",
+	reft * 1000 / repeat, t * 1000 / repeat, 
+	(t > 0) ? reft / t : 0.0);
+    if ((count != refcount) || (memcmp(out, refout, count) != 0)) {
+	fprintf(stdout, "output differs from previous compressor\n");
+	return 1;
+    }
+    free(data);
+    free(out);
+    free(refout);
+    return 0;
+}
+
+/* lzw infile outfile
+ * lzw -b infile [repeat]
+ */
 int main(int argc, char *argv[])
 {
-    char outbuf[4096];
+    unsigned char outbuf[4096];
     int outlen = sizeof(outbuf);
-    int outcount;
-    char inbuf[4096];
+    unsigned char inbuf[4096];
     int inlen;
     int incount;
     int inused;
@@ -241,6 +526,9 @@ int main(int argc, char *argv[])
     FILE *outfile = NULL;
     int inread=0, outwritten=0;
     
+    if ((argc >= 3) && (strcmp(argv[1], "-b") == 0))
+	return benchmark(argv[2], (argc > 3) ? atoi(argv[3]) : 10);
+
     if (argc != 3)
 	return 1;
 
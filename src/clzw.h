@@ -37,6 +37,12 @@ void lzw_compress(lzw_state_t *state,
     const unsigned char *inbuf, int *inlen,
     unsigned char *outbuf, int *outlen);
 
+/*
+ * Start a new LZW stream, as if the state was from lzw_new().
+ * This is cheaper than lzw_free() and lzw_new().
+ */
+void lzw_restart(lzw_state_t *state);
+
 /* 
  * Free the LZW structure
  * You must first have signalled EOD to lzw_compress, 
@@ -14,7 +14,7 @@
 # Used by all clients 
 OBJCOM1=$(OD)calloc$(OBJ) $(OD)capp$(OBJ) \
  $(OD)cbmp$(OBJ) $(OD)cdoc$(OBJ) $(OD)ceps$(OBJ) \
- $(OD)cimg$(OBJ) $(OD)clzw$(OBJ) \
+ $(OD)cfax$(OBJ) $(OD)cflate$(OBJ) $(OD)cimg$(OBJ) $(OD)clzw$(OBJ) \
  $(OD)cmac$(OBJ) $(OD)cmbcs$(OBJ) $(OD)cpdfscan$(OBJ) \
  $(OD)cprofile$(OBJ) $(OD)cps$(OBJ) \
  $(OD)dscparse$(OBJ) $(OD)dscutil$(OBJ)
@@ -34,13 +34,20 @@ OBJS=$(OBJCOM1) $(OBJCOM2) $(OBJCOM3) $(OBJPLAT)
 EPSTOOL_VERSION=3.09
 EPSTOOL_DATE=2015-03-15
 EPSOBJS=$(EPSOBJPLAT) \
- $(OD)epstool$(OBJ) \
+ $(OD)epstool$(OBJ) $(OD)cgsdisp$(OBJ) \
+ $(OD)chash$(OBJ) $(OD)ccache$(OBJ) \
+ $(OD)cpool$(OBJ) \
  $(OBJCOM1)
 
 EPSTESTOBJS=$(EPSOBJPLAT) \
  $(OD)epstest$(OBJ) \
- $(OD)cbmp$(OBJ) \
- $(OD)cimg$(OBJ) $(OD)clzw$(OBJ)
+ $(OD)cbmp$(OBJ) $(OD)cfax$(OBJ) $(OD)cflate$(OBJ) \
+ $(OD)cimg$(OBJ) $(OD)clzw$(OBJ) $(OD)cpool$(OBJ)
+
+EPSBENCHOBJS=$(EPSOBJPLAT) \
+ $(OD)epsbench$(OBJ) \
+ $(OD)calloc$(OBJ) $(OD)cbmp$(OBJ) $(OD)cfax$(OBJ) $(OD)cflate$(OBJ) \
+ $(OD)cimg$(OBJ) $(OD)clzw$(OBJ) $(OD)cmbcs$(OBJ) $(OD)cpool$(OBJ)
 
 cplat_h=$(SRC)cplat.h
 cfile_h=$(SRC)cfile.h
@@ -48,13 +55,18 @@ common_h=$(SRC)common.h $(cplat_h) $(cfile_h)
 capp_h=$(SRC)capp.h
 cargs_h=$(SRC)cargs.h
 cbmp_h=$(SRC)cbmp.h
+ccache_h=$(SRC)ccache.h
 cdisplay_h=$(SRC)cdisplay.h
 cdll_h=$(SRC)cdll.h
+cfax_h=$(SRC)cfax.h
+cflate_h=$(SRC)cflate.h
 cdoc_h=$(SRC)cdoc.h
 ceps_h=$(SRC)ceps.h
 cmac_h=$(SRC)cmac.h
+cgsdisp_h=$(SRC)cgsdisp.h
 cgsdll_h=$(SRC)cgsdll.h
 cgssrv_h=$(SRC)cgssrv.h
+chash_h=$(SRC)chash.h
 chist_h=$(SRC)chist.h
 cimg_h=$(SRC)cimg.h
 clzw_h=$(SRC)clzw.h
@@ -64,6 +76,7 @@ cpagec_h=$(SRC)cpagec.h
 cpdf_h=$(SRC)cpdf.h
 cpdfscan_h=$(SRC)cpdfscan.h
 cpldll_h=$(SRC)cpldll.h
+cpool_h=$(SRC)cpool.h
 cprofile_h=$(SRC)cprofile.h
 cps_h=$(SRC)cps.h
 cres_h=$(SRC)cres.h
@@ -83,15 +96,16 @@ $(OD)calloc$(OBJ): $(SRC)calloc.c $(common_h)
 	$(COMP) $(FOO)calloc$(OBJ) $(CO) $(SRC)calloc.c
 
 $(OD)capp$(OBJ): $(SRC)capp.c $(common_h) $(dscparse_h) $(copt_h) \
- $(capp_h) $(cdll_h) $(cgssrv_h) $(cimg_h) $(cpagec_h) $(cprofile_h) \
- $(cres_h)
+ $(capp_h) $(cdll_h) $(cflate_h) $(cgssrv_h) $(cimg_h) $(cpagec_h) \
+ $(cprofile_h) $(cres_h)
 	$(COMP) $(FOO)capp$(OBJ) $(CO) $(SRC)capp.c
 
 $(OD)cargs$(OBJ): $(SRC)cargs.c $(common_h) $(dscparse_h) $(capp_h) \
  $(cargs_h) $(copt_h) $(cview_h)
 	$(COMP) $(FOO)cargs$(OBJ) $(CO) $(SRC)cargs.c
 
-$(OD)cbmp$(OBJ): $(SRC)cbmp.c $(common_h) $(gdevdsp_h) $(cimg_h)
+$(OD)cbmp$(OBJ): $(SRC)cbmp.c $(common_h) $(gdevdsp_h) $(cimg_h) \
+ $(cfax_h) $(cflate_h) $(clzw_h) $(cpool_h)
 	$(COMP) $(LIBPNGINC) $(FOO)cbmp$(OBJ) $(CO) $(SRC)cbmp.c
 
 $(OD)ccoord$(OBJ): $(SRC)ccoord.c $(common_h) $(gdevdsp_h) $(cpagec_h)
@@ -116,6 +130,17 @@ $(OD)cfile$(OBJ): $(SRC)cfile.c $(SRC)cfile.h
 $(OD)clfile$(OBJ): $(SRC)clfile.c $(SRC)cfile.h
 	$(COMP) $(FOO)clfile$(OBJ) $(CO) $(SRC)clfile.c
 
+$(OD)cgsdisp$(OBJ): $(SRC)cgsdisp.c $(common_h) $(errors_h) $(iapi_h) \
+ $(gdevdsp_h) $(capp_h) $(cdll_h) $(cimg_h) $(cgsdisp_h)
+	$(COMP) $(FOO)cgsdisp$(OBJ) $(CO) $(SRC)cgsdisp.c
+
+$(OD)chash$(OBJ): $(SRC)chash.c $(common_h) $(chash_h)
+	$(COMP) $(FOO)chash$(OBJ) $(CO) $(SRC)chash.c
+
+$(OD)ccache$(OBJ): $(SRC)ccache.c $(common_h) $(capp_h) $(chash_h) \
+ $(ccache_h)
+	$(COMP) $(FOO)ccache$(OBJ) $(CO) $(SRC)ccache.c
+
 $(OD)cgsdll$(OBJ): $(SRC)cgsdll.c $(common_h) $(errors_h) $(iapi_h) \
  $(capp_h) $(cdll_h) $(cgsdll_h)
 	$(COMP) $(FOO)cgsdll$(OBJ) $(CO) $(SRC)cgsdll.c
@@ -129,7 +154,14 @@ $(OD)cgssrv$(OBJ): $(SRC)cgssrv.c $(common_h) $(dscparse_h) \
 $(OD)chist$(OBJ): $(SRC)chist.c $(common_h) $(chist_h)
 	$(COMP) $(FOO)chist$(OBJ) $(CO) $(SRC)chist.c
 
-$(OD)cimg$(OBJ): $(SRC)cimg.c $(common_h) $(gdevdsp_h) $(cimg_h) $(clzw_h)
+$(OD)cfax$(OBJ): $(SRC)cfax.c $(cfax_h)
+	$(COMP) $(FOO)cfax$(OBJ) $(CO) $(SRC)cfax.c
+
+$(OD)cflate$(OBJ): $(SRC)cflate.c $(common_h) $(cflate_h)
+	$(COMP) $(FOO)cflate$(OBJ) $(CO) $(SRC)cflate.c
+
+$(OD)cimg$(OBJ): $(SRC)cimg.c $(common_h) $(gdevdsp_h) $(cimg_h) \
+ $(cfax_h) $(cflate_h) $(clzw_h) $(cpool_h)
 	$(COMP) $(FOO)cimg$(OBJ) $(CO) $(SRC)cimg.c
 
 $(OD)clzw$(OBJ): $(SRC)clzw.c $(clzw_h)
@@ -166,6 +198,9 @@ $(OD)cplsrv$(OBJ): $(SRC)cplsrv.c $(common_h) $(dscparse_h) \
  $(cgsdll_h) $(cmsg_h) $(cpdf_h) $(cpdfscan_h) $(cview_h) $(cgssrv_h)
 	$(COMP) $(FOO)cplsrv$(OBJ) $(CO) $(SRC)cplsrv.c
 
+$(OD)cpool$(OBJ): $(SRC)cpool.c $(common_h) $(cpool_h)
+	$(COMP) $(FOO)cpool$(OBJ) $(CO) $(SRC)cpool.c
+
 $(OD)cprofile$(OBJ): $(SRC)cprofile.c $(cplat_h) $(cprofile_h)
 	$(COMP) $(FOO)cprofile$(OBJ) $(CO) $(SRC)cprofile.c
 
@@ -194,8 +229,9 @@ $(BD)epstool$(EXE): $(OD)lib.rsp $(EPSOBJS)
 	$(CLINK) $(FE)$(BD)epstool$(EXE) $(EPSOBJS) $(EPSLIB)
 
 $(OD)epstool$(OBJ): $(SRC)epstool.c $(SRC)common.mak \
- $(common_h) $(copt_h) $(capp_h) $(cbmp_h) $(cdoc_h) $(cdll_h) \
- $(ceps_h) $(cimg_h) $(cmac_h) $(cps_h) $(cres_h) \
+ $(common_h) $(copt_h) $(capp_h) $(cbmp_h) $(cdoc_h) $(cdll_h) $(cflate_h) \
+ $(ceps_h) $(cgsdisp_h) $(chash_h) $(ccache_h) \
+ $(cimg_h) $(cmac_h) $(cpool_h) $(cps_h) $(cres_h) \
  $(dscparse_h) $(errors_h) $(iapi_h) $(gdevdsp_h)
 	$(COMP) $(FOO)epstool$(OBJ) $(CO) -DEPSTOOL_VERSION="$(EPSTOOL_VERSION)" -DEPSTOOL_DATE="$(EPSTOOL_DATE)" $(SRC)epstool.c
 
@@ -203,11 +239,24 @@ $(BD)epstest$(EXE): $(OD)lib.rsp $(EPSTESTOBJS)
 	$(CLINK) $(FE)$(BD)epstest$(EXE) $(EPSTESTOBJS) $(EPSLIB)
 
 $(OD)epstest$(OBJ): $(SRC)epstest.c $(SRC)common.mak \
- $(common_h) $(copt_h) $(capp_h) $(cbmp_h) $(cdoc_h) $(cdll_h) \
+ $(common_h) $(copt_h) $(capp_h) $(cbmp_h) $(cdoc_h) $(cdll_h) $(cflate_h) \
  $(ceps_h) $(cimg_h) $(cmac_h) $(cps_h) $(cres_h) \
  $(dscparse_h) $(errors_h) $(iapi_h) $(gdevdsp_h)
 	$(COMP) $(FOO)epstest$(OBJ) $(CO) $(SRC)epstest.c
 
+$(BD)epsbench$(EXE): $(OD)lib.rsp $(EPSBENCHOBJS)
+	$(CLINK) $(FE)$(BD)epsbench$(EXE) $(EPSBENCHOBJS) $(EPSLIB)
+
+$(OD)epsbench$(OBJ): $(SRC)epsbench.c $(SRC)common.mak \
+ $(common_h) $(gdevdsp_h) $(cbmp_h) $(cimg_h) $(cpool_h) $(cflate_h)
+	$(COMP) $(FOO)epsbench$(OBJ) $(CO) $(SRC)epsbench.c
+
+$(BD)lzwbench$(EXE): $(OD)lib.rsp $(OD)lzwbench$(OBJ)
+	$(CLINK) $(FE)$(BD)lzwbench$(EXE) $(OD)lzwbench$(OBJ)
+
+$(OD)lzwbench$(OBJ): $(SRC)clzw.c $(clzw_h)
+	$(COMP) -DSTANDALONE $(FOO)lzwbench$(OBJ) $(CO) $(SRC)clzw.c
+
 
 $(BD)dscparse$(EXE): (OD)dscparse$(OBJ) $(SRC)dscutil.c
 	$(CC) $(CFLAGS) $(GSCFLAGS) -DSTANDALONE $(FOO)dscutils$(OBJ) $(CO) $(SRC)dscutil.c
@@ -242,8 +291,13 @@ epssrc:
 	$(CP) $(SRC)cdoc.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)ceps.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cfile.* $(EPSDIST)$(DD)$(SRCDIR)
+	$(CP) $(SRC)cfax.* $(EPSDIST)$(DD)$(SRCDIR)
+	$(CP) $(SRC)cflate.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)clfile.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)clzw.* $(EPSDIST)$(DD)$(SRCDIR)
+	$(CP) $(SRC)cgsdisp.* $(EPSDIST)$(DD)$(SRCDIR)
+	$(CP) $(SRC)chash.* $(EPSDIST)$(DD)$(SRCDIR)
+	$(CP) $(SRC)ccache.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cgssrv.h $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cimg.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cmac.* $(EPSDIST)$(DD)$(SRCDIR)
@@ -252,12 +306,14 @@ epssrc:
 	$(CP) $(SRC)copt.h $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cpagec.h $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cpdfscan.* $(EPSDIST)$(DD)$(SRCDIR)
+	$(CP) $(SRC)cpool.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cplat.h $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cprofile.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cps.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)cres.h $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)dscparse.* $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)dscutil.c $(EPSDIST)$(DD)$(SRCDIR)
+	$(CP) $(SRC)epsbench.c $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)epstool.c $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)epstool.mak $(EPSDIST)$(DD)$(SRCDIR)
 	$(CP) $(SRC)errors.h $(EPSDIST)$(DD)$(SRCDIR)
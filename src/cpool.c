@@ -0,0 +1,218 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: cpool.c,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* Thread pool for processing images in bands of rows */
+
+/* The pool runs one job at a time.  A job is a count of rows
+ * divided into bands.  The caller and the worker threads each
+ * take the next band until there are none left, so a slow band
+ * does not hold up the others.  The caller returns when every
+ * band is finished.
+ * Workers are started by the first job that needs them.  If the
+ * process forks, the child has no workers, so they are started
+ * again in the child.
+ */
+
+#include "common.h"
+#include "cpool.h"
+
+static int pool_nthreads = 1;
+
+/* Process bands in the calling thread */
+static int
+pool_serial(int count, int band, POOL_FN fn, void *arg)
+{
+    int first;
+    int code = 0;
+    for (first=0; (first<count) && (code == 0); first+=band)
+	code = fn(arg, first, min(first+band, count));
+    return code;
+}
+
+#if defined(UNIX) && defined(MULTITHREAD)
+
+typedef struct POOL_s {
+    int started;		/* worker threads running */
+    pid_t pid;			/* process that started them */
+    pthread_mutex_t mutex;
+    pthread_cond_t work;	/* a job is ready, or stop */
+    pthread_cond_t done;	/* a worker has finished the job */
+    pthread_t thread[POOL_MAXTHREADS];
+    unsigned long generation;	/* incremented for each job */
+    BOOL stop;
+    BOOL busy;			/* a job is running */
+    int active;			/* workers that have not finished the job */
+    /* the current job */
+    POOL_FN fn;
+    void *arg;
+    int count;
+    int band;
+    int next;			/* first row of next band */
+    int code;
+} POOL;
+
+static POOL pool;
+
+/* Take bands until there are none left.  Called with the mutex locked. */
+static void
+pool_run(void)
+{
+    int first, last, code;
+    while (pool.next < pool.count) {
+	first = pool.next;
+	last = min(first + pool.band, pool.count);
+	pool.next = last;
+	pthread_mutex_unlock(&pool.mutex);
+	code = pool.fn(pool.arg, first, last);
+	pthread_mutex_lock(&pool.mutex);
+	if ((code != 0) && (pool.code == 0)) {
+	    pool.code = code;
+	    pool.next = pool.count;	/* skip the rest */
+	}
+    }
+}
+
+static void *
+pool_worker(void *arg)
+{
+    unsigned long generation = 0;
+    pthread_mutex_lock(&pool.mutex);
+    while (!pool.stop) {
+	if (pool.generation == generation) {
+	    pthread_cond_wait(&pool.work, &pool.mutex);
+	    continue;
+	}
+	generation = pool.generation;
+	pool_run();
+	if (--pool.active == 0)
+	    pthread_cond_signal(&pool.done);
+    }
+    pthread_mutex_unlock(&pool.mutex);
+    return NULL;
+}
+
+/* Start the workers if needed.  Returns the number running. */
+static int
+pool_start(void)
+{
+    int i;
+    if (pool.pid != getpid()) {
+	/* first use, or workers were left behind by fork() */
+	memset(&pool, 0, sizeof(pool));
+	pool.pid = getpid();
+	pthread_mutex_init(&pool.mutex, NULL);
+	pthread_cond_init(&pool.work, NULL);
+	pthread_cond_init(&pool.done, NULL);
+    }
+    if (pool.started == 0) {
+	pthread_mutex_lock(&pool.mutex);
+	pool.stop = FALSE;
+	pool.generation = 0;	/* as seen by a new worker */
+	pthread_mutex_unlock(&pool.mutex);
+	for (i=0; i<pool_nthreads-1; i++) {
+	    if (pthread_create(&pool.thread[i], NULL, pool_worker, NULL) != 0)
+		break;
+	    pool.started++;
+	}
+    }
+    return pool.started;
+}
+
+int
+pool_for(int count, int band, POOL_FN fn, void *arg)
+{
+    int code;
+    if (band < 1)
+	band = 1;
+    if ((pool_nthreads <= 1) || (count <= band))
+	return pool_serial(count, band, fn, arg);
+    if ((pool.pid == getpid()) && (pool.started > 0)) {
+	pthread_mutex_lock(&pool.mutex);
+	if (pool.busy) {
+	    /* nested or concurrent use */
+	    pthread_mutex_unlock(&pool.mutex);
+	    return pool_serial(count, band, fn, arg);
+	}
+    }
+    else {
+	if (pool_start() == 0)
+	    return pool_serial(count, band, fn, arg);
+	pthread_mutex_lock(&pool.mutex);
+    }
+    pool.busy = TRUE;
+    pool.fn = fn;
+    pool.arg = arg;
+    pool.count = count;
+    pool.band = band;
+    pool.next = 0;
+    pool.code = 0;
+    pool.active = pool.started;
+    pool.generation++;
+    pthread_cond_broadcast(&pool.work);
+    pool_run();
+    while (pool.active > 0)
+	pthread_cond_wait(&pool.done, &pool.mutex);
+    code = pool.code;
+    pool.fn = NULL;
+    pool.arg = NULL;
+    pool.busy = FALSE;
+    pthread_mutex_unlock(&pool.mutex);
+    return code;
+}
+
+void
+pool_finish(void)
+{
+    int i;
+    if ((pool.pid != getpid()) || (pool.started == 0))
+	return;
+    pthread_mutex_lock(&pool.mutex);
+    pool.stop = TRUE;
+    pthread_cond_broadcast(&pool.work);
+    pthread_mutex_unlock(&pool.mutex);
+    for (i=0; i<pool.started; i++)
+	pthread_join(pool.thread[i], NULL);
+    pool.started = 0;
+}
+
+#else
+
+int
+pool_for(int count, int band, POOL_FN fn, void *arg)
+{
+    if (band < 1)
+	band = 1;
+    return pool_serial(count, band, fn, arg);
+}
+
+void
+pool_finish(void)
+{
+}
+
+#endif
+
+void
+pool_init(int threads)
+{
+    pool_finish();
+    if (threads < 1)
+	threads = 1;
+    if (threads > POOL_MAXTHREADS)
+	threads = POOL_MAXTHREADS;
+    pool_nthreads = threads;
+}
+
+int
+pool_threads(void)
+{
+    return pool_nthreads;
+}
@@ -0,0 +1,49 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: cpool.h,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* Thread pool for processing images in bands of rows */
+
+/* Public */
+
+#ifndef CPOOL_INCLUDED
+#define CPOOL_INCLUDED
+
+#define POOL_MAXTHREADS 64
+
+/* Process rows first to last-1.
+ * Bands may be processed at the same time in different threads,
+ * so fn must only write to its own rows and must not use
+ * shared scratch memory.
+ * Returns 0 on success, non-zero on error.
+ */
+typedef int (*POOL_FN)(void *arg, int first, int last);
+
+/* Set the number of threads, including the calling thread.
+ * Worker threads are started when they are first needed.
+ * Without MULTITHREAD, all bands are processed by the caller.
+ * pool_init() and pool_finish() must be called from the main thread.
+ */
+void pool_init(int threads);
+int pool_threads(void);
+
+/* Call fn for rows 0 to count-1 in bands of band rows.
+ * Returns when all bands are finished.  If called from inside fn,
+ * or from a second thread while the pool is busy, the bands are
+ * processed by the caller.
+ * Returns 0 on success, otherwise a non-zero code from fn, in which
+ * case bands that had not been started are skipped.
+ */
+int pool_for(int count, int band, POOL_FN fn, void *arg);
+
+/* Stop the worker threads.  They are started again if needed. */
+void pool_finish(void);
+
+#endif /* CPOOL_INCLUDED */
@@ -0,0 +1,430 @@
+/* Copyright (C) 2026 Ghostgum Software Pty Ltd.  All rights reserved.
+
+  This software is provided AS-IS with no warranty, either express or
+  implied.
+
+  This software is distributed under licence and may not be copied,
+  modified or distributed except as expressly authorised under the terms
+  of the licence contained in the file LICENCE in this distribution.
+*/
+
+/* $Id: epsbench.c,v 1.1 2026/10/17 00:00:00 ghostgum Exp $ */
+/* Time the image kernels with one thread and with several */
+
+/* Usage: epsbench [threads [scale]]
+ * Each kernel is run with one thread, then with threads threads,
+ * and the speedup is reported.  The default is the number of
+ * processors.  The test images are scale times the default size.
+ * The output of each kernel is checked to be the same for
+ * any number of threads.
+ */
+
+#include "common.h"
+#include "gdevdsp.h"
+#include "cimg.h"
+#include "cbmp.h"
+#include "cpool.h"
+#include "cflate.h"
+#ifdef UNIX
+#include <sys/time.h>
+#endif
+
+#define BENCH_REPEAT 3
+#define BENCH_FILE "epsbench.tmp"
+
+#define FORMAT_MONO (DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE | \
+    DISPLAY_DEPTH_1 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST)
+#define FORMAT_GREY (DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE | \
+    DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST)
+#define FORMAT_RGB (DISPLAY_COLORS_RGB | DISPLAY_ALPHA_NONE | \
+    DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST)
+#define FORMAT_BGR (DISPLAY_COLORS_RGB | DISPLAY_ALPHA_NONE | \
+    DISPLAY_DEPTH_8 | DISPLAY_LITTLEENDIAN | DISPLAY_BOTTOMFIRST)
+#define FORMAT_XRGB (DISPLAY_COLORS_RGB | DISPLAY_UNUSED_FIRST | \
+    DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST)
+#define FORMAT_CMYK (DISPLAY_COLORS_CMYK | DISPLAY_ALPHA_NONE | \
+    DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST)
+
+/* Test images */
+static IMAGE mono;	/* 1-bit text-like page */
+static IMAGE grey;	/* 8-bit separation */
+static IMAGE rgb;	/* 24-bit */
+static IMAGE xrgb;	/* 32-bit with unused byte */
+static IMAGE cmyk;	/* 32-bit */
+static IMAGE out;	/* result of a kernel */
+
+/* Platform specific, needed by cimg.c */
+int
+image_platform_init(IMAGE *img)
+{
+    return 0;
+}
+
+unsigned int
+image_platform_format(unsigned int format)
+{
+    return format;
+}
+
+/* cbmp.c reads PNM headers with ps_fgets() from cps.c, which needs
+ * the document code.  The benchmark does not read any files.
+ */
+int ps_fgets(char *s, int n, GFile *f);
+
+int
+ps_fgets(char *s, int n, GFile *f)
+{
+    return 0;
+}
+
+static double
+bench_time(void)
+{
+#ifdef UNIX
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return tv.tv_sec + tv.tv_usec / 1000000.0;
+#else
+    return (double)clock() / CLOCKS_PER_SEC;
+#endif
+}
+
+static int
+bench_image(IMAGE *img, unsigned int format, int width, int height,
+    int depth)
+{
+    memset(img, 0, sizeof(IMAGE));
+    img->width = width;
+    img->height = height;
+    img->format = format;
+    img->raster = ((width * depth + 7) / 8 + 3) & ~3;
+    img->image = (unsigned char *)malloc(img->raster * height);
+    if (img->image == NULL)
+	return -1;
+    memset(img->image, 0, img->raster * height);
+    return 0;
+}
+
+static void
+bench_free(IMAGE *img)
+{
+    if (img->image != NULL)
+	free(img->image);
+    memset(img, 0, sizeof(IMAGE));
+}
+
+/* Make images with some structure, so compression has work to do */
+static int
+bench_init(int width, int height)
+{
+    int x, y;
+    unsigned char *p;
+    unsigned int seed = 1;
+    if ((bench_image(&mono, FORMAT_MONO, width * 2, height * 2, 1) != 0) ||
+	(bench_image(&grey, FORMAT_GREY, width, height, 8) != 0) ||
+	(bench_image(&rgb, FORMAT_RGB, width, height, 24) != 0) ||
+	(bench_image(&xrgb, FORMAT_XRGB, width, height, 32) != 0) ||
+	(bench_image(&cmyk, FORMAT_CMYK, width, height, 32) != 0))
+	return -1;
+    for (y=0; y<(int)mono.height; y++) {
+	p = mono.image + y * mono.raster;
+	for (x=0; x<(int)mono.raster; x++) {
+	    seed = seed * 1103515245 + 12345;
+	    /* short runs of black on lines of text */
+	    p[x] = (((y / 16) & 1) && ((seed >> 16) & 1)) ?
+		(unsigned char)(seed >> 24) : 0;
+	}
+    }
+    for (y=0; y<height; y++) {
+	for (x=0; x<width; x++) {
+	    seed = seed * 1103515245 + 12345;
+	    grey.image[y * grey.raster + x] =
+		(unsigned char)((x + y) + ((seed >> 28) & 7));
+	    p = rgb.image + y * rgb.raster + x * 3;
+	    p[0] = (unsigned char)x;
+	    p[1] = (unsigned char)y;
+	    p[2] = (unsigned char)(x ^ y);
+	    p = xrgb.image + y * xrgb.raster + x * 4;
+	    p[0] = 0;
+	    p[1] = (unsigned char)x;
+	    p[2] = (unsigned char)y;
+	    p[3] = (unsigned char)((x * y) >> 4);
+	    p = cmyk.image + y * cmyk.raster + x * 4;
+	    p[0] = (unsigned char)(x >> 1);
+	    p[1] = (unsigned char)(y >> 1);
+	    p[2] = 0;
+	    p[3] = (unsigned char)((x + y) >> 2);
+	}
+    }
+    return 0;
+}
+
+/* Kernels.  Each leaves its result in out or in BENCH_FILE. */
+
+static int
+bench_merge_cmyk(void)
+{
+    /* merge into a copy, so each run has the same input */
+    bench_free(&out);
+    if (bench_image(&out, FORMAT_CMYK, cmyk.width, cmyk.height, 32) != 0)
+	return -1;
+    memcpy(out.image, cmyk.image, cmyk.raster * cmyk.height);
+    return image_merge_cmyk(&out, &grey, 0.1f, 0.5f, 0.9f, 0.3f);
+}
+
+static int
+bench_down_scale_mono(void)
+{
+    bench_free(&out);
+    if (bench_image(&out, FORMAT_GREY, mono.width / 3, mono.height / 3, 8)
+	!= 0)
+	return -1;
+    return image_down_scale(&out, &mono);
+}
+
+static int
+bench_down_scale_rgb(void)
+{
+    bench_free(&out);
+    if (bench_image(&out, FORMAT_RGB, rgb.width / 3, rgb.height / 3, 24)
+	!= 0)
+	return -1;
+    return image_down_scale(&out, &rgb);
+}
+
+static int
+bench_resize(void)
+{
+    bench_free(&out);
+    if (bench_image(&out, FORMAT_RGB, rgb.width * 2 / 5, rgb.height * 2 / 5,
+	24) != 0)
+	return -1;
+    return image_resize(&out, &rgb, IMAGE_RESIZE_LANCZOS3);
+}
+
+static int
+bench_copy_grey(void)
+{
+    bench_free(&out);
+    return image_copy(&out, &xrgb, FORMAT_GREY);
+}
+
+static int
+bench_copy_bgr(void)
+{
+    /* converts and reverses the row order */
+    bench_free(&out);
+    return image_copy(&out, &cmyk, FORMAT_BGR);
+}
+
+static int
+bench_eps_write(int use_a85, int compress)
+{
+    int code;
+    GFile *f = gfile_open(TEXT(BENCH_FILE),
+	gfile_modeWrite | gfile_modeCreate);
+    if (f == NULL)
+	return -1;
+    code = image_to_eps(f, &xrgb, 0, 0, 100, 100, 0.0f, 0.0f, 0.0f, 0.0f,
+	use_a85, compress, FLATE_LEVEL_DEFAULT, NULL);
+    gfile_close(f);
+    return code;
+}
+
+static int
+bench_eps(void)
+{
+    return bench_eps_write(IMAGE_ENCODE_ASCII85, IMAGE_COMPRESS_RLE);
+}
+
+static int
+bench_eps_hex(void)
+{
+    return bench_eps_write(IMAGE_ENCODE_HEX, IMAGE_COMPRESS_NONE);
+}
+
+static int
+bench_eps_a85(void)
+{
+    return bench_eps_write(IMAGE_ENCODE_ASCII85, IMAGE_COMPRESS_NONE);
+}
+
+static int
+bench_tiff(void)
+{
+    int code;
+    GFile *f = gfile_open(TEXT(BENCH_FILE),
+	gfile_modeWrite | gfile_modeCreate);
+    if (f == NULL)
+	return -1;
+    code = image_to_tiff(f, &mono, 7, 0, mono.width - 7, mono.height,
+	72.0f, 72.0f, FALSE, TIFF_COMPRESS_PACKBITS);
+    gfile_close(f);
+    return code;
+}
+
+static int
+bench_tiff_write(int compress)
+{
+    int code;
+    GFile *f = gfile_open(TEXT(BENCH_FILE),
+	gfile_modeWrite | gfile_modeCreate);
+    if (f == NULL)
+	return -1;
+    code = image_to_tiff(f, &rgb, 0, 0, rgb.width, rgb.height,
+	72.0f, 72.0f, FALSE, compress);
+    gfile_close(f);
+    return code;
+}
+
+static int
+bench_tiff_rgb(void)
+{
+    return bench_tiff_write(TIFF_COMPRESS_PACKBITS);
+}
+
+static int
+bench_tiff_lzw(void)
+{
+    return bench_tiff_write(TIFF_COMPRESS_LZW | TIFF_COMPRESS_PREDICTOR);
+}
+
+static int
+bench_bmp(void)
+{
+    return image_to_bmpfile(&cmyk, TEXT(BENCH_FILE), 72.0f, 72.0f);
+}
+
+typedef struct BENCH_s {
+    const char *name;
+    int (*fn)(void);
+    BOOL file;		/* result is in BENCH_FILE */
+    BOOL dated;		/* result includes the time, so can't be compared */
+} BENCH;
+
+static const BENCH bench[] = {
+    {"image_merge_cmyk", bench_merge_cmyk, FALSE, FALSE},
+    {"image_down_scale mono", bench_down_scale_mono, FALSE, FALSE},
+    {"image_down_scale rgb", bench_down_scale_rgb, FALSE, FALSE},
+    {"image_resize lanczos3", bench_resize, FALSE, FALSE},
+    {"image_copy to grey", bench_copy_grey, FALSE, FALSE},
+    {"image_copy to bgr", bench_copy_bgr, FALSE, FALSE},
+    {"image_to_eps", bench_eps, TRUE, FALSE},
+    {"image_to_eps hex", bench_eps_hex, TRUE, FALSE},
+    {"image_to_eps ascii85", bench_eps_a85, TRUE, FALSE},
+    {"image_to_tiff", bench_tiff, TRUE, TRUE},
+    {"image_to_tiff rgb", bench_tiff_rgb, TRUE, TRUE},
+    {"image_to_tiff lzw", bench_tiff_lzw, TRUE, TRUE},
+    {"image_to_bmpfile", bench_bmp, TRUE, FALSE},
+    {NULL, NULL, FALSE, FALSE}
+};
+
+/* Checksum of the result, to compare runs with different threads */
+static unsigned long
+bench_sum(const BENCH *b)
+{
+    unsigned long sum = 0;
+    unsigned int i;
+    int c;
+    FILE *f;
+    if (b->file) {
+	f = fopen(BENCH_FILE, "rb");
+	if (f == NULL)
+	    return 0;
+	while ((c = fgetc(f)) != EOF)
+	    sum = (sum * 31 + c) & 0xffffffffUL;
+	fclose(f);
+    }
+    else if (out.image != NULL) {
+	for (i=0; i<out.raster * out.height; i++)
+	    sum = (sum * 31 + out.image[i]) & 0xffffffffUL;
+    }
+    return sum;
+}
+
+/* Run a kernel several times and return the best time in seconds,
+ * or a negative value on error.
+ */
+static double
+bench_run(const BENCH *b, int threads, unsigned long *psum)
+{
+    int i;
+    double start, t;
+    double best = -1.0;
+    pool_init(threads);
+    for (i=0; i<BENCH_REPEAT; i++) {
+	start = bench_time();
+	if (b->fn() != 0)
+	    return -1.0;
+	t = bench_time() - start;
+	if ((best < 0) || (t < best))
+	    best = t;
+    }
+    *psum = bench_sum(b);
+    return best;
+}
+
+int
+main(int argc, char *argv[])
+{
+    int threads = 0;
+    int scale = 1;
+    int code = 0;
+    int i;
+    double t1, tn;
+    unsigned long sum1, sumn;
+    char buf[64];
+
+    if (argc > 1)
+	threads = atoi(argv[1]);
+    if (argc > 2)
+	scale = atoi(argv[2]);
+#ifdef UNIX
+    if (threads < 1)
+	threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+    if (threads < 1)
+	threads = 1;
+    if (threads > POOL_MAXTHREADS)
+	threads = POOL_MAXTHREADS;
+    if (scale < 1)
+	scale = 1;
+
+    image_convert_init();
+    if (bench_init(1200 * scale, 1600 * scale) != 0) {
+	fprintf(stderr, "epsbench: out of memory\n");
+	return 1;
+    }
+#if !(defined(UNIX) && defined(MULTITHREAD))
+    fprintf(stdout, "Built without MULTITHREAD, all kernels use one thread\n");
+#endif
+    snprintf(buf, sizeof(buf), "%d threads", threads);
+    fprintf(stdout, "%-24s %10s %10s %8s\n", "kernel", "1 thread",
+	buf, "speedup");
+    for (i=0; bench[i].name; i++) {
+	t1 = bench_run(&bench[i], 1, &sum1);
+	tn = bench_run(&bench[i], threads, &sumn);
+	if (bench[i].dated)
+	    sumn = sum1;
+	if ((t1 < 0) || (tn < 0)) {
+	    fprintf(stdout, "%-24s failed\n", bench[i].name);
+	    code = 1;
+	    continue;
+	}
+	fprintf(stdout, "%-24s %7.1f ms %7.1f ms %7.2fx%s\n",
+	    bench[i].name, t1 * 1000.0, tn * 1000.0,
+	    (tn > 0) ? t1 / tn : 0.0,
+	    (sum1 == sumn) ? "" : "  output differs");
+	if (sum1 != sumn)
+	    code = 1;
+    }
+    pool_finish();
+    bench_free(&out);
+    bench_free(&mono);
+    bench_free(&grey);
+    bench_free(&rgb);
+    bench_free(&xrgb);
+    bench_free(&cmyk);
+    remove(BENCH_FILE);
+    return code;
+}
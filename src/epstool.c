@@ -24,10 +24,15 @@
 #include "cdoc.h"
 #include "cdll.h"
 #include "cgssrv.h"
+#include "cgsdisp.h"
+#include "chash.h"
+#include "ccache.h"
 #include "cmac.h"
 #include "ceps.h"
 #include "cimg.h"
+#include "cflate.h"
 #include "cpagec.h"
+#include "cpool.h"
 #include "cres.h"
 #ifdef __WIN32__
 #include "wgsver.h"
@@ -37,6 +42,10 @@
 #include <sys/wait.h>
 #include <errno.h>
 #endif
+#ifdef UNIX
+#include <sys/stat.h>
+#include <dirent.h>
+#endif
 
 const char *epstool_name = "epstool";
 const char *epstool_version = "3.09";  /* should be EPSTOOL_VERSION */
@@ -53,12 +62,14 @@ Commands (one only):\n\
   --add-metafile-preview     or  -w\n\
   --add-pict-preview\n\
   --add-user-preview filename\n\
+  --add-preview type filename  (may be repeated)\n\
   --dcs2-multi\n\
   --dcs2-single\n\
   --dcs2-report\n\
   --extract-postscript       or  -p\n\
   --extract-preview          or  -v\n\
   --bitmap\n\
+  --cache-stats\n\
   --copy\n\
   --dump\n\
   --help                     or  -h\n\
@@ -68,20 +79,29 @@ Commands (one only):\n\
 
 const char *opt_help = "\
 Options:\n\
+  --batch filename\n\
   --bbox                     or  -b\n\
+  --bbox-render\n\
+  --cache directory\n\
+  --cache-size megabytes\n\
   --combine-separations filename\n\
   --combine-tolerance pts\n\
+  --composite-one-pass\n\
   --custom-colours filename\n\
   --debug                    or  -d\n\
   --device name\n\
   --doseps-reverse\n\
   --dpi resolution\n\
   --dpi-render resolution\n\
+  --flate level\n\
   --ignore-information\n\
   --ignore-warnings\n\
   --ignore-errors\n\
+  --image-compress method\n\
+  --jobs count\n\
   --gs command\n\
   --gs-args arguments\n\
+  --gs-dll library\n\
   --mac-binary\n\
   --mac-double\n\
   --mac-rsrc\n\
@@ -92,6 +112,9 @@ Options:\n\
   --quiet\n\
   --rename-separation old_name new_name\n\
   --replace-composite\n\
+  --resize-filter name\n\
+  --threads count\n\
+  --tiff-compress method\n\
 ";
 
 
@@ -115,9 +138,92 @@ typedef enum {
     CMD_DUMP,
     CMD_HELP,
     CMD_TEST,
-    CMD_VERSION
+    CMD_VERSION,
+    CMD_CACHE_STATS,
+    CMD_PREVIEWS
 } CMD;
 
+/* Output for --add-preview */
+typedef enum {
+    PREVIEW_TIFF4,
+    PREVIEW_TIFF6U,
+    PREVIEW_TIFF6P,
+    PREVIEW_INTERCHANGE,
+    PREVIEW_WMF,
+    PREVIEW_PICT,
+    PREVIEW_BMP,
+    PREVIEW_PBM,
+    PREVIEW_PGM,
+    PREVIEW_PPM,
+    PREVIEW_PNG,
+    PREVIEW_TIFF
+} PREVIEW_TYPE;
+
+typedef struct PREVIEW_OUTPUT_s PREVIEW_OUTPUT;
+struct PREVIEW_OUTPUT_s {
+    PREVIEW_TYPE type;
+    TCHAR filename[MAXSTR];
+    PREVIEW_OUTPUT *next;
+};
+
+static const struct {
+    const char *name;
+    PREVIEW_TYPE type;
+} preview_types[] = {
+    {"tiff4", PREVIEW_TIFF4},
+    {"tiff6u", PREVIEW_TIFF6U},
+    {"tiff6p", PREVIEW_TIFF6P},
+    {"interchange", PREVIEW_INTERCHANGE},
+    {"metafile", PREVIEW_WMF},
+    {"pict", PREVIEW_PICT},
+    {"bmp", PREVIEW_BMP},
+    {"pbm", PREVIEW_PBM},
+    {"pgm", PREVIEW_PGM},
+    {"ppm", PREVIEW_PPM},
+    {"png", PREVIEW_PNG},
+    {"tiff", PREVIEW_TIFF},
+    {NULL, PREVIEW_TIFF4}
+};
+
+/* Names for --resize-filter */
+static const struct {
+    const char *name;
+    int filter;
+} resize_filters[] = {
+    {"box", IMAGE_RESIZE_BOX},
+    {"bilinear", IMAGE_RESIZE_BILINEAR},
+    {"lanczos3", IMAGE_RESIZE_LANCZOS3},
+    {NULL, IMAGE_RESIZE_BOX}
+};
+
+/* Names for --tiff-compress */
+static const struct {
+    const char *name;
+    int compress;
+} tiff_compressions[] = {
+    {"packbits", TIFF_COMPRESS_PACKBITS},
+    {"lzw", TIFF_COMPRESS_LZW},
+    {"lzw-predictor", TIFF_COMPRESS_LZW | TIFF_COMPRESS_PREDICTOR},
+    {"deflate", TIFF_COMPRESS_DEFLATE},
+    {"deflate-predictor", TIFF_COMPRESS_DEFLATE | TIFF_COMPRESS_PREDICTOR},
+    {"ccitt", TIFF_COMPRESS_CCITT},
+    {NULL, TIFF_COMPRESS_PACKBITS}
+};
+
+/* Names for --image-compress */
+static const struct {
+    const char *name;
+    int compress;
+} image_compressions[] = {
+    {"none", IMAGE_COMPRESS_NONE},
+    {"rle", IMAGE_COMPRESS_RLE},
+    {"lzw", IMAGE_COMPRESS_LZW},
+    {"flate", IMAGE_COMPRESS_FLATE},
+    {"ccitt", IMAGE_COMPRESS_CCITT},
+    {"auto", IMAGE_COMPRESS_AUTO},
+    {NULL, IMAGE_COMPRESS_LZW}
+};
+
 typedef enum{
     CUSTOM_CMYK,
     CUSTOM_RGB
@@ -142,10 +248,14 @@ typedef struct OPT_s {
     CMD cmd;
     TCHAR device[64];	/* --device name for --bitmap or --add-tiff-preview */
     BOOL composite;		/* --replace-composite */
+    BOOL composite_one_pass;	/* --composite-one-pass */
     BOOL bbox;			/* --bbox */
+    BOOL bbox_render;		/* --bbox-render */
     int dscwarn;		/* --ignore-warnings etc. */
     TCHAR gs[MAXSTR];		/* --gs command */
     TCHAR gsargs[MAXSTR*4];	/* --gs-args arguments */
+    TCHAR gsdll[MAXSTR];	/* --gs-dll library */
+    GSDISP *gsdisp;		/* loaded from gsdll, or NULL */
     TCHAR input[MAXSTR];	/* filename */
     TCHAR output[MAXSTR];	/* --output filename or (second) filename */
     TCHAR user_preview[MAXSTR];	/* --add-user-preview filename */
@@ -154,6 +264,8 @@ typedef struct OPT_s {
     BOOL doseps_reverse;	/* --doseps-reverse */
     float dpi;			/* --dpi resolution */
     float dpi_render;		/* --dpi-render resolution */
+    int resize_filter;		/* --resize-filter, IMAGE_RESIZE_* */
+    int tiff_compress;		/* --tiff-compress, TIFF_COMPRESS_* */
     BOOL help;			/* --help */
     TCHAR custom_colours[MAXSTR]; /* --custom-colours filename */
     CUSTOM_COLOUR *colours;
@@ -161,11 +273,22 @@ typedef struct OPT_s {
     TCHAR combine[MAXSTR];	/* --combine-separations filename */
     int tolerance;		/* --combine-tolerance pts */
     RENAME_SEPARATION *rename_sep; /* --rename-separation */
+    PREVIEW_OUTPUT *previews;	/* --add-preview */
     CMAC_TYPE mac_type;		/* --mac-binary, --mac-double, --mac-single */
 				/* or --mac-rsrc */
     int page;			/* --page-number for --bitmap */
-    int image_compress; 	/* IMAGE_COMPRESS_NONE, RLE, LZW */
+    int image_compress; 	/* IMAGE_COMPRESS_NONE, RLE, LZW, FLATE, CCITT, AUTO */
+    int flate_level;		/* --flate level */
     int image_encode;		/* IMAGE_ENCODE_HEX, ASCII85 */
+    TCHAR batch[MAXSTR];	/* --batch filename */
+    int jobs;			/* --jobs count */
+    int threads;		/* --threads count */
+    TCHAR cachedir[MAXSTR];	/* --cache directory */
+    int cache_size;		/* --cache-size megabytes */
+    CACHE *cache;		/* opened from cachedir, or NULL */
+    char gs_version[64];	/* of opt->gs, for cache keys */
+    BOOL gs_version_valid;	/* gs_version has been read */
+    char gsdll_version[128];	/* of opt->gsdisp, for cache keys */
 } OPT;
 
 
@@ -196,7 +319,10 @@ static void print_help(void);
 static void print_version(void);
 static int parse_args(OPT *opt, int argc, TCHAR *argv[]);
 static Doc * epstool_open_document(GSview *app, OPT *opt, TCHAR *name);
+static int epstool_process(GSview *app, OPT *opt);
+static int epstool_batch(GSview *app, OPT *opt);
 static int epstool_add_preview(Doc *doc, OPT *opt);
+static int epstool_add_previews(Doc *doc, OPT *opt);
 static int epstool_dcs2_copy(Doc *doc, Doc *doc2, OPT *opt);
 static int epstool_dcs2_report(Doc *doc);
 static int epstool_dcs2_composite(Doc *doc, OPT *opt, GFile *compfile);
@@ -205,21 +331,57 @@ static int epstool_extract(Doc *doc, OPT *opt);
 static int epstool_bitmap(Doc *doc, OPT *opt);
 static int epstool_copy(Doc *doc, OPT *opt);
 static int epstool_copy_bitmap(Doc *doc, OPT *opt);
+static void report_image_compress(Doc *doc, OPT *opt, int compress);
 static int epstool_test(Doc *doc, OPT *opt);
+static int epstool_cache_stats(GSview *app, OPT *opt);
+static void get_gs_version(GSview *app, OPT *opt);
 static void epstool_dump_fn(void *caller_data, const char *str);
 
+/* Down scaling of a preview while it is being rendered */
+typedef struct PREVIEW_SCALE_s {
+    OPT *opt;
+    CDSCBBOX *bbox;
+    CDSCFBBOX *hires_bbox;
+    IMAGE *newimg;		/* image at opt->dpi */
+    IMAGE_SCALER *scaler;
+} PREVIEW_SCALE;
+
+static IMAGE *render_preview(Doc *doc, OPT *opt, int page, LPCTSTR device,
+    float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox,
+    PREVIEW_SCALE *scale);
+static IMAGE *render_preview_bbox(Doc *doc, OPT *opt, int page, 
+    LPCTSTR device, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox);
 static IMAGE *make_preview_image(Doc *doc, OPT *opt, int page, LPCTSTR device,
     CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox);
+static int make_preview_ps(Doc *doc, OPT *opt, int page, 
+    TCHAR *tpsname, int tpslen,
+    float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox,
+    int *width, int *height, float *xoffset, float *yoffset);
 static int make_preview_file(Doc *doc, OPT *opt, int page, 
     LPCTSTR preview, LPCTSTR device,
     float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox);
+static unsigned int display_format(LPCTSTR device);
+static IMAGE *make_preview_gsdisp(Doc *doc, OPT *opt, int page, 
+    unsigned int format, float dpi, 
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox,
+    PREVIEW_SCALE *scale);
+static IMAGE *preview_scale_alloc(OPT *opt, unsigned int format, 
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox);
+static IMAGE *preview_down_scale(OPT *opt, IMAGE *img, 
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox);
 static int calculate_bbox(Doc *doc, OPT *opt, LPCTSTR psname, 
     CDSCBBOX *bbox, CDSCFBBOX *hires_bbox);
 static int calc_device_size(float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox,
     int *width, int *height, float *xoffset, float *yoffset);
+/* Called by exec_program() with each block of the program's stdout.
+ * Return 0 to continue, -ve to discard the remaining output.
+ */
+typedef int (*EXEC_OUTPUT_FN)(void *caller, const unsigned char *buf,
+    unsigned int len);
 static int exec_program(LPTSTR command,
     int hstdin, int hstdout, int hstderr,
-    LPCTSTR stdin_name, LPCTSTR stdout_name, LPCTSTR stderr_name);
+    LPCTSTR stdin_name, LPCTSTR stdout_name, LPCTSTR stderr_name,
+    EXEC_OUTPUT_FN stdout_fn, void *caller);
 static int custom_colours_read(OPT *opt);
 static CUSTOM_COLOUR *custom_colours_find(OPT *opt, const char *name);
 static void custom_colours_free(OPT *opt);
@@ -259,6 +421,11 @@ parse_args(OPT *opt, int argc, TCHAR *argv[])
     opt->dscwarn = CDSC_ERROR_NONE;
     opt->image_encode = IMAGE_ENCODE_ASCII85;
     opt->image_compress = IMAGE_COMPRESS_LZW;
+    opt->jobs = 1;
+    opt->threads = 1;
+    opt->flate_level = FLATE_LEVEL_DEFAULT;
+    opt->tiff_compress = TIFF_COMPRESS_PACKBITS;
+    opt->cache_size = 100;
     csncpy(opt->gs, gsexe, sizeof(opt->gs)/sizeof(TCHAR)-1);
     for (arg=1; arg<argc; arg++) {
 	p = argv[arg];
@@ -314,6 +481,40 @@ parse_args(OPT *opt, int argc, TCHAR *argv[])
 	    csncpy(opt->user_preview, argv[arg], 
 		sizeof(opt->user_preview)/sizeof(TCHAR)-1);
 	}
+	else if (cscmp(p, TEXT("--add-preview")) == 0) {
+	    PREVIEW_OUTPUT *po;
+	    PREVIEW_OUTPUT **ppo = &opt->previews;
+	    char buf[MAXSTR];
+	    int i;
+	    if ((opt->cmd != CMD_UNKNOWN) && (opt->cmd != CMD_PREVIEWS))
+		return arg;
+	    opt->cmd = CMD_PREVIEWS;
+	    arg++;
+	    if (arg+1 >= argc)
+		return arg;
+	    memset(buf, 0, sizeof(buf));
+	    cs_to_narrow(buf, (int)sizeof(buf)-1, argv[arg], 
+		(int)cslen(argv[arg])+1);
+	    for (i=0; preview_types[i].name; i++)
+		if (strcmp(buf, preview_types[i].name) == 0)
+		    break;
+	    if (preview_types[i].name == NULL)
+		return arg;
+	    po = (PREVIEW_OUTPUT *)malloc(sizeof(PREVIEW_OUTPUT));
+	    if (po == NULL) {
+		fprintf(stderr, "Out of memory\n");
+		return arg;
+	    }
+	    memset(po, 0, sizeof(PREVIEW_OUTPUT));
+	    po->type = preview_types[i].type;
+	    arg++;
+	    csncpy(po->filename, argv[arg], 
+		sizeof(po->filename)/sizeof(TCHAR)-1);
+	    /* keep them in command line order */
+	    while (*ppo)
+		ppo = &(*ppo)->next;
+	    *ppo = po;
+	}
 	else if (cscmp(p, TEXT("--dcs2-multi")) == 0) {
 	    if (opt->cmd != CMD_UNKNOWN)
 		return arg;
@@ -339,6 +540,9 @@ parse_args(OPT *opt, int argc, TCHAR *argv[])
 		return arg;
 	    opt->cmd = CMD_TEST;
 	}
+	else if (cscmp(p, TEXT("--composite-one-pass")) == 0) {
+	    opt->composite_one_pass = TRUE;
+	}
 	else if (cscmp(p, TEXT("--replace-composite")) == 0) {
 	    opt->composite = TRUE;
 	}
@@ -462,6 +666,78 @@ parse_args(OPT *opt, int argc, TCHAR *argv[])
 	    (cscmp(p, TEXT("-b")) == 0)) {
 	    opt->bbox = TRUE;
 	}
+	else if (cscmp(p, TEXT("--batch")) == 0) {
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    csncpy(opt->batch, argv[arg], sizeof(opt->batch)/sizeof(TCHAR)-1);
+	}
+	else if (cscmp(p, TEXT("--jobs")) == 0) {
+	    char buf[MAXSTR];
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    cs_to_narrow(buf, (int)sizeof(buf)-1, argv[arg], 
+		(int)cslen(argv[arg])+1);
+	    opt->jobs = atoi(buf);
+	    if (opt->jobs < 1)
+		opt->jobs = 1;
+	    if (opt->jobs > 256)
+		opt->jobs = 256;
+	}
+	else if (cscmp(p, TEXT("--threads")) == 0) {
+	    char buf[MAXSTR];
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    cs_to_narrow(buf, (int)sizeof(buf)-1, argv[arg], 
+		(int)cslen(argv[arg])+1);
+	    opt->threads = atoi(buf);
+	    if (opt->threads < 1)
+		opt->threads = 1;
+	    if (opt->threads > POOL_MAXTHREADS)
+		opt->threads = POOL_MAXTHREADS;
+	}
+	else if (cscmp(p, TEXT("--flate")) == 0) {
+	    char buf[MAXSTR];
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    cs_to_narrow(buf, (int)sizeof(buf)-1, argv[arg], 
+		(int)cslen(argv[arg])+1);
+	    opt->flate_level = atoi(buf);
+	    if ((opt->flate_level < 0) || (opt->flate_level > 9))
+		return arg;
+	    opt->image_compress = IMAGE_COMPRESS_FLATE;
+	}
+	else if (cscmp(p, TEXT("--cache")) == 0) {
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    csncpy(opt->cachedir, argv[arg], 
+		sizeof(opt->cachedir)/sizeof(TCHAR)-1);
+	}
+	else if (cscmp(p, TEXT("--cache-size")) == 0) {
+	    char buf[MAXSTR];
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    cs_to_narrow(buf, (int)sizeof(buf)-1, argv[arg], 
+		(int)cslen(argv[arg])+1);
+	    opt->cache_size = atoi(buf);
+	    if (opt->cache_size < 0)
+		opt->cache_size = 0;
+	    if (opt->cache_size > 4000)
+		opt->cache_size = 4000;
+	}
+	else if (cscmp(p, TEXT("--cache-stats")) == 0) {
+	    if (opt->cmd != CMD_UNKNOWN)
+		return arg;
+	    opt->cmd = CMD_CACHE_STATS;
+	}
+	else if (cscmp(p, TEXT("--bbox-render")) == 0) {
+	    opt->bbox_render = TRUE;
+	}
 	else if (cscmp(p, TEXT("--ignore-information")) == 0) {
 	    opt->dscwarn = CDSC_ERROR_INFORM;
 	}
@@ -483,6 +759,12 @@ parse_args(OPT *opt, int argc, TCHAR *argv[])
 		return arg;
 	    csncpy(opt->gsargs, argv[arg], sizeof(opt->gsargs)/sizeof(TCHAR)-1);
 	}
+	else if (cscmp(p, TEXT("--gs-dll")) == 0) {
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    csncpy(opt->gsdll, argv[arg], sizeof(opt->gsdll)/sizeof(TCHAR)-1);
+	}
 	else if (cscmp(p, TEXT("--mac-binary")) == 0) {
 	    opt->mac_type = CMAC_TYPE_MACBIN;
 	}
@@ -505,6 +787,38 @@ parse_args(OPT *opt, int argc, TCHAR *argv[])
 	else if (cscmp(p, TEXT("--quiet")) == 0) {
 	    opt->quiet = TRUE;
 	}
+	else if (cscmp(p, TEXT("--resize-filter")) == 0) {
+	    char buf[MAXSTR];
+	    int i;
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    memset(buf, 0, sizeof(buf));
+	    cs_to_narrow(buf, (int)sizeof(buf)-1, argv[arg], 
+		(int)cslen(argv[arg])+1);
+	    for (i=0; resize_filters[i].name; i++)
+		if (strcmp(buf, resize_filters[i].name) == 0)
+		    break;
+	    if (resize_filters[i].name == NULL)
+		return arg;
+	    opt->resize_filter = resize_filters[i].filter;
+	}
+	else if (cscmp(p, TEXT("--tiff-compress")) == 0) {
+	    char buf[MAXSTR];
+	    int i;
+	    arg++;
+	    if (arg == argc)
+		return arg;
+	    memset(buf, 0, sizeof(buf));
+	    cs_to_narrow(buf, (int)sizeof(buf)-1, argv[arg], 
+		(int)cslen(argv[arg])+1);
+	    for (i=0; tiff_compressions[i].name; i++)
+		if (strcmp(buf, tiff_compressions[i].name) == 0)
+		    break;
+	    if (tiff_compressions[i].name == NULL)
+		return arg;
+	    opt->tiff_compress = tiff_compressions[i].compress;
+	}
 	else if ((cscmp(p, TEXT("--debug")) == 0) ||
 	    (cscmp(p, TEXT("-d")) == 0)) {
 	    opt->debug = TRUE;
@@ -545,17 +859,28 @@ parse_args(OPT *opt, int argc, TCHAR *argv[])
 	    opt->image_encode = IMAGE_ENCODE_ASCII85;
 	}	
 	else if (cscmp(p, TEXT("--image-compress")) == 0) {
-	    /* Not in user documentation - for debug purposes only */
 	    char buf[MAXSTR];
+	    int i;
 	    arg++;
 	    if (arg == argc)
 		return arg;
+	    memset(buf, 0, sizeof(buf));
 	    cs_to_narrow(buf, (int)sizeof(buf)-1, argv[arg], 
 		(int)cslen(argv[arg])+1);
-	    opt->image_compress = atoi(buf);
-	    if ((opt->image_compress < IMAGE_COMPRESS_NONE) ||
-	        (opt->image_compress > IMAGE_COMPRESS_LZW))
-	    opt->image_compress = IMAGE_COMPRESS_LZW;
+	    for (i=0; image_compressions[i].name; i++)
+		if (strcmp(buf, image_compressions[i].name) == 0)
+		    break;
+	    if (image_compressions[i].name != NULL)
+		opt->image_compress = image_compressions[i].compress;
+	    else if ((buf[0] >= '0') && (buf[0] <= '9')) {
+		/* numbers are still accepted, for old scripts */
+		opt->image_compress = atoi(buf);
+		if ((opt->image_compress < IMAGE_COMPRESS_NONE) ||
+		    (opt->image_compress > IMAGE_COMPRESS_AUTO))
+		opt->image_compress = IMAGE_COMPRESS_LZW;
+	    }
+	    else
+		return arg;
 	}
 	else if ((cscmp(p, TEXT("--help")) == 0) || (cscmp(p, TEXT("-h"))==0)) {
 	    opt->help = TRUE;
@@ -660,8 +985,6 @@ int main(int argc, char *argv[])
 #endif
 {
     GSview *app;
-    Doc *doc = NULL;
-    Doc *doc2 = NULL;
     int code = 0;
     int i, arg;
     OPT opt;
@@ -701,6 +1024,23 @@ int main(int argc, char *argv[])
         fprintf(MSGOUT, "Can't create epstool app\n");
 	return 1;
     }
+    image_convert_init();
+    pool_init(opt.threads);
+    if ((opt.image_compress == IMAGE_COMPRESS_FLATE) &&
+	((zlib_load(app) != 0) || !flate_available())) {
+	app_csmsgf(app, 
+	    TEXT("Can't load zlib for Flate compression, using LZW\n"));
+	opt.image_compress = IMAGE_COMPRESS_LZW;
+    }
+    if (opt.image_compress == IMAGE_COMPRESS_AUTO)
+	zlib_load(app);		/* Flate is only tried if this works */
+    if (((opt.tiff_compress & TIFF_COMPRESS_MASK) == TIFF_COMPRESS_DEFLATE) &&
+	((zlib_load(app) != 0) || !flate_available())) {
+	app_csmsgf(app, 
+	    TEXT("Can't load zlib for Deflate compression, using LZW\n"));
+	opt.tiff_compress = TIFF_COMPRESS_LZW | 
+	    (opt.tiff_compress & TIFF_COMPRESS_PREDICTOR);
+    }
 
     if (arg != 0) {
 	debug |= DEBUG_LOG;
@@ -725,7 +1065,33 @@ int main(int argc, char *argv[])
 	app_csmsgf(app, TEXT("No command specified.\n"));
 	code = -1;
     }
-    if (opt.input[0] == '\0') {
+    if (opt.batch[0] != '\0') {
+	if (opt.input[0] != '\0') {
+	    debug |= DEBUG_LOG;
+	    app_csmsgf(app, TEXT("Input file can't be used with --batch.\n"));
+	    code = -1;
+	}
+	if (opt.combine[0] != '\0') {
+	    debug |= DEBUG_LOG;
+	    app_csmsgf(app, 
+	      TEXT("--combine-separations can't be used with --batch.\n"));
+	    code = -1;
+	}
+	if (opt.cmd == CMD_PREVIEWS) {
+	    debug |= DEBUG_LOG;
+	    app_csmsgf(app, 
+	      TEXT("--add-preview can't be used with --batch.\n"));
+	    code = -1;
+	}
+    }
+    else if (opt.cmd == CMD_CACHE_STATS) {
+	if (opt.cachedir[0] == '\0') {
+	    debug |= DEBUG_LOG;
+	    app_csmsgf(app, TEXT("--cache-stats requires --cache.\n"));
+	    code = -1;
+	}
+    }
+    else if (opt.input[0] == '\0') {
 	debug |= DEBUG_LOG;
 	app_csmsgf(app, TEXT("Input file not specified.\n"));
 	code = -1;
@@ -741,7 +1107,8 @@ int main(int argc, char *argv[])
 	else
 	    fclose(f);
     }
-    if (code == 0) {
+    if ((code == 0) && (opt.batch[0] == '\0') && 
+	(opt.cmd != CMD_CACHE_STATS)) {
 	FILE *f = csfopen(opt.input, TEXT("rb"));
 	if (f == (FILE*)NULL) {
 	    debug |= DEBUG_LOG;
@@ -751,14 +1118,22 @@ int main(int argc, char *argv[])
 	else
 	    fclose(f);
     }
-    if ((opt.output[0] == '\0') && 
+    if ((opt.output[0] == '\0') && (opt.batch[0] == '\0') &&
         !((opt.cmd == CMD_DCS2_REPORT) || 
 	  (opt.cmd == CMD_TEST) ||
-	  (opt.cmd == CMD_DUMP)) ) {
+	  (opt.cmd == CMD_DUMP) ||
+	  (opt.cmd == CMD_CACHE_STATS) ||
+	  (opt.cmd == CMD_PREVIEWS)) ) {
 	debug |= DEBUG_LOG;
 	app_csmsgf(app, TEXT("Output file not specified.\n"));
 	code = -1;
     }
+    if ((opt.output[0] != '\0') && (opt.cmd == CMD_PREVIEWS)) {
+	debug |= DEBUG_LOG;
+	app_csmsgf(app, 
+	  TEXT("Output file can't be used with --add-preview.\n"));
+	code = -1;
+    }
     if ((opt.output[0] == '-') && (opt.output[1] == '\0'))
         opt.output[0] = '\0';  /* use stdout */
     if (code != 0) {
@@ -768,32 +1143,113 @@ int main(int argc, char *argv[])
 	return 1;
     }
 
-    if (opt.cmd == CMD_DUMP)
-        dump_macfile(opt.input, 1);
+    if (opt.gsdll[0] != '\0') {
+	/* Render with the Ghostscript library instead of the executable */
+	opt.gsdisp = gsdisp_load(app, opt.gsdll);
+	if (opt.gsdisp == NULL)
+	    app_csmsgf(app, 
+		TEXT("Can't load \042%s\042, using \042%s\042 instead.\n"),
+		opt.gsdll, opt.gs);
+	else
+	    gsdisp_version(opt.gsdisp, opt.gsdll_version, 
+		(int)sizeof(opt.gsdll_version));
+    }
+
+    if (opt.cachedir[0] != '\0') {
+	opt.cache = cache_open(app, opt.cachedir, 
+	    (unsigned long)opt.cache_size * 1024 * 1024);
+	if (opt.cache == NULL)
+	    code = -1;
+	else if ((opt.cmd != CMD_CACHE_STATS) && 
+	    ((opt.gsdisp == NULL) || opt.bbox))
+	    get_gs_version(app, &opt);	/* before --jobs workers start */
+    }
+
+    if (code == 0) {
+	if (opt.cmd == CMD_CACHE_STATS)
+	    code = epstool_cache_stats(app, &opt);
+	else if (opt.batch[0] != '\0')
+	    code = epstool_batch(app, &opt);
+	else
+	    code = epstool_process(app, &opt);
+    }
+
+    if (opt.gsdisp) {
+	gsdisp_unload(opt.gsdisp);
+	opt.gsdisp = NULL;
+    }
+    if (opt.cache) {
+	cache_close(opt.cache);
+	opt.cache = NULL;
+    }
+    pool_finish();
+
+    app_unref(app);
+
+#ifdef DEBUG_MALLOC
+    debug_memory_report();
+#endif
+
+    debug &= ~DEBUG_MEM;
+    while (opt.rename_sep) {
+	RENAME_SEPARATION *rs = opt.rename_sep;
+	if (rs->oldname)
+	    free((void *)rs->oldname);
+	if (rs->newname)
+	    free((void *)rs->newname);
+	opt.rename_sep = rs->next;
+	free(rs);
+    }
+    while (opt.previews) {
+	PREVIEW_OUTPUT *po = opt.previews;
+	opt.previews = po->next;
+	free(po);
+    }
+
+    if (!opt.quiet)
+        fprintf(MSGOUT, "%s\n", code == 0 ? "OK" : "Failed");
+    if (code != 0)
+	return 1;
+    return code;
+}
+
+/****************************************************************/
+
+/* Process one input file */
+static int
+epstool_process(GSview *app, OPT *opt)
+{
+    Doc *doc = NULL;
+    Doc *doc2 = NULL;
+    int code = 0;
+
+    if (opt->cmd == CMD_DUMP)
+        dump_macfile(opt->input, 1);
 
-    doc = epstool_open_document(app, &opt, opt.input);
+    doc = epstool_open_document(app, opt, opt->input);
     if (doc == NULL)
 	code = -1;
 
-    if (opt.combine[0]) {
+    if (opt->combine[0]) {
 	/* open second DCS2 input file */
-	doc2 = epstool_open_document(app, &opt, opt.combine);
+	doc2 = epstool_open_document(app, opt, opt->combine);
 	if (doc2 == NULL)
 	    code = -1;
     }
 
-    if ((code == 0) && opt.bbox) {
-	switch (opt.cmd) {
+    if ((code == 0) && opt->bbox) {
+	switch (opt->cmd) {
 	    case CMD_TIFF4:
 	    case CMD_TIFF6U:
 	    case CMD_TIFF6P:
 	    case CMD_INTERCHANGE:
 	    case CMD_WMF:
 	    case CMD_COPY:
+	    case CMD_PREVIEWS:
 		if (doc->dsc->dcs2) {
 		    debug |= DEBUG_LOG;
 		    app_csmsgf(app, TEXT("Ignoring --bbox for DCS 2.0.\n"));
-		    opt.bbox = 0;
+		    opt->bbox = 0;
 		}
 		/* all others are these OK */
 		break;
@@ -801,12 +1257,12 @@ int main(int argc, char *argv[])
 		debug |= DEBUG_LOG;
 		app_csmsgf(app, TEXT(
 		  "Can't use --bbox with this command.  Ignoring --bbox.\n"));
-		opt.bbox = 0;
+		opt->bbox = 0;
 	}
     }
 
     if (code == 0) {
-      switch (opt.cmd) {
+      switch (opt->cmd) {
 	case CMD_TIFF4:
 	case CMD_TIFF6U:
 	case CMD_TIFF6P:
@@ -815,30 +1271,33 @@ int main(int argc, char *argv[])
 	case CMD_WMF:
 	case CMD_PICT:
     	case CMD_USER:
-	    code = epstool_add_preview(doc, &opt);
+	    code = epstool_add_preview(doc, opt);
+	    break;
+	case CMD_PREVIEWS:
+	    code = epstool_add_previews(doc, opt);
 	    break;
 	case CMD_DCS2_SINGLE:
 	case CMD_DCS2_MULTI:
 	    if (doc->dsc->dcs2)
-		code = epstool_dcs2_check_files(doc, &opt);
+		code = epstool_dcs2_check_files(doc, opt);
 	    if (code == 0)
-		code = epstool_dcs2_copy(doc, doc2, &opt); 
+		code = epstool_dcs2_copy(doc, doc2, opt); 
 	    break;
 	case CMD_DCS2_REPORT:
 	    code = epstool_dcs2_report(doc); 
 	    break;
 	case CMD_PREVIEW:
 	case CMD_POSTSCRIPT:
-	    code = epstool_extract(doc, &opt);
+	    code = epstool_extract(doc, opt);
 	    break;
 	case CMD_BITMAP:
-	    code = epstool_bitmap(doc, &opt);
+	    code = epstool_bitmap(doc, opt);
 	    break;
 	case CMD_COPY:
-	    code = epstool_copy(doc, &opt);
+	    code = epstool_copy(doc, opt);
 	    break;
 	case CMD_TEST:
-	    code = epstool_test(doc, &opt);
+	    code = epstool_test(doc, opt);
 	    break;
 	case CMD_DUMP:
 	    if (doc && doc->dsc)
@@ -859,72 +1318,348 @@ int main(int argc, char *argv[])
 	doc_remove(doc);	/* detach doc from app */
 	doc_unref(doc);
     }
+    if (doc2) {
+	doc_close(doc2);
+	doc_remove(doc2);
+	doc_unref(doc2);
+    }
 
-    app_unref(app);
+    return code;
+}
 
-#ifdef DEBUG_MALLOC
-    debug_memory_report();
+/****************************************************************/
+/* Batch processing */
+
+typedef struct BATCH_s {
+    FILE *list;			/* manifest, or NULL */
+#ifdef UNIX
+    DIR *dir;			/* directory, or NULL */
 #endif
+    TCHAR dirname[MAXSTR];
+} BATCH;
 
-    debug &= ~DEBUG_MEM;
-    while (opt.rename_sep) {
-	RENAME_SEPARATION *rs = opt.rename_sep;
-	if (rs->oldname)
-	    free((void *)rs->oldname);
-	if (rs->newname)
-	    free((void *)rs->newname);
-	opt.rename_sep = rs->next;
-	free(rs);
-    }
+typedef struct BATCH_JOB_s {
+#ifdef UNIX
+    pid_t pid;			/* worker process, or 0 if slot is free */
+#endif
+    TCHAR input[MAXSTR];
+} BATCH_JOB;
 
-    if (!opt.quiet)
-        fprintf(MSGOUT, "%s\n", code == 0 ? "OK" : "Failed");
-    if (code != 0)
-	return 1;
-    return code;
+static int
+batch_open(GSview *app, BATCH *b, LPCTSTR name)
+{
+    memset(b, 0, sizeof(BATCH));
+    if (cscmp(name, TEXT("-")) == 0) {
+	b->list = stdin;
+	return 0;
+    }
+#ifdef UNIX
+    {
+	struct stat fstat;
+	if ((stat(name, &fstat) == 0) && S_ISDIR(fstat.st_mode)) {
+	    b->dir = opendir(name);
+	    if (b->dir == NULL) {
+		app_csmsgf(app, TEXT("Can't open directory \042%s\042\n"),
+		    name);
+		return -1;
+	    }
+	    csncpy(b->dirname, name, sizeof(b->dirname)/sizeof(TCHAR)-1);
+	    return 0;
+	}
+    }
+#endif
+    b->list = csfopen(name, TEXT("rb"));
+    if (b->list == NULL) {
+	app_csmsgf(app, TEXT("Can't open batch file \042%s\042\n"), name);
+	return -1;
+    }
+    return 0;
 }
 
-/****************************************************************/
+static void
+batch_close(BATCH *b)
+{
+    if (b->list && (b->list != stdin))
+	fclose(b->list);
+#ifdef UNIX
+    if (b->dir)
+	closedir(b->dir);
+#endif
+    memset(b, 0, sizeof(BATCH));
+}
 
+/* Get the next input and output filename.
+ * A manifest has one input filename per line, optionally followed 
+ * by a tab and the output filename.  Blank lines and lines starting
+ * with '#' are ignored.
+ * A directory supplies every file it contains.
+ * If no output is given and --output is a directory, the output
+ * is written there with the same name as the input.
+ * Returns 1 if there is another job, 0 if there are no more.
+ */
 static int
-epstool_add_preview(Doc *doc, OPT *opt)
+batch_next(BATCH *b, OPT *opt, TCHAR *input, TCHAR *output, int len)
 {
-    int code = 0;
-    CDSCBBOX devbbox = {0,0,595,842};
-    CDSCBBOX bbox = {0, 0, 0, 0};
-    CDSCFBBOX hires_bbox = {0.0, 0.0, 0.0, 0.0};
-    CDSCFBBOX *phires_bbox = NULL;
-    const TCHAR *device = COLOUR_DEVICE;
-    FILE *f;
-    TCHAR preview[MAXSTR];
-    IMAGE *img = NULL;
-    if (opt->device[0] != '\0')
-	device = opt->device;
-    else if (opt->cmd == CMD_INTERCHANGE)
-	device = MONO_DEVICE;
-    if (opt->cmd == CMD_TIFF4)
-	device = MONO_DEVICE;
+    char line[MAXSTR*2];
+    char *p;
+    char *tab;
+    const TCHAR *base;
 
-    if (doc->dsc->bbox) {
-	bbox = *doc->dsc->bbox;
+    input[0] = output[0] = '\0';
+    while (input[0] == '\0') {
+#ifdef UNIX
+	if (b->dir) {
+	    struct dirent *entry;
+	    struct stat fstat;
+	    entry = readdir(b->dir);
+	    if (entry == NULL)
+		return 0;
+	    if (entry->d_name[0] == '.')
+		continue;
+	    csnprintf(input, len, TEXT("%s%s%s"), b->dirname,
+		TEXT(PATHSEP), entry->d_name);
+	    if ((stat(input, &fstat) != 0) || !S_ISREG(fstat.st_mode))
+		input[0] = '\0';
+	    continue;
+	}
+#endif
+	if (fgets(line, sizeof(line), b->list) == NULL)
+	    return 0;
+	p = line + strlen(line);
+	while ((p > line) && ((p[-1] == '\r') || (p[-1] == '\n')))
+	    *(--p) = '\0';
+	if ((line[0] == '\0') || (line[0] == '#'))
+	    continue;
+	tab = strchr(line, '\t');
+	if (tab) {
+	    *tab++ = '\0';
+	    while (*tab == '\t')
+		tab++;
+	    narrow_to_cs(output, len-1, tab, (int)strlen(tab)+1);
+	}
+	narrow_to_cs(input, len-1, line, (int)strlen(line)+1);
     }
-    else
-	opt->bbox = 1;
 
-    if (doc->dsc->hires_bbox) {
-	hires_bbox = *doc->dsc->hires_bbox;
-	phires_bbox = &hires_bbox;
+    if ((output[0] == '\0') && (opt->output[0] != '\0')) {
+	base = input + cslen(input);
+	while ((base > input) && (base[-1] != '/') && (base[-1] != '\\'))
+	    base--;
+	csnprintf(output, len, TEXT("%s%s%s"), opt->output, 
+	    TEXT(PATHSEP), base);
     }
+    return 1;
+}
 
-    if (opt->cmd == CMD_USER) {
-	/* Attempt to load BMP or PPM */
-	/* If these fail, assume it is TIFF or WMF */
-	img = bmpfile_to_image(opt->user_preview);
-	if (img == NULL)
-	    img = pnmfile_to_image(opt->user_preview);
-    }
-    else if (opt->cmd == CMD_TIFF) {
-	/* We'll use ghostscript to make the image. */
+/* Report the result of one job */
+static void
+batch_report(GSview *app, OPT *opt, LPCTSTR input, int code)
+{
+    if (code != 0) {
+	debug |= DEBUG_LOG;
+	app_csmsgf(app, TEXT("Failed: %s\n"), input);
+    }
+    else if (!opt->quiet)
+	app_csmsgf(app, TEXT("OK: %s\n"), input);
+}
+
+/* Return TRUE if output is the same file as input.
+ * On Unix this finds other names for the same file,
+ * otherwise only the same name.
+ */
+static BOOL
+batch_same_file(LPCTSTR input, LPCTSTR output)
+{
+#ifdef UNIX
+    struct stat istat, ostat;
+    if ((stat(input, &istat) != 0) || (stat(output, &ostat) != 0))
+	return FALSE;
+    return (istat.st_dev == ostat.st_dev) && (istat.st_ino == ostat.st_ino);
+#else
+    return (cscmp(input, output) == 0);
+#endif
+}
+
+/* Run one job with its own copy of the options */
+static int
+batch_job(GSview *app, OPT *opt, LPCTSTR input, LPCTSTR output)
+{
+    OPT jobopt;
+    FILE *f;
+    memcpy(&jobopt, opt, sizeof(OPT));
+    jobopt.jobs = 1;	/* files are already processed in parallel */
+    csncpy(jobopt.input, input, sizeof(jobopt.input)/sizeof(TCHAR)-1);
+    csncpy(jobopt.output, output, sizeof(jobopt.output)/sizeof(TCHAR)-1);
+    if ((f = csfopen(jobopt.input, TEXT("rb"))) == (FILE *)NULL) {
+	app_csmsgf(app, TEXT("Failed to open \042%s\042.\n"), jobopt.input);
+	return -1;
+    }
+    fclose(f);
+    if ((jobopt.output[0] == '\0') &&
+        !((jobopt.cmd == CMD_DCS2_REPORT) || 
+	  (jobopt.cmd == CMD_TEST) ||
+	  (jobopt.cmd == CMD_DUMP)) ) {
+	app_csmsgf(app, TEXT("Output file not specified for \042%s\042.\n"),
+	    jobopt.input);
+	return -1;
+    }
+    if ((jobopt.output[0] != '\0') && 
+	batch_same_file(jobopt.input, jobopt.output)) {
+	/* writing the output would destroy the input */
+	app_csmsgf(app, 
+	    TEXT("Output \042%s\042 is the same file as the input.\n"),
+	    jobopt.output);
+	return -1;
+    }
+    return epstool_process(app, &jobopt);
+}
+
+/* Process many files with the same options.
+ * On Unix, each file is processed by a worker process, with
+ * at most opt->jobs running at once.  Files are read from the
+ * manifest or directory only when a worker is free, so the
+ * queue never holds more than opt->jobs files.
+ * On other platforms files are processed one at a time.
+ */
+static int
+epstool_batch(GSview *app, OPT *opt)
+{
+    BATCH b;
+    BATCH_JOB *jobs;
+    TCHAR input[MAXSTR];
+    TCHAR output[MAXSTR];
+    int count = 0;
+    int failed = 0;
+    int running = 0;
+    int more = 1;
+    int code;
+    int i;
+
+    if (batch_open(app, &b, opt->batch) != 0)
+	return -1;
+    jobs = (BATCH_JOB *)malloc(opt->jobs * sizeof(BATCH_JOB));
+    if (jobs == NULL) {
+	batch_close(&b);
+	return -1;
+    }
+    memset(jobs, 0, opt->jobs * sizeof(BATCH_JOB));
+
+    while (more || running) {
+	/* start jobs until all workers are busy */
+	while (more && (running < opt->jobs)) {
+	    if (!batch_next(&b, opt, input, output, 
+		sizeof(input)/sizeof(TCHAR))) {
+		more = 0;
+		break;
+	    }
+	    count++;
+#ifdef UNIX
+	    {
+		pid_t pid;
+		fflush(NULL);
+		pid = fork();
+		if (pid == 0) {
+		    /* worker */
+		    code = batch_job(app, opt, input, output);
+		    fflush(NULL);
+		    _exit(code == 0 ? 0 : 1);
+		}
+		if (pid != (pid_t)-1) {
+		    for (i=0; i<opt->jobs; i++)
+			if (jobs[i].pid == 0)
+			    break;
+		    jobs[i].pid = pid;
+		    csncpy(jobs[i].input, input, 
+			sizeof(jobs[i].input)/sizeof(TCHAR)-1);
+		    running++;
+		    continue;
+		}
+		app_csmsgf(app, 
+		    TEXT("Failed to fork, error=%d.  Running in this process.\n"),
+		    errno);
+	    }
+#endif
+	    code = batch_job(app, opt, input, output);
+	    if (code != 0)
+		failed++;
+	    batch_report(app, opt, input, code);
+	}
+
+#ifdef UNIX
+	if (running) {
+	    /* wait for a worker to finish */
+	    int status;
+	    pid_t pid = wait(&status);
+	    if (pid == (pid_t)-1) {
+		app_csmsgf(app, TEXT("Lost worker processes, error=%d\n"),
+		    errno);
+		failed += running;
+		break;
+	    }
+	    for (i=0; i<opt->jobs; i++) {
+		if (jobs[i].pid == pid) {
+		    code = (WIFEXITED(status) && (WEXITSTATUS(status) == 0)) 
+			? 0 : -1;
+		    if (code != 0)
+			failed++;
+		    batch_report(app, opt, jobs[i].input, code);
+		    jobs[i].pid = 0;
+		    running--;
+		    break;
+		}
+	    }
+	}
+#endif
+    }
+
+    free(jobs);
+    batch_close(&b);
+    if (!opt->quiet || failed)
+	app_csmsgf(app, TEXT("Batch: %d files, %d OK, %d failed\n"),
+	    count, count - failed, failed);
+    return (failed == 0) ? 0 : -1;
+}
+
+/****************************************************************/
+
+static int
+epstool_add_preview(Doc *doc, OPT *opt)
+{
+    int code = 0;
+    CDSCBBOX devbbox = {0,0,595,842};
+    CDSCBBOX bbox = {0, 0, 0, 0};
+    CDSCFBBOX hires_bbox = {0.0, 0.0, 0.0, 0.0};
+    CDSCFBBOX *phires_bbox = NULL;
+    const TCHAR *device = COLOUR_DEVICE;
+    FILE *f;
+    TCHAR preview[MAXSTR];
+    IMAGE *img = NULL;
+    if (opt->device[0] != '\0')
+	device = opt->device;
+    else if (opt->cmd == CMD_INTERCHANGE)
+	device = MONO_DEVICE;
+    if (opt->cmd == CMD_TIFF4)
+	device = MONO_DEVICE;
+
+    if (doc->dsc->bbox) {
+	bbox = *doc->dsc->bbox;
+    }
+    else
+	opt->bbox = 1;
+
+    if (doc->dsc->hires_bbox) {
+	hires_bbox = *doc->dsc->hires_bbox;
+	phires_bbox = &hires_bbox;
+    }
+
+    if (opt->cmd == CMD_USER) {
+	/* Attempt to load BMP or PPM */
+	/* If these fail, assume it is TIFF or WMF */
+	img = bmpfile_to_image(opt->user_preview);
+	if (img == NULL)
+	    img = pnmfile_to_image(opt->user_preview);
+    }
+    else if (opt->cmd == CMD_TIFF) {
+	/* We'll use ghostscript to make the image. */
     }
     else {
 	img = make_preview_image(doc, opt, 0, device, 
@@ -949,17 +1684,18 @@ epstool_add_preview(Doc *doc, OPT *opt)
     switch (opt->cmd) {
 	case CMD_TIFF4:
 	    code = make_eps_tiff(doc, img, devbbox, &bbox, phires_bbox, 
-		opt->dpi, opt->dpi, TRUE, FALSE, opt->doseps_reverse,
+		opt->dpi, opt->dpi, TRUE, TIFF_COMPRESS_NONE, opt->doseps_reverse,
 		opt->output);
 	    break;
 	case CMD_TIFF6U:
 	    code = make_eps_tiff(doc, img, devbbox, &bbox, phires_bbox, 
-		opt->dpi, opt->dpi, FALSE, FALSE, opt->doseps_reverse,
+		opt->dpi, opt->dpi, FALSE, TIFF_COMPRESS_NONE, opt->doseps_reverse,
 		opt->output);
 	    break;
 	case CMD_TIFF6P:
 	    code = make_eps_tiff(doc, img, devbbox, &bbox, phires_bbox, 
-		opt->dpi, opt->dpi, FALSE, TRUE, opt->doseps_reverse,
+		opt->dpi, opt->dpi, FALSE, opt->tiff_compress, 
+		opt->doseps_reverse,
 		opt->output);
 	    break;
 	case CMD_TIFF:
@@ -999,8 +1735,8 @@ epstool_add_preview(Doc *doc, OPT *opt)
     	case CMD_USER:
 	    if (img)
 		code = make_eps_tiff(doc, img, devbbox, &bbox, phires_bbox,
-		    opt->dpi, opt->dpi, FALSE, TRUE, opt->doseps_reverse, 
-		    opt->output);
+		    opt->dpi, opt->dpi, FALSE, opt->tiff_compress, 
+		    opt->doseps_reverse, opt->output);
 	    else
 	        code = make_eps_user(doc, opt->user_preview, 
 		    opt->doseps_reverse, opt->output);
@@ -1014,6 +1750,126 @@ epstool_add_preview(Doc *doc, OPT *opt)
     return code;
 }
 
+/* Render once, then write each --add-preview output from 
+ * the same image.
+ */
+static int
+epstool_add_previews(Doc *doc, OPT *opt)
+{
+    int code = 0;
+    CDSCBBOX devbbox;
+    CDSCBBOX bbox = {0, 0, 0, 0};
+    CDSCFBBOX hires_bbox = {0.0, 0.0, 0.0, 0.0};
+    CDSCFBBOX *phires_bbox = NULL;
+    const TCHAR *device = COLOUR_DEVICE;
+    IMAGE *img;
+    IMAGE *mono = NULL;
+    PREVIEW_OUTPUT *po;
+    if (opt->device[0] != '\0')
+	device = opt->device;
+
+    if (doc->dsc->bbox)
+	bbox = *doc->dsc->bbox;
+    else
+	opt->bbox = 1;
+    if (doc->dsc->hires_bbox)
+	hires_bbox = *doc->dsc->hires_bbox;
+
+    img = make_preview_image(doc, opt, 0, device, 
+	&bbox, &hires_bbox, opt->bbox);
+    if (img == NULL) {
+	app_csmsgf(doc->app, TEXT("Couldn't make preview image\n"));
+	return -1;
+    }
+    if ((hires_bbox.fllx < hires_bbox.furx) &&
+	(hires_bbox.flly < hires_bbox.fury))
+	phires_bbox = &hires_bbox;
+    devbbox.llx = devbbox.lly = 0;
+    devbbox.urx = img->width;
+    devbbox.ury = img->height;
+
+    for (po = opt->previews; (po != NULL) && (code == 0); po = po->next) {
+	switch (po->type) {
+	    case PREVIEW_TIFF4:
+		/* image_to_tiff() makes it monochrome */
+		code = make_eps_tiff(doc, img, devbbox, &bbox, phires_bbox, 
+		    opt->dpi, opt->dpi, TRUE, TIFF_COMPRESS_NONE, opt->doseps_reverse,
+		    po->filename);
+		break;
+	    case PREVIEW_TIFF6U:
+		code = make_eps_tiff(doc, img, devbbox, &bbox, phires_bbox, 
+		    opt->dpi, opt->dpi, FALSE, TIFF_COMPRESS_NONE, opt->doseps_reverse,
+		    po->filename);
+		break;
+	    case PREVIEW_TIFF6P:
+		code = make_eps_tiff(doc, img, devbbox, &bbox, phires_bbox, 
+		    opt->dpi, opt->dpi, FALSE, opt->tiff_compress, 
+		    opt->doseps_reverse,
+		    po->filename);
+		break;
+	    case PREVIEW_INTERCHANGE:
+		/* An interchange preview is monochrome unless 
+		 * --device is used, as for --add-interchange-preview.
+		 * Convert it once for all interchange outputs.
+		 */
+		if ((mono == NULL) && (opt->device[0] == '\0')) {
+		    mono = (IMAGE *)malloc(sizeof(IMAGE));
+		    if ((mono != NULL) && (image_copy(mono, img, 
+			display_format(MONO_DEVICE)) != 0)) {
+			free(mono);
+			mono = NULL;
+		    }
+		    if (mono == NULL) {
+			code = -1;
+			break;
+		    }
+		}
+		code = make_eps_interchange(doc, mono ? mono : img, devbbox, 
+		    &bbox, phires_bbox, po->filename);
+		break;
+	    case PREVIEW_WMF:
+		code = make_eps_metafile(doc, img, devbbox, &bbox, 
+		    phires_bbox, opt->dpi, opt->dpi, opt->doseps_reverse, 
+		    po->filename);
+		break;
+	    case PREVIEW_PICT:
+		code = make_eps_pict(doc, img, &bbox, phires_bbox, 
+		    opt->dpi, opt->dpi, opt->mac_type, po->filename);
+		break;
+	    case PREVIEW_BMP:
+		code = image_to_bmpfile(img, po->filename, 
+		    opt->dpi, opt->dpi);
+		break;
+	    case PREVIEW_PBM:
+		code = image_to_pnmfile(img, po->filename, PBMRAW);
+		break;
+	    case PREVIEW_PGM:
+		code = image_to_pnmfile(img, po->filename, PGMRAW);
+		break;
+	    case PREVIEW_PPM:
+		code = image_to_pnmfile(img, po->filename, PPMRAW);
+		break;
+	    case PREVIEW_PNG:
+		code = image_to_pngfile(img, po->filename);
+		break;
+	    case PREVIEW_TIFF:
+		code = image_to_tifffile(img, po->filename, 
+		    opt->dpi, opt->dpi, opt->tiff_compress);
+		break;
+	}
+	if (code != 0)
+	    app_csmsgf(doc->app, TEXT("Failed to write \042%s\042\n"),
+		po->filename);
+	else if (!opt->quiet)
+	    app_csmsgf(doc->app, TEXT("Wrote \042%s\042\n"), po->filename);
+    }
+
+    if (mono)
+	bitmap_image_free(mono);
+    bitmap_image_free(img);
+    return code;
+}
+
 /****************************************************************/
 
 static int
@@ -1130,11 +1986,27 @@ epstool_copy(Doc *doc, OPT *opt)
     return code;
 }
 
+/* With --debug, say which compression --image-compress auto chose */
+static void
+report_image_compress(Doc *doc, OPT *opt, int compress)
+{
+    int i;
+    if ((opt->image_compress != IMAGE_COMPRESS_AUTO) || !opt->debug)
+	return;
+    for (i=0; image_compressions[i].name; i++)
+	if (image_compressions[i].compress == compress)
+	    break;
+    if (image_compressions[i].name)
+	app_msgf(doc->app, "Image compression chosen: %s\n", 
+	    image_compressions[i].name);
+}
+
 /* Save a BMP, PBM or PNG as an EPS file */
 static int 
 epstool_copy_bitmap(Doc *doc, OPT *opt)
 {
     int code = 0;
+    int compress;
     IMAGE *img;
     img = bmpfile_to_image(doc->name);
     if (img == NULL)
@@ -1165,7 +2037,10 @@ epstool_copy_bitmap(Doc *doc, OPT *opt)
 	    code = image_to_eps(f, img, 0, 0, 
 	        (int)(width + 0.999), (int)(height + 0.999), 
 		0.0, 0.0, (float)width, (float)height,
-		opt->image_encode, opt->image_compress);
+		opt->image_encode, opt->image_compress, opt->flate_level,
+		&compress);
+	if (code == 0)
+	    report_image_compress(doc, opt, compress);
 	if (f)
 	    gfile_close(f);
      }
@@ -1610,12 +2485,18 @@ custom_colours_find(OPT *opt, const char *name)
 static float
 round_float(float f, int n)
 {
+    if (f < 0)
+	return -round_float(-f, n);
     return  (float)( ((int)(f * n + 0.5)) / (float)n );
 }
 
+/* Page size and offset used with the bbox device */
+#define BBOX_PAGESIZE 9400 /* Must be < 9419 on 7.07, < 150976 on 8.x */
+#define BBOX_OFFSET 3000
+
 /* Calculate the bounding box using the ghostscript bbox device */
 static int
-calculate_bbox(Doc *doc, OPT *opt, LPCTSTR psname, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+calculate_bbox_gs(Doc *doc, OPT *opt, LPCTSTR psname, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
 {
     FILE *bboxfile;
     TCHAR bboxname[MAXSTR];
@@ -1626,8 +2507,8 @@ calculate_bbox(Doc *doc, OPT *opt, LPCTSTR psname, CDSCBBOX *bbox, CDSCFBBOX *hi
     int code = 0;
     int llx, lly, urx, ury;
     float fllx, flly, furx, fury;
-    const int pagesize = 9400; /* Must be < 9419 on 7.07, < 150976 on 8.x */
-    const int offset = 3000;
+    const int pagesize = BBOX_PAGESIZE;
+    const int offset = BBOX_OFFSET;
     if ((bboxfile = app_temp_file(doc->app, bboxname, 
 	sizeof(bboxname)/sizeof(TCHAR))) == (FILE *)NULL) {
 	app_csmsgf(doc->app, TEXT("Can't create temporary bbox file \042%s\042\n"),
@@ -1635,6 +2516,7 @@ calculate_bbox(Doc *doc, OPT *opt, LPCTSTR psname, CDSCBBOX *bbox, CDSCFBBOX *hi
 	return -1;
     }
     fclose(bboxfile);
+    bboxfile = NULL;
 
     csnprintf(command, sizeof(command)/sizeof(TCHAR), TEXT(
 	"\042%s\042 %s -dNOPAUSE -dBATCH -sDEVICE=bbox %s \
@@ -1643,7 +2525,8 @@ calculate_bbox(Doc *doc, OPT *opt, LPCTSTR psname, CDSCBBOX *bbox, CDSCFBBOX *hi
 	pagesize, pagesize, offset, offset, psname);
     if (!opt->quiet)
 	app_csmsgf(doc->app, TEXT("%s\n"), command);
-    code = exec_program(command, -1, fileno(stdout), -1, NULL, NULL, bboxname);
+    code = exec_program(command, -1, fileno(stdout), -1, NULL, NULL, bboxname,
+	NULL, NULL);
     if (code != 0)
 	app_csmsgf(doc->app, 
 	    TEXT("Ghostscript failed to obtain bounding box\n"));
@@ -1689,73 +2572,1261 @@ calculate_bbox(Doc *doc, OPT *opt, LPCTSTR psname, CDSCBBOX *bbox, CDSCFBBOX *hi
 	}
     }
 
-    fclose(bboxfile);
-    if (!(debug & DEBUG_GENERAL))
-	csunlink(bboxname);
+    if (bboxfile)
+	fclose(bboxfile);
+    if (!(debug & DEBUG_GENERAL))
+	csunlink(bboxname);
+
+    if ((code == 0) && (!got_bbox)) {
+	app_csmsgf(doc->app, TEXT("Didn't get bounding box\n"));
+	code = -1;
+    }
+    if ((code == 0) && (!got_hires_bbox)) {
+	app_csmsgf(doc->app, TEXT("Didn't get hires bounding box\n"));
+	code = -1;
+    }
+    return code;
+}
+
+/****************************************************************/
+/* Cache keys and bounding box cache */
+
+/* Header comments which can't change how the page is drawn */
+static const char *cache_hash_ignore[] = {
+    "%%Title:", "%%Creator:", "%%CreationDate:", "%%For:", NULL
+};
+
+/* State for adding a page to the hash a block at a time,
+ * leaving out header comments that only describe the file,
+ * so that a file with changed metadata still hits the cache.
+ * Continuation lines of an ignored comment are also left out.
+ */
+typedef struct CACHE_PAGE_HASH_s {
+    HASH *h;
+    char prefix[16];		/* start of the current line */
+    unsigned int plen;
+    BOOL line_start;
+    BOOL skip;			/* leaving out the current line */
+    BOOL header;		/* in the header comments */
+    BOOL header_done;
+} CACHE_PAGE_HASH;
+
+static void
+cache_page_hash_init(CACHE_PAGE_HASH *ph, HASH *h)
+{
+    memset(ph, 0, sizeof(CACHE_PAGE_HASH));
+    ph->h = h;
+    ph->line_start = TRUE;
+}
+
+static void
+cache_page_hash_update(CACHE_PAGE_HASH *ph, const unsigned char *buf,
+    unsigned int count)
+{
+    unsigned int i = 0;
+    unsigned int j;
+    while (i < count) {
+	if (ph->line_start) {
+	    /* collect enough of the line to recognise it */
+	    ph->prefix[ph->plen++] = (char)buf[i++];
+	    if ((ph->prefix[ph->plen-1] != '\n') &&
+		(ph->plen < sizeof(ph->prefix)-1))
+		continue;
+	    ph->prefix[ph->plen] = '\0';
+	    if (!ph->header && !ph->header_done &&
+		(strncmp(ph->prefix, "%!PS-Adobe", 10) == 0))
+		ph->header = TRUE;
+	    else if (ph->header && ((ph->prefix[0] != '%') ||
+		(strncmp(ph->prefix, "%%EndComments", 13) == 0))) {
+		ph->header = FALSE;
+		ph->header_done = TRUE;
+	    }
+	    if (ph->header && ph->skip &&
+		(strncmp(ph->prefix, "%%+", 3) == 0))
+		;	/* continuation of an ignored comment */
+	    else {
+		ph->skip = FALSE;
+		for (j=0; ph->header && cache_hash_ignore[j]; j++)
+		    if (strncmp(ph->prefix, cache_hash_ignore[j],
+			strlen(cache_hash_ignore[j])) == 0)
+			ph->skip = TRUE;
+	    }
+	    if (!ph->skip)
+		hash_update(ph->h, ph->prefix, ph->plen);
+	    ph->line_start = (ph->prefix[ph->plen-1] == '\n');
+	    ph->plen = 0;
+	    continue;
+	}
+	/* rest of the line */
+	for (j=i; (j < count) && (buf[j] != '\n'); j++)
+	    ;
+	if (j < count) {
+	    j++;		/* include the end of line */
+	    ph->line_start = TRUE;
+	}
+	if (!ph->skip)
+	    hash_update(ph->h, buf+i, j-i);
+	i = j;
+    }
+}
+
+static void
+cache_page_hash_final(CACHE_PAGE_HASH *ph)
+{
+    if (ph->plen)
+	hash_update(ph->h, ph->prefix, ph->plen);	/* incomplete last line */
+    ph->plen = 0;
+}
+
+/* Add the bytes from begin to end of a file to the page hash */
+static void
+cache_page_hash_range(CACHE_PAGE_HASH *ph, GFile *f,
+    FILE_POS begin, FILE_POS end)
+{
+    unsigned char buf[16384];
+    unsigned int count;
+    if ((begin >= end) || (gfile_seek(f, begin, gfile_begin) != 0))
+	return;
+    while (begin < end) {
+	count = (unsigned int)min(end - begin, sizeof(buf));
+	if ((count = gfile_read(f, buf, count)) == 0)
+	    break;
+	cache_page_hash_update(ph, buf, count);
+	begin += count;
+    }
+}
+
+/* Add the page written by copy_page_temp() to the hash.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+cache_hash_page(HASH *h, LPCTSTR psname)
+{
+    CACHE_PAGE_HASH ph;
+    GFile *f = gfile_open(psname, gfile_modeRead);
+    if (f == NULL)
+	return -1;
+    cache_page_hash_init(&ph, h);
+    cache_page_hash_range(&ph, f, 0, gfile_get_length(f));
+    cache_page_hash_final(&ph);
+    gfile_close(f);
+    return 0;
+}
+
+/* Add a page of the document to the hash, reading the same parts
+ * of the file as copy_page_temp() but without writing a copy.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+cache_hash_doc_page(HASH *h, Doc *doc, int page)
+{
+    CDSC *dsc = doc->dsc;
+    CACHE_PAGE_HASH ph;
+    const char *fname;
+    TCHAR wfname[MAXSTR];
+    GFile *f;
+    if (dsc == NULL)
+	return -1;
+    cache_page_hash_init(&ph, h);
+    fname = dsc_find_platefile(dsc, page);
+    if (fname) {
+	/* A separation in a separate file */
+	narrow_to_cs(wfname, (int)sizeof(wfname), fname,
+	    (int)strlen(fname)+1);
+	if ((f = gfile_open(wfname, gfile_modeRead)) != (GFile *)NULL) {
+	    cache_page_hash_range(&ph, f, 0, gfile_get_length(f));
+	    gfile_close(f);
+	}
+    }
+    else {
+	if ((f = gfile_open(doc_name(doc), gfile_modeRead)) == (GFile *)NULL)
+	    return -1;
+	cache_page_hash_range(&ph, f, dsc->begincomments, dsc->endcomments);
+	cache_page_hash_range(&ph, f, dsc->begindefaults, dsc->enddefaults);
+	cache_page_hash_range(&ph, f, dsc->beginprolog, dsc->endprolog);
+	cache_page_hash_range(&ph, f, dsc->beginsetup, dsc->endsetup);
+	if (dsc->page_count && (page >= 0) && (page < (int)dsc->page_count))
+	    cache_page_hash_range(&ph, f,
+		dsc->page[page].begin, dsc->page[page].end);
+	cache_page_hash_range(&ph, f, dsc->begintrailer, dsc->endtrailer);
+	gfile_close(f);
+    }
+    cache_page_hash_final(&ph);
+    return 0;
+}
+
+/* Add a string to the hash */
+static void
+cache_hash_cs(HASH *h, LPCTSTR str)
+{
+    char buf[MAXSTR*4];
+    memset(buf, 0, sizeof(buf));
+    cs_to_narrow(buf, (int)sizeof(buf)-1, str, (int)cslen(str)+1);
+    hash_string(h, buf);
+}
+
+/* Add everything about Ghostscript that could change the result.
+ * library is TRUE if the result comes from opt->gsdisp,
+ * otherwise from the executable opt->gs.
+ */
+static void
+cache_hash_gs(HASH *h, GSview *app, OPT *opt, BOOL library)
+{
+    if (library) {
+	cache_hash_cs(h, opt->gsdll);
+	hash_string(h, opt->gsdll_version);
+    }
+    else {
+	if (!opt->gs_version_valid)
+	    get_gs_version(app, opt);
+	cache_hash_cs(h, opt->gs);
+	hash_string(h, opt->gs_version);
+    }
+    cache_hash_cs(h, opt->gsargs);
+}
+
+/* Write a bounding box as text for a cache entry */
+static void
+cache_format_bbox(char *buf, int len, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    /* %.9g is enough to read back the same float */
+    snprintf(buf, len, "%%%%BoundingBox: %d %d %d %d\n"
+	"%%%%HiResBoundingBox: %.9g %.9g %.9g %.9g\n",
+	bbox->llx, bbox->lly, bbox->urx, bbox->ury,
+	hires_bbox->fllx, hires_bbox->flly, 
+	hires_bbox->furx, hires_bbox->fury);
+    buf[len-1] = '\0';
+}
+
+/* Read a bounding box written by cache_format_bbox().
+ * Returns the number of bytes used, or -1 if it is not valid.
+ */
+static int
+cache_parse_bbox(const unsigned char *data, unsigned int length,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    char buf[MAXSTR];
+    unsigned int i;
+    int lines = 0;
+    /* the bounding box is the first two lines */
+    for (i=0; (i<length) && (i<sizeof(buf)-1) && (lines < 2); i++)
+	if ((buf[i] = (char)data[i]) == '\n')
+	    lines++;
+    buf[i] = '\0';
+    if ((lines != 2) ||
+	(sscanf(buf, "%%%%BoundingBox: %d %d %d %d\n"
+	"%%%%HiResBoundingBox: %f %f %f %f",
+	&bbox->llx, &bbox->lly, &bbox->urx, &bbox->ury,
+	&hires_bbox->fllx, &hires_bbox->flly, 
+	&hires_bbox->furx, &hires_bbox->fury) != 8))
+	return -1;
+    return (int)i;
+}
+
+/* Get the cache key for the bounding box of a page.
+ * This covers the page as written by copy_page_temp(), 
+ * and everything about Ghostscript that could change the result.
+ */
+static int
+bbox_cache_key(GSview *app, OPT *opt, LPCTSTR psname, char *key)
+{
+    HASH h;
+    char buf[MAXSTR];
+    hash_init(&h);
+    hash_string(&h, "epstool bbox 1");
+    cache_hash_gs(&h, app, opt, FALSE);
+    snprintf(buf, sizeof(buf), "%d %d", BBOX_PAGESIZE, BBOX_OFFSET);
+    hash_string(&h, buf);
+    if (cache_hash_page(&h, psname) != 0) {
+	hash_final(&h, key);
+	return -1;
+    }
+    hash_final(&h, key);
+    return 0;
+}
+
+/* Returns 0 on a hit */
+static int
+bbox_cache_get(Doc *doc, OPT *opt, const char *key, 
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    unsigned char *data;
+    unsigned int length;
+    int count;
+    CDSCBBOX cbbox;
+    CDSCFBBOX chires_bbox;
+    if (cache_get(opt->cache, key, "bbox", &data, &length) != 0)
+	return 1;
+    count = cache_parse_bbox(data, length, &cbbox, &chires_bbox);
+    free(data);
+    if (count < 0)
+	return 1;
+    *bbox = cbbox;
+    *hires_bbox = chires_bbox;
+    if (!opt->quiet) {
+	app_msgf(doc->app, "Bounding box from cache\n");
+	app_msgf(doc->app, "%%%%BoundingBox: %d %d %d %d\n",
+	    bbox->llx, bbox->lly, bbox->urx, bbox->ury);
+	app_msgf(doc->app, "%%%%HiResBoundingBox: %g %g %g %g\n",
+	    hires_bbox->fllx, hires_bbox->flly, 
+	    hires_bbox->furx, hires_bbox->fury);
+    }
+    return 0;
+}
+
+static void
+bbox_cache_put(OPT *opt, const char *key, 
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    char buf[MAXSTR];
+    cache_format_bbox(buf, (int)sizeof(buf), bbox, hires_bbox);
+    cache_put(opt->cache, key, "bbox", 
+	(const unsigned char *)buf, (unsigned int)strlen(buf));
+}
+
+/* Calculate the bounding box, using the result from 
+ * the cache if the same page has been seen before.
+ */
+static int
+calculate_bbox(Doc *doc, OPT *opt, LPCTSTR psname, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    char key[HASH_HEXLEN+1];
+    int code;
+    if ((opt->cache == NULL) || (bbox_cache_key(doc->app, opt, psname, key) != 0))
+	return calculate_bbox_gs(doc, opt, psname, bbox, hires_bbox);
+    if (bbox_cache_get(doc, opt, key, bbox, hires_bbox) == 0)
+	return 0;
+    code = calculate_bbox_gs(doc, opt, psname, bbox, hires_bbox);
+    if (code == 0)
+	bbox_cache_put(opt, key, bbox, hires_bbox);
+    return code;
+}
+
+#ifndef OS2
+static int
+gs_version_write(void *caller, const unsigned char *buf, unsigned int len)
+{
+    OPT *opt = (OPT *)caller;
+    unsigned int n = (unsigned int)strlen(opt->gs_version);
+    unsigned int i;
+    for (i=0; (i<len) && (n+1 < sizeof(opt->gs_version)); i++)
+	if ((buf[i] != '\r') && (buf[i] != '\n'))
+	    opt->gs_version[n++] = buf[i];
+    opt->gs_version[n] = '\0';
+    return 0;
+}
+#endif
+
+/* Get the Ghostscript executable version for cache keys, so that 
+ * results from a different Ghostscript are not used.
+ */
+static void
+get_gs_version(GSview *app, OPT *opt)
+{
+#ifndef OS2
+    TCHAR command[MAXSTR*2];
+    opt->gs_version_valid = TRUE;
+    memset(opt->gs_version, 0, sizeof(opt->gs_version));
+    csnprintf(command, sizeof(command)/sizeof(TCHAR),
+	TEXT("\042%s\042 --version"), opt->gs);
+    if (exec_program(command, -1, -1, -1, NULL, NULL, NULL,
+	gs_version_write, opt) != 0)
+	opt->gs_version[0] = '\0';
+    if (debug & DEBUG_GENERAL)
+	app_msgf(app, "Ghostscript version \042%s\042\n", opt->gs_version);
+#else
+    opt->gs_version_valid = TRUE;
+    opt->gs_version[0] = '\0';
+#endif
+}
+
+static int
+epstool_cache_stats(GSview *app, OPT *opt)
+{
+    CACHE_STATS stats;
+    if (cache_stats(opt->cache, &stats) != 0) {
+	app_csmsgf(app, TEXT("Can't read cache \042%s\042\n"), 
+	    opt->cachedir);
+	return -1;
+    }
+    /* always shown, even with --quiet */
+    fprintf(MSGOUT, "Entries: %lu\n", stats.entries);
+    fprintf(MSGOUT, "Size: %lu bytes\n", stats.bytes);
+    fprintf(MSGOUT, "Limit: %d MB\n", opt->cache_size);
+    fprintf(MSGOUT, "Hits: %lu\n", stats.hits);
+    fprintf(MSGOUT, "Misses: %lu\n", stats.misses);
+    return 0;
+}
+
+static int
+calc_device_size(float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox,
+    int *width, int *height, float *xoffset, float *yoffset)
+{
+    int code = 0;
+    int hires_bbox_valid = 1;
+    if ((bbox->llx >= bbox->urx) ||
+	(bbox->lly >= bbox->ury)) {
+	code = -1;
+    }
+
+    if ((hires_bbox->fllx > hires_bbox->furx) ||
+	(hires_bbox->flly > hires_bbox->fury)) {
+	hires_bbox_valid = 0;
+	code = -1;
+    }
+    if ((hires_bbox->fllx == hires_bbox->furx) ||
+	(hires_bbox->flly == hires_bbox->fury)) {
+	hires_bbox_valid = 0;
+	/* ignore hires_bbox */
+    }
+
+    /* Make the preview image */
+    if (hires_bbox_valid) {
+	*width = (int)((hires_bbox->furx - hires_bbox->fllx)*dpi/72.0+0.5);
+	*height = (int)((hires_bbox->fury - hires_bbox->flly)*dpi/72.0+0.5);
+	*xoffset = -hires_bbox->fllx;
+	*yoffset = -hires_bbox->flly;
+    }
+    else {
+	*width = (int)((bbox->urx - bbox->llx)*dpi/72.0+0.5);
+	*height = (int)((bbox->ury - bbox->lly)*dpi/72.0+0.5);
+	*xoffset = (float)(-bbox->llx);
+	*yoffset = (float)(-bbox->lly);
+    }
+    return 0;
+}
+
+
+/* Copy page to a temporary PostScript file, calculate the 
+ * bounding box if requested, then the size of the raster.
+ */
+static int
+make_preview_ps(Doc *doc, OPT *opt, int page, TCHAR *tpsname, int tpslen,
+    float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox,
+    int *width, int *height, float *xoffset, float *yoffset)
+{
+    GFile *f;
+    int code = 0;
+
+    /* Copy page to temporary file */
+    if ((f = app_temp_gfile(doc->app, tpsname, tpslen)) == (GFile *)NULL) {
+	app_csmsgf(doc->app, 
+	    TEXT("Can't create temporary ps file \042%s\042\n"),
+	    tpsname);
+	return -1;
+    }
+    code = copy_page_temp(doc, f, page);
+    gfile_close(f);
+    if (code != 0) {
+	if (!(debug & DEBUG_GENERAL))
+	    csunlink(tpsname);
+	return -1;
+    }
+
+    /* Get bbox */
+    if ((code == 0) && calc_bbox)
+	code = calculate_bbox(doc, opt, tpsname, bbox, hires_bbox);
+    *width = *height = 0;
+    *xoffset = *yoffset = 0.0;
+    if (code == 0)
+        code = calc_device_size(dpi, bbox, hires_bbox, width, height,
+	    xoffset, yoffset);
+    if (code) {
+	app_csmsgf(doc->app, TEXT("BoundingBox is invalid\n"));
+	if (!(debug & DEBUG_GENERAL))
+	    csunlink(tpsname);
+	return -1;
+    }
+    return 0;
+}
+
+static int
+make_preview_file(Doc *doc, OPT *opt, int page, 
+    LPCTSTR preview, LPCTSTR device,
+    float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox)
+{
+    int code = 0;
+    TCHAR tpsname[MAXSTR];
+    TCHAR command[MAXSTR*8];
+    int width, height;
+    float xoffset, yoffset;
+
+    code = make_preview_ps(doc, opt, page, 
+	tpsname, sizeof(tpsname)/sizeof(TCHAR), dpi, bbox, hires_bbox,
+	calc_bbox, &width, &height, &xoffset, &yoffset);
+    if (code != 0)
+	return -1;
+	
+    /* Make the preview image */
+    csnprintf(command, sizeof(command)/sizeof(TCHAR),
+	TEXT("\042%s\042 %s -dNOPAUSE -dBATCH -sDEVICE=%s -sOutputFile=\042%s\042 -r%g -g%dx%d %s -c %f %f translate -f \042%s\042"), 
+	opt->gs, opt->quiet ? TEXT("-dQUIET") : TEXT(""), 
+	device, (preview[0]=='\0' ? TEXT("-") : preview), dpi, width, height, 
+	opt->gsargs, xoffset, yoffset, tpsname);
+    if (!opt->quiet)
+	app_csmsgf(doc->app, TEXT("%s\n"), command);
+    code = exec_program(command, -1, fileno(stdout), fileno(stderr),
+	NULL, NULL, NULL, NULL, NULL);
+    if (code != 0)
+	app_csmsgf(doc->app, 
+	    TEXT("Ghostscript failed to create preview image\n"));
+
+    /* delete temporary ps file */
+    if (!(debug & DEBUG_GENERAL))
+	csunlink(tpsname);
+
+    return code;
+}
+
+/* Return the display device format which matches one of 
+ * the preview devices, or 0 if the device has no equivalent.
+ */
+static unsigned int
+display_format(LPCTSTR device)
+{
+    if (cscmp(device, COLOUR_DEVICE) == 0)
+	return DISPLAY_COLORS_RGB | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+    if (cscmp(device, GREY_DEVICE) == 0)
+	return DISPLAY_COLORS_GRAY | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+    if (cscmp(device, MONO_DEVICE) == 0)
+	return DISPLAY_COLORS_NATIVE | DISPLAY_ALPHA_NONE |
+	   DISPLAY_DEPTH_1 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
+    return 0;
+}
+
+/* Down scale the first page directly from the display device raster */
+static int
+preview_scale_page(void *caller, IMAGE *img)
+{
+    PREVIEW_SCALE *scale = (PREVIEW_SCALE *)caller;
+    if (scale->newimg != NULL)
+	return 0;
+    scale->newimg = preview_down_scale(scale->opt, img, 
+	scale->bbox, scale->hires_bbox);
+    return (scale->newimg != NULL) ? 0 : -1;
+}
+
+/* Down scale each row as it is read from Ghostscript */
+static int
+preview_scale_row(void *caller, IMAGE *img, unsigned int y, 
+    const unsigned char *row)
+{
+    PREVIEW_SCALE *scale = (PREVIEW_SCALE *)caller;
+    if (y == 0) {
+	scale->newimg = preview_scale_alloc(scale->opt, img->format, 
+	    scale->bbox, scale->hires_bbox);
+	if (scale->newimg == NULL)
+	    return -1;
+	scale->scaler = image_scaler_new(scale->newimg, img);
+	if (scale->scaler == NULL)
+	    return -1;
+    }
+    if (scale->scaler == NULL)
+	return -1;
+    return image_scaler_row(scale->scaler, row);
+}
+
+/* Render the preview with the Ghostscript library and
+ * the display device, without a child process or bitmap file.
+ * If scale is not NULL, return the image scaled to opt->dpi.
+ */
+static IMAGE *
+make_preview_gsdisp(Doc *doc, OPT *opt, int page, unsigned int format,
+    float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox,
+    PREVIEW_SCALE *scale)
+{
+    IMAGE *img = NULL;
+    TCHAR tpsname[MAXSTR];
+    TCHAR args[MAXSTR*8];
+    int width, height;
+    float xoffset, yoffset;
+
+    if (make_preview_ps(doc, opt, page, 
+	tpsname, sizeof(tpsname)/sizeof(TCHAR), dpi, bbox, hires_bbox,
+	calc_bbox, &width, &height, &xoffset, &yoffset) != 0)
+	return NULL;
+
+    csnprintf(args, sizeof(args)/sizeof(TCHAR),
+	TEXT("%s -dNOPAUSE -dBATCH -r%g -g%dx%d %s -c %f %f translate -f \042%s\042"), 
+	opt->quiet ? TEXT("-dQUIET") : TEXT(""), 
+	dpi, width, height, opt->gsargs, xoffset, yoffset, tpsname);
+    if (!opt->quiet)
+	app_csmsgf(doc->app, TEXT("%s\n"), args);
+    if (scale != NULL) {
+	if (gsdisp_render(opt->gsdisp, args, format, 
+	    preview_scale_page, scale) == 0)
+	    img = scale->newimg;
+	else if (scale->newimg != NULL)
+	    bitmap_image_free(scale->newimg);
+	scale->newimg = NULL;
+    }
+    else
+	img = gsdisp_render_image(opt->gsdisp, args, format);
+    if (img == NULL)
+	app_csmsgf(doc->app, 
+	    TEXT("Ghostscript failed to create preview image\n"));
+
+    if (!(debug & DEBUG_GENERAL))
+	csunlink(tpsname);
+    return img;
+}
+
+#ifndef OS2
+static int
+preview_pipe_write(void *caller, const unsigned char *buf, unsigned int len)
+{
+    return bitmap_reader_write((BITMAP_READER *)caller, buf, len);
+}
+
+/* Render the preview with Ghostscript writing the bitmap to stdout,
+ * and read it through a pipe as it is produced, so the bitmap 
+ * is not written to a temporary file.
+ * Ghostscript messages and PostScript output go to stderr.
+ * If scale is not NULL, each row is down scaled as it arrives
+ * and the image at opt->dpi is returned.
+ */
+static IMAGE *
+make_preview_pipe(Doc *doc, OPT *opt, int page, LPCTSTR device,
+    float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox,
+    PREVIEW_SCALE *scale)
+{
+    BITMAP_READER *reader;
+    IMAGE *img;
+    TCHAR tpsname[MAXSTR];
+    TCHAR command[MAXSTR*8];
+    int width, height;
+    float xoffset, yoffset;
+    int code;
+
+    if (scale != NULL)
+	reader = bitmap_reader_new_rows(preview_scale_row, scale);
+    else
+	reader = bitmap_reader_new();
+    if (reader == NULL)
+	return NULL;
+    if (make_preview_ps(doc, opt, page, 
+	tpsname, sizeof(tpsname)/sizeof(TCHAR), dpi, bbox, hires_bbox,
+	calc_bbox, &width, &height, &xoffset, &yoffset) != 0) {
+	bitmap_reader_finish(reader);
+	return NULL;
+    }
+
+    csnprintf(command, sizeof(command)/sizeof(TCHAR),
+	TEXT("\042%s\042 %s -dNOPAUSE -dBATCH -sDEVICE=%s -sOutputFile=- -sstdout=%%stderr -r%g -g%dx%d %s -c %f %f translate -f \042%s\042"), 
+	opt->gs, opt->quiet ? TEXT("-dQUIET") : TEXT(""), 
+	device, dpi, width, height, 
+	opt->gsargs, xoffset, yoffset, tpsname);
+    if (!opt->quiet)
+	app_csmsgf(doc->app, TEXT("%s\n"), command);
+    code = exec_program(command, -1, -1, fileno(stderr),
+	NULL, NULL, NULL, preview_pipe_write, reader);
+    img = bitmap_reader_finish(reader);
+    if (scale != NULL) {
+	img = scale->newimg;
+	scale->newimg = NULL;
+	if ((image_scaler_finish(scale->scaler) != 0) && (code == 0))
+	    code = -1;
+	scale->scaler = NULL;
+    }
+    if ((code == 0) && (img == NULL))
+	code = -1;
+    if (code != 0) {
+	app_csmsgf(doc->app, 
+	    TEXT("Ghostscript failed to create preview image\n"));
+	if (img) {
+	    bitmap_image_free(img);
+	    img = NULL;
+	}
+    }
+
+    if (!(debug & DEBUG_GENERAL))
+	csunlink(tpsname);
+    return img;
+}
+#endif
+
+
+/* Render a preview image at the given resolution.
+ * If scale is not NULL, return the image down scaled to opt->dpi.
+ */
+static IMAGE *
+render_preview(Doc *doc, OPT *opt, int page, LPCTSTR device, float dpi,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox,
+    PREVIEW_SCALE *scale)
+{
+    IMAGE *img = NULL;
+    unsigned int format = 0;
+
+    if (opt->gsdisp != NULL)
+	format = display_format(device);
+
+    if (format != 0) {
+	/* Render in-process */
+	img = make_preview_gsdisp(doc, opt, page, format,
+	    dpi, bbox, hires_bbox, calc_bbox, scale);
+    }
+#ifndef OS2
+    else {
+	/* Read the bitmap from Ghostscript through a pipe */
+	img = make_preview_pipe(doc, opt, page, device,
+	    dpi, bbox, hires_bbox, calc_bbox, scale);
+    }
+#else
+    else {
+	TCHAR preview[MAXSTR];
+	GFile *f;
+	int code = 0;
+	/* Create a temporary file for ghostscript bitmap output */
+	preview[0] = '\0';
+	if ((f = app_temp_gfile(doc->app, preview, 
+	    sizeof(preview)/sizeof(TCHAR))) == (GFile *)NULL) {
+	    app_csmsgf(doc->app, 
+		TEXT("Can't create temporary bitmap file \042%s\042\n"),
+		preview);
+	    code = -1;
+	}
+	else
+	    gfile_close(f);
+
+	if (code == 0)
+	    code = make_preview_file(doc, opt, page, 
+		preview, device, dpi, bbox, hires_bbox, calc_bbox);
+
+	if (code == 0) {
+	    /* Load image */
+	    img = bmpfile_to_image(preview);
+	    if (img == NULL)
+		img = pnmfile_to_image(preview);
+	}
+
+	if ((preview[0] != '\0') && !(debug & DEBUG_GENERAL))
+	    csunlink(preview);
+
+	if (img && scale) {
+	    IMAGE *newimg = preview_down_scale(opt, img, bbox, hires_bbox);
+	    bitmap_image_free(img);
+	    img = newimg;
+	}
+    }
+#endif
+
+    return img;
+}
+
+/* Render once onto a canvas larger than the expected bounding box,
+ * then get the bounding box from the marked pixels and crop the
+ * image to it.  This avoids interpreting the page a second time
+ * with the bbox device, but the bounding box is only accurate 
+ * to one pixel at the render resolution, and marks painted in 
+ * white are not included.
+ * Returns NULL if the bounding box can't be found this way.
+ */
+static IMAGE *
+render_preview_bbox(Doc *doc, OPT *opt, int page, LPCTSTR device,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    const int margin = 72;
+    float dpi = opt->dpi_render;
+    CDSCBBOX canvas;
+    CDSCFBBOX hires_canvas;
+    IMAGE *img;
+    int llx, lly, urx, ury;
+    float f;
+    int code;
+
+    if ((bbox->llx < bbox->urx) && (bbox->lly < bbox->ury))
+	canvas = *bbox;
+    else {
+	/* no bounding box, so allow for US Letter or A4 */
+	canvas.llx = canvas.lly = 0;
+	canvas.urx = 612;
+	canvas.ury = 842;
+    }
+    canvas.llx -= margin;
+    canvas.lly -= margin;
+    canvas.urx += margin;
+    canvas.ury += margin;
+    hires_canvas.fllx = (float)canvas.llx;
+    hires_canvas.flly = (float)canvas.lly;
+    hires_canvas.furx = (float)canvas.urx;
+    hires_canvas.fury = (float)canvas.ury;
+
+    img = render_preview(doc, opt, page, device, dpi, 
+	&canvas, &hires_canvas, FALSE, NULL);
+    if (img == NULL)
+	return NULL;
+
+    code = image_marked_bbox(img, &llx, &lly, &urx, &ury);
+    if ((code == 0) && ((llx == 0) || (lly == 0) || 
+	(urx == (int)img->width) || (ury == (int)img->height)))
+	code = 1;	/* marks reach the edge, so may be clipped */
+    if (code == 0)
+	code = image_crop(img, llx, lly, urx, ury);
+    if (code != 0) {
+	bitmap_image_free(img);
+	if (!opt->quiet)
+	    app_csmsgf(doc->app, 
+		TEXT("Can't get bounding box from preview, using bbox device\n"));
+	return NULL;
+    }
+
+    hires_bbox->fllx = round_float(canvas.llx + llx * 72.0f / dpi, 1000);
+    hires_bbox->flly = round_float(canvas.lly + lly * 72.0f / dpi, 1000);
+    hires_bbox->furx = round_float(canvas.llx + urx * 72.0f / dpi, 1000);
+    hires_bbox->fury = round_float(canvas.lly + ury * 72.0f / dpi, 1000);
+    /* round outwards, and llx, lly are always positive offsets */
+    bbox->llx = canvas.llx + (int)(llx * 72.0f / dpi);
+    bbox->lly = canvas.lly + (int)(lly * 72.0f / dpi);
+    f = urx * 72.0f / dpi;
+    bbox->urx = canvas.llx + (int)f + ((f > (int)f) ? 1 : 0);
+    f = ury * 72.0f / dpi;
+    bbox->ury = canvas.lly + (int)f + ((f > (int)f) ? 1 : 0);
+    if (!opt->quiet) {
+	app_msgf(doc->app, "%%%%BoundingBox: %d %d %d %d\n",
+	    bbox->llx, bbox->lly, bbox->urx, bbox->ury);
+	app_msgf(doc->app, "%%%%HiResBoundingBox: %g %g %g %g\n",
+	    hires_bbox->fllx, hires_bbox->flly, 
+	    hires_bbox->furx, hires_bbox->fury);
+    }
+    return img;
+}
+
+/* Allocate an image for the preview at opt->dpi */
+static IMAGE *
+preview_scale_alloc(OPT *opt, unsigned int format,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    IMAGE *newimg;
+    int ncomp;
+    int width, height;
+    float xoffset, yoffset;
+
+    newimg = (IMAGE *)malloc(sizeof(IMAGE));
+    if (newimg == NULL)
+	return NULL;
+    memset(newimg, 0, sizeof(IMAGE));
+    calc_device_size(opt->dpi, bbox, hires_bbox, &width, &height,
+	 &xoffset, &yoffset);
+    newimg->width = width;
+    newimg->height = height;
+    newimg->format = format;
+    if ((newimg->format & DISPLAY_COLORS_MASK) == DISPLAY_COLORS_CMYK)
+	ncomp = 4;
+    else if ((newimg->format & DISPLAY_COLORS_MASK) == DISPLAY_COLORS_RGB)
+	ncomp = 3;
+    else
+	ncomp = 1;
+    newimg->raster = newimg->width * ncomp;	/* bytes per row */
+    newimg->image = malloc(newimg->raster * newimg->height);
+    if (newimg->image == NULL) {
+	free(newimg);
+	return NULL;
+    }
+    memset(newimg->image, 0, newimg->raster * newimg->height);
+    return newimg;
+}
+
+/* Scale an image rendered at opt->dpi_render down to opt->dpi,
+ * using opt->resize_filter.
+ * Returns the new image, or NULL on error.
+ * img is not freed.
+ */
+static IMAGE *
+preview_down_scale(OPT *opt, IMAGE *img, 
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    IMAGE *newimg;
+    newimg = preview_scale_alloc(opt, img->format, bbox, hires_bbox);
+    if (newimg == NULL)
+	return NULL;
+    if (((opt->resize_filter == IMAGE_RESIZE_BOX) ?
+	image_down_scale(newimg, img) :
+	image_resize(newimg, img, opt->resize_filter)) != 0) {
+	bitmap_image_free(newimg);
+	newimg = NULL;
+    }
+    return newimg;
+}
+
+static IMAGE *
+make_preview_image_gs(Doc *doc, OPT *opt, int page, LPCTSTR device,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox)
+{
+    IMAGE *img = NULL;
+    IMAGE *newimg = NULL;
+
+    if (calc_bbox && opt->bbox_render)
+	img = render_preview_bbox(doc, opt, page, device, bbox, hires_bbox);
+    if ((img == NULL) && (opt->dpi_render != opt->dpi) &&
+	(opt->resize_filter == IMAGE_RESIZE_BOX) &&
+	((display_format(device) & DISPLAY_DEPTH_MASK) == DISPLAY_DEPTH_8)) {
+	/* Down scale as it is rendered, without keeping the
+	 * full resolution image.
+	 * Monochrome can't be down scaled, and the other filters
+	 * need the whole image, so these are handled below.
+	 */
+	PREVIEW_SCALE scale;
+	memset(&scale, 0, sizeof(scale));
+	scale.opt = opt;
+	scale.bbox = bbox;
+	scale.hires_bbox = hires_bbox;
+	return render_preview(doc, opt, page, device, opt->dpi_render,
+	    bbox, hires_bbox, calc_bbox, &scale);
+    }
+    if (img == NULL)
+	img = render_preview(doc, opt, page, device, opt->dpi_render,
+	    bbox, hires_bbox, calc_bbox, NULL);
+
+    if (img && (opt->dpi_render != opt->dpi)) {
+	/* downscale it */
+	newimg = preview_down_scale(opt, img, bbox, hires_bbox);
+	if (newimg != NULL) {
+	    bitmap_image_free(img);
+	    img = newimg;
+	}
+    }
+
+    return img;
+}
+
+/* Get the cache key for a preview image.
+ * This covers the page, the bounding box we start with,
+ * and everything that changes how it is rendered and scaled.
+ * Returns 0 on success, -1 on error.
+ */
+static int
+preview_cache_key(Doc *doc, OPT *opt, int page, LPCTSTR device,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox, char *key)
+{
+    char buf[MAXSTR];
+    HASH h;
+    int code;
+
+    hash_init(&h);
+    hash_string(&h, "epstool preview 1");
+    /* rendered by the library if it supports the device */
+    cache_hash_gs(&h, doc->app, opt, 
+	(opt->gsdisp != NULL) && (display_format(device) != 0));
+    cache_hash_cs(&h, device);
+    snprintf(buf, sizeof(buf), "%.9g %.9g %d %d %d", opt->dpi, 
+	opt->dpi_render, opt->bbox_render, calc_bbox, opt->resize_filter);
+    hash_string(&h, buf);
+    cache_format_bbox(buf, (int)sizeof(buf), bbox, hires_bbox);
+    hash_string(&h, buf);
+    code = cache_hash_doc_page(&h, doc, page);
+    hash_final(&h, key);
+    return code;
+}
+
+/* Returns the image on a hit, or NULL */
+static IMAGE *
+preview_cache_get(Doc *doc, OPT *opt, const char *key, 
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox)
+{
+    unsigned char *data;
+    unsigned int length;
+    int count;
+    CDSCBBOX cbbox;
+    CDSCFBBOX chires_bbox;
+    IMAGE *img = NULL;
+    if (cache_get(opt->cache, key, "preview", &data, &length) != 0)
+	return NULL;
+    count = cache_parse_bbox(data, length, &cbbox, &chires_bbox);
+    if (count >= 0)
+	img = image_unpack(data + count, length - count);
+    free(data);
+    if (img == NULL)
+	return NULL;
+    if (!opt->quiet)
+	app_msgf(doc->app, "Preview from cache\n");
+    if (calc_bbox) {
+	/* the bounding box was found when the preview was made */
+	*bbox = cbbox;
+	*hires_bbox = chires_bbox;
+	if (!opt->quiet) {
+	    app_msgf(doc->app, "%%%%BoundingBox: %d %d %d %d\n",
+		bbox->llx, bbox->lly, bbox->urx, bbox->ury);
+	    app_msgf(doc->app, "%%%%HiResBoundingBox: %g %g %g %g\n",
+		hires_bbox->fllx, hires_bbox->flly, 
+		hires_bbox->furx, hires_bbox->fury);
+	}
+    }
+    return img;
+}
+
+/* Store the image and the bounding box it was rendered with */
+static void
+preview_cache_put(OPT *opt, const char *key, IMAGE *img,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    char buf[MAXSTR];
+    unsigned char *packed;
+    unsigned char *data;
+    unsigned int plength;
+    unsigned int blength;
+    if (image_pack(img, &packed, &plength) != 0)
+	return;
+    cache_format_bbox(buf, (int)sizeof(buf), bbox, hires_bbox);
+    blength = (unsigned int)strlen(buf);
+    data = (unsigned char *)malloc(blength + plength);
+    if (data != NULL) {
+	memcpy(data, buf, blength);
+	memcpy(data + blength, packed, plength);
+	cache_put(opt->cache, key, "preview", data, blength + plength);
+	free(data);
+    }
+    free(packed);
+}
+
+/* Make the preview image, using the image from the cache
+ * if the same page has been rendered the same way before.
+ */
+static IMAGE *
+make_preview_image(Doc *doc, OPT *opt, int page, LPCTSTR device,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox)
+{
+    char key[HASH_HEXLEN+1];
+    IMAGE *img;
+    if ((opt->cache == NULL) || (preview_cache_key(doc, opt, page, device,
+	bbox, hires_bbox, calc_bbox, key) != 0))
+	return make_preview_image_gs(doc, opt, page, device, 
+	    bbox, hires_bbox, calc_bbox);
+    img = preview_cache_get(doc, opt, key, bbox, hires_bbox, calc_bbox);
+    if (img != NULL)
+	return img;
+    img = make_preview_image_gs(doc, opt, page, device, 
+	bbox, hires_bbox, calc_bbox);
+    if (img != NULL)
+	preview_cache_put(opt, key, img, bbox, hires_bbox);
+    return img;
+}
 
-    if ((code == 0) && (!got_bbox)) {
-	app_csmsgf(doc->app, TEXT("Didn't get bounding box\n"));
-	code = -1;
+
+/****************************************************************/
+/* DCS 2.0 composite */
+
+typedef struct DCS2_PLATE_s {
+    int page;			/* page number of separation */
+    const char *name;
+    float cyan;
+    float magenta;
+    float yellow;
+    float black;
+#ifdef UNIX
+    pid_t pid;			/* worker process, or 0 */
+    TCHAR layername[MAXSTR];	/* worker output */
+#endif
+} DCS2_PLATE;
+
+/* Merge one separation image into the composite */
+static int
+dcs2_merge_plate(Doc *doc, OPT *opt, IMAGE *img, DCS2_PLATE *plate, 
+    IMAGE *layer)
+{
+    int code;
+    if (layer == NULL) {
+	app_msgf(doc->app, "Failed to make image for separation (%s)\n",
+	    plate->name);
+	return -1;
     }
-    if ((code == 0) && (!got_hires_bbox)) {
-	app_csmsgf(doc->app, TEXT("Didn't get hires bounding box\n"));
-	code = -1;
+    if (!opt->quiet)
+	app_msgf(doc->app, "Merging separation %g %g %g %g  %s\n", 
+	    plate->cyan, plate->magenta, plate->yellow, plate->black, 
+	    plate->name);
+    code = image_merge_cmyk(img, layer, plate->cyan, plate->magenta, 
+	plate->yellow, plate->black);
+    if (code < 0) {
+	app_msgf(doc->app, "Failed to merge separation (%s)\n", plate->name);
+	return -1;
     }
-    return code;
+    return 0;
+}
+
+static IMAGE *
+dcs2_plate_image(Doc *doc, OPT *opt, DCS2_PLATE *plate,
+    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
+{
+    if (!opt->quiet)
+	app_msgf(doc->app, "Creating image from separation %s\n", plate->name);
+    return make_preview_image(doc, opt, plate->page, GREY_DEVICE,
+	bbox, hires_bbox, FALSE);
 }
 
+#ifdef UNIX
+/* Render separations in up to opt->jobs worker processes.
+ * Each worker writes its separation to a temporary PGM file,
+ * which is merged into the composite as soon as the worker finishes.
+ * The merge adds truncated integer amounts and saturates at 255,
+ * so the result does not depend on the order of completion.
+ */
 static int
-calc_device_size(float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox,
-    int *width, int *height, float *xoffset, float *yoffset)
+dcs2_render_plates_parallel(Doc *doc, OPT *opt, IMAGE *img,
+    DCS2_PLATE *plates, int nplates, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
 {
+    DCS2_PLATE *plate;
+    IMAGE *layer;
+    FILE *f;
+    pid_t pid;
+    int status;
+    int next = 0;
+    int running = 0;
     int code = 0;
-    int hires_bbox_valid = 1;
-    if ((bbox->llx >= bbox->urx) ||
-	(bbox->lly >= bbox->ury)) {
-	code = -1;
-    }
+    int i;
 
-    if ((hires_bbox->fllx > hires_bbox->furx) ||
-	(hires_bbox->flly > hires_bbox->fury)) {
-	hires_bbox_valid = 0;
-	code = -1;
-    }
-    if ((hires_bbox->fllx == hires_bbox->furx) ||
-	(hires_bbox->flly == hires_bbox->fury)) {
-	hires_bbox_valid = 0;
-	/* ignore hires_bbox */
-    }
+    while (((code == 0) && (next < nplates)) || running) {
+	/* start workers */
+	while ((code == 0) && (next < nplates) && (running < opt->jobs)) {
+	    plate = &plates[next];
+	    if ((f = app_temp_file(doc->app, plate->layername, 
+		sizeof(plate->layername)/sizeof(TCHAR))) == (FILE *)NULL) {
+		app_csmsgf(doc->app, 
+		    TEXT("Can't create temporary file \042%s\042\n"),
+		    plate->layername);
+		code = -1;
+		break;
+	    }
+	    fclose(f);
+	    fflush(NULL);
+	    pid = fork();
+	    if (pid == 0) {
+		/* worker */
+		code = -1;
+		layer = dcs2_plate_image(doc, opt, plate, bbox, hires_bbox);
+		if (layer) {
+		    code = image_to_pnmfile(layer, plate->layername, PGMRAW);
+		    bitmap_image_free(layer);
+		}
+		fflush(NULL);
+		_exit(code == 0 ? 0 : 1);
+	    }
+	    if (pid == (pid_t)-1) {
+		csunlink(plate->layername);
+		if (running)
+		    break;	/* try again when a worker finishes */
+		/* No workers, so it is safe to run Ghostscript here */
+		layer = dcs2_plate_image(doc, opt, plate, bbox, hires_bbox);
+		code = dcs2_merge_plate(doc, opt, img, plate, layer);
+		if (layer)
+		    bitmap_image_free(layer);
+		next++;
+		continue;
+	    }
+	    plate->pid = pid;
+	    running++;
+	    next++;
+	}
 
-    /* Make the preview image */
-    if (hires_bbox_valid) {
-	*width = (int)((hires_bbox->furx - hires_bbox->fllx)*dpi/72.0+0.5);
-	*height = (int)((hires_bbox->fury - hires_bbox->flly)*dpi/72.0+0.5);
-	*xoffset = -hires_bbox->fllx;
-	*yoffset = -hires_bbox->flly;
-    }
-    else {
-	*width = (int)((bbox->urx - bbox->llx)*dpi/72.0+0.5);
-	*height = (int)((bbox->ury - bbox->lly)*dpi/72.0+0.5);
-	*xoffset = (float)(-bbox->llx);
-	*yoffset = (float)(-bbox->lly);
+	if (running == 0)
+	    continue;
+	pid = wait(&status);
+	if (pid == (pid_t)-1) {
+	    app_msgf(doc->app, "Lost separation workers, error=%d\n", errno);
+	    code = -1;
+	    break;
+	}
+	for (i=0; i<next; i++) {
+	    plate = &plates[i];
+	    if (plate->pid != pid)
+		continue;
+	    plate->pid = 0;
+	    running--;
+	    layer = NULL;
+	    if (WIFEXITED(status) && (WEXITSTATUS(status) == 0))
+		layer = pnmfile_to_image(plate->layername);
+	    if (!(debug & DEBUG_GENERAL))
+		csunlink(plate->layername);
+	    if (code == 0)
+		code = dcs2_merge_plate(doc, opt, img, plate, layer);
+	    if (layer)
+		bitmap_image_free(layer);
+	    break;
+	}
     }
-    return 0;
+    return code;
 }
+#endif
 
+/* State for rendering all separations in one Ghostscript run */
+typedef struct DCS2_ONE_PASS_s {
+    Doc *doc;
+    OPT *opt;
+    IMAGE *img;			/* CMYK composite */
+    DCS2_PLATE *plates;
+    int nplates;
+    int count;			/* pages merged so far */
+    CDSCBBOX *bbox;
+    CDSCFBBOX *hires_bbox;
+} DCS2_ONE_PASS;
+
+/* Merge the next page of the one pass render into the composite.
+ * The layer is not freed.
+ */
+static int
+dcs2_one_pass_page(void *caller, IMAGE *layer)
+{
+    DCS2_ONE_PASS *op = (DCS2_ONE_PASS *)caller;
+    DCS2_PLATE *plate;
+    IMAGE *newimg;
+    int code;
+    if (op->count >= op->nplates) {
+	app_msgf(op->doc->app, "Too many pages from Ghostscript\n");
+	return_error(-1);
+    }
+    plate = &op->plates[op->count++];
+    if (op->opt->dpi_render == op->opt->dpi)
+	return dcs2_merge_plate(op->doc, op->opt, op->img, plate, layer);
+    newimg = preview_down_scale(op->opt, layer, op->bbox, op->hires_bbox);
+    code = dcs2_merge_plate(op->doc, op->opt, op->img, plate, newimg);
+    if (newimg)
+	bitmap_image_free(newimg);
+    return code;
+}
 
+/* Render all separations in a single Ghostscript run.
+ * The separation pages are copied to one temporary PostScript file,
+ * one page per plate in the same order as plates[], so the 
+ * interpreter is started and the prolog is run only once.
+ * Each page does its own translate, since showpage resets it.
+ * With --gs-dll each page is merged as the display device
+ * produces it, otherwise Ghostscript writes one bitmap file per page.
+ */
 static int
-make_preview_file(Doc *doc, OPT *opt, int page, 
-    LPCTSTR preview, LPCTSTR device,
-    float dpi, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox)
+dcs2_render_plates_one_pass(Doc *doc, OPT *opt, IMAGE *img,
+    DCS2_PLATE *plates, int nplates, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
 {
-    GFile *f;
-    int code = 0;
+    DCS2_ONE_PASS op;
     TCHAR tpsname[MAXSTR];
+    TCHAR preview[MAXSTR];
+    TCHAR pagename[MAXSTR];
+    TCHAR outname[MAXSTR];
     TCHAR command[MAXSTR*8];
+    char page_setup[MAXSTR];
+    int *pages;
+    GFile *f;
+    unsigned int format = 0;
     int width, height;
     float xoffset, yoffset;
+    int code = 0;
+    int i;
 
-    /* Copy page to temporary file */
+    memset(&op, 0, sizeof(op));
+    op.doc = doc;
+    op.opt = opt;
+    op.img = img;
+    op.plates = plates;
+    op.nplates = nplates;
+    op.bbox = bbox;
+    op.hires_bbox = hires_bbox;
+
+    if (calc_device_size(opt->dpi_render, bbox, hires_bbox, &width, &height,
+	&xoffset, &yoffset) != 0) {
+	app_csmsgf(doc->app, TEXT("BoundingBox is invalid\n"));
+	return -1;
+    }
+
+    /* Copy all separation pages to one temporary file */
     if ((f = app_temp_gfile(doc->app, tpsname, 
 	sizeof(tpsname)/sizeof(TCHAR))) == (GFile *)NULL) {
 	app_csmsgf(doc->app, 
@@ -1763,142 +3834,142 @@ make_preview_file(Doc *doc, OPT *opt, int page,
 	    tpsname);
 	return -1;
     }
-    code = copy_page_temp(doc, f, page);
+    pages = (int *)malloc(nplates * sizeof(int));
+    if (pages == NULL)
+	code = -1;
+    else {
+	for (i=0; i<nplates; i++)
+	    pages[i] = plates[i].page;
+	snprintf(page_setup, sizeof(page_setup), "%f %f translate\n",
+	    xoffset, yoffset);
+	code = copy_pages_temp(doc, f, pages, nplates, page_setup);
+	free(pages);
+    }
     gfile_close(f);
     if (code != 0) {
 	if (!(debug & DEBUG_GENERAL))
 	    csunlink(tpsname);
 	return -1;
     }
-
-    /* Get bbox */
-    if ((code == 0) && calc_bbox)
-	code = calculate_bbox(doc, opt, tpsname, bbox, hires_bbox);
-    width = height = 0;
-    xoffset = yoffset = 0.0;
-    if (code == 0)
-        code = calc_device_size(dpi, bbox, hires_bbox, &width, &height,
-	    &xoffset, &yoffset);
-    if (code) {
-	app_csmsgf(doc->app, TEXT("BoundingBox is invalid\n"));
-	if (!(debug & DEBUG_GENERAL))
-	    csunlink(tpsname);
-	return -1;
-    }
-	
-    /* Make the preview image */
-    csnprintf(command, sizeof(command)/sizeof(TCHAR),
-	TEXT("\042%s\042 %s -dNOPAUSE -dBATCH -sDEVICE=%s -sOutputFile=\042%s\042 -r%g -g%dx%d %s -c %f %f translate -f \042%s\042"), 
-	opt->gs, opt->quiet ? TEXT("-dQUIET") : TEXT(""), 
-	device, (preview[0]=='\0' ? TEXT("-") : preview), dpi, width, height, 
-	opt->gsargs, xoffset, yoffset, tpsname);
     if (!opt->quiet)
-	app_csmsgf(doc->app, TEXT("%s\n"), command);
-    code = exec_program(command, -1, fileno(stdout), fileno(stderr),
-	NULL, NULL, NULL);
+	app_msgf(doc->app, "Creating images from %d separations\n", nplates);
+
+    if (opt->gsdisp != NULL)
+	format = display_format(GREY_DEVICE);
+    preview[0] = '\0';
+    if (format != 0) {
+	/* Render in-process, merging each page as it is produced */
+	csnprintf(command, sizeof(command)/sizeof(TCHAR),
+	    TEXT("%s -dNOPAUSE -dBATCH -r%g -g%dx%d %s \042%s\042"), 
+	    opt->quiet ? TEXT("-dQUIET") : TEXT(""), 
+	    opt->dpi_render, width, height, opt->gsargs, tpsname);
+	if (!opt->quiet)
+	    app_csmsgf(doc->app, TEXT("%s\n"), command);
+	code = gsdisp_render(opt->gsdisp, command, format, 
+	    dcs2_one_pass_page, &op);
+    }
+    else {
+	/* One bitmap file per page, named from a temporary file */
+	if ((f = app_temp_gfile(doc->app, preview, 
+	    sizeof(preview)/sizeof(TCHAR))) == (GFile *)NULL) {
+	    app_csmsgf(doc->app, 
+		TEXT("Can't create temporary bitmap file \042%s\042\n"),
+		preview);
+	    code = -1;
+	}
+	else
+	    gfile_close(f);
+	if (code == 0) {
+	    csnprintf(outname, sizeof(outname)/sizeof(TCHAR),
+		TEXT("%s_%%d"), preview);
+	    csnprintf(command, sizeof(command)/sizeof(TCHAR),
+		TEXT("\042%s\042 %s -dNOPAUSE -dBATCH -sDEVICE=%s -sOutputFile=\042%s\042 -r%g -g%dx%d %s \042%s\042"), 
+		opt->gs, opt->quiet ? TEXT("-dQUIET") : TEXT(""), 
+		GREY_DEVICE, outname, opt->dpi_render, width, height, 
+		opt->gsargs, tpsname);
+	    if (!opt->quiet)
+		app_csmsgf(doc->app, TEXT("%s\n"), command);
+	    code = exec_program(command, -1, fileno(stdout), fileno(stderr),
+		NULL, NULL, NULL, NULL, NULL);
+	}
+	/* Merge each page, deleting each bitmap file as we go */
+	for (i=0; i<nplates; i++) {
+	    IMAGE *layer = NULL;
+	    csnprintf(pagename, sizeof(pagename)/sizeof(TCHAR),
+		TEXT("%s_%d"), preview, i+1);
+	    if (code == 0) {
+		layer = bmpfile_to_image(pagename);
+		if (layer == NULL)
+		    layer = pnmfile_to_image(pagename);
+		if (layer == NULL) {
+		    app_msgf(doc->app, 
+			"Failed to make image for separation (%s)\n",
+			plates[i].name);
+		    code = -1;
+		}
+	    }
+	    if (layer != NULL) {
+		code = dcs2_one_pass_page(&op, layer);
+		bitmap_image_free(layer);
+	    }
+	    if (!(debug & DEBUG_GENERAL))
+		csunlink(pagename);
+	}
+    }
+    if ((code == 0) && (op.count != nplates)) {
+	app_msgf(doc->app, "Expected %d pages from Ghostscript but got %d\n",
+	    nplates, op.count);
+	code = -1;
+    }
     if (code != 0)
 	app_csmsgf(doc->app, 
-	    TEXT("Ghostscript failed to create preview image\n"));
+	    TEXT("Ghostscript failed to create separation images\n"));
 
-    /* delete temporary ps file */
-    if (!(debug & DEBUG_GENERAL))
+    if (!(debug & DEBUG_GENERAL)) {
 	csunlink(tpsname);
-
+	if (preview[0] != '\0')
+	    csunlink(preview);
+    }
     return code;
 }
 
-
-static IMAGE *
-make_preview_image(Doc *doc, OPT *opt, int page, LPCTSTR device,
-    CDSCBBOX *bbox, CDSCFBBOX *hires_bbox, int calc_bbox)
+static int
+dcs2_render_plates(Doc *doc, OPT *opt, IMAGE *img,
+    DCS2_PLATE *plates, int nplates, CDSCBBOX *bbox, CDSCFBBOX *hires_bbox)
 {
-    IMAGE *img = NULL;
-    IMAGE *newimg = NULL;
-    TCHAR preview[MAXSTR];
-    GFile *f;
+    IMAGE *layer;
     int code = 0;
-
-    /* Create a temporary file for ghostscript bitmap output */
-    if ((f = app_temp_gfile(doc->app, preview, 
-	sizeof(preview)/sizeof(TCHAR))) == (GFile *)NULL) {
-	app_csmsgf(doc->app, 
-	    TEXT("Can't create temporary bitmap file \042%s\042\n"),
-	    preview);
-	code = -1;
-    }
-    else
-	gfile_close(f);
-
-    if (code == 0)
-	code = make_preview_file(doc, opt, page, 
-	    preview, device, opt->dpi_render, bbox, hires_bbox, calc_bbox);
-
-    if (code == 0) {
-	/* Load image */
-	img = bmpfile_to_image(preview);
-	if (img == NULL)
-	    img = pnmfile_to_image(preview);
-    }
-
-    if (img && (opt->dpi_render != opt->dpi)) {
-	/* downscale it */
-	newimg = (IMAGE *)malloc(sizeof(IMAGE));
-	if (newimg != NULL) {
-	    int ncomp;
-	    int width, height;
-	    float xoffset, yoffset;
-	    memset(newimg, 0, sizeof(newimg));
-	    calc_device_size(opt->dpi, bbox, hires_bbox, &width, &height,
-		 &xoffset, &yoffset);
-	    newimg->width = width;
-	    newimg->height = height;
-	    newimg->format = img->format;
-	    if ((newimg->format & DISPLAY_COLORS_MASK) 
-		== DISPLAY_COLORS_CMYK)
-		ncomp = 4;
-	    else if ((newimg->format & DISPLAY_COLORS_MASK) 
-		== DISPLAY_COLORS_RGB)
-		ncomp = 3;
-	    else
-		ncomp = 1;
-	    newimg->raster = newimg->width * ncomp;	/* bytes per row */
-	    newimg->image = malloc(newimg->raster * newimg->height);
-	    if (newimg->image == NULL) {
-		free(newimg);
-		newimg = NULL;
-	    }
-	}
-	if (newimg != NULL) {
-	    memset(newimg->image, 0, newimg->raster * newimg->height);
-	    if (image_down_scale(newimg, img) != 0) {
-		bitmap_image_free(newimg);
-		newimg = NULL;
-	    }
-	}
-	if (newimg != NULL) {
-	    bitmap_image_free(img);
-	    img = newimg;
-	}
+    int i;
+    if (opt->composite_one_pass && (nplates > 0))
+	return dcs2_render_plates_one_pass(doc, opt, img, plates, nplates,
+	    bbox, hires_bbox);
+#ifdef UNIX
+    if ((opt->jobs > 1) && (nplates > 1))
+	return dcs2_render_plates_parallel(doc, opt, img, plates, nplates,
+	    bbox, hires_bbox);
+#endif
+    for (i=0; (i<nplates) && (code == 0); i++) {
+	layer = dcs2_plate_image(doc, opt, &plates[i], bbox, hires_bbox);
+	code = dcs2_merge_plate(doc, opt, img, &plates[i], layer);
+	if (layer)
+	    bitmap_image_free(layer);
     }
-	
-    if (!(debug & DEBUG_GENERAL))
-	csunlink(preview);
-    return img;
+    return code;
 }
 
-
-/****************************************************************/
 int
 epstool_dcs2_composite(Doc *doc, OPT *opt, GFile *compfile)
 {
     CDSC *dsc = doc->dsc;
     IMAGE img;
-    IMAGE *layer = NULL;
+    DCS2_PLATE *plates;
+    int nplates = 0;
     int width, height;
     float xoffset, yoffset;
     float cyan, magenta, yellow, black;
     int code = 0;
     int i;
+    int compress;
     CDSCBBOX bbox = {0, 0, 0, 0};
     CDSCFBBOX hires_bbox = {0.0, 0.0, 0.0, 0.0};
     int hires_bbox_valid = 0;
@@ -1926,6 +3997,10 @@ epstool_dcs2_composite(Doc *doc, OPT *opt, GFile *compfile)
 	app_csmsgf(doc->app, TEXT("BoundingBox is invalid\n"));
 	return -1;
     }
+    plates = (DCS2_PLATE *)malloc(dsc->page_count * sizeof(DCS2_PLATE));
+    if (plates == NULL)
+	return -1;
+    memset(plates, 0, dsc->page_count * sizeof(DCS2_PLATE));
     memset(&img, 0, sizeof(img));
     img.width = width;
     img.height = height;
@@ -1933,13 +4008,13 @@ epstool_dcs2_composite(Doc *doc, OPT *opt, GFile *compfile)
     img.format = DISPLAY_COLORS_CMYK | DISPLAY_ALPHA_NONE |
        DISPLAY_DEPTH_8 | DISPLAY_BIGENDIAN | DISPLAY_TOPFIRST;
     img.image = (unsigned char *)malloc(img.raster * img.height);
-    if (img.image == NULL)
+    if (img.image == NULL) {
+	free(plates);
 	return -1;
+    }
     memset(img.image, 0, img.raster * img.height);
  
-    /* For each plate, make an image, then merge it into
-     * the composite
-     */
+    /* Find the colour of each plate */
     for (i=1; i<(int)dsc->page_count; i++) {
 	/* find colour */
 	int found;
@@ -1984,32 +4059,21 @@ epstool_dcs2_composite(Doc *doc, OPT *opt, GFile *compfile)
 		app_msgf(doc->app, "Skipping blank separation %s\n", name);
 	    continue;
 	}
-	if (!opt->quiet)
-	    app_msgf(doc->app, "Creating image from separation %s\n", name);
-	/* Now get the separation image */
-        layer = make_preview_image(doc, opt, i, GREY_DEVICE,
-    		&bbox, &hires_bbox, FALSE);
-	if (layer == NULL) {
-	    app_msgf(doc->app, "Failed to make image for separation (%s)\n",
-		name);
-	    code = -1;
-	    break;
-	}
-	else {
-	    if (!opt->quiet)
-		app_msgf(doc->app, "Merging separation %g %g %g %g  %s\n", 
-		    cyan, magenta, yellow, black, name);
-	    code = image_merge_cmyk(&img, layer, cyan, magenta, yellow, black);
-	    bitmap_image_free(layer);
-	    if (code < 0) {
-	        app_msgf(doc->app, "Failed to merge separation (%s)\n", name);
-		code = -1;
-		break;
-	    }
-	}
-	
+	plates[nplates].page = i;
+	plates[nplates].name = name;
+	plates[nplates].cyan = cyan;
+	plates[nplates].magenta = magenta;
+	plates[nplates].yellow = yellow;
+	plates[nplates].black = black;
+	nplates++;
     } 
 
+    /* For each plate, make an image, then merge it into
+     * the composite
+     */
+    if (code == 0)
+	code = dcs2_render_plates(doc, opt, &img, plates, nplates,
+	    &bbox, &hires_bbox);
 
     if (code == 0) {
 	if (!opt->quiet)
@@ -2019,10 +4083,13 @@ epstool_dcs2_composite(Doc *doc, OPT *opt, GFile *compfile)
 		hires_bbox.fllx, hires_bbox.flly, 
 		hires_bbox.furx, hires_bbox.fury, 
 		opt->image_encode, 
-		opt->image_compress);
+		opt->image_compress, opt->flate_level, &compress);
+	if (code == 0)
+	    report_image_compress(doc, opt, compress);
     }
 
     free(img.image);
+    free(plates);
     return code;
 }
 
@@ -2302,7 +4369,7 @@ epstool_test(Doc *doc, OPT *opt)
     if (!opt->quiet)
 	app_csmsgf(doc->app, TEXT("%s\n"), command);
     code = exec_program(command, -1, -1 , fileno(stderr),
-	NULL, testname, NULL);
+	NULL, testname, NULL, NULL, NULL);
     if (code != 0)
 	app_csmsgf(doc->app, 
 	    TEXT("Ghostscript failed to interpret file\n"));
@@ -2586,12 +4653,14 @@ image_platform_format(unsigned int format)
 int
 exec_program(LPTSTR command,
     int hstdin, int hstdout, int hstderr,
-    LPCTSTR stdin_name, LPCTSTR stdout_name, LPCTSTR stderr_name)
+    LPCTSTR stdin_name, LPCTSTR stdout_name, LPCTSTR stderr_name,
+    EXEC_OUTPUT_FN stdout_fn, void *caller)
 {
     int code = 0;
     HANDLE hChildStdinRd = INVALID_HANDLE_VALUE;
     HANDLE hChildStdoutWr = INVALID_HANDLE_VALUE;
     HANDLE hChildStderrWr = INVALID_HANDLE_VALUE;
+    HANDLE hStdoutRd = INVALID_HANDLE_VALUE;
     HANDLE hStdin = INVALID_HANDLE_VALUE;
     HANDLE hStderr = INVALID_HANDLE_VALUE;
     HANDLE hStdout = INVALID_HANDLE_VALUE;
@@ -2620,7 +4689,14 @@ exec_program(LPTSTR command,
 	        code = -1;
 	}
     }
-    if ((code==0) && (hstdout != -1)) {
+    if ((code==0) && stdout_fn) {
+	/* Read stdout through a pipe */
+	if (!CreatePipe(&hStdoutRd, &hChildStdoutWr, &saAttr, 0))
+	    code = -1;
+	else
+	    SetHandleInformation(hStdoutRd, HANDLE_FLAG_INHERIT, 0);
+    }
+    else if ((code==0) && (hstdout != -1)) {
 	INTPTR handle;
 	handle = _get_osfhandle(hstdout);
 	if (handle == -1)
@@ -2716,6 +4792,20 @@ exec_program(LPTSTR command,
     if (hChildStderrWr != INVALID_HANDLE_VALUE)
 	CloseHandle(hChildStderrWr);
 
+    if ((code == 0) && (hStdoutRd != INVALID_HANDLE_VALUE)) {
+	/* read stdout until the program closes it */
+	unsigned char buf[16384];
+	DWORD count;
+	int fn_code = 0;
+	while (ReadFile(hStdoutRd, buf, sizeof(buf), &count, NULL) &&
+	    (count != 0)) {
+	    if (fn_code == 0)
+		fn_code = stdout_fn(caller, buf, count);
+	}
+    }
+    if (hStdoutRd != INVALID_HANDLE_VALUE)
+	CloseHandle(hStdoutRd);
+
     if (code == 0) {
 	/* wait for process to finish */
 	WaitForSingleObject(piProcInfo.hProcess, 300000);
@@ -2734,13 +4824,15 @@ exec_program(LPTSTR command,
 int
 exec_program(LPTSTR command,
     int hstdin, int hstdout, int hstderr,
-    LPCTSTR stdin_name, LPCTSTR stdout_name, LPCTSTR stderr_name)
+    LPCTSTR stdin_name, LPCTSTR stdout_name, LPCTSTR stderr_name,
+    EXEC_OUTPUT_FN stdout_fn, void *caller)
 {
     int code = 0;
     int hChildStdinRd = -1;
     int hChildStdoutWr = -1;
     int hChildStderrWr = -1;
     int handle;
+    int pipefd[2];
     pid_t pid;
     int exitcode;
 #define MAXARG 64
@@ -2786,10 +4878,22 @@ exec_program(LPTSTR command,
     }
     argv[argc] = NULL;
 
+    pipefd[0] = pipefd[1] = -1;
+    if (stdout_fn && (pipe(pipefd) != 0)) {
+	fprintf(stderr, "Failed to create pipe, error=%d\n", errno);
+	free(args);
+	return -1;
+    }
+
     pid = fork();
     if (pid == (pid_t)-1) {
 	/* fork failed */
 	fprintf(stderr, "Failed to fork, error=%d\n", errno);
+	if (pipefd[0] != -1) {
+	    close(pipefd[0]);
+	    close(pipefd[1]);
+	}
+	free(args);
 	return -1;
     }
     else if (pid == 0) {
@@ -2800,7 +4904,15 @@ exec_program(LPTSTR command,
 	    if (hChildStdinRd == -1)
 		code = -1;
 	}
-	if ((code==0) && (hstdout != -1)) {
+	if ((code==0) && (pipefd[1] != -1)) {
+	    /* stdout is read by the parent */
+	    close(pipefd[0]);
+	    hChildStdoutWr = dup2(pipefd[1], 1);
+	    close(pipefd[1]);
+	    if (hChildStdoutWr == -1)
+		code = -1;
+	}
+	else if ((code==0) && (hstdout != -1)) {
 	    hChildStdoutWr = dup2(hstdout, 1);
 	    if (hChildStdoutWr == -1)
 		code = -1;
@@ -2853,9 +4965,25 @@ exec_program(LPTSTR command,
 	}
     }
 
-    /* parent - wait for child to finish */
+    /* parent - read stdout, then wait for child to finish */
     free(args);
-    wait(&exitcode);
+    if (pipefd[1] != -1) {
+	unsigned char buf[16384];
+	int count;
+	int fn_code = 0;
+	close(pipefd[1]);
+	while ((count = (int)read(pipefd[0], buf, sizeof(buf))) != 0) {
+	    if (count < 0) {
+		if (errno == EINTR)
+		    continue;
+		break;
+	    }
+	    if (fn_code == 0)
+		fn_code = stdout_fn(caller, buf, (unsigned int)count);
+	}
+	close(pipefd[0]);
+    }
+    waitpid(pid, &exitcode, 0);
     return exitcode;
 }
 #endif
@@ -2869,7 +4997,8 @@ exec_program(LPTSTR command,
 int
 exec_program(LPTSTR command,
     int hstdin, int hstdout, int hstderr,
-    LPCTSTR stdin_name, LPCTSTR stdout_name, LPCTSTR stderr_name)
+    LPCTSTR stdin_name, LPCTSTR stdout_name, LPCTSTR stderr_name,
+    EXEC_OUTPUT_FN stdout_fn, void *caller)
 {
     HFILE hStdin = 0;
     HFILE hStdout = 1;
@@ -2888,6 +5017,9 @@ exec_program(LPTSTR command,
     PSZ args;
     int cmdlen;
 
+    if (stdout_fn != NULL)
+	return -1;	/* reading stdout through a pipe is not supported */
+
     /* Copy command into format needed by DosExecPgm */
     cmdlen = strlen(command)+1;
     cmd = (char *)malloc(cmdlen+1);
@@ -17,8 +17,8 @@ SRCDIR=./src
 SRCWINDIR=./srcwin
 
 XINCLUDE=
-PFLAGS=
-PLINK=
+PFLAGS=-DMULTITHREAD
+PLINK=-lpthread
 
 GTKCFLAGS=
 GTKLIBS=
@@ -32,8 +32,8 @@ LONGFILEMOD=cfile
 
 include $(SRCDIR)/unixcom.mak
 
-EPSOBJPLAT=$(OD)xnodll$(OBJ) $(OD)$(LONGFILEMOD)$(OBJ)
-EPSLIB=$(LIBPNGLIBS)
+EPSOBJPLAT=$(OD)xdll$(OBJ) $(OD)$(LONGFILEMOD)$(OBJ)
+EPSLIB=$(LIBPNGLIBS) $(PLINK) -ldl -lm
 
 BEGIN=$(OD)lib.rsp
 TARGET=epstool
@@ -51,6 +51,14 @@ epstool: $(BD)epstool$(EXE)
 epstest: epstool $(BD)epstest$(EXE)
 	$(BD)epstest$(EXE)
 
+epsbench: $(BD)epsbench$(EXE)
+	$(BD)epsbench$(EXE)
+
+# LZWBENCHFILE is any file, such as an uncompressed image
+LZWBENCHFILE=$(BD)epstool$(EXE)
+lzwbench: $(BD)lzwbench$(EXE)
+	$(BD)lzwbench$(EXE) -b $(LZWBENCHFILE)
+
 $(OD)lib.rsp: makefile
 	-mkdir $(BINDIR)
 	-mkdir $(OBJDIR)
@@ -95,8 +103,12 @@ cygwin:
 clean:
 	-$(RM) $(EPSOBJS)
 	-$(RM) $(EPSTESTOBJS)
+	-$(RM) $(EPSBENCHOBJS)
+	-$(RM) $(OD)lzwbench$(OBJ)
 	-$(RM) $(OD)lib.rsp
 	-$(RM) $(BD)epstool$(EXE)
 	-$(RM) $(BD)epstest$(EXE)
+	-$(RM) $(BD)epsbench$(EXE)
+	-$(RM) $(BD)lzwbench$(EXE)
 	-rmdir $(OBJDIR)
 
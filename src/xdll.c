@@ -74,6 +74,8 @@ TCHAR buf[MAXSTR];
 	    msglen = dll_msg(msg, TEXT("\n"), msglen);
 	}
     }
+    if (*hmodule == NULL)
+	return -1;
     return 0;
 }
 